@@ -0,0 +1,281 @@
+/*
+ * Copyright (C) 2024 Canonical Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/**
+ * Benchmark of device access through the device cgroup program.
+ *
+ * devcgroup-bench [ITERATIONS]
+ *     creates throwaway cgroups under /sys/fs/cgroup, attaches the program
+ *     used by snap-confine to each of them with maps of 10, 100 and 500
+ *     entries, and reports the latency of opening and closing /dev/null and
+ *     a pty slave from a process in the cgroup, compared with a cgroup
+ *     without any program.
+ *
+ * The devices are allowed either in the base map or in the map of the
+ * application, by exact minor number or with any minor number, which
+ * covers the best and the worst case of the lookups made by the program.
+ * The map of the application is padded with unrelated block devices to
+ * reach the given size. The program must run as root on a system with
+ * cgroup v2.
+ **/
+
+#include "../libsnap-confine-private/device-cgroup-support.c"
+
+#include <stdlib.h>
+#include <sys/sysmacros.h>
+#include <sys/wait.h>
+#include <time.h>
+
+typedef enum bench_where {
+    BENCH_NO_PROGRAM,
+    BENCH_IN_BASE_MAP,
+    BENCH_IN_APP_MAP,
+} bench_where;
+
+typedef struct bench_config {
+    bench_where where;
+    bool any_minor;
+    size_t map_size;
+} bench_config;
+
+typedef struct bench_devices {
+    /* the pty master is kept open to keep the slave around */
+    int ptmx_fd;
+    char pts_path[PATH_MAX];
+    dev_t pts_rdev;
+} bench_devices;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t ua = *(const uint64_t *)a;
+    uint64_t ub = *(const uint64_t *)b;
+    return ua < ub ? -1 : ua > ub;
+}
+
+static void add_key(sc_cgroup_v2_device_key *keys, size_t *num_keys, char type, uint32_t major, uint32_t minor) {
+    keys[*num_keys] = (sc_cgroup_v2_device_key){.type = type, .major = major, .minor = minor};
+    (*num_keys)++;
+}
+
+/**
+ * load_program returns the device cgroup program for the given configuration,
+ * along with the two maps it uses.
+ */
+static int load_program(const bench_config *config, const bench_devices *devs, int *basemap_fd, int *map_fd) {
+    sc_cgroup_v2_device_key *keys SC_CLEANUP(_sc_cleanup_v2_device_key) =
+        calloc(sc_cgroup_v2_max_entries, sizeof(sc_cgroup_v2_device_key));
+    if (keys == NULL) {
+        die("cannot allocate keys map");
+    }
+    size_t num_keys = 0;
+
+    *basemap_fd = bpf_create_map(BPF_MAP_TYPE_HASH, sizeof(struct sc_cgroup_v2_device_key),
+                                 sizeof(sc_cgroup_v2_device_value), sc_cgroup_v2_max_entries);
+    *map_fd = bpf_create_map(BPF_MAP_TYPE_HASH, sizeof(struct sc_cgroup_v2_device_key),
+                             sizeof(sc_cgroup_v2_device_value), sc_cgroup_v2_max_entries);
+    if (*basemap_fd < 0 || *map_fd < 0) {
+        die("cannot create bpf map");
+    }
+
+    /* the devices being opened, the pty major is the one in use */
+    uint32_t pts_major = major(devs->pts_rdev);
+    if (config->any_minor) {
+        add_key(keys, &num_keys, 'c', 1, SC_DEVICE_MINOR_ANY);
+        add_key(keys, &num_keys, 'c', pts_major, SC_DEVICE_MINOR_ANY);
+    } else {
+        add_key(keys, &num_keys, 'c', 1, 3);
+        add_key(keys, &num_keys, 'c', pts_major, minor(devs->pts_rdev));
+    }
+    if (config->where == BENCH_IN_BASE_MAP) {
+        _sc_cgroup_v2_map_update(*basemap_fd, keys, num_keys);
+        num_keys = 0;
+    }
+    /* pad the map of the application with devices which never match */
+    for (uint32_t i = 0; num_keys < config->map_size; i++) {
+        add_key(keys, &num_keys, 'b', 4000 + i / 64, i % 64);
+    }
+    _sc_cgroup_v2_map_update(*map_fd, keys, num_keys);
+
+    return load_devcgroup_prog(*basemap_fd, *map_fd);
+}
+
+/**
+ * measure reports the median and 99th percentile latency of opening and
+ * closing the device at the given path.
+ */
+static void measure(const char *path, size_t iterations, uint64_t *samples, uint64_t *median, uint64_t *p99) {
+    /* warm up the caches along the path */
+    for (size_t i = 0; i < iterations / 10 + 1; i++) {
+        int fd = open(path, O_RDONLY | O_NOCTTY | O_CLOEXEC);
+        if (fd < 0) {
+            die("cannot open %s", path);
+        }
+        close(fd);
+    }
+    for (size_t i = 0; i < iterations; i++) {
+        uint64_t start = now_ns();
+        int fd = open(path, O_RDONLY | O_NOCTTY | O_CLOEXEC);
+        if (fd < 0) {
+            die("cannot open %s", path);
+        }
+        close(fd);
+        samples[i] = now_ns() - start;
+    }
+    qsort(samples, iterations, sizeof *samples, cmp_u64);
+    *median = samples[iterations / 2];
+    *p99 = samples[iterations * 99 / 100];
+}
+
+static void run_config(const bench_config *config, const bench_devices *devs, size_t iterations) {
+    char cgroup_path[PATH_MAX] = {0};
+    sc_must_snprintf(cgroup_path, sizeof cgroup_path, "/sys/fs/cgroup/devcgroup-bench.%d", getpid());
+    if (mkdir(cgroup_path, 0755) < 0) {
+        die("cannot create cgroup %s", cgroup_path);
+    }
+
+    int basemap_fd = -1, map_fd = -1, prog_fd = -1;
+    if (config->where != BENCH_NO_PROGRAM) {
+        prog_fd = load_program(config, devs, &basemap_fd, &map_fd);
+        int cgroup_fd = open(cgroup_path, O_PATH | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+        if (cgroup_fd < 0) {
+            die("cannot open cgroup %s", cgroup_path);
+        }
+        if (bpf_prog_attach(BPF_CGROUP_DEVICE, cgroup_fd, prog_fd) < 0) {
+            die("cannot attach cgroup program");
+        }
+        close(cgroup_fd);
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        die("cannot fork");
+    }
+    if (pid == 0) {
+        char procs_path[PATH_MAX] = {0};
+        sc_must_snprintf(procs_path, sizeof procs_path, "%s/cgroup.procs", cgroup_path);
+        int procs_fd = open(procs_path, O_WRONLY | O_CLOEXEC);
+        if (procs_fd < 0 || dprintf(procs_fd, "%d\n", getpid()) < 0) {
+            die("cannot move to cgroup %s", cgroup_path);
+        }
+        close(procs_fd);
+
+        uint64_t *samples = calloc(iterations, sizeof *samples);
+        if (samples == NULL) {
+            die("cannot allocate samples");
+        }
+        uint64_t null_median, null_p99, pts_median, pts_p99;
+        measure("/dev/null", iterations, samples, &null_median, &null_p99);
+        measure(devs->pts_path, iterations, samples, &pts_median, &pts_p99);
+
+        static const char *where_names[] = {
+            [BENCH_NO_PROGRAM] = "no program",
+            [BENCH_IN_BASE_MAP] = "base map",
+            [BENCH_IN_APP_MAP] = "app map",
+        };
+        printf("%-10s  %-5s  %8zu  %8llu  %8llu  %8llu  %8llu\n", where_names[config->where],
+               config->where == BENCH_NO_PROGRAM ? "-" : (config->any_minor ? "any" : "exact"), config->map_size,
+               (unsigned long long)null_median, (unsigned long long)null_p99, (unsigned long long)pts_median,
+               (unsigned long long)pts_p99);
+        fflush(stdout);
+        free(samples);
+        _exit(0);
+    }
+
+    int status = 0;
+    if (waitpid(pid, &status, 0) < 0) {
+        die("cannot wait for benchmark process");
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        die("benchmark process failed");
+    }
+    /* the program is detached when the cgroup goes away */
+    if (rmdir(cgroup_path) < 0) {
+        die("cannot remove cgroup %s", cgroup_path);
+    }
+    sc_cleanup_close(&prog_fd);
+    sc_cleanup_close(&map_fd);
+    sc_cleanup_close(&basemap_fd);
+}
+
+int main(int argc, char **argv) {
+    size_t iterations = 100000;
+    if (argc > 2) {
+        fprintf(stderr, "usage: %s [ITERATIONS]\n", argv[0]);
+        return 1;
+    }
+    if (argc == 2) {
+        iterations = strtoul(argv[1], NULL, 10);
+        if (iterations == 0) {
+            fprintf(stderr, "invalid number of iterations: %s\n", argv[1]);
+            return 1;
+        }
+    }
+    if (geteuid() != 0) {
+        fprintf(stderr, "%s must be run as root\n", argv[0]);
+        return 1;
+    }
+    if (!sc_cgroup_is_v2()) {
+        fprintf(stderr, "%s requires cgroup v2\n", argv[0]);
+        return 1;
+    }
+    (void)_sc_cgroup_v2_adjust_memlock_limit();
+
+    bench_devices devs = {.ptmx_fd = -1};
+    devs.ptmx_fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (devs.ptmx_fd < 0 || grantpt(devs.ptmx_fd) < 0 || unlockpt(devs.ptmx_fd) < 0) {
+        die("cannot allocate a pty");
+    }
+    if (ptsname_r(devs.ptmx_fd, devs.pts_path, sizeof devs.pts_path) != 0) {
+        die("cannot obtain the name of the pty slave");
+    }
+    struct stat sb;
+    if (stat(devs.pts_path, &sb) < 0) {
+        die("cannot stat %s", devs.pts_path);
+    }
+    devs.pts_rdev = sb.st_rdev;
+
+    printf("open and close latency in ns over %zu iterations, pty slave %s\n", iterations, devs.pts_path);
+    printf("%-10s  %-5s  %8s  %8s  %8s  %8s  %8s\n", "devices", "minor", "entries", "null p50", "null p99",
+           "pty p50", "pty p99");
+
+    bench_config baseline = {.where = BENCH_NO_PROGRAM};
+    run_config(&baseline, &devs, iterations);
+
+    static const size_t map_sizes[] = {10, 100, 500};
+    static const bench_where wheres[] = {BENCH_IN_BASE_MAP, BENCH_IN_APP_MAP};
+    for (size_t w = 0; w < sizeof wheres / sizeof *wheres; w++) {
+        for (int any_minor = 0; any_minor <= 1; any_minor++) {
+            for (size_t s = 0; s < sizeof map_sizes / sizeof *map_sizes; s++) {
+                bench_config config = {
+                    .where = wheres[w],
+                    .any_minor = any_minor,
+                    .map_size = map_sizes[s],
+                };
+                run_config(&config, &devs, iterations);
+            }
+        }
+    }
+
+    close(devs.ptmx_fd);
+    return 0;
+}
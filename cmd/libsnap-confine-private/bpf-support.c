@@ -131,26 +131,92 @@ int bpf_map_get_next_key(int map_fd, const void *key, void *next_key) {
     return sys_bpf(BPF_MAP_GET_NEXT_KEY, &attr, sizeof(attr));
 }
 
-int bpf_map_delete_batch(int map_fd, const void *keys, size_t cnt) {
-#if 0
-/*
- * XXX: batch operations don't seem to work with 5.13.10, getting -EINVAL
- * XXX: also batch operations are supported by recent kernels only
- */
-    debug("batch delete in map %d keys cnt %zu", map_fd, cnt);
+static int bpf_map_batch(enum bpf_cmd cmd, int map_fd, const void *in_batch, void *out_batch, const void *keys,
+                         const void *values, size_t *cnt) {
     union bpf_attr attr;
     memset(&attr, 0, sizeof(attr));
 
-    attr.map_fd = map_fd;
+    attr.batch.map_fd = map_fd;
+    attr.batch.in_batch = __ptr_as_u64(in_batch);
+    attr.batch.out_batch = __ptr_as_u64(out_batch);
     attr.batch.keys = __ptr_as_u64(keys);
-    attr.batch.count = cnt;
-    /* TODO: getting EINVAL? */
-    int ret = sys_bpf(BPF_MAP_DELETE_BATCH, &attr, sizeof(attr));
-    debug("returned count %d", attr.batch.count);
+    attr.batch.values = __ptr_as_u64(values);
+    attr.batch.count = *cnt;
+    /* update or create an existing element */
+    attr.batch.elem_flags = BPF_ANY;
+
+    int ret = sys_bpf(cmd, &attr, sizeof(attr));
+    /* the count of processed elements is valid also on failure */
+    *cnt = attr.batch.count;
     return ret;
-#endif
-    errno = ENOSYS;
-    return -1;
+}
+
+int bpf_map_lookup_batch(int map_fd, const void *in_batch, void *out_batch, void *keys, void *values, size_t *cnt) {
+    debug("batch lookup in map %d keys cnt %zu", map_fd, *cnt);
+    return bpf_map_batch(BPF_MAP_LOOKUP_BATCH, map_fd, in_batch, out_batch, keys, values, cnt);
+}
+
+int bpf_map_update_batch(int map_fd, const void *keys, const void *values, size_t *cnt) {
+    debug("batch update in map %d keys cnt %zu", map_fd, *cnt);
+    return bpf_map_batch(BPF_MAP_UPDATE_BATCH, map_fd, NULL, NULL, keys, values, cnt);
+}
+
+int bpf_map_delete_batch(int map_fd, const void *keys, size_t *cnt) {
+    debug("batch delete in map %d keys cnt %zu", map_fd, *cnt);
+    return bpf_map_batch(BPF_MAP_DELETE_BATCH, map_fd, NULL, NULL, keys, NULL, cnt);
+}
+
+static bool bpf_probe_map_batch(void) {
+    /* batch operations on hash maps appeared in 5.6, but were seen failing
+     * with EINVAL on later kernels too, so rather than trusting the kernel
+     * version, exercise all of them on a throwaway map */
+    int map_fd = bpf_create_map(BPF_MAP_TYPE_HASH, sizeof(uint32_t), sizeof(uint8_t), 1);
+    if (map_fd < 0) {
+        return false;
+    }
+    bool ok = false;
+    uint32_t key = 1;
+    uint8_t value = 1;
+    uint32_t out_batch = 0;
+    size_t cnt = 1;
+    if (bpf_map_update_batch(map_fd, &key, &value, &cnt) < 0 || cnt != 1) {
+        goto out;
+    }
+    key = 0;
+    cnt = 1;
+    if ((bpf_map_lookup_batch(map_fd, NULL, &out_batch, &key, &value, &cnt) < 0 && errno != ENOENT) || cnt != 1 ||
+        key != 1) {
+        goto out;
+    }
+    cnt = 1;
+    if (bpf_map_delete_batch(map_fd, &key, &cnt) < 0 || cnt != 1) {
+        goto out;
+    }
+    ok = true;
+out:
+    close(map_fd);
+    return ok;
+}
+
+bool bpf_map_batch_supported(void) {
+    static int supported = -1;
+    if (supported == -1) {
+        supported = bpf_probe_map_batch();
+        debug("bpf map batch operations %s", supported ? "supported" : "not supported");
+    }
+    return supported;
+}
+
+int bpf_map_lookup_elem(int map_fd, const void *key, void *value) {
+    debug("lookup elem in map %d", map_fd);
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+
+    attr.map_fd = map_fd;
+    attr.key = __ptr_as_u64(key);
+    attr.value = __ptr_as_u64(value);
+
+    return sys_bpf(BPF_MAP_LOOKUP_ELEM, &attr, sizeof(attr));
 }
 
 int bpf_map_delete_elem(int map_fd, const void *key) {
@@ -164,6 +230,77 @@ int bpf_map_delete_elem(int map_fd, const void *key) {
     return sys_bpf(BPF_MAP_DELETE_ELEM, &attr, sizeof(attr));
 }
 
+static int bpf_obj_get_info_by_fd(int fd, void *info, uint32_t info_len) {
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+
+    attr.info.bpf_fd = fd;
+    attr.info.info_len = info_len;
+    attr.info.info = __ptr_as_u64(info);
+
+    return sys_bpf(BPF_OBJ_GET_INFO_BY_FD, &attr, sizeof(attr));
+}
+
+int bpf_map_get_id(int map_fd, uint32_t *id) {
+    struct bpf_map_info info;
+    memset(&info, 0, sizeof(info));
+
+    if (bpf_obj_get_info_by_fd(map_fd, &info, sizeof(info)) < 0) {
+        return -1;
+    }
+    *id = info.id;
+    return 0;
+}
+
+int bpf_prog_get_map_ids(int prog_fd, uint32_t *ids, uint32_t *cnt) {
+    struct bpf_prog_info info;
+    memset(&info, 0, sizeof(info));
+    info.nr_map_ids = *cnt;
+    info.map_ids = __ptr_as_u64(ids);
+
+    if (bpf_obj_get_info_by_fd(prog_fd, &info, sizeof(info)) < 0) {
+        return -1;
+    }
+    *cnt = info.nr_map_ids;
+    return 0;
+}
+
+int bpf_prog_get_id(int prog_fd, uint32_t *id) {
+    struct bpf_prog_info info;
+    memset(&info, 0, sizeof(info));
+
+    if (bpf_obj_get_info_by_fd(prog_fd, &info, sizeof(info)) < 0) {
+        return -1;
+    }
+    *id = info.id;
+    return 0;
+}
+
+int bpf_prog_get_fd_by_id(uint32_t id) {
+    debug("get fd of program %u", id);
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+
+    attr.prog_id = id;
+
+    return sys_bpf(BPF_PROG_GET_FD_BY_ID, &attr, sizeof(attr));
+}
+
+int bpf_prog_query(enum bpf_attach_type type, int cgroup_fd, uint32_t *ids, uint32_t *cnt) {
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+
+    attr.query.target_fd = cgroup_fd;
+    attr.query.attach_type = type;
+    attr.query.prog_ids = __ptr_as_u64(ids);
+    attr.query.prog_cnt = *cnt;
+
+    int ret = sys_bpf(BPF_PROG_QUERY, &attr, sizeof(attr));
+    /* the count is also set when the capacity was too small */
+    *cnt = attr.query.prog_cnt;
+    return ret;
+}
+
 #ifndef BPF_FS_MAGIC
 #define BPF_FS_MAGIC 0xcafe4a11
 #endif
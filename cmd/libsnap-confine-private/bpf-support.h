@@ -21,6 +21,7 @@
 #include <linux/bpf.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 /**
  * bpf_pin_to_path pins an object referenced by fd to a path under a bpffs
@@ -61,6 +62,12 @@ int bpf_create_map(enum bpf_map_type type, size_t key_size, size_t value_size, s
  */
 int bpf_update_map(int map_fd, const void *key, const void *value);
 
+/**
+ * bpf_map_lookup_elem obtains the value of element with a given key, returns -1
+ * and ENOENT when the element does not exist.
+ */
+int bpf_map_lookup_elem(int map_fd, const void *key, void *value);
+
 /**
  * bpf_map_get_next_key iterates over keys of the map.
  *
@@ -71,11 +78,39 @@ int bpf_update_map(int map_fd, const void *key, const void *value);
  */
 int bpf_map_get_next_key(int map_fd, const void *key, void *next_key);
 
+/**
+ * bpf_map_batch_supported returns true when the kernel supports batch
+ * operations on hash maps. The kernel is probed once, the first time the
+ * function is called.
+ */
+bool bpf_map_batch_supported(void);
+
+/**
+ * bpf_map_lookup_batch obtains up to cnt elements of the map, storing their
+ * keys and values in the respective arrays, and updates cnt to the number of
+ * elements obtained.
+ *
+ * The lookup starts at the beginning of the map when in_batch is NULL, and
+ * otherwise at the position stored in out_batch by the previous call. For hash
+ * maps, the position is an uint32_t. When the end of the map is reached, -1 is
+ * returned and errno is set to ENOENT, the elements obtained by that call are
+ * still valid.
+ */
+int bpf_map_lookup_batch(int map_fd, const void *in_batch, void *out_batch, void *keys, void *values, size_t *cnt);
+
+/**
+ * bpf_map_update_batch updates the values of cnt elements with given keys (or
+ * adds them to the map), and updates cnt to the number of elements that were
+ * updated, also on failure.
+ */
+int bpf_map_update_batch(int map_fd, const void *keys, const void *values, size_t *cnt);
+
 /**
  * bpf_map_delete_batch performs a batch delete of elements with keys, where cnt
- * is the number of keys.
+ * is the number of keys, and updates cnt to the number of elements that were
+ * deleted, also on failure.
  */
-int bpf_map_delete_batch(int map_fd, const void *keys, size_t cnt);
+int bpf_map_delete_batch(int map_fd, const void *keys, size_t *cnt);
 
 /**
  * bpf_map_delete_elem deletes an element with a key from the map, returns -1
@@ -83,6 +118,38 @@ int bpf_map_delete_batch(int map_fd, const void *keys, size_t cnt);
  */
 int bpf_map_delete_elem(int map_fd, const void *key);
 
+/**
+ * bpf_map_get_id obtains the system wide ID of the map referenced by map_fd.
+ */
+int bpf_map_get_id(int map_fd, uint32_t *id);
+
+/**
+ * bpf_prog_get_map_ids obtains the IDs of the maps used by the program
+ * referenced by prog_fd. On input cnt is the capacity of ids, on output it is
+ * the number of maps used by the program, which may exceed the capacity.
+ */
+int bpf_prog_get_map_ids(int prog_fd, uint32_t *ids, uint32_t *cnt);
+
+/**
+ * bpf_prog_get_id obtains the system wide ID of the program referenced by
+ * prog_fd.
+ */
+int bpf_prog_get_id(int prog_fd, uint32_t *id);
+
+/**
+ * bpf_prog_get_fd_by_id obtains a file descriptor of the program with the
+ * given ID, returns -1 and ENOENT when there is no such program.
+ */
+int bpf_prog_get_fd_by_id(uint32_t id);
+
+/**
+ * bpf_prog_query obtains the IDs of the programs of given attach type which
+ * are attached directly to the cgroup referenced by cgroup_fd. On input cnt is
+ * the capacity of ids, on output it is the number of attached programs. When
+ * the capacity is too small -1 is returned and errno is set to ENOSPC.
+ */
+int bpf_prog_query(enum bpf_attach_type type, int cgroup_fd, uint32_t *ids, uint32_t *cnt);
+
 /**
  * bpf_path_is_bpffs returns true when given path is a bpffs filesystem.
  */
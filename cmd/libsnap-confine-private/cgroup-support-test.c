@@ -147,6 +147,83 @@ static void test_sc_cgroupv2_is_tracking_other_snaps(cgroupv2_is_tracking_fixtur
     g_assert_false(is_tracking);
 }
 
+static void test_sc_cgroupv2_is_tracking_user_service(cgroupv2_is_tracking_fixture *fixture,
+                                                       gconstpointer user_data) {
+    g_assert_true(g_file_set_contents(fixture->self_cgroup, "0::/system.slice/snap.foo.svc.service", -1, NULL));
+
+    /* groups of applications are created by the user manager */
+    const char *dirs[] = {
+        "/system.slice/snap.foo.svc.service",
+        "/user.slice/user-1000.slice/user@1000.service/app.slice/snap.foo.app-1234-1234.scope",
+    };
+
+    for (size_t i = 0; i < sizeof dirs / sizeof dirs[0]; i++) {
+        char *np = g_build_filename(fixture->root, dirs[i], NULL);
+        int ret = g_mkdir_with_parents(np, 0755);
+        g_assert_cmpint(ret, ==, 0);
+        g_free(np);
+    }
+
+    bool is_tracking = sc_cgroup_v2_is_tracking_snap("foo");
+    g_assert_true(is_tracking);
+}
+
+static void test_sc_cgroupv2_is_tracking_pruned(cgroupv2_is_tracking_fixture *fixture, gconstpointer user_data) {
+    g_assert_true(g_file_set_contents(fixture->self_cgroup, "0::/system.slice/snap.foo.svc.service", -1, NULL));
+
+    /* groups which are not slices are not traversed */
+    const char *dirs[] = {
+        "/system.slice/snap.foo.svc.service",
+        "/foo/bar/snap.foo.app.1111-1111.scope",
+        "/kubepods.slice/kubepods-pod1.slice/cri-containerd-1.scope/system.slice/snap.foo.svc.service",
+        "/user.slice/user-1000.slice/session-1.scope/snap.foo.app-1234-1234.scope",
+    };
+
+    for (size_t i = 0; i < sizeof dirs / sizeof dirs[0]; i++) {
+        char *np = g_build_filename(fixture->root, dirs[i], NULL);
+        int ret = g_mkdir_with_parents(np, 0755);
+        g_assert_cmpint(ret, ==, 0);
+        g_free(np);
+    }
+
+    bool is_tracking = sc_cgroup_v2_is_tracking_snap("foo");
+    g_assert_false(is_tracking);
+}
+
+static void test_sc_cgroupv2_is_tracking_populated(cgroupv2_is_tracking_fixture *fixture, gconstpointer user_data) {
+    g_assert_true(g_file_set_contents(fixture->self_cgroup, "0::/system.slice/snap.foo.svc.service", -1, NULL));
+
+    const char *dirs[] = {
+        "/system.slice/snap.foo.svc.service",
+        "/system.slice/snap.foo.other.service",
+        "/user.slice/user-1000.slice/user@1000.service/snap.foo.app-1234-1234.scope",
+    };
+
+    for (size_t i = 0; i < sizeof dirs / sizeof dirs[0]; i++) {
+        char *np = g_build_filename(fixture->root, dirs[i], NULL);
+        int ret = g_mkdir_with_parents(np, 0755);
+        g_assert_cmpint(ret, ==, 0);
+        g_free(np);
+    }
+
+    /* the groups have not been cleaned up after the processes exited */
+    char *events = g_build_filename(fixture->root, dirs[1], "cgroup.events", NULL);
+    g_assert_true(g_file_set_contents(events, "populated 0\nfrozen 0\n", -1, NULL));
+    g_free(events);
+    events = g_build_filename(fixture->root, dirs[2], "cgroup.events", NULL);
+    g_assert_true(g_file_set_contents(events, "populated 0\nfrozen 0\n", -1, NULL));
+
+    bool is_tracking = sc_cgroup_v2_is_tracking_snap("foo");
+    g_assert_false(is_tracking);
+
+    /* an application of the snap is running */
+    g_assert_true(g_file_set_contents(events, "populated 1\nfrozen 0\n", -1, NULL));
+    g_free(events);
+
+    is_tracking = sc_cgroup_v2_is_tracking_snap("foo");
+    g_assert_true(is_tracking);
+}
+
 static void test_sc_cgroupv2_is_tracking_no_dirs(cgroupv2_is_tracking_fixture *fixture, gconstpointer user_data) {
     g_assert_true(g_file_set_contents(fixture->self_cgroup, "0::/foo/bar/baz/snap.foo.app.scope", -1, NULL));
 
@@ -173,7 +250,7 @@ static void test_sc_cgroupv2_is_tracking_bad_nesting(cgroupv2_is_tracking_fixtur
     /* create a hierarchy so deep that it triggers the nesting error */
     char *prev_path = g_build_filename(fixture->root, NULL);
     for (size_t i = 0; i < max_traversal_depth; i++) {
-        char *np = g_build_filename(prev_path, "nested", NULL);
+        char *np = g_build_filename(prev_path, "nested.slice", NULL);
         int ret = g_mkdir_with_parents(np, 0755);
         g_assert_cmpint(ret, ==, 0);
         g_free(prev_path);
@@ -199,12 +276,12 @@ static void test_sc_cgroupv2_is_tracking_dir_permissions(cgroupv2_is_tracking_fi
 
     /* there exist 2 groups with processes from a given snap */
     const char *dirs[] = {
-        "/foo/bar/bad",
-        "/foo/bar/bad/badperm",
+        "/foo.slice/bar.slice/bad.slice",
+        "/foo.slice/bar.slice/bad.slice/badperm.slice",
     };
     for (size_t i = 0; i < sizeof dirs / sizeof dirs[0]; i++) {
         int mode = 0755;
-        if (g_str_has_suffix(dirs[i], "/badperm")) {
+        if (g_str_has_suffix(dirs[i], "/badperm.slice")) {
             mode = 0000;
         }
         char *np = g_build_filename(fixture->root, dirs[i], NULL);
@@ -219,7 +296,7 @@ static void test_sc_cgroupv2_is_tracking_dir_permissions(cgroupv2_is_tracking_fi
     }
     g_test_trap_subprocess(NULL, 0, 0);
     g_test_trap_assert_failed();
-    g_test_trap_assert_stderr("cannot open directory entry \"badperm\": Permission denied\n");
+    g_test_trap_assert_stderr("cannot open directory entry \"badperm.slice\": Permission denied\n");
 }
 
 static void test_sc_cgroupv2_is_tracking_no_cgroup_root(cgroupv2_is_tracking_fixture *fixture,
@@ -355,6 +432,12 @@ static void __attribute__((constructor)) init(void) {
                test_sc_cgroupv2_is_tracking_just_own_group, cgroupv2_is_tracking_tear_down);
     g_test_add("/cgroup/v2/is_tracking_only_other_snaps", cgroupv2_is_tracking_fixture, NULL,
                cgroupv2_is_tracking_set_up, test_sc_cgroupv2_is_tracking_other_snaps, cgroupv2_is_tracking_tear_down);
+    g_test_add("/cgroup/v2/is_tracking_user_service", cgroupv2_is_tracking_fixture, NULL, cgroupv2_is_tracking_set_up,
+               test_sc_cgroupv2_is_tracking_user_service, cgroupv2_is_tracking_tear_down);
+    g_test_add("/cgroup/v2/is_tracking_pruned", cgroupv2_is_tracking_fixture, NULL, cgroupv2_is_tracking_set_up,
+               test_sc_cgroupv2_is_tracking_pruned, cgroupv2_is_tracking_tear_down);
+    g_test_add("/cgroup/v2/is_tracking_populated", cgroupv2_is_tracking_fixture, NULL, cgroupv2_is_tracking_set_up,
+               test_sc_cgroupv2_is_tracking_populated, cgroupv2_is_tracking_tear_down);
     g_test_add("/cgroup/v2/is_tracking_empty_groups", cgroupv2_is_tracking_fixture, NULL, cgroupv2_is_tracking_set_up,
                test_sc_cgroupv2_is_tracking_no_dirs, cgroupv2_is_tracking_tear_down);
     g_test_add("/cgroup/v2/is_tracking_bad_self_group", cgroupv2_is_tracking_fixture, NULL, cgroupv2_is_tracking_set_up,
@@ -22,9 +22,12 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/vfs.h>
 #include <unistd.h>
@@ -96,61 +99,109 @@ bool sc_cgroup_is_v2(void) {
 
 static const size_t max_traversal_depth = 32;
 
-static bool traverse_looking_for_prefix_in_dir(DIR *root, const char *prefix, const char *skip, size_t depth) {
+// Directories are read in large chunks, as a busy host may have thousands of
+// groups in system.slice alone.
+#define SC_CGROUP_DIRENT_BUF_SIZE (64 * 1024)
+
+// The layout of entries returned by getdents64(2).
+struct sc_linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+bool sc_cgroup_v2_may_contain_tracking_groups(const char *name) {
+    return sc_endswith(name, ".slice") || (sc_startswith(name, "user@") && sc_endswith(name, ".service"));
+}
+
+// Check whether a group contains any processes, directly or in its
+// descendants. When this cannot be determined, the group is assumed to be
+// populated.
+static bool is_group_populated(int dir_fd, const char *name) {
+    char path[PATH_MAX] = {0};
+    sc_must_snprintf(path, sizeof path, "%s/cgroup.events", name);
+    int events_fd SC_CLEANUP(sc_cleanup_close) = openat(dir_fd, path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (events_fd < 0) {
+        debug("cannot open %s, assuming the group is populated", path);
+        return true;
+    }
+    char buf[256] = {0};
+    ssize_t n = read(events_fd, buf, sizeof buf - 1);
+    if (n < 0) {
+        debug("cannot read %s, assuming the group is populated", path);
+        return true;
+    }
+    // the file has a "key value" pair per line, e.g. "populated 1"
+    const char *populated = strstr(buf, "populated ");
+    if (populated == NULL || (populated != buf && populated[-1] != '\n')) {
+        return true;
+    }
+    return populated[strlen("populated ")] != '0';
+}
+
+static bool traverse_looking_for_prefix_in_dir(int dir_fd, const char *prefix, const char *skip, size_t depth) {
     if (depth > max_traversal_depth) {
         die("cannot traverse cgroups hierarchy deeper than %zu levels", max_traversal_depth);
     }
+    char *buf SC_CLEANUP(sc_cleanup_string) = malloc(SC_CGROUP_DIRENT_BUF_SIZE);
+    if (buf == NULL) {
+        die("cannot allocate memory for directory entries");
+    }
     while (true) {
-        errno = 0;
-        struct dirent *ent = readdir(root);
-        if (ent == NULL) {
-            // is this an error?
-            if (errno != 0) {
-                if (errno == ENOENT) {
-                    // the processes may exit and the group entries may go away at
-                    // any time
-                    // the entries may go away at any time
-                    break;
-                }
-                die("cannot read directory entry");
-            }
-            break;
-        }
-        if (ent->d_type != DT_DIR) {
-            continue;
-        }
-        if (sc_streq(ent->d_name, "..") || sc_streq(ent->d_name, ".")) {
-            // we don't want to go up or process the current directory again
-            continue;
-        }
-        if (sc_streq(ent->d_name, skip)) {
-            // we were asked to skip this group
-            continue;
-        }
-        if (sc_startswith(ent->d_name, prefix)) {
-            debug("found matching prefix in \"%s\"", ent->d_name);
-            // the directory starts with our prefix
-            return true;
-        }
-        // entfd is consumed by fdopendir() and freed with closedir()
-        int entfd = openat(dirfd(root), ent->d_name, O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
-        if (entfd == -1) {
+        long n = syscall(SYS_getdents64, dir_fd, buf, SC_CGROUP_DIRENT_BUF_SIZE);
+        if (n < 0) {
             if (errno == ENOENT) {
                 // the processes may exit and the group entries may go away at
                 // any time
-                return false;
+                break;
             }
-            die("cannot open directory entry \"%s\"", ent->d_name);
+            die("cannot read directory entry");
         }
-        // takes ownership of the file descriptor
-        DIR *entdir SC_CLEANUP(sc_cleanup_closedir) = fdopendir(entfd);
-        if (entdir == NULL) {
-            // we have the fd, so ENOENT isn't possible here
-            die("cannot fdopendir directory \"%s\"", ent->d_name);
+        if (n == 0) {
+            break;
         }
-        bool found = traverse_looking_for_prefix_in_dir(entdir, prefix, skip, depth + 1);
-        if (found == true) {
-            return true;
+        for (long offset = 0; offset < n;) {
+            struct sc_linux_dirent64 *ent = (struct sc_linux_dirent64 *)(buf + offset);
+            offset += ent->d_reclen;
+            if (ent->d_type != DT_DIR) {
+                continue;
+            }
+            if (sc_streq(ent->d_name, "..") || sc_streq(ent->d_name, ".")) {
+                // we don't want to go up or process the current directory again
+                continue;
+            }
+            if (sc_streq(ent->d_name, skip)) {
+                // we were asked to skip this group
+                continue;
+            }
+            if (sc_startswith(ent->d_name, prefix)) {
+                // the directory starts with our prefix, but systemd may not
+                // have cleaned up the group after the processes exited
+                if (is_group_populated(dir_fd, ent->d_name)) {
+                    debug("found matching prefix in \"%s\"", ent->d_name);
+                    return true;
+                }
+                debug("skipping group \"%s\" which is not populated", ent->d_name);
+                continue;
+            }
+            if (!sc_cgroup_v2_may_contain_tracking_groups(ent->d_name)) {
+                continue;
+            }
+            int entfd SC_CLEANUP(sc_cleanup_close) =
+                openat(dir_fd, ent->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (entfd == -1) {
+                if (errno == ENOENT) {
+                    // the processes may exit and the group entries may go away at
+                    // any time
+                    continue;
+                }
+                die("cannot open directory entry \"%s\"", ent->d_name);
+            }
+            if (traverse_looking_for_prefix_in_dir(entfd, prefix, skip, depth + 1)) {
+                return true;
+            }
         }
     }
     return false;
@@ -187,17 +238,17 @@ bool sc_cgroup_v2_is_tracking_snap(const char *snap_instance) {
     // cleaned up the group
 
     debug("opening cgroup root dir at %s", cgroup_dir);
-    DIR *root SC_CLEANUP(sc_cleanup_closedir) = opendir(cgroup_dir);
-    if (root == NULL) {
+    int root_fd SC_CLEANUP(sc_cleanup_close) = open(cgroup_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0) {
         if (errno == ENOENT) {
             return false;
         }
         die("cannot open cgroup root dir");
     }
-    // traverse the cgroup hierarchy tree looking for other groups that
-    // correspond to the snap (i.e. their name matches the pattern), but skip
-    // our own group in the process
-    return traverse_looking_for_prefix_in_dir(root, tracking_group_name, just_leaf, 1);
+    // traverse the slices of the cgroup hierarchy tree looking for other
+    // populated groups that correspond to the snap (i.e. their name matches
+    // the pattern), but skip our own group in the process
+    return traverse_looking_for_prefix_in_dir(root_fd, tracking_group_name, just_leaf, 1);
 }
 
 static const char *self_cgroup = "/proc/self/cgroup";
@@ -53,6 +53,17 @@ bool sc_cgroup_is_v2(void);
  */
 bool sc_cgroup_v2_is_tracking_snap(const char *snap_instance);
 
+/**
+ * sc_cgroup_v2_may_contain_tracking_groups returns true if groups tracking snap
+ * applications or services may be found below the group with the given name.
+ *
+ * Such groups are created by systemd, which only nests units in slices, and in
+ * the user@<uid>.service of the user manager. Groups of other units, such as
+ * containers or pods, may have deep hierarchies of their own, but cannot
+ * contain groups of the snaps of the host.
+ */
+bool sc_cgroup_v2_may_contain_tracking_groups(const char *name);
+
 /**
  * sc_cgroup_v2_own_path_full return the full path of the owning cgroup as
  * reported by the kernel.
@@ -93,6 +93,16 @@ static void test_is_on_core_on16(void)
 	g_assert_cmpint(sc_classify_distro(), ==, SC_DISTRO_CORE16);
 }
 
+static const char *os_release_core16_unterminated = ""
+    "NAME=\"Ubuntu Core\"\n" "garbage\n" "VERSION_ID=\"16\"\n" "ID=ubuntu-core";
+
+static void test_is_on_core_on16_unterminated(void)
+{
+	mock_os_release(os_release_core16_unterminated);
+	mock_meta_snap_yaml(meta_snap_yaml_core16);
+	g_assert_cmpint(sc_classify_distro(), ==, SC_DISTRO_CORE16);
+}
+
 static const char *os_release_core18 = ""
     "NAME=\"Ubuntu Core\"\n" "VERSION_ID=\"18\"\n" "ID=ubuntu-core\n";
 
@@ -189,6 +199,9 @@ static const char *os_release_actual_debian_valid = "ID=debian\n";
 
 static const char *os_release_invalid = "garbage\n";
 
+static const char *os_release_debian_like_with_empty_line = ""
+    "# comment\n" "ID=my-fun-distro\n" "\n" "ID_LIKE=debian\n";
+
 static void test_is_debian_like(void)
 {
 	mock_os_release(os_release_debian_like_valid);
@@ -205,6 +218,9 @@ static void test_is_debian_like(void)
 
 	mock_os_release(os_release_invalid);
 	g_assert_false(sc_is_debian_like());
+
+	mock_os_release(os_release_debian_like_with_empty_line);
+	g_assert_true(sc_is_debian_like());
 }
 
 static void __attribute__((constructor)) init(void)
@@ -213,6 +229,8 @@ static void __attribute__((constructor)) init(void)
 	g_test_add_func("/classic/on-classic-with-long-line",
 			test_is_on_classic_with_long_line);
 	g_test_add_func("/classic/on-core-on16", test_is_on_core_on16);
+	g_test_add_func("/classic/on-core-on16-unterminated",
+			test_is_on_core_on16_unterminated);
 	g_test_add_func("/classic/on-core-on18", test_is_on_core_on18);
 	g_test_add_func("/classic/on-core-on20", test_is_on_core_on20);
 	g_test_add_func("/classic/on-fedora-base", test_is_on_fedora_base);
@@ -3,6 +3,7 @@
 #include "../libsnap-confine-private/cleanup-funcs.h"
 #include "../libsnap-confine-private/infofile.h"
 #include "../libsnap-confine-private/string-utils.h"
+#include "../libsnap-confine-private/utils.h"
 
 #include <stdbool.h>
 #include <stdio.h>
@@ -12,6 +13,21 @@
 static const char *os_release = "/etc/os-release";
 static const char *meta_snap_yaml = "/meta/snap.yaml";
 
+/* os_release_value_is returns true if the value of a key in /etc/os-release,
+   quoted or not, is the expected one. */
+static bool os_release_value_is(const char *value, const char *expected)
+{
+	if (value == NULL) {
+		return false;
+	}
+	size_t len = strlen(value);
+	if (len >= 2 && value[0] == '"' && value[len - 1] == '"') {
+		return strlen(expected) == len - 2
+		    && strncmp(value + 1, expected, len - 2) == 0;
+	}
+	return sc_streq(value, expected);
+}
+
 sc_distro sc_classify_distro(void)
 {
 	FILE *f SC_CLEANUP(sc_cleanup_file) = fopen(os_release, "r");
@@ -19,27 +35,27 @@ sc_distro sc_classify_distro(void)
 		return SC_DISTRO_CLASSIC;
 	}
 
-	bool is_core = false;
-	int core_version = 0;
-	char buf[255] = { 0 };
-
-	while (fgets(buf, sizeof buf, f) != NULL) {
-		size_t len = strlen(buf);
-		if (len > 0 && buf[len - 1] == '\n') {
-			buf[len - 1] = '\0';
-		}
-		if (sc_streq(buf, "ID=\"ubuntu-core\"")
-		    || sc_streq(buf, "ID=ubuntu-core")) {
-			is_core = true;
-		} else if (sc_streq(buf, "VERSION_ID=\"16\"")
-			   || sc_streq(buf, "VERSION_ID=16")) {
-			core_version = 16;
-		} else if (sc_streq(buf, "VARIANT_ID=\"snappy\"")
-			   || sc_streq(buf, "VARIANT_ID=snappy")) {
-			is_core = true;
-		}
+	char *id SC_CLEANUP(sc_cleanup_string) = NULL;
+	char *version_id SC_CLEANUP(sc_cleanup_string) = NULL;
+	char *variant_id SC_CLEANUP(sc_cleanup_string) = NULL;
+	sc_infofile_key keys[] = {
+		{.key = "ID",.value = &id},
+		{.key = "VERSION_ID",.value = &version_id},
+		{.key = "VARIANT_ID",.value = &variant_id},
+	};
+	/* Like other readers of os-release, tolerate lines that are not
+	   key=value pairs. */
+	struct sc_error *err SC_CLEANUP(sc_cleanup_error) = NULL;
+	if (sc_infofile_get_keys(f, keys, sizeof keys / sizeof *keys,
+				 SC_INFOFILE_LENIENT, &err) < 0) {
+		/* Use the keys found before the read error. */
+		debug("cannot read %s: %s", os_release, sc_error_msg(err));
 	}
 
+	bool is_core = os_release_value_is(id, "ubuntu-core")
+	    || os_release_value_is(variant_id, "snappy");
+	int core_version = os_release_value_is(version_id, "16") ? 16 : 0;
+
 	if (!is_core) {
 		/* Since classic systems don't have a /meta/snap.yaml file the simple
 		   presence of that file qualifies as SC_DISTRO_CORE_OTHER. */
@@ -64,28 +80,17 @@ bool sc_is_debian_like(void)
 	if (f == NULL) {
 		return false;
 	}
-	const char *const id_keys_to_try[] = {
-		"ID",		/* actual debian only sets ID */
-		"ID_LIKE",	/* distros based on debian */
+	char *id SC_CLEANUP(sc_cleanup_string) = NULL;
+	char *id_like SC_CLEANUP(sc_cleanup_string) = NULL;
+	sc_infofile_key keys[] = {
+		{.key = "ID",.value = &id},	/* actual debian only sets ID */
+		{.key = "ID_LIKE",.value = &id_like},	/* distros based on debian */
 	};
-	size_t id_keys_to_try_len =
-	    sizeof id_keys_to_try / sizeof *id_keys_to_try;
-	for (size_t i = 0; i < id_keys_to_try_len; i++) {
-		if (fseek(f, 0L, SEEK_SET) == -1) {
-			return false;
-		}
-		char *id_val SC_CLEANUP(sc_cleanup_string) = NULL;
-		struct sc_error *err SC_CLEANUP(sc_cleanup_error) = NULL;
-		int rc =
-		    sc_infofile_get_key(f, id_keys_to_try[i], &id_val, &err);
-		if (rc != 0) {
-			/* only if sc_infofile_get_key failed */
-			return false;
-		}
-		if (sc_streq(id_val, "\"debian\"")
-		    || sc_streq(id_val, "debian")) {
-			return true;
-		}
+	struct sc_error *err SC_CLEANUP(sc_cleanup_error) = NULL;
+	if (sc_infofile_get_keys(f, keys, sizeof keys / sizeof *keys,
+				 SC_INFOFILE_LENIENT, &err) < 0) {
+		return false;
 	}
-	return false;
+	return os_release_value_is(id, "debian")
+	    || os_release_value_is(id_like, "debian");
 }
@@ -16,15 +16,21 @@
  */
 #include "config.h"
 
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/random.h>
 #include <sys/resource.h>
 #include <sys/stat.h>
 
 #include "cgroup-support.h"
 #include "cleanup-funcs.h"
+#include "error.h"
+#include "locking.h"
 #include "snap.h"
 #include "string-utils.h"
 #include "utils.h"
@@ -58,9 +64,21 @@ struct sc_device_cgroup {
         } v1;
         struct {
             int devmap_fd;
+            int basemap_fd;
             int prog_fd;
+            /* the device map was set up for a program consulting the base
+             * map */
+            bool uses_base;
             char *tag;
             struct rlimit old_limit;
+            /* keys of allowed devices not yet added to the map */
+            struct sc_cgroup_v2_device_key *pending;
+            size_t num_pending;
+            size_t cap_pending;
+            /* keys found in a reused map, to be reconciled with the allowed
+             * devices */
+            struct sc_cgroup_v2_device_key *existing;
+            size_t num_existing;
         } v2;
     };
 };
@@ -148,8 +166,25 @@ typedef struct sc_cgroup_v2_device_key sc_cgroup_v2_device_key;
  */
 typedef uint8_t sc_cgroup_v2_device_value;
 
+/**
+ * SC_CGROUP_V2_META_TYPE is the type of keys which do not describe a device
+ * but the map itself. The program only looks up keys of block and character
+ * devices so these never allow anything.
+ */
+#define SC_CGROUP_V2_META_TYPE 0
+
+/**
+ * sc_cgroup_v2_uses_base_key marks device maps which were set up for a program
+ * consulting the base map, see _sc_cgroup_v2_allow_base_bpf().
+ */
+static const sc_cgroup_v2_device_key sc_cgroup_v2_uses_base_key = {
+    .type = SC_CGROUP_V2_META_TYPE,
+    .major = 0,
+    .minor = 1,
+};
+
 #ifdef ENABLE_BPF
-static int load_devcgroup_prog(int map_fd) {
+static int load_devcgroup_prog(int basemap_fd, int map_fd) {
     /* Basic rules about registers:
      * r0    - return value of built in functions and exit code of the program
      * r1-r5 - respective arguments to built in functions, clobbered by calls
@@ -161,6 +196,11 @@ static int load_devcgroup_prog(int map_fd) {
      * this:
      *   int program(struct bpf_cgroup_dev_ctx * ctx)
      * where *ctx is passed in r1, while the result goes to r0
+     *
+     * The device is looked up in the base map of devices allowed for all
+     * snaps, and then in the map of devices assigned to the snap application,
+     * each time first with the exact minor number and then with any minor
+     * number.
      */
 
     /* just a placeholder for map value where the value is 1 byte, but
@@ -192,11 +232,11 @@ static int load_devcgroup_prog(int map_fd) {
                     offsetof(struct bpf_cgroup_dev_ctx, major)), /* r2 = *(u32)(r1->major) */
         BPF_STX_MEM(BPF_W, BPF_REG_6, BPF_REG_2,
                     offsetof(struct sc_cgroup_v2_device_key, major)), /* *(r6 + offsetof(major)) = r2 */
-        /* copy minor to our key */
-        BPF_LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_1,
-                    offsetof(struct bpf_cgroup_dev_ctx, minor)), /* r2 = *(u32)(r1->minor) */
-        BPF_STX_MEM(BPF_W, BPF_REG_6, BPF_REG_2,
-                    offsetof(struct sc_cgroup_v2_device_key, minor)), /* *(r6 + offsetof(minor)) = r2 */
+        /* copy minor to our key, keeping it in r7 for the second map */
+        BPF_LDX_MEM(BPF_W, BPF_REG_7, BPF_REG_1,
+                    offsetof(struct bpf_cgroup_dev_ctx, minor)), /* r7 = *(u32)(r1->minor) */
+        BPF_STX_MEM(BPF_W, BPF_REG_6, BPF_REG_7,
+                    offsetof(struct sc_cgroup_v2_device_key, minor)), /* *(r6 + offsetof(minor)) = r7 */
         /* copy device access_type to r2 */
         BPF_LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_1,
                     offsetof(struct bpf_cgroup_dev_ctx, access_type)), /* r2 = *(u32*)(r1->access_type) */
@@ -215,26 +255,41 @@ static int load_devcgroup_prog(int map_fd) {
         /* unknown device type */
         BPF_MOV64_IMM(BPF_REG_0, 0), /* r0 = 0 */
         BPF_EXIT_INSN(),
-        /* back on happy path, prepare arguments for map lookup */
+        /* back on happy path, look up the exact match in the base map */
+        BPF_LD_MAP_FD(BPF_REG_1, basemap_fd),
+        BPF_MOV64_REG(BPF_REG_2, BPF_REG_6),                                 /* r2 = (struct key *) r6, */
+        BPF_RAW_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem), /* r0 = bpf_map_lookup_elem(<base>,
+                                                                                &key) */
+        BPF_JMP_IMM(BPF_JNE, BPF_REG_0, 0, 20),                              /* if (value_ptr != 0) goto allow */
+        /* maybe the minor number is using 0xffffffff (any) mask */
+        BPF_ST_MEM(BPF_W, BPF_REG_6, offsetof(struct sc_cgroup_v2_device_key, minor), UINT32_MAX),
+        BPF_LD_MAP_FD(BPF_REG_1, basemap_fd),
+        BPF_MOV64_REG(BPF_REG_2, BPF_REG_6),                                 /* r2 = (struct key *) r6, */
+        BPF_RAW_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem), /* r0 = bpf_map_lookup_elem(<base>,
+                                                                                &key) */
+        BPF_JMP_IMM(BPF_JNE, BPF_REG_0, 0, 14),                              /* if (value_ptr != 0) goto allow */
+        /* restore the minor number and look up the exact match in the map of
+         * the snap application */
+        BPF_STX_MEM(BPF_W, BPF_REG_6, BPF_REG_7,
+                    offsetof(struct sc_cgroup_v2_device_key, minor)), /* *(r6 + offsetof(minor)) = r7 */
         BPF_LD_MAP_FD(BPF_REG_1, map_fd),
         BPF_MOV64_REG(BPF_REG_2, BPF_REG_6),                                 /* r2 = (struct key *) r6, */
         BPF_RAW_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem), /* r0 = bpf_map_lookup_elem(<map>,
                                                                                 &key) */
-        BPF_JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 1),                               /* if (value_ptr == 0) goto pc + 1 */
-        /* we found an exact match */
-        BPF_JMP_A(5), /* else goto pc + 5 */
-        /* maybe the minor number is using 0xffffffff (any) mask */
+        BPF_JMP_IMM(BPF_JNE, BPF_REG_0, 0, 8),                               /* if (value_ptr != 0) goto allow */
+        /* and again with any minor number */
         BPF_ST_MEM(BPF_W, BPF_REG_6, offsetof(struct sc_cgroup_v2_device_key, minor), UINT32_MAX),
         BPF_LD_MAP_FD(BPF_REG_1, map_fd),
         BPF_MOV64_REG(BPF_REG_2, BPF_REG_6),                                 /* r2 = (struct key *) r6, */
         BPF_RAW_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem), /* r0 = bpf_map_lookup_elem(<map>,
                                                                                 &key) */
-        BPF_JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 2),                               /* if (value_ptr == 0) goto pc + 2 */
-        /* we found a match with any minor number for that type|major */
-        BPF_MOV64_IMM(BPF_REG_0, 1), /* r0 = 1 */
-        BPF_JMP_A(1),
+        BPF_JMP_IMM(BPF_JNE, BPF_REG_0, 0, 2),                               /* if (value_ptr != 0) goto allow */
+        /* no match */
         BPF_MOV64_IMM(BPF_REG_0, 0), /* r0 = 0 */
         BPF_EXIT_INSN(),
+        /* allow: we found a match in either map */
+        BPF_MOV64_IMM(BPF_REG_0, 1), /* r0 = 1 */
+        BPF_EXIT_INSN(),
     };
 
     char log_buf[4096] = {0};
@@ -247,6 +302,81 @@ static int load_devcgroup_prog(int map_fd) {
     return prog_fd;
 }
 
+/**
+ * SC_DEVCGROUP_PROG_VERSION identifies the program built by
+ * load_devcgroup_prog() and must be bumped whenever the program changes, such
+ * that programs pinned by older versions of snap-confine are not reused.
+ */
+#define SC_DEVCGROUP_PROG_VERSION 2
+
+/**
+ * _sc_cgroup_v2_prog_uses_map_id returns true if the program uses the map with
+ * the given ID.
+ */
+static bool _sc_cgroup_v2_prog_uses_map_id(int prog_fd, uint32_t map_id) {
+    uint32_t prog_map_ids[4] = {0};
+    uint32_t prog_map_cnt = sizeof prog_map_ids / sizeof prog_map_ids[0];
+    if (bpf_prog_get_map_ids(prog_fd, prog_map_ids, &prog_map_cnt) < 0) {
+        die("cannot obtain maps of device cgroup program");
+    }
+    for (uint32_t i = 0; i < prog_map_cnt && i < sizeof prog_map_ids / sizeof prog_map_ids[0]; i++) {
+        if (prog_map_ids[i] == map_id) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static uint32_t _sc_cgroup_v2_map_id(int map_fd) {
+    uint32_t map_id = 0;
+    if (bpf_map_get_id(map_fd, &map_id) < 0) {
+        die("cannot obtain device map ID");
+    }
+    return map_id;
+}
+
+/**
+ * _sc_cgroup_v2_prog_uses_map returns true if the program uses the given map.
+ */
+static bool _sc_cgroup_v2_prog_uses_map(int prog_fd, int map_fd) {
+    return _sc_cgroup_v2_prog_uses_map_id(prog_fd, _sc_cgroup_v2_map_id(map_fd));
+}
+
+/**
+ * _sc_cgroup_v2_get_prog returns the device cgroup program for the maps.
+ *
+ * The program is pinned at the given path and shared by all the instances of
+ * the application, such that it is only verified once. A pinned program using
+ * other maps, that is ones that were since recreated, is replaced.
+ */
+static int _sc_cgroup_v2_get_prog(const char *prog_path, int devmap_fd, int basemap_fd) {
+    int prog_fd = bpf_get_by_path(prog_path);
+    if (prog_fd >= 0) {
+        if (_sc_cgroup_v2_prog_uses_map(prog_fd, devmap_fd) && _sc_cgroup_v2_prog_uses_map(prog_fd, basemap_fd)) {
+            debug("reusing device cgroup program pinned at %s", prog_path);
+            return prog_fd;
+        }
+        debug("pinned device cgroup program uses another map");
+        close(prog_fd);
+        if (unlink(prog_path) < 0 && errno != ENOENT) {
+            die("cannot remove stale device cgroup program %s", prog_path);
+        }
+    } else if (errno != ENOENT) {
+        die("cannot get existing device cgroup program");
+    }
+
+    prog_fd = load_devcgroup_prog(basemap_fd, devmap_fd);
+    if (bpf_pin_to_path(prog_fd, prog_path) < 0) {
+        if (errno != EEXIST) {
+            die("cannot pin device cgroup program to %s", prog_path);
+        }
+        /* another instance pinned its own program in the meantime, which is
+         * just as good, so use ours and let the next launch pick that one */
+        debug("device cgroup program was pinned concurrently");
+    }
+    return prog_fd;
+}
+
 static void _sc_cleanup_v2_device_key(sc_cgroup_v2_device_key **keyptr) {
     if (keyptr == NULL || *keyptr == NULL) {
         return;
@@ -255,6 +385,206 @@ static void _sc_cleanup_v2_device_key(sc_cgroup_v2_device_key **keyptr) {
     *keyptr = NULL;
 }
 
+static void _sc_cleanup_v2_device_value(sc_cgroup_v2_device_value **valueptr) {
+    if (valueptr == NULL || *valueptr == NULL) {
+        return;
+    }
+    free(*valueptr);
+    *valueptr = NULL;
+}
+
+static int _sc_cgroup_v2_device_key_cmp(const void *a, const void *b) {
+    const sc_cgroup_v2_device_key *ka = a;
+    const sc_cgroup_v2_device_key *kb = b;
+    if (ka->type != kb->type) {
+        return ka->type < kb->type ? -1 : 1;
+    }
+    if (ka->major != kb->major) {
+        return ka->major < kb->major ? -1 : 1;
+    }
+    if (ka->minor != kb->minor) {
+        return ka->minor < kb->minor ? -1 : 1;
+    }
+    return 0;
+}
+
+/* XXX: this should be more than enough keys */
+static const size_t sc_cgroup_v2_max_entries = 500;
+
+/**
+ * _sc_cgroup_v2_map_keys collects the keys of all elements of the map and
+ * returns their number.
+ */
+static size_t _sc_cgroup_v2_map_keys(int map_fd, sc_cgroup_v2_device_key *keys) {
+    const size_t max_entries = sc_cgroup_v2_max_entries;
+    if (bpf_map_batch_supported()) {
+        sc_cgroup_v2_device_value *values SC_CLEANUP(_sc_cleanup_v2_device_value) =
+            calloc(max_entries, sizeof(sc_cgroup_v2_device_value));
+        if (values == NULL) {
+            die("cannot allocate values map");
+        }
+        uint32_t batch = 0;
+        size_t count = 0;
+        while (true) {
+            size_t cnt = max_entries - count;
+            if (cnt == 0) {
+                die("too many elements in the map");
+            }
+            int ret =
+                bpf_map_lookup_batch(map_fd, count > 0 ? &batch : NULL, &batch, keys + count, values + count, &cnt);
+            count += cnt;
+            if (ret == 0) {
+                continue;
+            }
+            if (errno == ENOENT) {
+                /* we are done */
+                return count;
+            }
+            debug("cannot lookup device map keys in batch, falling back to iteration");
+            break;
+        }
+    }
+
+    /* 'current' key is zeroed, such that no entry can match it and thus
+     * we'll iterate over the keys from the beginning */
+    sc_cgroup_v2_device_key key = {0};
+    size_t count = 0;
+    while (true) {
+        sc_cgroup_v2_device_key next = {0};
+        if (count >= max_entries) {
+            die("too many elements in the map");
+        }
+        if (count > 0) {
+            /* grab the previous key */
+            key = keys[count - 1];
+        }
+        int ret = bpf_map_get_next_key(map_fd, &key, &next);
+        if (ret == -1) {
+            if (errno != ENOENT) {
+                die("cannot lookup existing device map keys");
+            }
+            /* we are done */
+            break;
+        }
+        keys[count] = next;
+        count++;
+    }
+    return count;
+}
+
+/**
+ * _sc_cgroup_v2_map_delete deletes the elements with given keys from the map.
+ */
+static void _sc_cgroup_v2_map_delete(int map_fd, const sc_cgroup_v2_device_key *keys, size_t count) {
+    size_t done = 0;
+    if (count > 0 && bpf_map_batch_supported()) {
+        done = count;
+        if (bpf_map_delete_batch(map_fd, keys, &done) < 0) {
+            debug("cannot delete device map entries in batch, deleted %zu of %zu", done, count);
+        }
+    }
+    for (size_t i = done; i < count; i++) {
+        sc_cgroup_v2_device_key key = keys[i];
+        debug("delete key for %c %d:%d", key.type, key.major, key.minor);
+        if (bpf_map_delete_elem(map_fd, &key) < 0 && errno != ENOENT) {
+            die("cannot delete device map entry for %c %d:%d", key.type, key.major, key.minor);
+        }
+    }
+}
+
+/**
+ * _sc_cgroup_v2_map_update adds the elements with given keys to the map.
+ */
+static void _sc_cgroup_v2_map_update(int map_fd, const sc_cgroup_v2_device_key *keys, size_t count) {
+    size_t done = 0;
+    if (count > 0 && bpf_map_batch_supported()) {
+        sc_cgroup_v2_device_value *values SC_CLEANUP(_sc_cleanup_v2_device_value) =
+            calloc(count, sizeof(sc_cgroup_v2_device_value));
+        if (values == NULL) {
+            die("cannot allocate values map");
+        }
+        memset(values, 1, count * sizeof(sc_cgroup_v2_device_value));
+        done = count;
+        if (bpf_map_update_batch(map_fd, keys, values, &done) < 0) {
+            debug("cannot update device map in batch, updated %zu of %zu", done, count);
+        }
+    }
+    for (size_t i = done; i < count; i++) {
+        sc_cgroup_v2_device_key key = keys[i];
+        sc_cgroup_v2_device_value value = 1;
+        if (bpf_update_map(map_fd, &key, &value) < 0) {
+            die("cannot update device map for key %c %u:%u", key.type, key.major, key.minor);
+        }
+    }
+}
+
+/* the directory with the maps and programs pinned by snap-confine */
+static const char sc_cgroup_v2_pin_dir[] = "/sys/fs/bpf/snap";
+
+/* the prefix of the temporary names maps are pinned under before being
+ * renamed, see _sc_cgroup_v2_link_tag() */
+static const char sc_cgroup_v2_tmp_pin_prefix[] = "new-";
+
+/**
+ * _sc_cgroup_v2_get_shared_map returns the device map pinned at the given path,
+ * creating and pinning a new one if needed, in which case created is set.
+ */
+static int _sc_cgroup_v2_get_shared_map(const char *path, bool *created) {
+    *created = false;
+    int map_fd = bpf_get_by_path(path);
+    if (map_fd >= 0) {
+        return map_fd;
+    }
+    if (errno != ENOENT) {
+        die("cannot get existing device map %s", path);
+    }
+    debug("device map %s not present yet", path);
+    /* kernels used to do account of BPF memory using rlimit memlock pool,
+     * thus on older kernels (seen on 5.10), the map effectively locks 11
+     * pages (45k) of memlock memory, while on newer kernels (5.11+) only 2 (8k) */
+    /* NOTE: the new file map must be owned by root:root. */
+    map_fd = bpf_create_map(BPF_MAP_TYPE_HASH, sizeof(struct sc_cgroup_v2_device_key),
+                            sizeof(sc_cgroup_v2_device_value), sc_cgroup_v2_max_entries);
+    if (map_fd < 0) {
+        die("cannot create bpf map");
+    }
+    debug("got bpf map at fd: %d", map_fd);
+    /* the map can only be referenced by a fd like object which is valid
+     * here and referenced by the BPF programs that use it; by pinning the
+     * map to a well known path, it is possible to obtain a reference to it
+     * from another process, which is used by snap-device-helper to
+     * dynamically update device access permissions; the downside is a tiny
+     * bit of kernel memory still in use as, even once all BPF programs
+     * referencing the map go away with their respective cgroups, the map
+     * will stay around as it is still referenced by the path, until it is
+     * removed by snap-discard-ns, see sc_device_cgroup_discard_unused() */
+    if (bpf_pin_to_path(map_fd, path) < 0) {
+        if (errno != EEXIST) {
+            die("cannot pin map to %s", path);
+        }
+        /* the map is shared, so another process may have been started at the
+         * same time and pinned its map first, use that one */
+        debug("device map %s was pinned concurrently", path);
+        close(map_fd);
+        map_fd = bpf_get_by_path(path);
+        if (map_fd < 0) {
+            die("cannot get existing device map %s", path);
+        }
+        return map_fd;
+    }
+    *created = true;
+    return map_fd;
+}
+
+/**
+ * _sc_cgroup_v2_get_base_map returns the map of devices which all snaps are
+ * allowed to access, creating and pinning it at the given path if needed.
+ */
+static int _sc_cgroup_v2_get_base_map(const char *path) {
+    bool created = false;
+    return _sc_cgroup_v2_get_shared_map(path, &created);
+}
+
 static void _sc_cgroup_v2_set_memlock_limit(struct rlimit limit) {
     /* we may be setting the limit over the current max, which requires root
      * privileges or CAP_SYS_RESOURCE */
@@ -307,8 +637,234 @@ static bool _sc_is_snap_cgroup(const char *group) {
     return true;
 }
 
+static void _sc_cgroup_v2_add_pending(sc_device_cgroup *self, sc_cgroup_v2_device_key key) {
+    if (self->v2.num_pending == self->v2.cap_pending) {
+        size_t cap = self->v2.cap_pending > 0 ? 2 * self->v2.cap_pending : 64;
+        sc_cgroup_v2_device_key *pending = reallocarray(self->v2.pending, cap, sizeof(sc_cgroup_v2_device_key));
+        if (pending == NULL) {
+            die("cannot allocate pending device keys");
+        }
+        self->v2.pending = pending;
+        self->v2.cap_pending = cap;
+    }
+    self->v2.pending[self->v2.num_pending++] = key;
+}
+
+static uint64_t _sc_cgroup_v2_fnv1a(uint64_t hash, const char *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)data[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * _sc_cgroup_v2_policy_hash returns a hash of the device policy of the security
+ * tag, that is of the udev rules snapd wrote to tag devices with it, with the
+ * tag left out.
+ *
+ * Applications and hooks whose rules only differ by the tag are assigned the
+ * same devices, both when their device cgroup is set up and as devices come
+ * and go later on, so they can share the device map and the program.
+ */
+static uint64_t _sc_cgroup_v2_policy_hash(const char *security_tag, const char *instance_name) {
+    /* udev tags have dots replaced by underscores, and the plus sign
+     * separating the name of a component by two underscores */
+    char tag_rule[PATH_MAX] = {0};
+    sc_string_init(tag_rule, sizeof tag_rule);
+    sc_string_append(tag_rule, sizeof tag_rule, "TAG+=\"");
+    for (const char *c = security_tag; *c != '\0'; c++) {
+        if (*c == '.') {
+            sc_string_append_char(tag_rule, sizeof tag_rule, '_');
+        } else if (*c == '+') {
+            sc_string_append_char_pair(tag_rule, sizeof tag_rule, '_', '_');
+        } else {
+            sc_string_append_char(tag_rule, sizeof tag_rule, *c);
+        }
+    }
+    sc_string_append_char(tag_rule, sizeof tag_rule, '"');
+    size_t tag_rule_len = strlen(tag_rule);
+
+    /* FNV-1a */
+    uint64_t hash = 14695981039346656037ULL;
+    char rules_path[PATH_MAX] = {0};
+    sc_must_snprintf(rules_path, sizeof rules_path, "/etc/udev/rules.d/70-snap.%s.rules", instance_name);
+    FILE *rules SC_CLEANUP(sc_cleanup_file) = fopen(rules_path, "re");
+    if (rules == NULL) {
+        if (errno != ENOENT) {
+            die("cannot open %s", rules_path);
+        }
+        debug("no udev rules for snap %s", instance_name);
+        return hash;
+    }
+    char *line SC_CLEANUP(sc_cleanup_string) = NULL;
+    size_t line_size = 0;
+    while (getline(&line, &line_size, rules) != -1) {
+        char *tag_start = strstr(line, tag_rule);
+        if (tag_start == NULL) {
+            continue;
+        }
+        const char *tag_end = tag_start + tag_rule_len;
+        hash = _sc_cgroup_v2_fnv1a(hash, line, (size_t)(tag_start - line));
+        hash = _sc_cgroup_v2_fnv1a(hash, tag_end, strlen(tag_end));
+    }
+    if (ferror(rules)) {
+        die("cannot read %s", rules_path);
+    }
+    return hash;
+}
+
+/**
+ * _sc_cgroup_v2_is_tag_cgroup returns true if the cgroup with the given name
+ * holds processes of the application or hook with the given unit name, as
+ * derived from its security tag.
+ */
+static bool _sc_cgroup_v2_is_tag_cgroup(const char *name, const char *unit_name) {
+    size_t len = strlen(unit_name);
+    if (strncmp(name, unit_name, len) != 0) {
+        return false;
+    }
+    const char *rest = name + len;
+    if (sc_streq(rest, ".service")) {
+        return true;
+    }
+    /* transient scopes are named after the tag followed by a UUID, separated
+     * by a dash, or by a dot with older versions of snapd */
+    if (*rest != '-' && *rest != '.') {
+        return false;
+    }
+    rest++;
+    static const size_t uuid_len = 36;
+    return strspn(rest, "0123456789abcdef-") == uuid_len && sc_streq(rest + uuid_len, ".scope");
+}
+
+/**
+ * _sc_cgroup_v2_reattach attaches the program to the cgroups of the application
+ * with the given unit name which have another device cgroup program attached,
+ * in the cgroup referenced by dir_fd and below. The descriptor is closed.
+ */
+static void _sc_cgroup_v2_reattach(int dir_fd, const char *unit_name, int prog_fd, uint32_t prog_id) {
+    DIR *dir = fdopendir(dir_fd);
+    if (dir == NULL) {
+        die("cannot fdopendir");
+    }
+    while (true) {
+        errno = 0;
+        struct dirent *dent = readdir(dir);
+        if (dent == NULL) {
+            if (errno != 0) {
+                die("cannot read next directory entry");
+            }
+            break;
+        }
+        if (dent->d_type != DT_DIR || sc_streq(dent->d_name, ".") || sc_streq(dent->d_name, "..")) {
+            continue;
+        }
+        int child_fd = openat(dirfd(dir), dent->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (child_fd < 0) {
+            if (errno == ENOENT) {
+                /* the cgroup went away in the meantime */
+                continue;
+            }
+            die("cannot open cgroup %s", dent->d_name);
+        }
+        if (!_sc_cgroup_v2_is_tag_cgroup(dent->d_name, unit_name)) {
+            _sc_cgroup_v2_reattach(child_fd, unit_name, prog_fd, prog_id);
+            continue;
+        }
+        /* the program is attached to the cgroup of the application itself,
+         * cgroups below it inherit it */
+        uint32_t ids[1] = {0};
+        uint32_t cnt = 1;
+        if (bpf_prog_query(BPF_CGROUP_DEVICE, child_fd, ids, &cnt) < 0) {
+            die("cannot query device cgroup programs of %s", dent->d_name);
+        }
+        if (cnt > 0 && ids[0] != prog_id) {
+            debug("switching cgroup %s to the current device cgroup program", dent->d_name);
+            /* there is a single program attached, which gets replaced */
+            if (bpf_prog_attach(BPF_CGROUP_DEVICE, child_fd, prog_fd) < 0) {
+                die("cannot attach cgroup program to %s", dent->d_name);
+            }
+        }
+        close(child_fd);
+    }
+    if (closedir(dir) < 0) {
+        die("cannot close directory");
+    }
+}
+
+/**
+ * _sc_cgroup_v2_link_tag pins the device map under the name of the security
+ * tag, which is how snap-device-helper finds it, replacing the map the tag
+ * used so far. The running processes of the application or hook, which use
+ * the program of the previous map, are switched over to the current program.
+ */
+static void _sc_cgroup_v2_link_tag(sc_device_cgroup *self) {
+    char path[PATH_MAX] = {0};
+    sc_must_snprintf(path, sizeof path, "%s/%s", sc_cgroup_v2_pin_dir, self->v2.tag);
+    int old_fd = bpf_get_by_path(path);
+    bool had_map = old_fd >= 0;
+    if (had_map) {
+        bool same_map = _sc_cgroup_v2_map_id(old_fd) == _sc_cgroup_v2_map_id(self->v2.devmap_fd);
+        close(old_fd);
+        if (same_map) {
+            return;
+        }
+        debug("device policy of %s changed", self->v2.tag);
+    } else if (errno != ENOENT) {
+        die("cannot get existing device map %s", path);
+    }
+
+    /* pin under a temporary name and rename, such that the tag refers to
+     * either map at all times; bpffs does not allow dots in names. The name
+     * is unique to this process, any existing pin of that name is a leftover
+     * of an earlier process with the same PID. Leftovers of processes which
+     * died before the rename are removed by sc_device_cgroup_discard_unused() */
+    uint32_t suffix = 0;
+    if (getrandom(&suffix, sizeof suffix, GRND_NONBLOCK) < 0) {
+        debug("cannot obtain random suffix, relying on the PID only");
+    }
+    char tmp_path[PATH_MAX] = {0};
+    sc_must_snprintf(tmp_path, sizeof tmp_path, "%s/%s%s:%d-%08" PRIx32, sc_cgroup_v2_pin_dir,
+                     sc_cgroup_v2_tmp_pin_prefix, self->v2.tag, (int)getpid(), suffix);
+    if (unlink(tmp_path) < 0 && errno != ENOENT) {
+        die("cannot remove %s", tmp_path);
+    }
+    if (bpf_pin_to_path(self->v2.devmap_fd, tmp_path) < 0) {
+        die("cannot pin map to %s", tmp_path);
+    }
+    if (rename(tmp_path, path) < 0) {
+        die("cannot rename %s to %s", tmp_path, path);
+    }
+    if (!had_map) {
+        /* there was no map, so there are no processes to switch over */
+        return;
+    }
+
+    /* cgroups are named after the systemd unit name of the tag, see
+     * SecurityTagToUnitName() in snapd */
+    char unit_name[PATH_MAX] = {0};
+    sc_string_init(unit_name, sizeof unit_name);
+    for (const char *c = self->security_tag; *c != '\0'; c++) {
+        if (*c == '+') {
+            sc_string_append(unit_name, sizeof unit_name, "\\x2b");
+        } else {
+            sc_string_append_char(unit_name, sizeof unit_name, *c);
+        }
+    }
+    uint32_t prog_id = 0;
+    if (bpf_prog_get_id(self->v2.prog_fd, &prog_id) < 0) {
+        die("cannot obtain device cgroup program ID");
+    }
+    int cgroup_fd = open("/sys/fs/cgroup", O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (cgroup_fd < 0) {
+        die("cannot open /sys/fs/cgroup");
+    }
+    _sc_cgroup_v2_reattach(cgroup_fd, unit_name, self->v2.prog_fd, prog_id);
+}
+
 static int _sc_cgroup_v2_init_bpf(sc_device_cgroup *self, int flags) {
     self->v2.devmap_fd = -1;
+    self->v2.basemap_fd = -1;
     self->v2.prog_fd = -1;
 
     /* fix the memlock limit if needed, this affects creating maps */
@@ -362,129 +918,215 @@ static int _sc_cgroup_v2_init_bpf(sc_device_cgroup *self, int flags) {
     }
     close(bpf_fd);
 
+    /* the applications and hooks of a snap with the same device policy share
+     * the device map and the program, which are pinned under a name derived
+     * from the policy, and the map is also pinned under the name of each tag
+     * using it; the name cannot be that of a tag, as @ is not valid in the
+     * names of applications */
+    if (!sc_startswith(self->security_tag, "snap.")) {
+        die("malformed security tag %s", self->security_tag);
+    }
+    char instance_name[SNAP_INSTANCE_LEN + 1] = {0};
+    const char *instance_start = self->security_tag + strlen("snap.");
+    size_t instance_len = strcspn(instance_start, ".+");
+    if (instance_len == 0 || instance_len >= sizeof instance_name) {
+        die("malformed security tag %s", self->security_tag);
+    }
+    memcpy(instance_name, instance_start, instance_len);
+    uint64_t policy = _sc_cgroup_v2_policy_hash(self->security_tag, instance_name);
+    char policy_name[PATH_MAX] = {0};
+    sc_must_snprintf(policy_name, sizeof policy_name, "snap_%s_@%016" PRIx64, instance_name, policy);
+    char policy_path[PATH_MAX] = {0};
+    sc_must_snprintf(policy_path, sizeof policy_path, "%s/%s", sc_cgroup_v2_pin_dir, policy_name);
+    debug("device policy of %s is %s", self->v2.tag, policy_name);
+
     /* and obtain a file descriptor to the map, also as root */
-    int devmap_fd = bpf_get_by_path(path);
-    /* keep a copy of errno in case it gets clobbered */
-    int get_by_path_errno = errno;
-    /* XXX: this should be more than enough keys */
-    const size_t max_entries = 500;
-    if (devmap_fd < 0) {
-        if (get_by_path_errno != ENOENT) {
-            die("cannot get existing device map");
-        }
-        if (from_existing) {
+    int devmap_fd = -1;
+    bool created = false;
+    const size_t max_entries = sc_cgroup_v2_max_entries;
+    if (from_existing) {
+        /* the map is pinned under the name of the tag once its device cgroup
+         * has been set up */
+        int tag_map_fd SC_CLEANUP(sc_cleanup_close) = bpf_get_by_path(path);
+        if (tag_map_fd < 0) {
+            if (errno != ENOENT) {
+                die("cannot get existing device map");
+            }
             debug("device map not present, not creating one");
-            /* restore the errno so that the caller sees ENOENT */
-            errno = get_by_path_errno;
             /* there is no map, and we haven't been asked to setup a new cgroup */
+            errno = ENOENT;
             return -1;
         }
-        debug("device map not present yet");
-        /* map not created and pinned yet */
-        const size_t value_size = 1;
-        /* kernels used to do account of BPF memory using rlimit memlock pool,
-         * thus on older kernels (seen on 5.10), the map effectively locks 11
-         * pages (45k) of memlock memory, while on newer kernels (5.11+) only 2 (8k) */
-        /* NOTE: the new file map must be owned by root:root. */
-        devmap_fd = bpf_create_map(BPF_MAP_TYPE_HASH, sizeof(struct sc_cgroup_v2_device_key), value_size, max_entries);
-        if (devmap_fd < 0) {
-            die("cannot create bpf map");
-        }
-        debug("got bpf map at fd: %d", devmap_fd);
-        /* the map can only be referenced by a fd like object which is valid
-         * here and referenced by the BPF program that we'll load; by pinning
-         * the map to a well known path, it is possible to obtain a reference to
-         * it from another process, which is used by snap-device-helper to
-         * dynamically update device access permissions; the downside is a tiny
-         * bit of kernel memory still in use as, even once all BPF programs
-         * referencing the map go away with their respective cgroups, the map
-         * will stay around as it is still referenced by the path */
-        if (bpf_pin_to_path(devmap_fd, path) < 0) {
-            /* we checked that the map did not exist, so fail on EEXIST too */
-            die("cannot pin map to %s", path);
+        devmap_fd = bpf_get_by_path(policy_path);
+        if (devmap_fd >= 0 && _sc_cgroup_v2_map_id(devmap_fd) == _sc_cgroup_v2_map_id(tag_map_fd)) {
+            self->v2.devmap_fd = devmap_fd;
+            return 0;
         }
-    } else if (!from_existing) {
-        /* the devices access map exists, and we have been asked to setup a
-         * cgroup, so clear the old map first so it was like it never existed */
-
-        debug("found existing device map");
-        /* the v1 implementation blocks all devices by default and then adds
-         * each assigned one individually, however for v2 there's no way to drop
-         * all the contents of the map, so we need to find out what keys are
-         * there in the map */
-
-        /* first collect all keys in the map */
-        sc_cgroup_v2_device_key *existing_keys SC_CLEANUP(_sc_cleanup_v2_device_key) =
-            calloc(max_entries, sizeof(sc_cgroup_v2_device_key));
-        if (existing_keys == NULL) {
-            die("cannot allocate keys map");
+        if (devmap_fd < 0 && errno != ENOENT) {
+            die("cannot get existing device map %s", policy_path);
         }
-        /* 'current' key is zeroed, such that no entry can match it and thus
-         * we'll iterate over the keys from the beginning */
-        sc_cgroup_v2_device_key key = {0};
-        size_t existing_count = 0;
-        while (true) {
-            sc_cgroup_v2_device_key next = {0};
-            if (existing_count >= max_entries) {
-                die("too many elements in the map");
-            }
-            if (existing_count > 0) {
-                /* grab the previous key */
-                key = existing_keys[existing_count - 1];
-            }
-            int ret = bpf_map_get_next_key(devmap_fd, &key, &next);
-            if (ret == -1) {
-                if (errno != ENOENT) {
-                    die("cannot lookup existing device map keys");
-                }
-                /* we are done */
-                break;
+        /* the device policy changed since the device cgroup of the tag was
+         * set up, updating its map would also affect the tags it was shared
+         * with, so the processes of the application are switched over to the
+         * map of the current policy, which starts with the devices they were
+         * allowed so far unless it is already in use */
+        debug("device policy of %s changed", self->v2.tag);
+        if (devmap_fd < 0) {
+            devmap_fd = _sc_cgroup_v2_get_shared_map(policy_path, &created);
+        }
+        if (created) {
+            sc_cgroup_v2_device_key *keys SC_CLEANUP(_sc_cleanup_v2_device_key) =
+                calloc(max_entries, sizeof(sc_cgroup_v2_device_key));
+            if (keys == NULL) {
+                die("cannot allocate keys map");
             }
-            existing_keys[existing_count] = next;
-            existing_count++;
-        }
-        debug("found %zu existing entries in devices map", existing_count);
-        if (existing_count > 0) {
-#if 0
-            /* XXX: we should be doing a batch delete of elements, however:
-             * - on Arch with 5.13 kernel I'm getting EINVAL
-             * - the linux/bpf.h header present during build on 16.04 does not
-             *     support batch operations
-             */
-            if (bpf_map_delete_batch(devmap_fd, existing_keys, existing_count) < 0) {
-                 die("cannot dump all elements from devices map");
+            size_t num_keys = _sc_cgroup_v2_map_keys(tag_map_fd, keys);
+            _sc_cgroup_v2_map_update(devmap_fd, keys, num_keys);
+            _sc_cgroup_v2_map_update(devmap_fd, &sc_cgroup_v2_uses_base_key, 1);
+        }
+    } else {
+        devmap_fd = _sc_cgroup_v2_get_shared_map(policy_path, &created);
+        if (created) {
+            self->v2.uses_base = true;
+        } else {
+            /* the devices access map exists, and we have been asked to setup a
+             * cgroup, so the map must end up as if it never existed */
+
+            debug("found existing device map");
+            /* the v1 implementation blocks all devices by default and then adds
+             * each assigned one individually, however for v2 the map is shared
+             * with processes which are already running, clearing it would make
+             * them lose access to their devices for a while; instead the keys
+             * present in the map are collected and once all the allowed devices
+             * are known only the difference is applied */
+            sc_cgroup_v2_device_key *existing_keys = calloc(max_entries, sizeof(sc_cgroup_v2_device_key));
+            if (existing_keys == NULL) {
+                die("cannot allocate keys map");
             }
-#endif
-            for (size_t i = 0; i < existing_count; i++) {
-                sc_cgroup_v2_device_key key = existing_keys[i];
-                debug("delete key for %c %d:%d", key.type, key.major, key.minor);
-                if (bpf_map_delete_elem(devmap_fd, &key) < 0) {
-                    die("cannot delete device map entry for %c %d:%d", key.type, key.major, key.minor);
+            self->v2.existing = existing_keys;
+            self->v2.num_existing = _sc_cgroup_v2_map_keys(devmap_fd, existing_keys);
+            debug("found %zu existing entries in devices map", self->v2.num_existing);
+            for (size_t i = 0; i < self->v2.num_existing; i++) {
+                if (_sc_cgroup_v2_device_key_cmp(&existing_keys[i], &sc_cgroup_v2_uses_base_key) == 0) {
+                    self->v2.uses_base = true;
+                    break;
                 }
             }
         }
+        /* keep the mark in the map, or add it to a new one */
+        if (self->v2.uses_base) {
+            _sc_cgroup_v2_add_pending(self, sc_cgroup_v2_uses_base_key);
+        }
     }
+    self->v2.devmap_fd = devmap_fd;
 
-    if (!from_existing) {
-        /* load and attach the BPF program */
-        int prog_fd = load_devcgroup_prog(devmap_fd);
-        /* keep track of the program */
-        self->v2.prog_fd = prog_fd;
+    /* the devices allowed for all snaps are in a separate map consulted
+     * by the programs of all snap applications, security tags always start
+     * with snap_ and thus the name cannot clash with the map of a tag */
+    char base_path[PATH_MAX] = {0};
+    sc_must_snprintf(base_path, sizeof base_path, "%s/base-devices", sc_cgroup_v2_pin_dir);
+    self->v2.basemap_fd = _sc_cgroup_v2_get_base_map(base_path);
+
+    /* get the BPF program which will be attached later, the program is
+     * pinned next to the map, security tags never contain a colon and
+     * thus the name cannot clash with the map of another tag */
+    char prog_path[PATH_MAX] = {0};
+    sc_must_snprintf(prog_path, sizeof prog_path, "%s:prog-v%d", policy_path, SC_DEVCGROUP_PROG_VERSION);
+    self->v2.prog_fd = _sc_cgroup_v2_get_prog(prog_path, devmap_fd, self->v2.basemap_fd);
+
+    if (from_existing) {
+        _sc_cgroup_v2_link_tag(self);
     }
+    return 0;
+}
 
-    self->v2.devmap_fd = devmap_fd;
+/**
+ * _sc_cgroup_v2_reconcile_bpf makes the map contain exactly the pending keys,
+ * given the keys which were found in it. Missing keys are added before the
+ * ones no longer allowed are removed, and the keys present in both are not
+ * touched, such that processes already using the map do not lose access to
+ * the devices which remain allowed.
+ */
+static void _sc_cgroup_v2_reconcile_bpf(sc_device_cgroup *self) {
+    sc_cgroup_v2_device_key *want = self->v2.pending;
+    sc_cgroup_v2_device_key *have = self->v2.existing;
+    size_t num_want = self->v2.num_pending;
+    size_t num_have = self->v2.num_existing;
+
+    if (num_want > 0) {
+        /* sort the wanted keys and drop the duplicates */
+        qsort(want, num_want, sizeof *want, _sc_cgroup_v2_device_key_cmp);
+        size_t n = 1;
+        for (size_t i = 1; i < num_want; i++) {
+            if (_sc_cgroup_v2_device_key_cmp(&want[n - 1], &want[i]) != 0) {
+                want[n++] = want[i];
+            }
+        }
+        num_want = n;
+    }
+    qsort(have, num_have, sizeof *have, _sc_cgroup_v2_device_key_cmp);
+
+    /* walk both sorted sets, compacting the keys to add at the front of the
+     * wanted set and the keys to remove at the front of the existing one */
+    size_t num_add = 0, num_del = 0, num_kept = 0;
+    size_t i = 0, j = 0;
+    while (i < num_want || j < num_have) {
+        int cmp = 0;
+        if (i == num_want) {
+            cmp = 1;
+        } else if (j == num_have) {
+            cmp = -1;
+        } else {
+            cmp = _sc_cgroup_v2_device_key_cmp(&want[i], &have[j]);
+        }
+        if (cmp < 0) {
+            want[num_add++] = want[i++];
+        } else if (cmp > 0) {
+            have[num_del++] = have[j++];
+        } else {
+            num_kept++;
+            i++;
+            j++;
+        }
+    }
+    debug("device map changes: %zu added, %zu removed, %zu unchanged", num_add, num_del, num_kept);
 
-    return 0;
+    _sc_cgroup_v2_map_update(self->v2.devmap_fd, want, num_add);
+    _sc_cgroup_v2_map_delete(self->v2.devmap_fd, have, num_del);
+}
+
+static void _sc_cgroup_v2_flush_bpf(sc_device_cgroup *self) {
+    if (self->v2.existing != NULL) {
+        /* the first flush of a reused map, the set of allowed devices is
+         * complete, subsequent ones only add keys */
+        _sc_cgroup_v2_reconcile_bpf(self);
+        _sc_cleanup_v2_device_key(&self->v2.existing);
+        self->v2.num_existing = 0;
+        self->v2.num_pending = 0;
+        return;
+    }
+    if (self->v2.num_pending == 0) {
+        return;
+    }
+    _sc_cgroup_v2_map_update(self->v2.devmap_fd, self->v2.pending, self->v2.num_pending);
+    self->v2.num_pending = 0;
 }
 
 static void _sc_cgroup_v2_close_bpf(sc_device_cgroup *self) {
+    if (self->v2.devmap_fd != -1) {
+        _sc_cgroup_v2_flush_bpf(self);
+    }
+    _sc_cleanup_v2_device_key(&self->v2.pending);
+    _sc_cleanup_v2_device_key(&self->v2.existing);
+
     /* restore the old limit */
     _sc_cgroup_v2_set_memlock_limit(self->v2.old_limit);
 
     sc_cleanup_string(&self->v2.tag);
-    /* the map is pinned to a per-snap-application file and referenced by the
-     * program */
+    /* the map is pinned to per-policy and per-snap-application files and
+     * referenced by the program */
     sc_cleanup_close(&self->v2.devmap_fd);
+    sc_cleanup_close(&self->v2.basemap_fd);
     sc_cleanup_close(&self->v2.prog_fd);
 }
 
@@ -494,10 +1136,101 @@ static void _sc_cgroup_v2_allow_bpf(sc_device_cgroup *self, int kind, int major,
         .minor = minor,
         .type = (kind == S_IFCHR) ? 'c' : 'b',
     };
-    sc_cgroup_v2_device_value value = 1;
     debug("v2 allow %c %u:%u", (char)key.type, key.major, key.minor);
-    if (bpf_update_map(self->v2.devmap_fd, &key, &value) < 0) {
-        die("cannot update device map for key %c %u:%u", key.type, key.major, key.minor);
+    /* the map is updated in batches, when the program is attached or the
+     * wrapper is disposed of */
+    _sc_cgroup_v2_add_pending(self, key);
+}
+
+/**
+ * _sc_cgroup_v2_populate_base_bpf populates the base map with the devices
+ * allowed by the populate function and marks it with the stamp.
+ */
+static void _sc_cgroup_v2_populate_base_bpf(int basemap_fd, const sc_cgroup_v2_device_key *stamp_key,
+                                            void (*populate)(sc_device_cgroup *cgroup)) {
+    /* populate the map through a wrapper of its own, such that its contents
+     * are reconciled like those of the map of a snap application */
+    sc_device_cgroup base = {0};
+    base.is_v2 = true;
+    base.v2.devmap_fd = basemap_fd;
+    base.v2.basemap_fd = -1;
+    base.v2.prog_fd = -1;
+
+    sc_cgroup_v2_device_key *keys = calloc(sc_cgroup_v2_max_entries, sizeof(sc_cgroup_v2_device_key));
+    if (keys == NULL) {
+        die("cannot allocate keys map");
+    }
+    size_t num_keys = _sc_cgroup_v2_map_keys(basemap_fd, keys);
+    /* set the previous stamps aside, they are only replaced once the devices
+     * are in place; meta keys sort first */
+    qsort(keys, num_keys, sizeof *keys, _sc_cgroup_v2_device_key_cmp);
+    size_t num_stamps = 0;
+    while (num_stamps < num_keys && keys[num_stamps].type == SC_CGROUP_V2_META_TYPE) {
+        num_stamps++;
+    }
+    sc_cgroup_v2_device_key *stamps SC_CLEANUP(_sc_cleanup_v2_device_key) =
+        calloc(num_stamps > 0 ? num_stamps : 1, sizeof(sc_cgroup_v2_device_key));
+    if (stamps == NULL) {
+        die("cannot allocate keys map");
+    }
+    memcpy(stamps, keys, num_stamps * sizeof *keys);
+    memmove(keys, keys + num_stamps, (num_keys - num_stamps) * sizeof *keys);
+    base.v2.existing = keys;
+    base.v2.num_existing = num_keys - num_stamps;
+
+    populate(&base);
+    _sc_cgroup_v2_flush_bpf(&base);
+    _sc_cleanup_v2_device_key(&base.v2.pending);
+
+    _sc_cgroup_v2_map_update(basemap_fd, stamp_key, 1);
+    _sc_cgroup_v2_map_delete(basemap_fd, stamps, num_stamps);
+}
+
+static void _sc_cgroup_v2_allow_base_bpf(sc_device_cgroup *self, uint64_t stamp,
+                                         void (*populate)(sc_device_cgroup *cgroup)) {
+    if (self->v2.basemap_fd == -1) {
+        die("internal error: base device map not open");
+    }
+    /* the stamp identifies the state of the system the devices were found
+     * in, the map does not change as long as it does not change */
+    sc_cgroup_v2_device_key stamp_key = {
+        .type = SC_CGROUP_V2_META_TYPE,
+        .major = (uint32_t)(stamp >> 32),
+        .minor = (uint32_t)stamp,
+    };
+    sc_cgroup_v2_device_value value = 0;
+    /* the map is shared by all snaps, hold the global lock such that
+     * concurrent invocations neither populate it at the same time nor find
+     * the stamp of a state whose devices are being taken out by another one */
+    int global_lock_fd = sc_lock_global();
+    if (bpf_map_lookup_elem(self->v2.basemap_fd, &stamp_key, &value) == 0) {
+        debug("base device map is up to date");
+    } else {
+        if (errno != ENOENT) {
+            die("cannot look up base device map stamp");
+        }
+        debug("populating base device map");
+        _sc_cgroup_v2_populate_base_bpf(self->v2.basemap_fd, &stamp_key, populate);
+    }
+    sc_unlock(global_lock_fd);
+
+    if (!self->v2.uses_base) {
+        /* the map was set up by an older version of snap-confine, whose
+         * program only consults the map of the snap application and may still
+         * be attached to running processes, keep the devices allowed for all
+         * snaps in there too, until the map is recreated */
+        debug("device map predates the base device map");
+        sc_cgroup_v2_device_key *keys SC_CLEANUP(_sc_cleanup_v2_device_key) =
+            calloc(sc_cgroup_v2_max_entries, sizeof(sc_cgroup_v2_device_key));
+        if (keys == NULL) {
+            die("cannot allocate keys map");
+        }
+        size_t num_keys = _sc_cgroup_v2_map_keys(self->v2.basemap_fd, keys);
+        for (size_t i = 0; i < num_keys; i++) {
+            if (keys[i].type != SC_CGROUP_V2_META_TYPE) {
+                _sc_cgroup_v2_add_pending(self, keys[i]);
+            }
+        }
     }
 }
 
@@ -508,6 +1241,7 @@ static void _sc_cgroup_v2_deny_bpf(sc_device_cgroup *self, int kind, int major,
         .type = (kind == S_IFCHR) ? 'c' : 'b',
     };
     debug("v2 deny %c %u:%u", (char)key.type, key.major, key.minor);
+    _sc_cgroup_v2_flush_bpf(self);
     if (bpf_map_delete_elem(self->v2.devmap_fd, &key) < 0 && errno != ENOENT) {
         die("cannot delete device map entry for key %c %u:%u", key.type, key.major, key.minor);
     }
@@ -521,6 +1255,7 @@ static void _sc_cgroup_v2_attach_pid_bpf(sc_device_cgroup *self, pid_t pid) {
     if (self->v2.prog_fd == -1) {
         die("internal error: BPF program not loaded");
     }
+    _sc_cgroup_v2_flush_bpf(self);
 
     char *own_group SC_CLEANUP(sc_cleanup_string) = sc_cgroup_v2_own_path_full();
     if (own_group == NULL) {
@@ -551,6 +1286,499 @@ static void _sc_cgroup_v2_attach_pid_bpf(sc_device_cgroup *self, pid_t pid) {
     if (attach < 0) {
         die("cannot attach cgroup program");
     }
+
+    /* the map is now populated and in use, make it the one of the tag */
+    _sc_cgroup_v2_link_tag(self);
+}
+
+/**
+ * sc_cgroup_v2_id_set is a set of BPF object IDs.
+ */
+typedef struct sc_cgroup_v2_id_set {
+    uint32_t *ids;
+    size_t len;
+    size_t cap;
+} sc_cgroup_v2_id_set;
+
+static bool _sc_cgroup_v2_id_set_contains(const sc_cgroup_v2_id_set *set, uint32_t id) {
+    for (size_t i = 0; i < set->len; i++) {
+        if (set->ids[i] == id) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void _sc_cgroup_v2_id_set_add(sc_cgroup_v2_id_set *set, uint32_t id) {
+    if (_sc_cgroup_v2_id_set_contains(set, id)) {
+        return;
+    }
+    if (set->len == set->cap) {
+        size_t cap = set->cap > 0 ? 2 * set->cap : 16;
+        uint32_t *ids = reallocarray(set->ids, cap, sizeof *ids);
+        if (ids == NULL) {
+            die("cannot allocate ID set");
+        }
+        set->ids = ids;
+        set->cap = cap;
+    }
+    set->ids[set->len++] = id;
+}
+
+/**
+ * _sc_cgroup_v2_add_prog_map_ids adds the IDs of the maps used by the program
+ * to the set. Returns -1 with errno set on failure.
+ */
+static int _sc_cgroup_v2_add_prog_map_ids(int prog_fd, sc_cgroup_v2_id_set *maps) {
+    uint32_t map_ids[4] = {0};
+    uint32_t map_cnt = sizeof map_ids / sizeof map_ids[0];
+    if (bpf_prog_get_map_ids(prog_fd, map_ids, &map_cnt) < 0) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < map_cnt && i < sizeof map_ids / sizeof map_ids[0]; i++) {
+        _sc_cgroup_v2_id_set_add(maps, map_ids[i]);
+    }
+    return 0;
+}
+
+/**
+ * _sc_cgroup_v2_query_attached adds the IDs of the device cgroup programs
+ * attached to the cgroup referenced by dir_fd to the set.
+ */
+static void _sc_cgroup_v2_query_attached(int dir_fd, sc_cgroup_v2_id_set *progs, sc_error **errorp) {
+    sc_error *err = NULL;
+    uint32_t ids[64] = {0};
+    uint32_t cnt = sizeof ids / sizeof ids[0];
+    if (bpf_prog_query(BPF_CGROUP_DEVICE, dir_fd, ids, &cnt) < 0) {
+        err = sc_error_init_from_errno(errno, "cannot query device cgroup programs");
+        goto out;
+    }
+    for (uint32_t i = 0; i < cnt; i++) {
+        _sc_cgroup_v2_id_set_add(progs, ids[i]);
+    }
+out:
+    sc_error_forward(errorp, err);
+}
+
+static const size_t sc_cgroup_v2_max_traversal_depth = 32;
+
+/**
+ * _sc_cgroup_v2_collect_attached adds the IDs of the device cgroup programs
+ * attached to the cgroup referenced by dir_fd, and to the cgroups below it, to
+ * the set. Like sc_cgroup_v2_is_tracking_snap(), only the groups which may
+ * contain groups tracking snaps are descended into. The programs attached to
+ * all of their children are collected though, since snap-confine attaches the
+ * program to the group it runs in, which may not track the snap, such as the
+ * scope of a login session. The descriptor is closed.
+ */
+static void _sc_cgroup_v2_collect_attached(int dir_fd, sc_cgroup_v2_id_set *progs, size_t depth,
+                                           sc_error **errorp) {
+    sc_error *err = NULL;
+    DIR *dir = NULL;
+    if (depth > sc_cgroup_v2_max_traversal_depth) {
+        close(dir_fd);
+        err = sc_error_init_simple("cannot traverse cgroups hierarchy deeper than %zu levels",
+                                   sc_cgroup_v2_max_traversal_depth);
+        goto out;
+    }
+    _sc_cgroup_v2_query_attached(dir_fd, progs, &err);
+    if (err != NULL) {
+        close(dir_fd);
+        goto out;
+    }
+    dir = fdopendir(dir_fd);
+    if (dir == NULL) {
+        close(dir_fd);
+        err = sc_error_init_from_errno(errno, "cannot fdopendir");
+        goto out;
+    }
+    while (true) {
+        errno = 0;
+        struct dirent *dent = readdir(dir);
+        if (dent == NULL) {
+            if (errno != 0) {
+                err = sc_error_init_from_errno(errno, "cannot read next directory entry");
+                goto out;
+            }
+            break;
+        }
+        if (dent->d_type != DT_DIR || sc_streq(dent->d_name, ".") || sc_streq(dent->d_name, "..")) {
+            continue;
+        }
+        int child_fd = openat(dirfd(dir), dent->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (child_fd < 0) {
+            if (errno == ENOENT) {
+                /* the cgroup went away in the meantime */
+                continue;
+            }
+            err = sc_error_init_from_errno(errno, "cannot open cgroup %s", dent->d_name);
+            goto out;
+        }
+        if (sc_cgroup_v2_may_contain_tracking_groups(dent->d_name)) {
+            _sc_cgroup_v2_collect_attached(child_fd, progs, depth + 1, &err);
+        } else {
+            _sc_cgroup_v2_query_attached(child_fd, progs, &err);
+            close(child_fd);
+        }
+        if (err != NULL) {
+            goto out;
+        }
+    }
+out:
+    if (dir != NULL && closedir(dir) < 0 && err == NULL) {
+        err = sc_error_init_from_errno(errno, "cannot close directory");
+    }
+    sc_error_forward(errorp, err);
+}
+
+/**
+ * _sc_cgroup_v2_pin_tag extracts the security tag from the name of a pin. The
+ * map of a tag is pinned under the name of the tag, and its programs under the
+ * name of the tag followed by a colon and the version of the program. The map
+ * and the program shared by the tags of a snap with the same device policy are
+ * pinned under names of the same form, "snap_$INSTANCE_@$POLICY". Maps pinned
+ * under a temporary name belong to the tag the name is made of.
+ */
+static bool _sc_cgroup_v2_pin_tag(const char *name, char *tag, size_t tag_size) {
+    if (sc_startswith(name, sc_cgroup_v2_tmp_pin_prefix)) {
+        name += sizeof sc_cgroup_v2_tmp_pin_prefix - 1;
+    }
+    /* this leaves out the base map */
+    if (!sc_startswith(name, "snap_")) {
+        return false;
+    }
+    size_t len = strcspn(name, ":");
+    if (len >= tag_size) {
+        return false;
+    }
+    memcpy(tag, name, len);
+    tag[len] = '\0';
+    return true;
+}
+
+static int _sc_cgroup_v2_tag_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * _sc_cgroup_v2_pinned_tags returns the sorted array of security tags with
+ * BPF objects pinned in the directory referenced by dir_fd.
+ */
+static char **_sc_cgroup_v2_pinned_tags(int dir_fd, size_t *num_tags, sc_error **errorp) {
+    sc_error *err = NULL;
+    char **tags = NULL;
+    size_t len = 0, cap = 0;
+    DIR *dir = NULL;
+
+    /* use a separate open file description so that the directory offset of
+     * dir_fd is not affected */
+    int list_fd = openat(dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (list_fd < 0) {
+        err = sc_error_init_from_errno(errno, "cannot open %s", sc_cgroup_v2_pin_dir);
+        goto out;
+    }
+    dir = fdopendir(list_fd);
+    if (dir == NULL) {
+        close(list_fd);
+        err = sc_error_init_from_errno(errno, "cannot fdopendir");
+        goto out;
+    }
+    while (true) {
+        errno = 0;
+        struct dirent *dent = readdir(dir);
+        if (dent == NULL) {
+            if (errno != 0) {
+                err = sc_error_init_from_errno(errno, "cannot read next directory entry");
+                goto out;
+            }
+            break;
+        }
+        char tag[PATH_MAX] = {0};
+        if (!_sc_cgroup_v2_pin_tag(dent->d_name, tag, sizeof tag)) {
+            continue;
+        }
+        if (len == cap) {
+            cap = cap > 0 ? 2 * cap : 16;
+            char **new_tags = reallocarray(tags, cap, sizeof *tags);
+            if (new_tags == NULL) {
+                die("cannot allocate security tags");
+            }
+            tags = new_tags;
+        }
+        tags[len++] = sc_strdup(tag);
+    }
+
+    /* the map and the programs of a tag are pinned separately */
+    if (len > 0) {
+        qsort(tags, len, sizeof *tags, _sc_cgroup_v2_tag_cmp);
+        size_t n = 1;
+        for (size_t i = 1; i < len; i++) {
+            if (sc_streq(tags[i], tags[n - 1])) {
+                free(tags[i]);
+            } else {
+                tags[n++] = tags[i];
+            }
+        }
+        len = n;
+    }
+out:
+    if (dir != NULL && closedir(dir) < 0 && err == NULL) {
+        err = sc_error_init_from_errno(errno, "cannot close directory");
+    }
+    if (err != NULL) {
+        for (size_t i = 0; i < len; i++) {
+            free(tags[i]);
+        }
+        free(tags);
+        tags = NULL;
+        len = 0;
+    }
+    *num_tags = len;
+    sc_error_forward(errorp, err);
+    return tags;
+}
+
+static void _sc_cgroup_v2_free_tags(char **tags, size_t num_tags) {
+    for (size_t i = 0; i < num_tags; i++) {
+        free(tags[i]);
+    }
+    free(tags);
+}
+
+/**
+ * _sc_cgroup_v2_open_pin_dir returns a descriptor of the directory with the
+ * pinned BPF objects, or -1 if there is no such directory.
+ */
+static int _sc_cgroup_v2_open_pin_dir(sc_error **errorp) {
+    sc_error *err = NULL;
+    int dir_fd = -1;
+    if (!sc_cgroup_is_v2() || !bpf_path_is_bpffs("/sys/fs/bpf")) {
+        goto out;
+    }
+    dir_fd = open(sc_cgroup_v2_pin_dir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (dir_fd < 0 && errno != ENOENT) {
+        err = sc_error_init_from_errno(errno, "cannot open %s", sc_cgroup_v2_pin_dir);
+    }
+out:
+    sc_error_forward(errorp, err);
+    return dir_fd;
+}
+
+static void _sc_cgroup_v2_for_each_pinned_tag_bpf(void (*fn)(const char *tag, void *data), void *data,
+                                                  sc_error **errorp) {
+    sc_error *err = NULL;
+    size_t num_tags = 0;
+    char **tags = NULL;
+    int dir_fd SC_CLEANUP(sc_cleanup_close) = _sc_cgroup_v2_open_pin_dir(&err);
+    if (dir_fd < 0) {
+        goto out;
+    }
+    tags = _sc_cgroup_v2_pinned_tags(dir_fd, &num_tags, &err);
+    for (size_t i = 0; i < num_tags; i++) {
+        fn(tags[i], data);
+    }
+    _sc_cgroup_v2_free_tags(tags, num_tags);
+out:
+    sc_error_forward(errorp, err);
+}
+
+static void _sc_cgroup_v2_discard_unused_bpf(bool (*select)(const char *tag, void *data), void *data,
+                                             sc_error **errorp) {
+    sc_error *err = NULL;
+    size_t num_tags = 0;
+    char **tags = NULL;
+    sc_cgroup_v2_id_set attached = {0};
+    sc_cgroup_v2_id_set used_maps = {0};
+    bool *in_use = NULL;
+    uint32_t *map_ids = NULL;
+    DIR *dir = NULL;
+
+    int dir_fd SC_CLEANUP(sc_cleanup_close) = _sc_cgroup_v2_open_pin_dir(&err);
+    if (dir_fd < 0) {
+        goto out;
+    }
+    tags = _sc_cgroup_v2_pinned_tags(dir_fd, &num_tags, &err);
+    if (err != NULL) {
+        goto out;
+    }
+    size_t num_selected = 0;
+    for (size_t i = 0; i < num_tags; i++) {
+        if (select(tags[i], data)) {
+            tags[num_selected++] = tags[i];
+        } else {
+            free(tags[i]);
+        }
+    }
+    num_tags = num_selected;
+    if (num_tags == 0) {
+        goto out;
+    }
+
+    /* find the programs attached in the cgroup hierarchy, and the maps they
+     * use; programs attached by older versions of snap-confine are not
+     * necessarily pinned */
+    int cgroup_fd = open("/sys/fs/cgroup", O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (cgroup_fd < 0) {
+        err = sc_error_init_from_errno(errno, "cannot open /sys/fs/cgroup");
+        goto out;
+    }
+    _sc_cgroup_v2_collect_attached(cgroup_fd, &attached, 1, &err);
+    if (err != NULL) {
+        goto out;
+    }
+    for (size_t i = 0; i < attached.len; i++) {
+        int prog_fd = bpf_prog_get_fd_by_id(attached.ids[i]);
+        if (prog_fd < 0) {
+            if (errno == ENOENT) {
+                /* detached and released in the meantime */
+                continue;
+            }
+            err = sc_error_init_from_errno(errno, "cannot get device cgroup program %u", attached.ids[i]);
+            goto out;
+        }
+        int res = _sc_cgroup_v2_add_prog_map_ids(prog_fd, &used_maps);
+        int saved_errno = errno;
+        close(prog_fd);
+        if (res < 0) {
+            err = sc_error_init_from_errno(saved_errno, "cannot obtain maps of device cgroup program");
+            goto out;
+        }
+    }
+    debug("found %zu device cgroup programs using %zu maps", attached.len, used_maps.len);
+
+    /* the map of a tag is in use if a program attached to a cgroup uses it,
+     * that is if a process of the snap application may still be running */
+    in_use = calloc(num_tags, sizeof *in_use);
+    map_ids = calloc(num_tags, sizeof *map_ids);
+    if (in_use == NULL || map_ids == NULL) {
+        die("cannot allocate memory");
+    }
+    for (size_t i = 0; i < num_tags; i++) {
+        char path[PATH_MAX] = {0};
+        sc_must_snprintf(path, sizeof path, "%s/%s", sc_cgroup_v2_pin_dir, tags[i]);
+        int map_fd = bpf_get_by_path(path);
+        if (map_fd < 0) {
+            if (errno != ENOENT) {
+                err = sc_error_init_from_errno(errno, "cannot get device map %s", path);
+                goto out;
+            }
+            continue;
+        }
+        int res = bpf_map_get_id(map_fd, &map_ids[i]);
+        int saved_errno = errno;
+        close(map_fd);
+        if (res < 0) {
+            err = sc_error_init_from_errno(saved_errno, "cannot obtain device map ID");
+            goto out;
+        }
+        in_use[i] = _sc_cgroup_v2_id_set_contains(&used_maps, map_ids[i]);
+        debug("device map of %s is %s", tags[i], in_use[i] ? "in use" : "unused");
+    }
+
+    /* remove the programs first, of all the unused tags, those of older
+     * versions and those using another map than the one pinned under the same
+     * name, such as the ones pinned for each tag before maps were shared, as
+     * long as they are not attached; maps left under a temporary name are
+     * removed too, snap-confine only uses them while holding the snap lock */
+    char current_suffix[32] = {0};
+    sc_must_snprintf(current_suffix, sizeof current_suffix, ":prog-v%d", SC_DEVCGROUP_PROG_VERSION);
+    int list_fd = openat(dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (list_fd < 0) {
+        err = sc_error_init_from_errno(errno, "cannot open %s", sc_cgroup_v2_pin_dir);
+        goto out;
+    }
+    dir = fdopendir(list_fd);
+    if (dir == NULL) {
+        close(list_fd);
+        err = sc_error_init_from_errno(errno, "cannot fdopendir");
+        goto out;
+    }
+    while (true) {
+        errno = 0;
+        struct dirent *dent = readdir(dir);
+        if (dent == NULL) {
+            if (errno != 0) {
+                err = sc_error_init_from_errno(errno, "cannot read next directory entry");
+                goto out;
+            }
+            break;
+        }
+        char tag[PATH_MAX] = {0};
+        if (strchr(dent->d_name, ':') == NULL || !_sc_cgroup_v2_pin_tag(dent->d_name, tag, sizeof tag)) {
+            continue;
+        }
+        char **found = bsearch(&(const char *){tag}, tags, num_tags, sizeof *tags, _sc_cgroup_v2_tag_cmp);
+        if (found == NULL) {
+            continue;
+        }
+        char path[PATH_MAX] = {0};
+        sc_must_snprintf(path, sizeof path, "%s/%s", sc_cgroup_v2_pin_dir, dent->d_name);
+        if (sc_startswith(dent->d_name, sc_cgroup_v2_tmp_pin_prefix)) {
+            debug("removing leftover device map %s", path);
+            if (unlinkat(dir_fd, dent->d_name, 0) < 0 && errno != ENOENT) {
+                err = sc_error_init_from_errno(errno, "cannot remove %s", path);
+                goto out;
+            }
+            continue;
+        }
+        int prog_fd = bpf_get_by_path(path);
+        if (prog_fd < 0) {
+            if (errno == ENOENT) {
+                continue;
+            }
+            err = sc_error_init_from_errno(errno, "cannot get device cgroup program %s", path);
+            goto out;
+        }
+        size_t idx = (size_t)(found - tags);
+        sc_cgroup_v2_id_set prog_maps = {0};
+        uint32_t prog_id = 0;
+        int res = 0;
+        if (in_use[idx] && sc_endswith(dent->d_name, current_suffix)) {
+            res = _sc_cgroup_v2_add_prog_map_ids(prog_fd, &prog_maps);
+        }
+        if (res == 0) {
+            res = bpf_prog_get_id(prog_fd, &prog_id);
+        }
+        int saved_errno = errno;
+        close(prog_fd);
+        bool current = _sc_cgroup_v2_id_set_contains(&prog_maps, map_ids[idx]);
+        free(prog_maps.ids);
+        if (res < 0) {
+            err = sc_error_init_from_errno(saved_errno, "cannot inspect device cgroup program %s", path);
+            goto out;
+        }
+        if (current || _sc_cgroup_v2_id_set_contains(&attached, prog_id)) {
+            continue;
+        }
+        debug("removing device cgroup program %s", path);
+        if (unlinkat(dir_fd, dent->d_name, 0) < 0 && errno != ENOENT) {
+            err = sc_error_init_from_errno(errno, "cannot remove %s", path);
+            goto out;
+        }
+    }
+
+    /* and then the unused maps */
+    for (size_t i = 0; i < num_tags; i++) {
+        if (in_use[i]) {
+            continue;
+        }
+        debug("removing device map %s/%s", sc_cgroup_v2_pin_dir, tags[i]);
+        if (unlinkat(dir_fd, tags[i], 0) < 0 && errno != ENOENT) {
+            err = sc_error_init_from_errno(errno, "cannot remove %s/%s", sc_cgroup_v2_pin_dir, tags[i]);
+            goto out;
+        }
+    }
+
+out:
+    if (dir != NULL && closedir(dir) < 0 && err == NULL) {
+        err = sc_error_init_from_errno(errno, "cannot close directory");
+    }
+    free(in_use);
+    free(map_ids);
+    free(attached.ids);
+    free(used_maps.ids);
+    _sc_cgroup_v2_free_tags(tags, num_tags);
+    sc_error_forward(errorp, err);
 }
 #endif /* ENABLE_BPF */
 
@@ -568,6 +1796,15 @@ static void _sc_cgroup_v2_allow(sc_device_cgroup *self, int kind, int major, int
 #endif
 }
 
+static void _sc_cgroup_v2_allow_base(sc_device_cgroup *self, uint64_t stamp,
+                                     void (*populate)(sc_device_cgroup *cgroup)) {
+#ifdef ENABLE_BPF
+    _sc_cgroup_v2_allow_base_bpf(self, stamp, populate);
+#else
+    die("device cgroup v2 is not enabled");
+#endif
+}
+
 static void _sc_cgroup_v2_deny(sc_device_cgroup *self, int kind, int major, int minor) {
 #ifdef ENABLE_BPF
     _sc_cgroup_v2_deny_bpf(self, kind, major, minor);
@@ -651,6 +1888,16 @@ int sc_device_cgroup_allow(sc_device_cgroup *self, int kind, int major, int mino
     return 0;
 }
 
+int sc_device_cgroup_allow_base(sc_device_cgroup *self, uint64_t stamp, void (*populate)(sc_device_cgroup *cgroup)) {
+    if (self->is_v2) {
+        _sc_cgroup_v2_allow_base(self, stamp, populate);
+    } else {
+        /* each cgroup has its own list of allowed devices */
+        populate(self);
+    }
+    return 0;
+}
+
 int sc_device_cgroup_deny(sc_device_cgroup *self, int kind, int major, int minor) {
     if (kind != S_IFCHR && kind != S_IFBLK) {
         die("unsupported device kind 0x%04x", kind);
@@ -672,6 +1919,18 @@ int sc_device_cgroup_attach_pid(sc_device_cgroup *self, pid_t pid) {
     return 0;
 }
 
+void sc_device_cgroup_for_each_pinned_tag(void (*fn)(const char *tag, void *data), void *data, sc_error **errorp) {
+#ifdef ENABLE_BPF
+    _sc_cgroup_v2_for_each_pinned_tag_bpf(fn, data, errorp);
+#endif
+}
+
+void sc_device_cgroup_discard_unused(bool (*select)(const char *tag, void *data), void *data, sc_error **errorp) {
+#ifdef ENABLE_BPF
+    _sc_cgroup_v2_discard_unused_bpf(select, data, errorp);
+#endif
+}
+
 static void sc_dprintf(int fd, const char *format, ...) {
     va_list ap1;
     va_list ap2;
@@ -18,9 +18,12 @@
 #ifndef SNAP_CONFINE_DEVICE_CGROUP_SUPPORT_H
 #define SNAP_CONFINE_DEVICE_CGROUP_SUPPORT_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <unistd.h>
 
+#include "error.h"
+
 struct sc_device_cgroup;
 typedef struct sc_device_cgroup sc_device_cgroup;
 
@@ -36,6 +39,11 @@ enum {
  * case an existing cgroup will be used, and a -1 return value with errno set to
  * ENOENT indicates that the group was not found. Otherwise, a new device cgroup
  * for a given tag will be set up.
+ *
+ * With cgroup v2 the applications and hooks of a snap whose udev rules tag the
+ * same devices share the device map and the program. When the device policy
+ * of a tag changed, its running processes are switched over to the map of the
+ * new policy, by both snap-confine and snap-device-helper.
  */
 sc_device_cgroup* sc_device_cgroup_new(const char* security_tag, int flags);
 /**
@@ -56,6 +64,16 @@ static const uint32_t SC_DEVICE_MINOR_ANY = UINT32_MAX;
  */
 int sc_device_cgroup_allow(sc_device_cgroup* self, int kind, int major, int minor);
 
+/**
+ * sc_device_cgroup_allow_base sets up the cgroup to allow access to the devices
+ * which all snaps are allowed to access, as allowed by the populate function.
+ * With cgroup v2 those devices are kept in a map shared by all snaps and the
+ * populate function is only called when the stamp differs from the one the map
+ * was populated with, thus the stamp must change whenever the set of devices
+ * may have changed.
+ */
+int sc_device_cgroup_allow_base(sc_device_cgroup* self, uint64_t stamp, void (*populate)(sc_device_cgroup* cgroup));
+
 /**
  * sc_device_cgroup_deny sets up the cgroup to deny access to a given device or
  * a set of devices if SC_MINOR_ANY is passed as the minor number. The kind must
@@ -69,4 +87,31 @@ int sc_device_cgroup_deny(sc_device_cgroup* self, int kind, int major, int minor
  */
 int sc_device_cgroup_attach_pid(sc_device_cgroup* self, pid_t pid);
 
+/**
+ * sc_device_cgroup_for_each_pinned_tag calls fn with each security tag for
+ * which snap-confine pinned BPF objects, a device map or programs. The tags are
+ * in the form used for the pins, with dots replaced by underscores. The objects
+ * shared by the tags of a snap instance with the same device policy are listed
+ * under "snap_$INSTANCE_@$POLICY". The pinned objects which cannot be listed
+ * are reported through errorp.
+ */
+void sc_device_cgroup_for_each_pinned_tag(void (*fn)(const char* tag, void* data), void* data, sc_error** errorp);
+
+/**
+ * sc_device_cgroup_discard_unused removes the device map and programs pinned
+ * for each security tag accepted by the select function, unless the map is
+ * used by a program attached to a cgroup. Programs of older versions of
+ * snap-confine are removed from maps which are still in use, once they are
+ * no longer attached. Only the groups which may contain groups tracking snaps
+ * are searched for attached programs, see
+ * sc_cgroup_v2_may_contain_tracking_groups(). Failures are reported through
+ * errorp, the objects which were removed until then stay removed.
+ *
+ * The caller must hold the locks of the snaps the selected tags belong to, so
+ * that snap-confine does not set up a device cgroup for them concurrently. The
+ * maps are only opened by snap-device-helper to update them, it is harmless if
+ * it updates a map which is being removed.
+ */
+void sc_device_cgroup_discard_unused(bool (*select)(const char* tag, void* data), void* data, sc_error** errorp);
+
 #endif /* SNAP_CONFINE_DEVICE_CGROUP_SUPPORT_H */
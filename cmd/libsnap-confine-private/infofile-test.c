@@ -261,6 +261,130 @@ static void test_infofile_get_ini_key(void) {
     fclose(stream);
 }
 
+static void test_infofile_get_keys(void) {
+    int rc;
+    sc_error *err;
+
+    char text[] =
+        "key=value\n"
+        "# a comment\n"
+        "dup-key=value-one\n"
+        "dup-key=value-two\n"
+        "other-key=other-value\n"
+        "garbage\n";
+    FILE *stream = fmemopen(text, sizeof text - 1, "r");
+    g_assert_nonnull(stream);
+
+    /* All the keys are found in one pass, the first value of each key is
+     * extracted and scanning stops before the malformed line. */
+    char *value, *dup_value, *other_value;
+    sc_infofile_key keys[] = {
+        {.key = "other-key", .value = &other_value},
+        {.key = "dup-key", .value = &dup_value},
+        {.key = "key", .value = &value},
+    };
+    rc = sc_infofile_get_keys(stream, keys, 3, 0, &err);
+    g_assert_cmpint(rc, ==, 0);
+    g_assert_null(err);
+    g_assert_cmpstr(value, ==, "value");
+    g_assert_cmpstr(dup_value, ==, "value-one");
+    g_assert_cmpstr(other_value, ==, "other-value");
+    free(value);
+    free(dup_value);
+    free(other_value);
+
+    /* Keys that are not found get NULL values. When a malformed line is
+     * reached the keys found before it are kept. */
+    char *missing_value = (void *)0xfefefefe;
+    sc_infofile_key keys2[] = {
+        {.key = "key", .value = &value},
+        {.key = "missing-key", .value = &missing_value},
+    };
+    rewind(stream);
+    rc = sc_infofile_get_keys(stream, keys2, 2, 0, &err);
+    g_assert_cmpint(rc, ==, -1);
+    g_assert_nonnull(err);
+    g_assert_cmpstr(sc_error_msg(err), ==, "line 6 is not a key=value assignment");
+    g_assert_cmpstr(value, ==, "value");
+    g_assert_null(missing_value);
+    sc_error_free(err);
+    free(value);
+
+    /* Caller must provide the keys to look for. */
+    rc = sc_infofile_get_keys(stream, NULL, 1, 0, &err);
+    g_assert_cmpint(rc, ==, -1);
+    g_assert_nonnull(err);
+    g_assert_cmpint(sc_error_code(err), ==, SC_API_MISUSE);
+    g_assert_cmpstr(sc_error_msg(err), ==, "keys cannot be NULL");
+    sc_error_free(err);
+
+    fclose(stream);
+
+    char ini[] =
+        "[section1]\n"
+        "key=value\n"
+        "[section2]\n"
+        "key2=value-two\n"
+        "key=value-one-two\n";
+    stream = fmemopen(ini, sizeof ini - 1, "r");
+    g_assert_nonnull(stream);
+
+    char *value2;
+    sc_infofile_key keys3[] = {
+        {.key = "key", .value = &value},
+        {.key = "key2", .value = &value2},
+    };
+    rc = sc_infofile_get_ini_section_keys(stream, "section2", keys3, 2, 0, &err);
+    g_assert_cmpint(rc, ==, 0);
+    g_assert_null(err);
+    g_assert_cmpstr(value, ==, "value-one-two");
+    g_assert_cmpstr(value2, ==, "value-two");
+    free(value);
+    free(value2);
+    fclose(stream);
+}
+
+static void test_infofile_get_keys_lenient(void) {
+    int rc;
+    sc_error *err;
+
+    char text[] =
+        "\n"
+        "garbage\n"
+        "=empty-key\n"
+        "[section]\n"
+        "key=value\n"
+        "other-key=other-value";
+    FILE *stream = fmemopen(text, sizeof text - 1, "r");
+    g_assert_nonnull(stream);
+
+    /* By default empty lines are not key=value pairs either. */
+    char *value;
+    rc = sc_infofile_get_key(stream, "key", &value, &err);
+    g_assert_cmpint(rc, ==, -1);
+    g_assert_nonnull(err);
+    g_assert_cmpstr(sc_error_msg(err), ==, "line 1 is not a key=value assignment");
+    g_assert_null(value);
+    sc_error_free(err);
+
+    /* Lenient parsing skips empty and malformed lines and accepts a last line
+     * without a trailing newline. */
+    char *other_value;
+    sc_infofile_key keys[] = {
+        {.key = "key", .value = &value},
+        {.key = "other-key", .value = &other_value},
+    };
+    rewind(stream);
+    rc = sc_infofile_get_keys(stream, keys, 2, SC_INFOFILE_LENIENT, &err);
+    g_assert_cmpint(rc, ==, 0);
+    g_assert_null(err);
+    g_assert_cmpstr(value, ==, "value");
+    g_assert_cmpstr(other_value, ==, "other-value");
+    free(value);
+    free(other_value);
+    fclose(stream);
+}
+
 static void test_infofile_only_comments(void) {
     int rc;
     sc_error *err;
@@ -296,5 +420,7 @@ static void test_infofile_only_comments(void) {
 static void __attribute__((constructor)) init(void) {
     g_test_add_func("/infofile/get_key", test_infofile_get_key);
     g_test_add_func("/infofile/get_ini_key", test_infofile_get_ini_key);
+    g_test_add_func("/infofile/get_keys", test_infofile_get_keys);
+    g_test_add_func("/infofile/get_keys/lenient", test_infofile_get_keys_lenient);
     g_test_add_func("/infofile/only_comments", test_infofile_only_comments);
 }
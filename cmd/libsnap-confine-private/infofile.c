@@ -33,7 +33,18 @@ int sc_infofile_get_key(FILE *stream, const char *key, char **value, sc_error **
 
 int sc_infofile_get_ini_section_key(FILE *stream, const char *section, const char *key, char **value,
                                     sc_error **err_out) {
+    sc_infofile_key keys[] = {{.key = key, .value = value}};
+    return sc_infofile_get_ini_section_keys(stream, section, keys, 1, 0, err_out);
+}
+
+int sc_infofile_get_keys(FILE *stream, sc_infofile_key *keys, size_t num_keys, unsigned flags, sc_error **err_out) {
+    return sc_infofile_get_ini_section_keys(stream, NULL, keys, num_keys, flags, err_out);
+}
+
+int sc_infofile_get_ini_section_keys(FILE *stream, const char *section, sc_infofile_key *keys, size_t num_keys,
+                                     unsigned flags, sc_error **err_out) {
     sc_error *err = NULL;
+    const bool lenient = (flags & SC_INFOFILE_LENIENT) != 0;
     size_t line_size = 0;
     char *line_buf SC_CLEANUP(sc_cleanup_string) = NULL;
 
@@ -41,27 +52,36 @@ int sc_infofile_get_ini_section_key(FILE *stream, const char *section, const cha
         err = sc_error_init_api_misuse("stream cannot be NULL");
         goto out;
     }
-    if (key == NULL) {
-        err = sc_error_init_api_misuse("key cannot be NULL");
+    if (keys == NULL) {
+        err = sc_error_init_api_misuse("keys cannot be NULL");
         goto out;
     }
-    if (value == NULL) {
-        err = sc_error_init_api_misuse("value cannot be NULL");
-        goto out;
+    for (size_t i = 0; i < num_keys; ++i) {
+        if (keys[i].key == NULL) {
+            err = sc_error_init_api_misuse("key cannot be NULL");
+            goto out;
+        }
+        if (keys[i].value == NULL) {
+            err = sc_error_init_api_misuse("value cannot be NULL");
+            goto out;
+        }
     }
     if (section != NULL && strlen(section) == 0) {
         err = sc_error_init_api_misuse("section name cannot be empty");
         goto out;
     }
 
-    /* Store NULL in case we don't find the key.
-     * This makes the value always well-defined. */
-    *value = NULL;
+    /* Store NULL in case we don't find the keys.
+     * This makes the values always well-defined. */
+    for (size_t i = 0; i < num_keys; ++i) {
+        *keys[i].value = NULL;
+    }
+    size_t num_found = 0;
 
     bool section_matched = false;
 
     /* This loop advances through subsequent lines. */
-    for (int lineno = 1;; ++lineno) {
+    for (int lineno = 1; num_found < num_keys; ++lineno) {
         errno = 0;
         ssize_t nread = getline(&line_buf, &line_size, stream);
         if (nread < 0 && errno != 0) {
@@ -76,34 +96,49 @@ int sc_infofile_get_ini_section_key(FILE *stream, const char *section, const cha
         /* Guard against malformed input that may contain NUL bytes that
          * would confuse the code below. */
         if (memchr(line_buf, '\0', nread) != NULL) {
+            if (lenient) {
+                continue;
+            }
             err = sc_error_init_simple("line %d contains NUL byte", lineno);
             goto out;
         }
-        /* Guard against non-strictly formatted input that doesn't contain
-         * trailing newline. */
-        if (line_buf[nread - 1] != '\n') {
+        size_t len = nread;
+        if (line_buf[len - 1] == '\n') {
+            /* Replace the trailing newline character with the NUL byte. */
+            line_buf[--len] = '\0';
+        } else if (!lenient) {
+            /* Guard against non-strictly formatted input that doesn't
+             * contain trailing newline. */
             err = sc_error_init(SC_LIBSNAP_DOMAIN, 0, "line %d does not end with a newline", lineno);
             goto out;
         }
-        /* Replace the trailing newline character with the NUL byte. */
-        line_buf[nread - 1] = '\0';
 
         if (line_buf[0] == '#') {
             /* A comment, advance to next line. */
             continue;
         }
+        if (line_buf[0] == '\0' && lenient) {
+            /* An empty line, advance to next line. */
+            continue;
+        }
 
         /* Handle ini sections (if requested via non-null section name) */
         if (line_buf[0] == '[') {
             if (section == NULL) {
+                if (lenient) {
+                    continue;
+                }
                 err = sc_error_init_simple("line %d contains unexpected section", lineno);
                 goto out;
             }
             section_matched = false;
             char *start_section_name = line_buf + 1;
-            // skip the leading [ and trailing \0
-            char *end_section_name = memchr(start_section_name, ']', nread - 2);
+            // skip the leading [
+            char *end_section_name = memchr(start_section_name, ']', len - 1);
             if (end_section_name == NULL) {
+                if (lenient) {
+                    continue;
+                }
                 err = sc_error_init_simple("line %d is not a valid ini section", lineno);
                 goto out;
             }
@@ -122,25 +157,34 @@ int sc_infofile_get_ini_section_key(FILE *stream, const char *section, const cha
         }
 
         /* Guard against malformed input that does not contain '=' byte */
-        char *eq_ptr = memchr(line_buf, '=', nread);
+        char *eq_ptr = memchr(line_buf, '=', len);
         if (eq_ptr == NULL) {
+            if (lenient) {
+                continue;
+            }
             err = sc_error_init_simple("line %d is not a key=value assignment", lineno);
             goto out;
         }
         /* Guard against malformed input with empty key. */
         if (eq_ptr == line_buf) {
+            if (lenient) {
+                continue;
+            }
             err = sc_error_init_simple("line %d contains empty key", lineno);
             goto out;
         }
         /* Replace the first '=' with string terminator byte. */
         *eq_ptr = '\0';
 
-        /* If the key matches the one we are looking for, store it and stop scanning. */
+        /* If the key matches one we are looking for, and was not seen yet,
+         * store it. Scanning stops once all the keys are found. */
         const char *scanned_key = line_buf;
         const char *scanned_value = eq_ptr + 1;
-        if (sc_streq(scanned_key, key)) {
-            *value = sc_strdup(scanned_value);
-            break;
+        for (size_t i = 0; i < num_keys; ++i) {
+            if (*keys[i].value == NULL && sc_streq(scanned_key, keys[i].key)) {
+                *keys[i].value = sc_strdup(scanned_value);
+                num_found++;
+            }
         }
     }
 
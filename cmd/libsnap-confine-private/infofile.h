@@ -18,6 +18,7 @@
 #ifndef SNAP_CONFINE_INFOFILE_H
 #define SNAP_CONFINE_INFOFILE_H
 
+#include <stddef.h>
 #include <stdio.h>
 
 #include "../libsnap-confine-private/error.h"
@@ -33,6 +34,49 @@
  **/
 int sc_infofile_get_key(FILE *stream, const char *key, char **value, sc_error **err_out);
 
+/**
+ * sc_infofile_key describes a key to extract from a stream and the place where
+ * its value is stored.
+ **/
+typedef struct sc_infofile_key {
+    const char *key;
+    char **value;
+} sc_infofile_key;
+
+/**
+ * sc_infofile_flags alter how strictly a stream is parsed.
+ *
+ * By default every line must be a comment or a key=value pair ending with a
+ * newline. With SC_INFOFILE_LENIENT, empty and malformed lines are skipped and
+ * the last line may lack the trailing newline, as in files such as
+ * /etc/os-release that are not written by snapd.
+ **/
+typedef enum sc_infofile_flags {
+    SC_INFOFILE_LENIENT = 1 << 0,
+} sc_infofile_flags;
+
+/**
+ * sc_infofile_get_keys extracts the values of several key=value pairs from a
+ * given stream in a single pass.
+ *
+ * Each value is set to a copy of the first value of the corresponding key, or
+ * to NULL if the key is not present. Scanning stops as soon as all the keys
+ * were found. The flags are a bitwise or of sc_infofile_flags values. On
+ * failure the values of the keys found before the malformed line are kept and
+ * must be freed by the caller. Errors are reported as with
+ * sc_infofile_get_key.
+ **/
+int sc_infofile_get_keys(FILE *stream, sc_infofile_key *keys, size_t num_keys, unsigned flags, sc_error **err_out);
+
+/**
+ * sc_infofile_get_ini_section_keys extracts the values of several key=value
+ * pairs from a given ini section of the stream in a single pass.
+ *
+ * The values are set and errors are reported as with sc_infofile_get_keys.
+ **/
+int sc_infofile_get_ini_section_keys(FILE *stream, const char *section, sc_infofile_key *keys, size_t num_keys,
+                                     unsigned flags, sc_error **err_out);
+
 /**
  * sc_infofile_get_ini_section_key extracts a single value of a key=value pair
  * from a given ini section of the stream.
@@ -15,10 +15,48 @@
  *
  */
 
+#define _GNU_SOURCE
+
 #include "mountinfo.h"
 #include "mountinfo.c"
+#include "string-utils.h"
 
 #include <glib.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/**
+ * Parse a single mountinfo entry (line) into a separately allocated entry.
+ *
+ * The returned entry holds a copy of the line and must be freed with
+ * sc_free_mountinfo_entry().
+ **/
+static sc_mountinfo_entry *sc_parse_mountinfo_entry(const char *line)
+{
+	// NOTE: the entry is allocated along with enough extra storage to hold a
+	// copy of the line, which is then parsed in place.
+	size_t line_len = strlen(line);
+	sc_mountinfo_entry *entry = calloc(1, sizeof *entry + line_len + 1);
+	if (entry == NULL) {
+		return NULL;
+	}
+	char *line_copy = (char *)(entry + 1);
+	memcpy(line_copy, line, line_len + 1);
+	if (!sc_parse_mountinfo_line(line_copy, entry)) {
+		free(entry);
+		return NULL;
+	}
+	return entry;
+}
+
+static void unlink_file(gpointer path)
+{
+	(void)unlink(path);
+}
 
 static void test_parse_mountinfo_entry__sysfs(void)
 {
@@ -279,6 +317,588 @@ static void test_parse_mountinfo_entry__broken_9p_superblock(void)
 	g_assert_null(entry->next);
 }
 
+static void test_parse_mountinfo__file(void)
+{
+	GError *err = NULL;
+	char *path = NULL;
+	int fd = g_file_open_tmp(NULL, &path, &err);
+	g_assert_no_error(err);
+	close(fd);
+	g_test_queue_free(path);
+	g_test_queue_destroy(unlink_file, path);
+
+	sc_mountinfo *info SC_CLEANUP(sc_cleanup_mountinfo) = NULL;
+
+	// An empty file has no entries.
+	g_assert_true(g_file_set_contents(path, "", -1, NULL));
+	info = sc_parse_mountinfo(path);
+	g_assert_nonnull(info);
+	g_assert_null(sc_first_mountinfo_entry(info));
+	g_assert_cmpuint(info->num_entries, ==, 0);
+	sc_cleanup_mountinfo(&info);
+
+	// The last line does not need to be terminated. Newlines are not a
+	// part of the last field.
+	g_assert_true(g_file_set_contents(path,
+					  "19 25 0:18 / /sys rw shared:7 - sysfs sysfs rw\n"
+					  "104 23 0:19 /snapd/ns /run/snapd/ns rw - tmpfs tmpfs rw,mode=755",
+					  -1, NULL));
+	info = sc_parse_mountinfo(path);
+	g_assert_nonnull(info);
+	g_assert_cmpuint(info->num_entries, ==, 2);
+	sc_mountinfo_entry *entry = sc_first_mountinfo_entry(info);
+	g_assert_true(entry == &info->entries[0]);
+	g_assert_cmpstr(entry->mount_dir, ==, "/sys");
+	g_assert_cmpstr(entry->optional_fields, ==, "shared:7");
+	g_assert_cmpstr(entry->super_opts, ==, "rw");
+	entry = sc_next_mountinfo_entry(entry);
+	g_assert_true(entry == &info->entries[1]);
+	g_assert_cmpstr(entry->mount_dir, ==, "/run/snapd/ns");
+	g_assert_cmpstr(entry->super_opts, ==, "rw,mode=755");
+	g_assert_null(sc_next_mountinfo_entry(entry));
+	sc_cleanup_mountinfo(&info);
+
+	// Malformed lines are rejected.
+	g_assert_true(g_file_set_contents(path,
+					  "19 25 0:18 / /sys rw - sysfs sysfs rw\n"
+					  "256 104 0:3\n", -1, NULL));
+	info = sc_parse_mountinfo(path);
+	g_assert_null(info);
+}
+
+static void test_parse_mountinfo__large_file(void)
+{
+	GError *err = NULL;
+	char *path = NULL;
+	int fd = g_file_open_tmp(NULL, &path, &err);
+	g_assert_no_error(err);
+	g_test_queue_free(path);
+	g_test_queue_destroy(unlink_file, path);
+
+	// Write enough entries to need several reads and to grow the buffer.
+	FILE *f = fdopen(fd, "w");
+	g_assert_nonnull(f);
+	const int n = 5000;
+	for (int i = 0; i < n; i++) {
+		fprintf(f, "%d 1 7:%d / /snap/app\\040%d/1 ro shared:%d - "
+			"squashfs /dev/loop%d ro\n", i + 2, i, i, i, i);
+	}
+	g_assert_cmpint(fclose(f), ==, 0);
+
+	sc_mountinfo *info SC_CLEANUP(sc_cleanup_mountinfo) = NULL;
+	info = sc_parse_mountinfo(path);
+	g_assert_nonnull(info);
+	g_assert_cmpuint(info->num_entries, ==, n);
+	int i = 0;
+	for (sc_mountinfo_entry * entry = sc_first_mountinfo_entry(info);
+	     entry != NULL; entry = sc_next_mountinfo_entry(entry), i++) {
+		char mount_dir[64];
+		snprintf(mount_dir, sizeof mount_dir, "/snap/app %d/1", i);
+		g_assert_cmpint(entry->mount_id, ==, i + 2);
+		g_assert_cmpuint(entry->dev_minor, ==, i);
+		g_assert_cmpstr(entry->mount_dir, ==, mount_dir);
+		g_assert_cmpstr(entry->fs_type, ==, "squashfs");
+		g_assert_cmpstr(entry->super_opts, ==, "ro");
+	}
+	g_assert_cmpint(i, ==, n);
+}
+
+typedef struct query_state {
+	const char *mount_dir;
+	int num_visited;
+	int stop_after;
+	sc_mountinfo_entry *last;
+} query_state;
+
+static bool query_match(const char *mount_dir, void *data)
+{
+	query_state *state = data;
+	return state->mount_dir == NULL
+	    || strcmp(mount_dir, state->mount_dir) == 0;
+}
+
+static bool query_visit(const sc_mountinfo_entry *entry, void *data)
+{
+	query_state *state = data;
+	state->num_visited++;
+	sc_cleanup_mountinfo_entry(&state->last);
+	state->last = sc_dup_mountinfo_entry(entry);
+	g_assert_nonnull(state->last);
+	return state->num_visited != state->stop_after;
+}
+
+static void test_query_mountinfo(void)
+{
+	GError *err = NULL;
+	char *path = NULL;
+	int fd = g_file_open_tmp(NULL, &path, &err);
+	g_assert_no_error(err);
+	close(fd);
+	g_test_queue_free(path);
+	g_test_queue_destroy(unlink_file, path);
+
+	g_assert_true(g_file_set_contents(path,
+					  "19 25 0:18 / /sys rw shared:7 - sysfs sysfs rw\n"
+					  "20 25 0:19 / /mnt\\040dir rw - tmpfs tmpfs rw\n"
+					  "21 20 0:20 /sub /mnt\\040dir ro master:3 - tmpfs none ro\n"
+					  "22 25 0:21 / /run rw - tmpfs tmpfs rw\n", -1,
+					  NULL));
+	query_state state = {.mount_dir = "/mnt dir" };
+
+	// All the matching entries are visited, only the requested fields are
+	// parsed.
+	g_assert_cmpint(sc_query_mountinfo
+			(path, SC_MOUNTINFO_OPTIONAL_FIELDS, query_match,
+			 query_visit, &state), ==, 0);
+	g_assert_cmpint(state.num_visited, ==, 2);
+	g_assert_nonnull(state.last);
+	g_assert_cmpint(state.last->mount_id, ==, 21);
+	g_assert_cmpint(state.last->parent_id, ==, 20);
+	g_assert_cmpuint(state.last->dev_major, ==, 0);
+	g_assert_cmpuint(state.last->dev_minor, ==, 20);
+	g_assert_cmpstr(state.last->mount_dir, ==, "/mnt dir");
+	g_assert_null(state.last->root);
+	g_assert_cmpstr(state.last->mount_opts, ==, "ro");
+	g_assert_cmpstr(state.last->optional_fields, ==, "master:3");
+	g_assert_null(state.last->fs_type);
+	g_assert_null(state.last->mount_source);
+	g_assert_null(state.last->super_opts);
+	sc_cleanup_mountinfo_entry(&state.last);
+
+	// The query stops as soon as the visit function says so.
+	state.num_visited = 0;
+	state.stop_after = 1;
+	g_assert_cmpint(sc_query_mountinfo
+			(path, SC_MOUNTINFO_ALL_FIELDS, query_match,
+			 query_visit, &state), ==, 0);
+	g_assert_cmpint(state.num_visited, ==, 1);
+	g_assert_cmpint(state.last->mount_id, ==, 20);
+	g_assert_cmpstr(state.last->root, ==, "/");
+	g_assert_cmpstr(state.last->fs_type, ==, "tmpfs");
+	g_assert_cmpstr(state.last->mount_source, ==, "tmpfs");
+	g_assert_cmpstr(state.last->super_opts, ==, "rw");
+	sc_cleanup_mountinfo_entry(&state.last);
+
+	// NULL matches every entry.
+	state.mount_dir = NULL;
+	state.num_visited = 0;
+	state.stop_after = 0;
+	g_assert_cmpint(sc_query_mountinfo
+			(path, SC_MOUNTINFO_ROOT, NULL, query_visit, &state),
+			==, 0);
+	g_assert_cmpint(state.num_visited, ==, 4);
+	g_assert_cmpstr(state.last->mount_dir, ==, "/run");
+	g_assert_cmpstr(state.last->root, ==, "/");
+	g_assert_null(state.last->mount_opts);
+	sc_cleanup_mountinfo_entry(&state.last);
+
+	// Malformed lines are rejected.
+	g_assert_true(g_file_set_contents(path, "256 104 0:3\n", -1, NULL));
+	state.num_visited = 0;
+	errno = 0;
+	g_assert_cmpint(sc_query_mountinfo
+			(path, 0, NULL, query_visit, &state), ==, -1);
+	g_assert_cmpint(errno, ==, EINVAL);
+	g_assert_cmpint(state.num_visited, ==, 0);
+
+	// Missing files are reported.
+	errno = 0;
+	g_assert_cmpint(sc_query_mountinfo
+			("/nonexistent/mountinfo", 0, NULL, query_visit,
+			 &state), ==, -1);
+	g_assert_cmpint(errno, ==, ENOENT);
+
+	// The rest of the file is not read once the query is stopped, the
+	// writer of the pipe never closes it.
+	char *fifo = g_strdup_printf("%s.fifo", path);
+	g_test_queue_free(fifo);
+	g_assert_cmpint(mkfifo(fifo, 0600), ==, 0);
+	g_test_queue_destroy(unlink_file, fifo);
+	pid_t pid = fork();
+	g_assert_cmpint(pid, >=, 0);
+	if (pid == 0) {
+		int fifo_fd = open(fifo, O_WRONLY);
+		const char *line =
+		    "20 25 0:19 / /mnt\\040dir rw - tmpfs tmpfs rw\n";
+		if (fifo_fd < 0 || write(fifo_fd, line, strlen(line)) < 0) {
+			_exit(1);
+		}
+		// Outlive the query, but not a test run which failed.
+		sleep(20);
+		_exit(0);
+	}
+	state.mount_dir = "/mnt dir";
+	state.num_visited = 0;
+	state.stop_after = 1;
+	// A query reading up to the end of the file would hang.
+	alarm(10);
+	g_assert_cmpint(sc_query_mountinfo
+			(fifo, SC_MOUNTINFO_ROOT, query_match, query_visit,
+			 &state), ==, 0);
+	alarm(0);
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	g_assert_cmpint(state.num_visited, ==, 1);
+	g_assert_cmpint(state.last->mount_id, ==, 20);
+	sc_cleanup_mountinfo_entry(&state.last);
+}
+
+static void assert_same_mountinfo_entry(const sc_mountinfo_entry *a,
+					const sc_mountinfo_entry *b)
+{
+	g_assert_cmpint(a->mount_id, ==, b->mount_id);
+	g_assert_cmpint(a->parent_id, ==, b->parent_id);
+	g_assert_cmpuint(a->dev_major, ==, b->dev_major);
+	g_assert_cmpuint(a->dev_minor, ==, b->dev_minor);
+	g_assert_cmpstr(a->root, ==, b->root);
+	g_assert_cmpstr(a->mount_dir, ==, b->mount_dir);
+	g_assert_cmpstr(a->mount_opts, ==, b->mount_opts);
+	g_assert_cmpstr(a->optional_fields, ==, b->optional_fields);
+	g_assert_cmpstr(a->fs_type, ==, b->fs_type);
+	g_assert_cmpstr(a->mount_source, ==, b->mount_source);
+	g_assert_cmpstr(a->super_opts, ==, b->super_opts);
+}
+
+static sc_mountinfo_entry *find_mount_id(sc_mountinfo *info, int mount_id)
+{
+	for (sc_mountinfo_entry * entry = sc_first_mountinfo_entry(info);
+	     entry != NULL; entry = sc_next_mountinfo_entry(entry)) {
+		if (entry->mount_id == mount_id) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+// Check that the mounts at or below dir form the same tree with both
+// backends. Returns the number of the failed check or 0.
+static int check_statmount_tree(const char *dir)
+{
+	sc_mountinfo *sm_info SC_CLEANUP(sc_cleanup_mountinfo) = NULL;
+	sm_info = sc_parse_mountinfo_statmount();
+	sc_mountinfo *info SC_CLEANUP(sc_cleanup_mountinfo) = NULL;
+	info = sc_parse_mountinfo("/proc/self/mountinfo");
+	if (sm_info == NULL || info == NULL) {
+		return 1;
+	}
+	sc_mountinfo_entry *sm_top = sc_first_mountinfo_entry_at(sm_info, dir);
+	sc_mountinfo_entry *top = sc_first_mountinfo_entry_at(info, dir);
+	if (sm_top == NULL || top == NULL || sm_top->mount_id != top->mount_id) {
+		return 2;
+	}
+	// The mounts that are visible are the same.
+	size_t len = strlen(dir);
+	for (sc_mountinfo_entry * entry = sc_first_mountinfo_entry(info);
+	     entry != NULL; entry = sc_next_mountinfo_entry(entry)) {
+		if (strncmp(entry->mount_dir, dir, len) != 0) {
+			continue;
+		}
+		sc_mountinfo_entry *a =
+		    sc_find_mountinfo_entry(sm_info, entry->mount_dir);
+		sc_mountinfo_entry *b =
+		    sc_find_mountinfo_entry(info, entry->mount_dir);
+		if (a == NULL || b == NULL || a->mount_id != b->mount_id) {
+			return 3;
+		}
+	}
+	// Both post-order traversals visit the same mounts, each of them after
+	// everything mounted on it.
+	sc_mountinfo *infos[] = { sm_info, info };
+	sc_mountinfo_entry *tops[] = { sm_top, top };
+	size_t counts[2] = { 0 };
+	for (size_t i = 0; i < 2; i++) {
+		bool *visited = calloc(infos[i]->num_entries, sizeof *visited);
+		if (visited == NULL) {
+			return 4;
+		}
+		for (sc_mountinfo_entry * entry =
+		     sc_first_postorder_mountinfo_entry(infos[i], tops[i]);
+		     entry != NULL;
+		     entry = sc_next_postorder_mountinfo_entry(tops[i], entry)) {
+			for (sc_mountinfo_entry * child = entry->first_child;
+			     child != NULL; child = child->next_sibling) {
+				if (!visited[child - infos[i]->entries]) {
+					free(visited);
+					return 5;
+				}
+			}
+			visited[entry - infos[i]->entries] = true;
+			counts[i]++;
+		}
+		free(visited);
+	}
+	if (counts[0] != counts[1] || counts[0] < 4) {
+		return 6;
+	}
+	return 0;
+}
+
+static void test_parse_mountinfo__statmount_tree(void)
+{
+	if (geteuid() != 0) {
+		g_test_skip("changes to the mount table require root");
+		return;
+	}
+	sc_mountinfo *sm_info SC_CLEANUP(sc_cleanup_mountinfo) = NULL;
+	sm_info = sc_parse_mountinfo_statmount();
+	if (sm_info == NULL && errno == ENOSYS) {
+		g_test_skip("listmount and statmount are not supported");
+		return;
+	}
+	// A mount moved under a more recent one and a mount stacked on top of
+	// that make the order of the unique identifiers differ from the order
+	// in which mounts are mounted on one another. The child process gets a
+	// mount namespace of its own for that.
+	pid_t pid = fork();
+	g_assert_cmpint(pid, >=, 0);
+	if (pid == 0) {
+		if (unshare(CLONE_NEWNS) < 0
+		    || mount("none", "/", NULL, MS_REC | MS_PRIVATE, NULL) < 0) {
+			_exit(77);
+		}
+		char dir[] = "/tmp/statmount-test.XXXXXX";
+		if (mkdtemp(dir) == NULL
+		    || mount("tmpfs", dir, "tmpfs", 0, NULL) < 0) {
+			_exit(77);
+		}
+		char a[64], b[64], moved[64];
+		sc_must_snprintf(a, sizeof a, "%s/a", dir);
+		sc_must_snprintf(b, sizeof b, "%s/b", dir);
+		sc_must_snprintf(moved, sizeof moved, "%s/b/a", dir);
+		int status = 0;
+		if (mkdir(a, 0755) < 0 || mkdir(b, 0755) < 0
+		    || mount("tmpfs", a, "tmpfs", 0, NULL) < 0
+		    || mount("tmpfs", b, "tmpfs", 0, NULL) < 0
+		    || mkdir(moved, 0755) < 0
+		    || mount(a, moved, NULL, MS_MOVE, NULL) < 0
+		    || mount("tmpfs", b, "tmpfs", 0, NULL) < 0) {
+			status = 77;
+		} else {
+			status = check_statmount_tree(dir);
+		}
+		umount2(dir, MNT_DETACH);
+		rmdir(dir);
+		_exit(status);
+	}
+	int status = 0;
+	g_assert_cmpint(waitpid(pid, &status, 0), ==, pid);
+	g_assert_true(WIFEXITED(status));
+	if (WEXITSTATUS(status) == 77) {
+		g_test_skip("cannot create mount namespaces");
+		return;
+	}
+	g_assert_cmpint(WEXITSTATUS(status), ==, 0);
+}
+
+static void test_parse_mountinfo__statmount(void)
+{
+	sc_mountinfo *sm_info SC_CLEANUP(sc_cleanup_mountinfo) = NULL;
+	sm_info = sc_parse_mountinfo_statmount();
+	if (sm_info == NULL && errno == ENOSYS) {
+		g_test_skip("listmount and statmount are not supported");
+		return;
+	}
+	g_assert_nonnull(sm_info);
+
+	// The mount table is the same as the one described by mountinfo.
+	sc_mountinfo *info SC_CLEANUP(sc_cleanup_mountinfo) = NULL;
+	info = sc_parse_mountinfo("/proc/self/mountinfo");
+	g_assert_nonnull(info);
+	// The entries are not necessarily listed in the same order.
+	g_assert_cmpuint(sm_info->num_entries, ==, info->num_entries);
+	for (sc_mountinfo_entry * a = sc_first_mountinfo_entry(sm_info);
+	     a != NULL; a = sc_next_mountinfo_entry(a)) {
+		sc_mountinfo_entry *b = find_mount_id(info, a->mount_id);
+		g_assert_nonnull(b);
+		assert_same_mountinfo_entry(a, b);
+	}
+
+	// Queries see the same entries, with just the requested fields.
+	query_state state = {.mount_dir = "/" };
+	g_assert_cmpint(sc_query_mountinfo_statmount
+			(SC_MOUNTINFO_OPTIONAL_FIELDS, query_match, query_visit,
+			 &state), ==, 0);
+	g_assert_cmpint(state.num_visited, >, 0);
+	g_assert_nonnull(state.last);
+	g_assert_cmpstr(state.last->mount_dir, ==, "/");
+	g_assert_null(state.last->root);
+	g_assert_nonnull(state.last->optional_fields);
+	g_assert_null(state.last->super_opts);
+	sc_cleanup_mountinfo_entry(&state.last);
+}
+
+static sc_mountinfo *parse_mountinfo_text(const char *text)
+{
+	GError *err = NULL;
+	char *path = NULL;
+	int fd = g_file_open_tmp(NULL, &path, &err);
+	g_assert_no_error(err);
+	close(fd);
+	g_assert_true(g_file_set_contents(path, text, -1, NULL));
+	sc_mountinfo *info = sc_parse_mountinfo(path);
+	unlink(path);
+	g_free(path);
+	return info;
+}
+
+static void test_mountinfo_tree(void)
+{
+	sc_mountinfo *info SC_CLEANUP(sc_cleanup_mountinfo) = NULL;
+	info = parse_mountinfo_text("1 0 8:1 / / rw - ext4 /dev/sda1 rw\n"
+				    "2 1 0:2 / /run rw - tmpfs tmpfs rw\n"
+				    "3 2 0:3 / /run/a rw - tmpfs tmpfs rw\n"
+				    "4 1 0:4 / /tmp rw - tmpfs tmpfs rw\n"
+				    "5 2 0:5 / /run/b rw - tmpfs tmpfs rw\n"
+				    "6 3 0:6 / /run/a rw - tmpfs tmpfs rw\n"
+				    "7 6 0:7 / /run/a/c rw - tmpfs tmpfs rw\n"
+				    "8 99 0:8 / /orphan rw - tmpfs tmpfs rw\n");
+	g_assert_nonnull(info);
+	sc_mountinfo_entry *e = info->entries;
+
+	// Entries are linked to their parents and children, in order.
+	g_assert_true(info->first_root == &e[0]);
+	g_assert_true(e[0].next_sibling == &e[7]);
+	g_assert_null(e[7].parent);
+	g_assert_null(e[0].parent);
+	g_assert_true(e[0].first_child == &e[1]);
+	g_assert_true(e[1].next_sibling == &e[3]);
+	g_assert_null(e[3].next_sibling);
+	g_assert_true(e[1].first_child == &e[2]);
+	g_assert_true(e[2].next_sibling == &e[4]);
+	g_assert_true(e[5].parent == &e[2]);
+
+	// The topmost mount of a stack is found.
+	g_assert_true(sc_find_mountinfo_entry(info, "/run/a") == &e[5]);
+	g_assert_true(sc_find_mountinfo_entry(info, "/run/a/c") == &e[6]);
+	g_assert_true(sc_find_mountinfo_entry(info, "/") == &e[0]);
+	g_assert_null(sc_find_mountinfo_entry(info, "/run/c"));
+
+	// Subtrees are traversed in pre-order.
+	const int subtree[] = { 2, 3, 6, 7, 5 };
+	size_t n = 0;
+	for (sc_mountinfo_entry * entry = &e[1]; entry != NULL;
+	     entry = sc_next_subtree_mountinfo_entry(&e[1], entry)) {
+		g_assert_cmpuint(n, <, G_N_ELEMENTS(subtree));
+		g_assert_cmpint(entry->mount_id, ==, subtree[n++]);
+	}
+	g_assert_cmpuint(n, ==, G_N_ELEMENTS(subtree));
+
+	// Post-order traversals visit children before their parents.
+	const int postorder[] = { 7, 6, 3, 5, 2, 4, 1, 8 };
+	n = 0;
+	for (sc_mountinfo_entry * entry =
+	     sc_first_postorder_mountinfo_entry(info, NULL); entry != NULL;
+	     entry = sc_next_postorder_mountinfo_entry(NULL, entry)) {
+		g_assert_cmpuint(n, <, G_N_ELEMENTS(postorder));
+		g_assert_cmpint(entry->mount_id, ==, postorder[n++]);
+	}
+	g_assert_cmpuint(n, ==, G_N_ELEMENTS(postorder));
+	n = 0;
+	for (sc_mountinfo_entry * entry =
+	     sc_first_postorder_mountinfo_entry(info, &e[2]); entry != NULL;
+	     entry = sc_next_postorder_mountinfo_entry(&e[2], entry)) {
+		g_assert_cmpint(entry->mount_id, ==, postorder[n++]);
+	}
+	g_assert_cmpuint(n, ==, 3);
+}
+
+static void test_mountinfo_tree__cycle(void)
+{
+	sc_mountinfo *info SC_CLEANUP(sc_cleanup_mountinfo) = NULL;
+	info = parse_mountinfo_text("1 1 8:1 / / rw - ext4 /dev/sda1 rw\n"
+				    "2 3 0:2 / /a rw - tmpfs tmpfs rw\n"
+				    "3 2 0:3 / /b rw - tmpfs tmpfs rw\n");
+	g_assert_nonnull(info);
+	sc_mountinfo_entry *e = info->entries;
+
+	// Entries whose parents form a cycle become roots.
+	g_assert_true(info->first_root == &e[0]);
+	g_assert_true(e[0].next_sibling == &e[1]);
+	g_assert_true(e[1].next_sibling == &e[2]);
+	g_assert_null(e[1].parent);
+	g_assert_null(e[1].first_child);
+	size_t n = 0;
+	for (sc_mountinfo_entry * entry =
+	     sc_first_postorder_mountinfo_entry(info, NULL); entry != NULL;
+	     entry = sc_next_postorder_mountinfo_entry(NULL, entry)) {
+		n++;
+	}
+	g_assert_cmpuint(n, ==, 3);
+
+	// An empty table has no tree.
+	sc_cleanup_mountinfo(&info);
+	info = parse_mountinfo_text("");
+	g_assert_nonnull(info);
+	g_assert_null(info->first_root);
+	g_assert_null(sc_find_mountinfo_entry(info, "/"));
+	g_assert_null(sc_first_postorder_mountinfo_entry(info, NULL));
+}
+
+static void test_mountinfo_snapshot(void)
+{
+	// The snapshot is reused while nothing changes.
+	sc_mountinfo *info = sc_mountinfo_snapshot();
+	g_assert_nonnull(info);
+	g_assert_true(sc_mountinfo_snapshot() == info);
+	g_assert_nonnull(sc_find_mountinfo_entry(info, "/"));
+	sc_invalidate_mountinfo_snapshot();
+	g_assert_null(sc_snapshot.info);
+	g_assert_cmpint(sc_snapshot.fd, ==, -1);
+	info = sc_mountinfo_snapshot();
+	g_assert_nonnull(info);
+
+	if (geteuid() != 0) {
+		g_test_skip("changes to the mount table require root");
+		return;
+	}
+	// Changes of the mount namespace and of the mount table are noticed. The
+	// child process gets a mount namespace of its own for that.
+	pid_t pid = fork();
+	g_assert_cmpint(pid, >=, 0);
+	if (pid == 0) {
+		// A forked process does not reuse the snapshot of its parent.
+		sc_mountinfo *child_info = sc_mountinfo_snapshot();
+		if (child_info == NULL || sc_snapshot.pid != getpid()) {
+			_exit(1);
+		}
+		if (unshare(CLONE_NEWNS) < 0
+		    || mount("none", "/", NULL, MS_REC | MS_PRIVATE, NULL) < 0) {
+			_exit(77);
+		}
+		child_info = sc_mountinfo_snapshot();
+		struct stat st;
+		if (child_info == NULL || stat("/proc/self/ns/mnt", &st) < 0
+		    || sc_snapshot.ns_ino != st.st_ino) {
+			_exit(2);
+		}
+		char dir[] = "/tmp/snapshot-test.XXXXXX";
+		if (mkdtemp(dir) == NULL) {
+			_exit(77);
+		}
+		int status = 0;
+		if (mount("tmpfs", dir, "tmpfs", 0, NULL) < 0) {
+			status = 77;
+		} else {
+			child_info = sc_mountinfo_snapshot();
+			if (child_info == NULL
+			    || sc_find_mountinfo_entry(child_info, dir) == NULL) {
+				status = 3;
+			}
+			umount(dir);
+		}
+		rmdir(dir);
+		_exit(status);
+	}
+	int status = 0;
+	g_assert_cmpint(waitpid(pid, &status, 0), ==, pid);
+	g_assert_true(WIFEXITED(status));
+	if (WEXITSTATUS(status) == 77) {
+		g_test_skip("cannot create mount namespaces");
+		return;
+	}
+	g_assert_cmpint(WEXITSTATUS(status), ==, 0);
+}
+
 static void __attribute__((constructor)) init(void)
 {
 	g_test_add_func("/mountinfo/parse_mountinfo_entry/sysfs",
@@ -307,4 +927,16 @@ static void __attribute__((constructor)) init(void)
 			test_parse_mountinfo_entry__unescaped_whitespace);
 	g_test_add_func("/mountinfo/parse_mountinfo_entry/broken_9p_superblock",
 			test_parse_mountinfo_entry__broken_9p_superblock);
+	g_test_add_func("/mountinfo/parse_mountinfo/file",
+			test_parse_mountinfo__file);
+	g_test_add_func("/mountinfo/parse_mountinfo/large_file",
+			test_parse_mountinfo__large_file);
+	g_test_add_func("/mountinfo/query_mountinfo", test_query_mountinfo);
+	g_test_add_func("/mountinfo/parse_mountinfo/statmount",
+			test_parse_mountinfo__statmount);
+	g_test_add_func("/mountinfo/parse_mountinfo/statmount/tree",
+			test_parse_mountinfo__statmount_tree);
+	g_test_add_func("/mountinfo/tree", test_mountinfo_tree);
+	g_test_add_func("/mountinfo/tree/cycle", test_mountinfo_tree__cycle);
+	g_test_add_func("/mountinfo/snapshot", test_mountinfo_snapshot);
 }
@@ -17,10 +17,19 @@
 #include "mountinfo.h"
 
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <poll.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 #include "cleanup-funcs.h"
 
@@ -43,9 +52,12 @@
  * (9) filesystem type:  name of filesystem of the form "type[.subtype]"
  * (10) mount source:  filesystem specific information or "none"
  * (11) super options:  per super block options
+ *
+ * The line is parsed in place, the text fields of the entry point into it.
+ * The return value is false if the line is malformed.
  **/
-static sc_mountinfo_entry *sc_parse_mountinfo_entry(const char *line)
-    __attribute__((nonnull(1)));
+static bool sc_parse_mountinfo_line(char *line, sc_mountinfo_entry * entry)
+    __attribute__((nonnull(1, 2)));
 
 /**
  * Free a sc_mountinfo structure and all its entries.
@@ -59,9 +71,30 @@ static void sc_free_mountinfo(sc_mountinfo * info)
 static void sc_free_mountinfo_entry(sc_mountinfo_entry * entry)
     __attribute__((nonnull(1)));
 
+/**
+ * Link the entries into a tree and index them by mount point.
+ *
+ * The return value is -1 with errno set if memory cannot be allocated.
+ **/
+static int sc_index_mountinfo(sc_mountinfo * info)
+    __attribute__((nonnull(1)));
+
+/**
+ * Build the mount table of the current process with statmount(2).
+ **/
+static sc_mountinfo *sc_parse_mountinfo_statmount(void);
+
+/**
+ * Query the mount table of the current process with statmount(2).
+ **/
+static int sc_query_mountinfo_statmount(unsigned fields,
+					sc_mountinfo_match_fn match,
+					sc_mountinfo_visit_fn visit,
+					void *data);
+
 sc_mountinfo_entry *sc_first_mountinfo_entry(sc_mountinfo *info)
 {
-	return info->first;
+	return info->num_entries > 0 ? &info->entries[0] : NULL;
 }
 
 sc_mountinfo_entry *sc_next_mountinfo_entry(sc_mountinfo_entry *entry)
@@ -69,76 +102,344 @@ sc_mountinfo_entry *sc_next_mountinfo_entry(sc_mountinfo_entry *entry)
 	return entry->next;
 }
 
-sc_mountinfo *sc_parse_mountinfo(const char *fname)
+/**
+ * Read the whole file into a single NUL-terminated buffer.
+ *
+ * Files in /proc do not report their size so the buffer is grown as needed.
+ * The buffer starts out large enough to hold the mount table of a typical
+ * system so that it is read with a handful of read calls.
+ **/
+static char *sc_read_whole_file(const char *fname, size_t *size_out)
 {
-	sc_mountinfo *info = calloc(1, sizeof *info);
-	if (info == NULL) {
+	int fd SC_CLEANUP(sc_cleanup_close) = -1;
+	fd = open(fname, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
 		return NULL;
 	}
-	if (fname == NULL) {
-		fname = "/proc/self/mountinfo";
-	}
-	FILE *f SC_CLEANUP(sc_cleanup_file) = NULL;
-	f = fopen(fname, "rt");
-	if (f == NULL) {
-		free(info);
+	size_t cap = 64 * 1024;
+	size_t size = 0;
+	char *buf = malloc(cap);
+	if (buf == NULL) {
 		return NULL;
 	}
-	char *line SC_CLEANUP(sc_cleanup_string) = NULL;
-	size_t line_size = 0;
-	sc_mountinfo_entry *entry, *last = NULL;
 	for (;;) {
-		errno = 0;
-		if (getline(&line, &line_size, f) == -1) {
-			if (errno != 0) {
-				sc_free_mountinfo(info);
+		if (cap - size < 2) {
+			char *new_buf = realloc(buf, cap * 2);
+			if (new_buf == NULL) {
+				free(buf);
 				return NULL;
 			}
+			buf = new_buf;
+			cap *= 2;
+		}
+		// Leave room for the terminator.
+		ssize_t n = read(fd, buf + size, cap - size - 1);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			int saved_errno = errno;
+			free(buf);
+			errno = saved_errno;
+			return NULL;
+		}
+		if (n == 0) {
 			break;
-		};
-		entry = sc_parse_mountinfo_entry(line);
-		if (entry == NULL) {
+		}
+		size += n;
+	}
+	buf[size] = '\0';
+	*size_out = size;
+	return buf;
+}
+
+sc_mountinfo *sc_parse_mountinfo(const char *fname)
+{
+	if (fname == NULL) {
+		// Ask the kernel for the mounts directly, if it can tell, rather
+		// than have it format the whole table as text for us to parse.
+		sc_mountinfo *info = sc_parse_mountinfo_statmount();
+		if (info != NULL || errno != ENOSYS) {
+			return info;
+		}
+		fname = "/proc/self/mountinfo";
+	}
+	sc_mountinfo *info = calloc(1, sizeof *info);
+	if (info == NULL) {
+		return NULL;
+	}
+	// The whole file is read into one buffer which is then split into lines
+	// and parsed in place. All the text fields of all the entries point into
+	// that buffer.
+	size_t size = 0;
+	info->buf = sc_read_whole_file(fname, &size);
+	if (info->buf == NULL) {
+		sc_free_mountinfo(info);
+		return NULL;
+	}
+	size_t num_lines = 0;
+	for (char *p = info->buf; p < info->buf + size;) {
+		char *eol = memchr(p, '\n', info->buf + size - p);
+		num_lines++;
+		if (eol == NULL) {
+			break;
+		}
+		p = eol + 1;
+	}
+	if (num_lines == 0) {
+		return info;
+	}
+	info->entries = calloc(num_lines, sizeof *info->entries);
+	if (info->entries == NULL) {
+		sc_free_mountinfo(info);
+		return NULL;
+	}
+	char *line = info->buf;
+	for (size_t i = 0; i < num_lines; i++) {
+		char *eol = memchr(line, '\n', info->buf + size - line);
+		if (eol != NULL) {
+			*eol = '\0';
+		}
+		sc_mountinfo_entry *entry = &info->entries[i];
+		if (!sc_parse_mountinfo_line(line, entry)) {
 			sc_free_mountinfo(info);
+			errno = EINVAL;
 			return NULL;
 		}
-		if (last != NULL) {
-			last->next = entry;
-		} else {
-			info->first = entry;
+		if (i > 0) {
+			info->entries[i - 1].next = entry;
 		}
-		last = entry;
+		info->num_entries++;
+		if (eol != NULL) {
+			line = eol + 1;
+		}
+	}
+	if (sc_index_mountinfo(info) < 0) {
+		sc_free_mountinfo(info);
+		return NULL;
 	}
 	return info;
 }
 
-static void show_buffers(const char *line, int offset,
-			 sc_mountinfo_entry *entry)
+// FNV-1a hash of a mount point.
+static size_t sc_hash_mount_dir(const char *mount_dir)
+{
+	uint32_t hash = 2166136261u;
+	for (const char *p = mount_dir; *p != '\0'; p++) {
+		hash ^= (unsigned char)*p;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static int sc_index_mountinfo(sc_mountinfo *info)
+{
+	if (info->num_entries == 0) {
+		return 0;
+	}
+	// Keep both tables at most half full.
+	size_t size = 16;
+	while (size < info->num_entries * 2) {
+		size *= 2;
+	}
+	const size_t mask = size - 1;
+	info->buckets = calloc(size, sizeof *info->buckets);
+	if (info->buckets == NULL) {
+		return -1;
+	}
+	info->num_buckets = size;
+	// Open addressing table of the entries by mount ID, used to find the
+	// parent of each entry.
+	sc_mountinfo_entry **by_id = calloc(size, sizeof *by_id);
+	if (by_id == NULL) {
+		return -1;
+	}
+	for (size_t i = 0; i < info->num_entries; i++) {
+		sc_mountinfo_entry *entry = &info->entries[i];
+		size_t j = ((uint32_t)entry->mount_id * 2654435761u) & mask;
+		while (by_id[j] != NULL && by_id[j]->mount_id != entry->mount_id) {
+			j = (j + 1) & mask;
+		}
+		if (by_id[j] == NULL) {
+			by_id[j] = entry;
+		}
+	}
+	// Walk the entries backwards and prepend each one to the lists it
+	// belongs to, so that all the lists end up in mount table order.
+	for (size_t i = info->num_entries; i-- > 0;) {
+		sc_mountinfo_entry *entry = &info->entries[i];
+		entry->parent = NULL;
+		if (entry->parent_id != entry->mount_id) {
+			size_t j = ((uint32_t)entry->parent_id * 2654435761u) & mask;
+			while (by_id[j] != NULL
+			       && by_id[j]->mount_id != entry->parent_id) {
+				j = (j + 1) & mask;
+			}
+			entry->parent = by_id[j];
+		}
+		if (entry->parent != NULL) {
+			entry->next_sibling = entry->parent->first_child;
+			entry->parent->first_child = entry;
+		} else {
+			entry->next_sibling = info->first_root;
+			info->first_root = entry;
+		}
+		size_t b = sc_hash_mount_dir(entry->mount_dir) & mask;
+		entry->next_in_bucket = info->buckets[b];
+		info->buckets[b] = entry;
+	}
+	free(by_id);
+	// Entries that cannot be reached from any root form cycles through their
+	// parent IDs. The kernel never reports those but a damaged file could,
+	// turn such entries into roots so that every traversal terminates.
+	bool *reached = calloc(info->num_entries, sizeof *reached);
+	if (reached == NULL) {
+		return -1;
+	}
+	sc_mountinfo_entry *last_root = NULL;
+	for (sc_mountinfo_entry * root = info->first_root; root != NULL;
+	     root = root->next_sibling) {
+		for (sc_mountinfo_entry * entry = root; entry != NULL;
+		     entry = sc_next_subtree_mountinfo_entry(root, entry)) {
+			reached[entry - info->entries] = true;
+		}
+		last_root = root;
+	}
+	for (size_t i = 0; i < info->num_entries; i++) {
+		if (reached[i]) {
+			continue;
+		}
+		sc_mountinfo_entry *entry = &info->entries[i];
+		entry->parent = NULL;
+		entry->first_child = NULL;
+		entry->next_sibling = NULL;
+		if (last_root != NULL) {
+			last_root->next_sibling = entry;
+		} else {
+			info->first_root = entry;
+		}
+		last_root = entry;
+	}
+	free(reached);
+	return 0;
+}
+
+sc_mountinfo_entry *sc_find_mountinfo_entry(sc_mountinfo *info,
+					    const char *mount_dir)
+{
+	sc_mountinfo_entry *found = NULL;
+	for (sc_mountinfo_entry * entry =
+	     sc_first_mountinfo_entry_at(info, mount_dir); entry != NULL;
+	     entry = sc_next_mountinfo_entry_at(entry)) {
+		// Mounts stacked on top of this one have the same mount point.
+		bool covered = false;
+		for (sc_mountinfo_entry * child = entry->first_child;
+		     child != NULL; child = child->next_sibling) {
+			if (strcmp(child->mount_dir, mount_dir) == 0) {
+				covered = true;
+				break;
+			}
+		}
+		// As with the mount table as a whole, later entries win.
+		if (!covered || found == NULL) {
+			found = entry;
+		}
+	}
+	return found;
+}
+
+sc_mountinfo_entry *sc_first_mountinfo_entry_at(sc_mountinfo *info,
+						const char *mount_dir)
+{
+	if (info->num_buckets == 0) {
+		return NULL;
+	}
+	size_t b = sc_hash_mount_dir(mount_dir) & (info->num_buckets - 1);
+	for (sc_mountinfo_entry * entry = info->buckets[b]; entry != NULL;
+	     entry = entry->next_in_bucket) {
+		if (strcmp(entry->mount_dir, mount_dir) == 0) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+sc_mountinfo_entry *sc_next_mountinfo_entry_at(sc_mountinfo_entry *entry)
+{
+	for (sc_mountinfo_entry * next = entry->next_in_bucket; next != NULL;
+	     next = next->next_in_bucket) {
+		if (strcmp(next->mount_dir, entry->mount_dir) == 0) {
+			return next;
+		}
+	}
+	return NULL;
+}
+
+sc_mountinfo_entry *sc_next_subtree_mountinfo_entry(const sc_mountinfo_entry
+						    *top,
+						    sc_mountinfo_entry *entry)
+{
+	if (entry->first_child != NULL) {
+		return entry->first_child;
+	}
+	for (; entry != top; entry = entry->parent) {
+		if (entry->next_sibling != NULL) {
+			return entry->next_sibling;
+		}
+	}
+	return NULL;
+}
+
+// Descend to the first leaf of the subtree rooted at the given entry.
+static sc_mountinfo_entry *sc_first_leaf_mountinfo_entry(sc_mountinfo_entry
+							 *entry)
+{
+	while (entry->first_child != NULL) {
+		entry = entry->first_child;
+	}
+	return entry;
+}
+
+sc_mountinfo_entry *sc_first_postorder_mountinfo_entry(sc_mountinfo *info,
+						       sc_mountinfo_entry *top)
+{
+	if (top == NULL) {
+		top = info->first_root;
+	}
+	return top != NULL ? sc_first_leaf_mountinfo_entry(top) : NULL;
+}
+
+sc_mountinfo_entry *sc_next_postorder_mountinfo_entry(const
+						      sc_mountinfo_entry *top,
+						      sc_mountinfo_entry *entry)
+{
+	if (entry == top) {
+		return NULL;
+	}
+	if (entry->next_sibling != NULL) {
+		return sc_first_leaf_mountinfo_entry(entry->next_sibling);
+	}
+	return entry->parent;
+}
+
+static void show_buffers(const char *line, size_t line_len, size_t offset)
 {
 #ifdef MOUNTINFO_DEBUG
-	fprintf(stderr, "Input buffer (first), with offset arrow\n");
-	fprintf(stderr, "Output buffer (second)\n");
+	fprintf(stderr, "Buffer being parsed in place, with offset arrow\n");
 
 	fputc(' ', stderr);
-	for (int i = 0; i < offset - 1; ++i)
+	for (size_t i = 0; i + 1 < offset; ++i)
 		fputc('-', stderr);
 	fputc('v', stderr);
 	fputc('\n', stderr);
 
-	fprintf(stderr, ">%s<\n", line);
-
 	fputc('>', stderr);
-	for (size_t i = 0; i < strlen(line); ++i) {
-		int c = entry->line_buf[i];
-		fputc(c == 0 ? '@' : c == 1 ? '#' : c, stderr);
+	for (size_t i = 0; i < line_len; ++i) {
+		int c = line[i];
+		fputc(c == 0 ? '@' : c, stderr);
 	}
 	fputc('<', stderr);
 	fputc('\n', stderr);
-
-	fputc('>', stderr);
-	for (size_t i = 0; i < strlen(line); ++i)
-		fputc('=', stderr);
-	fputc('<', stderr);
-	fputc('\n', stderr);
 #endif				// MOUNTINFO_DEBUG
 }
 
@@ -147,12 +448,15 @@ static bool is_octal_digit(char c)
 	return c >= '0' && c <= '7';
 }
 
-static char *parse_next_string_field_ex(sc_mountinfo_entry *entry,
-					const char *line, size_t *offset,
+static char *parse_next_string_field_ex(char *line, size_t line_len,
+					size_t *offset,
 					bool allow_spaces_in_field)
 {
+	// The field is unescaped in place. The writing index never overtakes
+	// the reading index as escape sequences are longer than the characters
+	// they represent.
 	const char *input = &line[*offset];
-	char *output = &entry->line_buf[*offset];
+	char *output = &line[*offset];
 	size_t input_idx = 0;	// reading index
 	size_t output_idx = 0;	// writing index
 
@@ -225,86 +529,92 @@ static char *parse_next_string_field_ex(sc_mountinfo_entry *entry,
 		"\nscanned: >%s< (%zd bytes), input idx: %zd, output idx: %zd\n",
 		output, strlen(output), input_idx, output_idx);
 #endif
-	show_buffers(line, *offset, entry);
+	show_buffers(line, line_len, *offset);
 	return output;
 }
 
 // Return the next space separated string field in the given line
-static char *parse_next_string_field(sc_mountinfo_entry *entry,
-				     const char *line, size_t *offset)
+static char *parse_next_string_field(char *line, size_t line_len,
+				     size_t *offset)
 {
-	return parse_next_string_field_ex(entry, line, offset, false);
+	return parse_next_string_field_ex(line, line_len, offset, false);
 }
 
 // Return the last string field in the given line, this means the field
 // is allowed to contain spaces (' ', 0x20)
-static char *parse_last_string_field(sc_mountinfo_entry *entry,
-				     const char *line, size_t *offset)
+static char *parse_last_string_field(char *line, size_t line_len,
+				     size_t *offset)
 {
-	return parse_next_string_field_ex(entry, line, offset, true);
+	return parse_next_string_field_ex(line, line_len, offset, true);
 }
 
-static sc_mountinfo_entry *sc_parse_mountinfo_entry(const char *line)
+static int sc_parse_mountinfo_line_ex(char *line, sc_mountinfo_entry *entry,
+				      unsigned fields,
+				      sc_mountinfo_match_fn match, void *data)
 {
-	// NOTE: the sc_mountinfo structure is allocated along with enough extra
-	// storage to hold the whole line we are parsing. This is used as backing
-	// store for all text fields.
-	//
-	// The idea is that since the line has a given length and we are only after
-	// set of substrings we can easily predict the amount of required space
-	// (after all, it is just a set of non-overlapping substrings) and append
-	// it to the allocated entry structure.
-	//
-	// The parsing code below, specifically parse_next_string_field(), uses
-	// this extra memory to hold data parsed from the original line. In the
-	// end, the result is similar to using strtok except that the source and
-	// destination buffers are separate.
+	// NOTE: the line is parsed in place. The parsing code below,
+	// specifically parse_next_string_field(), converts the spaces separating
+	// fields into NUL bytes (string terminators) and unescapes the octal
+	// escape sequences used by the kernel, so that the text fields of the
+	// entry can point directly into the line. In the end, the result is
+	// similar to using strtok.
 	//
-	// At the end of the parsing process, the input buffer (line) and the
-	// output buffer (entry->line_buf) are the same except for where spaces
-	// were converted into NUL bytes (string terminators) and except for the
-	// leading part of the buffer that contains mount_id, parent_id, dev_major
-	// and dev_minor integer fields that are parsed separately.
+	// The mount point is parsed first, so that lines rejected by the match
+	// function cost as little as possible, and only the requested text
+	// fields are parsed afterwards.
 	//
 	// If MOUNTINFO_DEBUG is defined then extra debugging is printed to stderr
 	// and this allows for visual analysis of what is going on.
-	sc_mountinfo_entry *entry = calloc(1, sizeof *entry + strlen(line) + 1);
-	if (entry == NULL) {
-		return NULL;
+	size_t line_len = strlen(line);
+	size_t offset = 0, root_offset = 0;
+
+	// Skip over the mount ID, parent ID and major:minor fields. Neither of
+	// them nor the root field that follows contains unescaped spaces.
+	const char *p = line;
+	for (int i = 0; i < 3; i++) {
+		if ((p = strchr(p, ' ')) == NULL)
+			return -1;
+		p++;
 	}
-#ifdef MOUNTINFO_DEBUG
-	// Poison the buffer with '\1' bytes that are printed as '#' characters
-	// by show_buffers() below. This is "unaltered" memory.
-	memset(entry->line_buf, 1, strlen(line));
-#endif				// MOUNTINFO_DEBUG
-	int nscanned, initial_offset = 0;
-	size_t offset = 0;
-	nscanned = sscanf(line, "%d %d %u:%u %n",
-			  &entry->mount_id, &entry->parent_id,
-			  &entry->dev_major, &entry->dev_minor,
-			  &initial_offset);
-	if (nscanned != 4)
-		goto fail;
-	offset += initial_offset;
-
-	show_buffers(line, offset, entry);
-
-	if ((entry->root =
-	     parse_next_string_field(entry, line, &offset)) == NULL)
-		goto fail;
+	root_offset = p - line;
+	if ((p = strchr(p, ' ')) == NULL)
+		return -1;
+	offset = p + 1 - line;
+
+	show_buffers(line, line_len, offset);
+
 	if ((entry->mount_dir =
-	     parse_next_string_field(entry, line, &offset)) == NULL)
-		goto fail;
+	     parse_next_string_field(line, line_len, &offset)) == NULL)
+		return -1;
+	if (match != NULL && !match(entry->mount_dir, data))
+		return 0;
+	if (sscanf(line, "%d %d %u:%u",
+		   &entry->mount_id, &entry->parent_id,
+		   &entry->dev_major, &entry->dev_minor) != 4)
+		return -1;
+	if ((fields & SC_MOUNTINFO_ROOT) != 0) {
+		if ((entry->root =
+		     parse_next_string_field(line, line_len,
+					     &root_offset)) == NULL)
+			return -1;
+	}
+	entry->next = NULL;
+	// The remaining fields are parsed in order up to the last one requested.
+	if ((fields & ~SC_MOUNTINFO_ROOT) == 0)
+		return 1;
 	if ((entry->mount_opts =
-	     parse_next_string_field(entry, line, &offset)) == NULL)
-		goto fail;
-	entry->optional_fields = &entry->line_buf[0] + offset;
+	     parse_next_string_field(line, line_len, &offset)) == NULL)
+		return -1;
+	if ((fields & ~(SC_MOUNTINFO_ROOT | SC_MOUNTINFO_MOUNT_OPTS)) == 0)
+		return 1;
+	entry->optional_fields = &line[offset];
 	// NOTE: This ensures that optional_fields is never NULL. If this changes,
 	// must adjust all callers of parse_mountinfo_entry() accordingly.
 	for (int field_num = 0;; ++field_num) {
-		char *opt_field = parse_next_string_field(entry, line, &offset);
+		char *opt_field =
+		    parse_next_string_field(line, line_len, &offset);
 		if (opt_field == NULL)
-			goto fail;
+			return -1;
 		if (strcmp(opt_field, "-") == 0) {
 			opt_field[0] = 0;
 			break;
@@ -313,19 +623,73 @@ static sc_mountinfo_entry *sc_parse_mountinfo_entry(const char *line)
 			opt_field[-1] = ' ';
 		}
 	}
+	if ((fields & (SC_MOUNTINFO_FS_TYPE | SC_MOUNTINFO_MOUNT_SOURCE |
+		       SC_MOUNTINFO_SUPER_OPTS)) == 0)
+		return 1;
 	if ((entry->fs_type =
-	     parse_next_string_field(entry, line, &offset)) == NULL)
-		goto fail;
+	     parse_next_string_field(line, line_len, &offset)) == NULL)
+		return -1;
+	if ((fields & (SC_MOUNTINFO_MOUNT_SOURCE | SC_MOUNTINFO_SUPER_OPTS)) ==
+	    0)
+		return 1;
 	if ((entry->mount_source =
-	     parse_next_string_field(entry, line, &offset)) == NULL)
-		goto fail;
+	     parse_next_string_field(line, line_len, &offset)) == NULL)
+		return -1;
+	if ((fields & SC_MOUNTINFO_SUPER_OPTS) == 0)
+		return 1;
 	if ((entry->super_opts =
-	     parse_last_string_field(entry, line, &offset)) == NULL)
-		goto fail;
-	return entry;
- fail:
-	free(entry);
-	return NULL;
+	     parse_last_string_field(line, line_len, &offset)) == NULL)
+		return -1;
+	return 1;
+}
+
+static bool sc_parse_mountinfo_line(char *line, sc_mountinfo_entry *entry)
+{
+	return sc_parse_mountinfo_line_ex(line, entry, SC_MOUNTINFO_ALL_FIELDS,
+					  NULL, NULL) == 1;
+}
+
+int sc_query_mountinfo(const char *fname, unsigned fields,
+		       sc_mountinfo_match_fn match,
+		       sc_mountinfo_visit_fn visit, void *data)
+{
+	if (fname == NULL) {
+		int res = sc_query_mountinfo_statmount(fields, match, visit,
+						       data);
+		if (res == 0 || errno != ENOSYS) {
+			return res;
+		}
+		fname = "/proc/self/mountinfo";
+	}
+	// The file is read a line at a time, so that stopping the query early
+	// also stops reading the rest of the table.
+	FILE *f SC_CLEANUP(sc_cleanup_file) = fopen(fname, "re");
+	if (f == NULL) {
+		return -1;
+	}
+	char *line SC_CLEANUP(sc_cleanup_string) = NULL;
+	size_t line_size = 0;
+	ssize_t line_len;
+	while ((line_len = getline(&line, &line_size, f)) != -1) {
+		if (line_len > 0 && line[line_len - 1] == '\n') {
+			line[line_len - 1] = '\0';
+		}
+		sc_mountinfo_entry entry = { 0 };
+		int res =
+		    sc_parse_mountinfo_line_ex(line, &entry, fields, match,
+					       data);
+		if (res < 0) {
+			errno = EINVAL;
+			return -1;
+		}
+		if (res > 0 && !visit(&entry, data)) {
+			return 0;
+		}
+	}
+	if (ferror(f)) {
+		return -1;
+	}
+	return 0;
 }
 
 void sc_cleanup_mountinfo(sc_mountinfo **ptr)
@@ -336,13 +700,72 @@ void sc_cleanup_mountinfo(sc_mountinfo **ptr)
 	}
 }
 
-static void sc_free_mountinfo(sc_mountinfo *info)
+/**
+ * Process-wide snapshot of the mount table.
+ *
+ * The mountinfo file is kept open to be polled for changes. Since an open
+ * mountinfo file keeps describing the mount namespace and root directory it
+ * was opened in, both are recorded as well. Polling consumes the change
+ * notification of the open file, which a forked child would share, so the
+ * snapshot is also tied to the process that took it.
+ **/
+static struct {
+	sc_mountinfo *info;
+	int fd;
+	pid_t pid;
+	dev_t ns_dev, root_dev;
+	ino_t ns_ino, root_ino;
+} sc_snapshot = {.fd = -1 };
+
+void sc_invalidate_mountinfo_snapshot(void)
+{
+	sc_cleanup_mountinfo(&sc_snapshot.info);
+	sc_cleanup_close(&sc_snapshot.fd);
+}
+
+sc_mountinfo *sc_mountinfo_snapshot(void)
 {
-	sc_mountinfo_entry *entry, *next;
-	for (entry = info->first; entry != NULL; entry = next) {
-		next = entry->next;
-		sc_free_mountinfo_entry(entry);
+	struct stat ns_st, root_st;
+	// Without /proc the snapshot cannot be checked for changes, it is then
+	// retrieved each time.
+	bool reusable = stat("/proc/self/ns/mnt", &ns_st) == 0
+	    && stat("/", &root_st) == 0;
+	pid_t pid = getpid();
+	if (sc_snapshot.info != NULL && sc_snapshot.fd >= 0 && reusable
+	    && sc_snapshot.pid == pid && sc_snapshot.ns_dev == ns_st.st_dev
+	    && sc_snapshot.ns_ino == ns_st.st_ino
+	    && sc_snapshot.root_dev == root_st.st_dev
+	    && sc_snapshot.root_ino == root_st.st_ino) {
+		struct pollfd pfd = {.fd = sc_snapshot.fd,.events = POLLPRI };
+		if (poll(&pfd, 1, 0) == 0) {
+			return sc_snapshot.info;
+		}
+	}
+	sc_invalidate_mountinfo_snapshot();
+	if (reusable) {
+		// The file is opened before the table is retrieved so that no
+		// change made in between goes unnoticed.
+		sc_snapshot.fd = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+		sc_snapshot.pid = pid;
+		sc_snapshot.ns_dev = ns_st.st_dev;
+		sc_snapshot.ns_ino = ns_st.st_ino;
+		sc_snapshot.root_dev = root_st.st_dev;
+		sc_snapshot.root_ino = root_st.st_ino;
 	}
+	sc_snapshot.info = sc_parse_mountinfo(NULL);
+	if (sc_snapshot.info == NULL) {
+		int saved_errno = errno;
+		sc_invalidate_mountinfo_snapshot();
+		errno = saved_errno;
+	}
+	return sc_snapshot.info;
+}
+
+static void sc_free_mountinfo(sc_mountinfo *info)
+{
+	free(info->buckets);
+	free(info->entries);
+	free(info->buf);
 	free(info);
 }
 
@@ -350,3 +773,571 @@ static void sc_free_mountinfo_entry(sc_mountinfo_entry *entry)
 {
 	free(entry);
 }
+
+void sc_cleanup_mountinfo_entry(sc_mountinfo_entry **ptr)
+{
+	if (*ptr != NULL) {
+		sc_free_mountinfo_entry(*ptr);
+		*ptr = NULL;
+	}
+}
+
+// Copy a text field to the storage pointed to by dst and advance dst past it.
+static char *sc_copy_mountinfo_field(char **dst, const char *field)
+{
+	if (field == NULL) {
+		return NULL;
+	}
+	size_t len = strlen(field) + 1;
+	char *copy = memcpy(*dst, field, len);
+	*dst += len;
+	return copy;
+}
+
+sc_mountinfo_entry *sc_dup_mountinfo_entry(const sc_mountinfo_entry *entry)
+{
+	const char *fields[] = {
+		entry->root, entry->mount_dir, entry->mount_opts,
+		entry->optional_fields, entry->fs_type, entry->mount_source,
+		entry->super_opts,
+	};
+	size_t size = 0;
+	for (size_t i = 0; i < sizeof fields / sizeof *fields; i++) {
+		if (fields[i] != NULL) {
+			size += strlen(fields[i]) + 1;
+		}
+	}
+	// NOTE: the text fields are stored right after the entry, in the same
+	// allocation.
+	sc_mountinfo_entry *copy = calloc(1, sizeof *copy + size);
+	if (copy == NULL) {
+		return NULL;
+	}
+	char *p = (char *)(copy + 1);
+	copy->mount_id = entry->mount_id;
+	copy->parent_id = entry->parent_id;
+	copy->dev_major = entry->dev_major;
+	copy->dev_minor = entry->dev_minor;
+	copy->root = sc_copy_mountinfo_field(&p, entry->root);
+	copy->mount_dir = sc_copy_mountinfo_field(&p, entry->mount_dir);
+	copy->mount_opts = sc_copy_mountinfo_field(&p, entry->mount_opts);
+	copy->optional_fields =
+	    sc_copy_mountinfo_field(&p, entry->optional_fields);
+	copy->fs_type = sc_copy_mountinfo_field(&p, entry->fs_type);
+	copy->mount_source = sc_copy_mountinfo_field(&p, entry->mount_source);
+	copy->super_opts = sc_copy_mountinfo_field(&p, entry->super_opts);
+	return copy;
+}
+
+/* Support for listmount(2) and statmount(2), available since Linux 6.8.
+ *
+ * The definitions below mirror include/uapi/linux/mount.h, which older
+ * system headers do not provide. The system call numbers are shared by all
+ * the architectures using the generic system call table. */
+#ifndef __NR_statmount
+#define __NR_statmount 457
+#endif
+#ifndef __NR_listmount
+#define __NR_listmount 458
+#endif
+
+#define SC_STATMOUNT_SB_BASIC 0x00000001U
+#define SC_STATMOUNT_MNT_BASIC 0x00000002U
+#define SC_STATMOUNT_PROPAGATE_FROM 0x00000004U
+#define SC_STATMOUNT_MNT_ROOT 0x00000008U
+#define SC_STATMOUNT_MNT_POINT 0x00000010U
+#define SC_STATMOUNT_FS_TYPE 0x00000020U
+#define SC_STATMOUNT_MNT_OPTS 0x00000080U
+#define SC_STATMOUNT_FS_SUBTYPE 0x00000100U
+#define SC_STATMOUNT_SB_SOURCE 0x00000200U
+#define SC_STATMOUNT_SUPPORTED_MASK 0x00001000U
+
+/* Everything needed to describe a mount the way mountinfo does. */
+#define SC_STATMOUNT_REQUIRED (SC_STATMOUNT_SB_BASIC | SC_STATMOUNT_MNT_BASIC \
+	| SC_STATMOUNT_PROPAGATE_FROM | SC_STATMOUNT_MNT_ROOT \
+	| SC_STATMOUNT_MNT_POINT | SC_STATMOUNT_FS_TYPE | SC_STATMOUNT_MNT_OPTS \
+	| SC_STATMOUNT_FS_SUBTYPE | SC_STATMOUNT_SB_SOURCE)
+
+#define SC_LSMT_ROOT 0xffffffffffffffffULL
+
+#define SC_MOUNT_ATTR_RDONLY 0x00000001
+#define SC_MOUNT_ATTR_NOSUID 0x00000002
+#define SC_MOUNT_ATTR_NODEV 0x00000004
+#define SC_MOUNT_ATTR_NOEXEC 0x00000008
+#define SC_MOUNT_ATTR__ATIME 0x00000070
+#define SC_MOUNT_ATTR_RELATIME 0x00000000
+#define SC_MOUNT_ATTR_NOATIME 0x00000010
+#define SC_MOUNT_ATTR_NODIRATIME 0x00000080
+#define SC_MOUNT_ATTR_IDMAP 0x00100000
+#define SC_MOUNT_ATTR_NOSYMFOLLOW 0x00200000
+
+struct sc_mnt_id_req {
+	uint32_t size;
+	uint32_t spare;
+	uint64_t mnt_id;
+	uint64_t param;
+};
+
+struct sc_statmount {
+	uint32_t size;
+	uint32_t mnt_opts;
+	uint64_t mask;
+	uint32_t sb_dev_major;
+	uint32_t sb_dev_minor;
+	uint64_t sb_magic;
+	uint32_t sb_flags;
+	uint32_t fs_type;
+	uint64_t mnt_id;
+	uint64_t mnt_parent_id;
+	uint32_t mnt_id_old;
+	uint32_t mnt_parent_id_old;
+	uint64_t mnt_attr;
+	uint64_t mnt_propagation;
+	uint64_t mnt_peer_group;
+	uint64_t mnt_master;
+	uint64_t propagate_from;
+	uint32_t mnt_root;
+	uint32_t mnt_point;
+	uint64_t mnt_ns_id;
+	uint32_t fs_subtype;
+	uint32_t sb_source;
+	uint32_t opt_num;
+	uint32_t opt_array;
+	uint32_t opt_sec_num;
+	uint32_t opt_sec_array;
+	uint64_t supported_mask;
+	uint64_t spare2[45];
+	char str[];
+};
+
+_Static_assert(sizeof(struct sc_statmount) == 512,
+	       "struct sc_statmount must match the kernel definition");
+
+/**
+ * State of the statmount backend.
+ *
+ * The backend is probed once per process, kernels that lack the system calls
+ * or any of the attributes needed to describe a mount fall back to parsing
+ * the text of /proc/self/mountinfo.
+ **/
+static enum {
+	SC_STATMOUNT_UNKNOWN,
+	SC_STATMOUNT_AVAILABLE,
+	SC_STATMOUNT_UNAVAILABLE,
+} sc_statmount_state = SC_STATMOUNT_UNKNOWN;
+
+/**
+ * Buffers reused across statmount calls made by one query.
+ *
+ * The text buffer holds the fields of the current entry that have no direct
+ * counterpart in struct statmount and must be formatted.
+ **/
+typedef struct sc_statmount_ctx {
+	struct sc_statmount *sm;
+	size_t sm_size;
+	char *text;
+	size_t text_size;
+} sc_statmount_ctx;
+
+static void sc_cleanup_statmount_ctx(sc_statmount_ctx *ctx)
+{
+	free(ctx->sm);
+	free(ctx->text);
+	ctx->sm = NULL;
+	ctx->text = NULL;
+}
+
+static ssize_t sc_listmount(uint64_t last_mnt_id, uint64_t *mnt_ids,
+			    size_t nr_mnt_ids)
+{
+	struct sc_mnt_id_req req = {
+		.size = sizeof req,
+		.mnt_id = SC_LSMT_ROOT,
+		.param = last_mnt_id,
+	};
+	return syscall(__NR_listmount, &req, mnt_ids, nr_mnt_ids, 0);
+}
+
+static int sc_statmount(sc_statmount_ctx *ctx, uint64_t mnt_id, uint64_t mask)
+{
+	struct sc_mnt_id_req req = {
+		.size = sizeof req,
+		.mnt_id = mnt_id,
+		.param = mask,
+	};
+	for (;;) {
+		if (ctx->sm != NULL
+		    && syscall(__NR_statmount, &req, ctx->sm, ctx->sm_size,
+			       0) == 0) {
+			return 0;
+		}
+		if (ctx->sm != NULL && errno != EOVERFLOW) {
+			return -1;
+		}
+		// The strings did not fit, grow the buffer and try again.
+		size_t size = ctx->sm_size != 0 ? ctx->sm_size * 2 :
+		    sizeof *ctx->sm + PATH_MAX;
+		struct sc_statmount *sm = realloc(ctx->sm, size);
+		if (sm == NULL) {
+			return -1;
+		}
+		ctx->sm = sm;
+		ctx->sm_size = size;
+	}
+}
+
+// Return a string attribute of the mount or an empty string if the kernel
+// did not provide one.
+static const char *sc_statmount_str(const struct sc_statmount *sm,
+				    uint64_t flag, uint32_t offset)
+{
+	return (sm->mask & flag) != 0 ? sm->str + offset : "";
+}
+
+/**
+ * Check if the statmount backend can be used.
+ *
+ * The attributes of the given mount are used to find out which of them are
+ * supported by the running kernel.
+ **/
+static bool sc_statmount_available(sc_statmount_ctx *ctx, uint64_t mnt_id)
+{
+	if (sc_statmount_state == SC_STATMOUNT_UNKNOWN) {
+		sc_statmount_state = SC_STATMOUNT_UNAVAILABLE;
+		if (sc_statmount(ctx, mnt_id, SC_STATMOUNT_SUPPORTED_MASK) == 0
+		    && (ctx->sm->mask & SC_STATMOUNT_SUPPORTED_MASK) != 0
+		    && (ctx->sm->supported_mask & SC_STATMOUNT_REQUIRED) ==
+		    SC_STATMOUNT_REQUIRED) {
+			sc_statmount_state = SC_STATMOUNT_AVAILABLE;
+		}
+	}
+	return sc_statmount_state == SC_STATMOUNT_AVAILABLE;
+}
+
+static uint64_t sc_statmount_mask(unsigned fields)
+{
+	uint64_t mask = SC_STATMOUNT_SB_BASIC | SC_STATMOUNT_MNT_BASIC |
+	    SC_STATMOUNT_MNT_POINT;
+	if ((fields & SC_MOUNTINFO_ROOT) != 0) {
+		mask |= SC_STATMOUNT_MNT_ROOT;
+	}
+	if ((fields & SC_MOUNTINFO_OPTIONAL_FIELDS) != 0) {
+		mask |= SC_STATMOUNT_PROPAGATE_FROM;
+	}
+	if ((fields & SC_MOUNTINFO_FS_TYPE) != 0) {
+		mask |= SC_STATMOUNT_FS_TYPE | SC_STATMOUNT_FS_SUBTYPE;
+	}
+	if ((fields & SC_MOUNTINFO_MOUNT_SOURCE) != 0) {
+		mask |= SC_STATMOUNT_SB_SOURCE;
+	}
+	if ((fields & SC_MOUNTINFO_SUPER_OPTS) != 0) {
+		mask |= SC_STATMOUNT_MNT_OPTS;
+	}
+	return mask;
+}
+
+/**
+ * Describe the mount retrieved by the last statmount call as a mountinfo
+ * entry.
+ *
+ * Fields are formatted the same way the kernel formats them in mountinfo,
+ * after unescaping. The text fields point into the buffers of the context.
+ **/
+static int sc_statmount_to_entry(sc_statmount_ctx *ctx, unsigned fields,
+				 sc_mountinfo_entry *entry)
+{
+	struct sc_statmount *sm = ctx->sm;
+	const char *fs_type =
+	    sc_statmount_str(sm, SC_STATMOUNT_FS_TYPE, sm->fs_type);
+	const char *fs_subtype =
+	    sc_statmount_str(sm, SC_STATMOUNT_FS_SUBTYPE, sm->fs_subtype);
+	char *mnt_opts = sm->str + sm->mnt_opts;
+	if ((sm->mask & SC_STATMOUNT_MNT_OPTS) == 0) {
+		mnt_opts = "";
+	}
+	// The fixed size fields need well under 256 bytes.
+	size_t size = 256 + strlen(fs_type) + strlen(fs_subtype) +
+	    strlen(mnt_opts);
+	if (ctx->text_size < size) {
+		char *text = realloc(ctx->text, size);
+		if (text == NULL) {
+			return -1;
+		}
+		ctx->text = text;
+		ctx->text_size = size;
+	}
+	char *p = ctx->text;
+
+	entry->mount_id = sm->mnt_id_old;
+	entry->parent_id = sm->mnt_parent_id_old;
+	entry->dev_major = sm->sb_dev_major;
+	entry->dev_minor = sm->sb_dev_minor;
+	entry->mount_dir = sm->str + sm->mnt_point;
+	entry->next = NULL;
+	if ((fields & SC_MOUNTINFO_ROOT) != 0) {
+		entry->root = (char *)sc_statmount_str(sm, SC_STATMOUNT_MNT_ROOT,
+						       sm->mnt_root);
+	}
+	if ((fields & SC_MOUNTINFO_MOUNT_OPTS) != 0) {
+		// See show_mnt_opts() in fs/proc_namespace.c
+		uint64_t attr = sm->mnt_attr;
+		entry->mount_opts = p;
+		p += sprintf(p, "%s%s%s%s%s%s%s%s%s",
+			     (attr & SC_MOUNT_ATTR_RDONLY) ? "ro" : "rw",
+			     (attr & SC_MOUNT_ATTR_NOSUID) ? ",nosuid" : "",
+			     (attr & SC_MOUNT_ATTR_NODEV) ? ",nodev" : "",
+			     (attr & SC_MOUNT_ATTR_NOEXEC) ? ",noexec" : "",
+			     (attr & SC_MOUNT_ATTR__ATIME) ==
+			     SC_MOUNT_ATTR_NOATIME ? ",noatime" : "",
+			     (attr & SC_MOUNT_ATTR_NODIRATIME) ? ",nodiratime" :
+			     "",
+			     (attr & SC_MOUNT_ATTR__ATIME) ==
+			     SC_MOUNT_ATTR_RELATIME ? ",relatime" : "",
+			     (attr & SC_MOUNT_ATTR_NOSYMFOLLOW) ?
+			     ",nosymfollow" : "",
+			     (attr & SC_MOUNT_ATTR_IDMAP) ? ",idmapped" : "") +
+		    1;
+	}
+	if ((fields & SC_MOUNTINFO_OPTIONAL_FIELDS) != 0) {
+		// See show_mountinfo() in fs/proc_namespace.c
+		entry->optional_fields = p;
+		*p = '\0';
+		char *q = p;
+		if ((sm->mnt_propagation & MS_SHARED) != 0) {
+			q += sprintf(q, " shared:%" PRIu64, sm->mnt_peer_group);
+		}
+		if ((sm->mnt_propagation & MS_SLAVE) != 0) {
+			q += sprintf(q, " master:%" PRIu64, sm->mnt_master);
+			if (sm->propagate_from != 0
+			    && sm->propagate_from != sm->mnt_master) {
+				q += sprintf(q, " propagate_from:%" PRIu64,
+					     sm->propagate_from);
+			}
+		}
+		if ((sm->mnt_propagation & MS_UNBINDABLE) != 0) {
+			q += sprintf(q, " unbindable");
+		}
+		if (q != p) {
+			// Skip the leading space.
+			memmove(p, p + 1, q - p);
+			q--;
+		}
+		p = q + 1;
+	}
+	if ((fields & SC_MOUNTINFO_FS_TYPE) != 0) {
+		entry->fs_type = p;
+		p += sprintf(p, "%s%s%s", fs_type, fs_subtype[0] ? "." : "",
+			     fs_subtype) + 1;
+	}
+	if ((fields & SC_MOUNTINFO_MOUNT_SOURCE) != 0) {
+		entry->mount_source =
+		    (char *)sc_statmount_str(sm, SC_STATMOUNT_SB_SOURCE,
+					     sm->sb_source);
+	}
+	if ((fields & SC_MOUNTINFO_SUPER_OPTS) != 0) {
+		// See show_sb_opts() in fs/proc_namespace.c. Unlike the other
+		// strings, file system options are escaped the same way as in
+		// mountinfo.
+		size_t offset = 0;
+		char *opts = parse_last_string_field(mnt_opts, strlen(mnt_opts),
+						     &offset);
+		entry->super_opts = p;
+		p += sprintf(p, "%s%s%s%s%s%s",
+			     (sm->sb_flags & MS_RDONLY) ? "ro" : "rw",
+			     (sm->sb_flags & MS_SYNCHRONOUS) ? ",sync" : "",
+			     (sm->sb_flags & MS_DIRSYNC) ? ",dirsync" : "",
+			     (sm->sb_flags & MS_LAZYTIME) ? ",lazytime" : "",
+			     opts != NULL ? "," : "",
+			     opts != NULL ? opts : "") + 1;
+	}
+	return 0;
+}
+
+/**
+ * Query the mount table of the current process with statmount(2).
+ *
+ * Mounts are listed in the order of their unique identifiers, which are
+ * allocated in increasing order as mounts are created. The mountinfo file is
+ * not guaranteed to list them in the same order, for instance after a mount
+ * is moved, so the users of the table must rely on the mount tree, which is
+ * built from the parent identifiers, rather than on the position of entries.
+ * Only the mount point is retrieved for mounts that are then rejected by the
+ * match function.
+ *
+ * The return value is -1 with errno set to ENOSYS if the backend cannot be
+ * used and nothing was visited.
+ **/
+static int sc_query_mountinfo_statmount(unsigned fields,
+					sc_mountinfo_match_fn match,
+					sc_mountinfo_visit_fn visit,
+					void *data)
+{
+	if (sc_statmount_state == SC_STATMOUNT_UNAVAILABLE) {
+		errno = ENOSYS;
+		return -1;
+	}
+	sc_statmount_ctx ctx SC_CLEANUP(sc_cleanup_statmount_ctx) = { 0 };
+	uint64_t mnt_ids[256];
+	uint64_t last_mnt_id = 0;
+	uint64_t mask = sc_statmount_mask(fields);
+	for (;;) {
+		ssize_t n =
+		    sc_listmount(last_mnt_id, mnt_ids,
+				 sizeof mnt_ids / sizeof *mnt_ids);
+		if (n < 0 && sc_statmount_state == SC_STATMOUNT_UNKNOWN) {
+			sc_statmount_state = SC_STATMOUNT_UNAVAILABLE;
+			errno = ENOSYS;
+		}
+		if (n <= 0) {
+			return n < 0 ? -1 : 0;
+		}
+		if (!sc_statmount_available(&ctx, mnt_ids[0])) {
+			errno = ENOSYS;
+			return -1;
+		}
+		for (ssize_t i = 0; i < n; i++) {
+			if (match != NULL) {
+				if (sc_statmount(&ctx, mnt_ids[i],
+						 SC_STATMOUNT_MNT_POINT) < 0) {
+					if (errno == ENOENT) {
+						// The mount is already gone.
+						continue;
+					}
+					return -1;
+				}
+				if (!match(ctx.sm->str + ctx.sm->mnt_point,
+					   data)) {
+					continue;
+				}
+			}
+			if (sc_statmount(&ctx, mnt_ids[i], mask) < 0) {
+				if (errno == ENOENT) {
+					continue;
+				}
+				return -1;
+			}
+			// Mounts outside of the root directory of the process
+			// have no mount point and are not in mountinfo either.
+			if (ctx.sm->str[ctx.sm->mnt_point] == '\0') {
+				continue;
+			}
+			sc_mountinfo_entry entry = { 0 };
+			if (sc_statmount_to_entry(&ctx, fields, &entry) < 0) {
+				return -1;
+			}
+			if (!visit(&entry, data)) {
+				return 0;
+			}
+		}
+		last_mnt_id = mnt_ids[n - 1];
+	}
+}
+
+/**
+ * Table of mounts built by sc_parse_mountinfo_statmount().
+ *
+ * The text fields are stored in a buffer that grows as entries are added so
+ * they are recorded as offsets until the table is complete.
+ **/
+typedef struct sc_statmount_table {
+	sc_mountinfo *info;
+	size_t entries_cap;
+	size_t buf_size, buf_cap;
+	size_t (*offsets)[7];
+	bool failed;
+} sc_statmount_table;
+
+static bool sc_statmount_table_add(const sc_mountinfo_entry *entry,
+				   void *data)
+{
+	sc_statmount_table *table = data;
+	sc_mountinfo *info = table->info;
+	if (info->num_entries == table->entries_cap) {
+		size_t cap = table->entries_cap ? table->entries_cap * 2 : 64;
+		sc_mountinfo_entry *entries =
+		    realloc(info->entries, cap * sizeof *entries);
+		size_t (*offsets)[7] =
+		    realloc(table->offsets, cap * sizeof *offsets);
+		if (entries != NULL) {
+			info->entries = entries;
+		}
+		if (offsets != NULL) {
+			table->offsets = offsets;
+		}
+		if (entries == NULL || offsets == NULL) {
+			table->failed = true;
+			return false;
+		}
+		table->entries_cap = cap;
+	}
+	const char *fields[7] = {
+		entry->root, entry->mount_dir, entry->mount_opts,
+		entry->optional_fields, entry->fs_type, entry->mount_source,
+		entry->super_opts,
+	};
+	size_t *offsets = table->offsets[info->num_entries];
+	for (size_t i = 0; i < 7; i++) {
+		size_t len = strlen(fields[i]) + 1;
+		if (table->buf_cap - table->buf_size < len) {
+			size_t cap = table->buf_cap ? table->buf_cap * 2 : 16384;
+			while (cap - table->buf_size < len) {
+				cap *= 2;
+			}
+			char *buf = realloc(info->buf, cap);
+			if (buf == NULL) {
+				table->failed = true;
+				return false;
+			}
+			info->buf = buf;
+			table->buf_cap = cap;
+		}
+		offsets[i] = table->buf_size;
+		memcpy(info->buf + table->buf_size, fields[i], len);
+		table->buf_size += len;
+	}
+	info->entries[info->num_entries++] = *entry;
+	return true;
+}
+
+/**
+ * Build the mount table of the current process with statmount(2).
+ *
+ * The return value is NULL with errno set to ENOSYS if the backend cannot be
+ * used.
+ **/
+static sc_mountinfo *sc_parse_mountinfo_statmount(void)
+{
+	sc_statmount_table table = { 0 };
+	table.info = calloc(1, sizeof *table.info);
+	if (table.info == NULL) {
+		return NULL;
+	}
+	sc_mountinfo *info = table.info;
+	if (sc_query_mountinfo_statmount(SC_MOUNTINFO_ALL_FIELDS, NULL,
+					 sc_statmount_table_add,
+					 &table) < 0 || table.failed) {
+		int saved_errno = table.failed ? ENOMEM : errno;
+		free(table.offsets);
+		sc_free_mountinfo(info);
+		errno = saved_errno;
+		return NULL;
+	}
+	for (size_t i = 0; i < info->num_entries; i++) {
+		sc_mountinfo_entry *entry = &info->entries[i];
+		size_t *offsets = table.offsets[i];
+		entry->root = info->buf + offsets[0];
+		entry->mount_dir = info->buf + offsets[1];
+		entry->mount_opts = info->buf + offsets[2];
+		entry->optional_fields = info->buf + offsets[3];
+		entry->fs_type = info->buf + offsets[4];
+		entry->mount_source = info->buf + offsets[5];
+		entry->super_opts = info->buf + offsets[6];
+		entry->next = i + 1 < info->num_entries ? entry + 1 : NULL;
+	}
+	free(table.offsets);
+	if (sc_index_mountinfo(info) < 0) {
+		sc_free_mountinfo(info);
+		return NULL;
+	}
+	return info;
+}
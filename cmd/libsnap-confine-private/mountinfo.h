@@ -17,6 +17,9 @@
 #ifndef SNAP_CONFINE_MOUNTINFO_H
 #define SNAP_CONFINE_MOUNTINFO_H
 
+#include <stdbool.h>
+#include <stddef.h>
+
 /**
  * Structure describing a single entry in /proc/self/sc_mountinfo
  **/
@@ -78,19 +81,64 @@ typedef struct sc_mountinfo_entry {
 
 	struct sc_mountinfo_entry *next;
 
-	// Buffer holding all of the text data above.
-	//
-	// The buffer must be the last element of the structure. It is allocated
-	// along with the structure itself and does not need to be freed
-	// separately.
-	char line_buf[0];
+	/**
+	 * The mount this entry is mounted on, as identified by parent_id.
+	 *
+	 * The pointer is NULL for mounts at the top of the tree and for mounts
+	 * whose parent is not described by the mount table, such as the root
+	 * directory of a chroot.
+	 **/
+	struct sc_mountinfo_entry *parent;
+	/**
+	 * The first mount mounted on this one, in mount table order.
+	 *
+	 * The remaining ones are reached through next_sibling.
+	 **/
+	struct sc_mountinfo_entry *first_child;
+	/**
+	 * The next mount mounted on the same parent, in mount table order.
+	 *
+	 * Mounts without a parent are siblings of each other.
+	 **/
+	struct sc_mountinfo_entry *next_sibling;
+	/**
+	 * The next entry in the same bucket of the mount point index.
+	 **/
+	struct sc_mountinfo_entry *next_in_bucket;
 } sc_mountinfo_entry;
 
 /**
  * Structure describing entire /proc/self/sc_mountinfo file
  **/
 typedef struct sc_mountinfo {
-	sc_mountinfo_entry *first;
+	/**
+	 * All the entries, in the order they appear in the file.
+	 *
+	 * The entries form a contiguous array and can be iterated over by index
+	 * or, as before, by following the next pointers.
+	 **/
+	sc_mountinfo_entry *entries;
+	size_t num_entries;
+	/**
+	 * Contents of the file, parsed in place.
+	 *
+	 * All the text fields of all the entries point into this buffer. When
+	 * the table was retrieved with statmount(2) the buffer holds just the
+	 * text fields.
+	 **/
+	char *buf;
+	/**
+	 * The first mount without a parent, see sc_mountinfo_entry.parent.
+	 **/
+	sc_mountinfo_entry *first_root;
+	/**
+	 * Hash index of the entries by mount point.
+	 *
+	 * The number of buckets is a power of two. Entries in each bucket are
+	 * chained through next_in_bucket in mount table order.
+	 **/
+	sc_mountinfo_entry **buckets;
+	size_t num_buckets;
 } sc_mountinfo;
 
 /**
@@ -98,7 +146,8 @@ typedef struct sc_mountinfo {
  *
  * The argument can be used to parse an arbitrary file.  NULL can be used to
  * implicitly parse /proc/self/sc_mountinfo, that is the mount information
- * associated with the current process.
+ * associated with the current process. In that case the information is
+ * retrieved with listmount(2) and statmount(2) when the kernel supports them.
  **/
 sc_mountinfo *sc_parse_mountinfo(const char *fname);
 
@@ -131,4 +180,163 @@ sc_mountinfo_entry *sc_first_mountinfo_entry(sc_mountinfo * info)
 sc_mountinfo_entry *sc_next_mountinfo_entry(sc_mountinfo_entry * entry)
     __attribute__((nonnull(1)));
 
+/**
+ * Find the topmost mount at the given mount point.
+ *
+ * When several mounts are stacked on top of each other at the same mount
+ * point only the topmost one is visible. The returned value is NULL if
+ * nothing is mounted there. It is bound to the lifecycle of the whole
+ * sc_mountinfo structure and should not be freed explicitly.
+ **/
+sc_mountinfo_entry *sc_find_mountinfo_entry(sc_mountinfo * info,
+					    const char *mount_dir)
+    __attribute__((nonnull(1, 2)));
+
+/**
+ * Get the first sc_mountinfo entry at the given mount point.
+ *
+ * Unlike sc_find_mountinfo_entry(), this returns the first of the mounts
+ * stacked at the mount point, in mount table order. The returned value is
+ * NULL if nothing is mounted there.
+ **/
+sc_mountinfo_entry *sc_first_mountinfo_entry_at(sc_mountinfo * info,
+						const char *mount_dir)
+    __attribute__((nonnull(1, 2)));
+
+/**
+ * Get the next sc_mountinfo entry at the same mount point.
+ *
+ * The returned value is NULL if this was the last entry at the mount point.
+ **/
+sc_mountinfo_entry *sc_next_mountinfo_entry_at(sc_mountinfo_entry * entry)
+    __attribute__((nonnull(1)));
+
+/**
+ * Get the next sc_mountinfo entry of the subtree rooted at the given entry.
+ *
+ * The subtree consists of the top entry and everything mounted on it,
+ * directly or not, and is traversed in pre-order: each mount is visited
+ * before the mounts mounted on it. Iteration starts at the top entry itself
+ * and the returned value is NULL once the whole subtree was visited.
+ **/
+sc_mountinfo_entry *sc_next_subtree_mountinfo_entry(const sc_mountinfo_entry *
+						    top,
+						    sc_mountinfo_entry * entry)
+    __attribute__((nonnull(1, 2)));
+
+/**
+ * Get the first sc_mountinfo entry of a post-order traversal.
+ *
+ * A post-order traversal visits the mounts mounted on a given mount before the
+ * mount itself, which is the order in which the mounts can be unmounted. The
+ * traversal covers the subtree rooted at the top entry or, if top is NULL,
+ * the whole mount table.
+ **/
+sc_mountinfo_entry *sc_first_postorder_mountinfo_entry(sc_mountinfo * info,
+						       sc_mountinfo_entry * top)
+    __attribute__((nonnull(1)));
+
+/**
+ * Get the next sc_mountinfo entry of a post-order traversal.
+ *
+ * The top entry must be the same as the one given to
+ * sc_first_postorder_mountinfo_entry(). The returned value is NULL once the
+ * traversal is complete.
+ **/
+sc_mountinfo_entry *sc_next_postorder_mountinfo_entry(const sc_mountinfo_entry
+						      * top,
+						      sc_mountinfo_entry *
+						      entry)
+    __attribute__((nonnull(2)));
+
+/**
+ * Optional text fields of a mountinfo entry.
+ *
+ * The mount ID, parent ID, device numbers and mount point are always parsed,
+ * the remaining fields are only parsed when requested.
+ **/
+typedef enum sc_mountinfo_field {
+	SC_MOUNTINFO_ROOT = 1 << 0,
+	SC_MOUNTINFO_MOUNT_OPTS = 1 << 1,
+	SC_MOUNTINFO_OPTIONAL_FIELDS = 1 << 2,
+	SC_MOUNTINFO_FS_TYPE = 1 << 3,
+	SC_MOUNTINFO_MOUNT_SOURCE = 1 << 4,
+	SC_MOUNTINFO_SUPER_OPTS = 1 << 5,
+} sc_mountinfo_field;
+
+#define SC_MOUNTINFO_ALL_FIELDS ((1 << 6) - 1)
+
+/**
+ * Function deciding if the entry with the given mount point is interesting.
+ **/
+typedef bool (*sc_mountinfo_match_fn)(const char *mount_dir, void *data);
+
+/**
+ * Function called for each interesting entry.
+ *
+ * The entry, including all its text fields, is only valid for the duration
+ * of the call. Fields that were not requested may be NULL. The return value
+ * is false to stop the query early.
+ **/
+typedef bool (*sc_mountinfo_visit_fn)(const sc_mountinfo_entry * entry,
+				      void *data);
+
+/**
+ * Get a snapshot of the mount table of the current process.
+ *
+ * The snapshot is shared by all the callers in the process and is only
+ * retrieved again when the mount table may have changed. The kernel flags
+ * changes to the mount namespace with POLLPRI and POLLERR on an open mountinfo
+ * file, which is polled on each call. Switching to another mount namespace
+ * or root directory is detected separately.
+ *
+ * The returned value is NULL, with errno set, on failure. It is owned by the
+ * snapshot and must not be freed. It is valid until the next call to either
+ * this function or sc_invalidate_mountinfo_snapshot().
+ **/
+sc_mountinfo *sc_mountinfo_snapshot(void);
+
+/**
+ * Discard the snapshot of the mount table of the current process.
+ **/
+void sc_invalidate_mountinfo_snapshot(void);
+
+/**
+ * Query a file in sc_mountinfo syntax without building the whole table.
+ *
+ * The file is read and scanned a line at a time, so a query stopped early by
+ * the visit function does not read the rest of the file. Only the mount point
+ * of each line is parsed and passed to the match function, NULL matches every
+ * line. The matching lines are then parsed up to the last of the requested
+ * fields, a bitwise or of sc_mountinfo_field values, and passed to the visit
+ * function.
+ *
+ * As with sc_parse_mountinfo(), NULL stands for /proc/self/mountinfo, which
+ * is then queried with statmount(2) when possible. Only the mount point is
+ * retrieved for mounts rejected by the match function. The return value is 0
+ * on success and -1, with errno set, on failure.
+ **/
+int sc_query_mountinfo(const char *fname, unsigned fields,
+		       sc_mountinfo_match_fn match,
+		       sc_mountinfo_visit_fn visit, void *data)
+    __attribute__((nonnull(4)));
+
+/**
+ * Copy a sc_mountinfo entry into a separately allocated entry.
+ *
+ * This is useful for keeping an entry seen by sc_query_mountinfo(). The copy
+ * must be freed with sc_cleanup_mountinfo_entry().
+ **/
+sc_mountinfo_entry *sc_dup_mountinfo_entry(const sc_mountinfo_entry * entry)
+    __attribute__((nonnull(1)));
+
+/**
+ * Free a separately allocated sc_mountinfo entry.
+ *
+ * This function is designed to be used with __attribute__((cleanup)) so it
+ * takes a pointer to the freed object (which is also a pointer).
+ **/
+void sc_cleanup_mountinfo_entry(sc_mountinfo_entry ** ptr)
+    __attribute__((nonnull(1)));
+
 #endif
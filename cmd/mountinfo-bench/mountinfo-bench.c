@@ -0,0 +1,467 @@
+/*
+ * Copyright (C) 2024 Canonical Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/**
+ * Benchmark and fuzz target of the mountinfo parser.
+ *
+ * When built with MOUNTINFO_FUZZER defined, and linked with libFuzzer (or
+ * with AFL++ in its libFuzzer compatible mode), this is just the fuzz target.
+ *
+ * Otherwise the program runs on its own:
+ *
+ * mountinfo-bench
+ *     parses synthetic mount tables of 100, 1k, 10k and 50k entries and
+ *     reports parse and query time, peak heap usage and allocations per
+ *     entry, then feeds mutated tables to the fuzz target as a regression
+ *     test.
+ * mountinfo-bench --fuzz-regression
+ *     only runs the regression test, as done by make check.
+ * mountinfo-bench FILE...
+ *     feeds the given files, such as a fuzzing corpus, to the fuzz target.
+ **/
+
+#include <errno.h>
+#include <malloc.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../libsnap-confine-private/mountinfo.h"
+
+// The fuzz target writes its input to an unlinked scratch file, which is
+// then read through its /proc/self/fd path.
+static char scratch_path[64];
+static int scratch_fd = -1;
+
+static void write_scratch_file(const void *data, size_t size)
+{
+	if (scratch_fd < 0) {
+		char tmpl[] = "/tmp/mountinfo-bench.XXXXXX";
+		scratch_fd = mkstemp(tmpl);
+		if (scratch_fd < 0) {
+			perror("cannot create scratch file");
+			abort();
+		}
+		unlink(tmpl);
+		snprintf(scratch_path, sizeof scratch_path, "/proc/self/fd/%d",
+			 scratch_fd);
+	}
+	if (ftruncate(scratch_fd, 0) < 0
+	    || pwrite(scratch_fd, data, size, 0) != (ssize_t) size) {
+		perror("cannot write scratch file");
+		abort();
+	}
+}
+
+static bool count_entry(const sc_mountinfo_entry *entry, void *data)
+{
+	size_t *count = data;
+	(*count)++;
+	return true;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	write_scratch_file(data, size);
+
+	sc_mountinfo *info = sc_parse_mountinfo(scratch_path);
+	size_t num_visited = 0;
+	int query_res = sc_query_mountinfo(scratch_path,
+					   SC_MOUNTINFO_ALL_FIELDS, NULL,
+					   count_entry, &num_visited);
+	// Both ways of reading the file agree on whether it is valid.
+	if ((info != NULL) != (query_res == 0)) {
+		abort();
+	}
+	if (info == NULL) {
+		return 0;
+	}
+	if (num_visited != info->num_entries) {
+		abort();
+	}
+	for (size_t i = 0; i < info->num_entries; i++) {
+		sc_mountinfo_entry *entry = &info->entries[i];
+		if (entry->root == NULL || entry->mount_dir == NULL
+		    || entry->mount_opts == NULL
+		    || entry->optional_fields == NULL
+		    || entry->fs_type == NULL || entry->mount_source == NULL
+		    || entry->super_opts == NULL) {
+			abort();
+		}
+		sc_mountinfo_entry *found =
+		    sc_find_mountinfo_entry(info, entry->mount_dir);
+		if (found == NULL
+		    || strcmp(found->mount_dir, entry->mount_dir) != 0) {
+			abort();
+		}
+	}
+	// Every entry is visited exactly once, after everything mounted on it.
+	size_t num_postorder = 0;
+	for (sc_mountinfo_entry * entry =
+	     sc_first_postorder_mountinfo_entry(info, NULL); entry != NULL;
+	     entry = sc_next_postorder_mountinfo_entry(NULL, entry)) {
+		for (sc_mountinfo_entry * child = entry->first_child;
+		     child != NULL; child = child->next_sibling) {
+			if (child->parent != entry) {
+				abort();
+			}
+		}
+		if (++num_postorder > info->num_entries) {
+			abort();
+		}
+	}
+	if (num_postorder != info->num_entries) {
+		abort();
+	}
+	sc_cleanup_mountinfo(&info);
+	return 0;
+}
+
+#ifndef MOUNTINFO_FUZZER
+
+// Allocation statistics, gathered by wrapping the allocator at link time.
+static struct {
+	size_t num_allocs;
+	size_t live_bytes;
+	size_t peak_bytes;
+} heap;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+void *__wrap_malloc(size_t size);
+void *__wrap_calloc(size_t nmemb, size_t size);
+void *__wrap_realloc(void *ptr, size_t size);
+void __wrap_free(void *ptr);
+
+static void *count_alloc(void *ptr)
+{
+	if (ptr != NULL) {
+		heap.num_allocs++;
+		heap.live_bytes += malloc_usable_size(ptr);
+		if (heap.live_bytes > heap.peak_bytes) {
+			heap.peak_bytes = heap.live_bytes;
+		}
+	}
+	return ptr;
+}
+
+void *__wrap_malloc(size_t size)
+{
+	return count_alloc(__real_malloc(size));
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	return count_alloc(__real_calloc(nmemb, size));
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	size_t old_size = ptr != NULL ? malloc_usable_size(ptr) : 0;
+	void *new_ptr = __real_realloc(ptr, size);
+	if (new_ptr != NULL) {
+		heap.live_bytes -= old_size;
+		count_alloc(new_ptr);
+	}
+	return new_ptr;
+}
+
+void __wrap_free(void *ptr)
+{
+	if (ptr != NULL) {
+		heap.live_bytes -= malloc_usable_size(ptr);
+	}
+	__real_free(ptr);
+}
+
+// Minimal growable buffer for synthetic mount tables.
+typedef struct text {
+	char *buf;
+	size_t len, cap;
+} text;
+
+static void text_printf(text *t, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void text_printf(text *t, const char *fmt, ...)
+{
+	for (;;) {
+		va_list ap;
+		va_start(ap, fmt);
+		int n = vsnprintf(t->buf + t->len, t->cap - t->len, fmt, ap);
+		va_end(ap);
+		if (n < 0) {
+			abort();
+		}
+		if ((size_t)n < t->cap - t->len) {
+			t->len += n;
+			return;
+		}
+		t->cap = t->cap ? t->cap * 2 : 4096;
+		while (t->cap - t->len <= (size_t)n) {
+			t->cap *= 2;
+		}
+		t->buf = realloc(t->buf, t->cap);
+		if (t->buf == NULL) {
+			abort();
+		}
+	}
+}
+
+/**
+ * Generate a mount table with the given number of entries.
+ *
+ * Mounts form a tree a few levels deep, every seventh mount point has escaped
+ * spaces and every hundredth mount has a very long list of optional fields.
+ * If malformed is true the last line is cut short.
+ **/
+static void generate_table(text *t, int num_entries, bool malformed)
+{
+	t->len = 0;
+	text_printf(t, "1 0 8:1 / / rw,relatime shared:1 - ext4 /dev/sda1 "
+		    "rw,errors=remount-ro\n");
+	for (int i = 2; i <= num_entries; i++) {
+		int parent = i / 4 > 0 ? i / 4 : 1;
+		text_printf(t, "%d %d 7:%d / /snap/app%s%d/x%d ro,nodev,relatime",
+			    i, parent, i, i % 7 == 0 ? "\\040with\\040space" :
+			    "", i, parent);
+		text_printf(t, " shared:%d", i);
+		if (i % 100 == 0) {
+			for (int j = 0; j < 200; j++) {
+				text_printf(t, " master:%d", j);
+			}
+		}
+		if (malformed && i == num_entries) {
+			text_printf(t, "\n");
+			break;
+		}
+		text_printf(t, " - squashfs /dev/loop%d ro,errors=continue\n",
+			    i);
+	}
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool match_last(const char *mount_dir, void *data)
+{
+	return strcmp(mount_dir, data) == 0;
+}
+
+static bool stop_query(const sc_mountinfo_entry *entry, void *data)
+{
+	return false;
+}
+
+static void benchmark(void)
+{
+	const int sizes[] = { 100, 1000, 10000, 50000 };
+	text t = { 0 };
+	printf("%8s %12s %12s %12s %12s %14s\n", "entries", "parse-ms",
+	       "reject-ms", "query-ms", "peak-KiB", "allocs/entry");
+	for (size_t s = 0; s < sizeof sizes / sizeof *sizes; s++) {
+		int n = sizes[s];
+		int reps = 1000000 / n;
+		if (reps < 5) {
+			reps = 5;
+		}
+		double best_parse = 1e9, best_reject = 1e9, best_query = 1e9;
+		size_t peak = 0, allocs = 0;
+		char last_dir[64];
+		snprintf(last_dir, sizeof last_dir, "/snap/app%s%d/x%d",
+			 n % 7 == 0 ? " with space" : "", n, n / 4);
+
+		generate_table(&t, n, false);
+		write_scratch_file(t.buf, t.len);
+		for (int r = 0; r < reps; r++) {
+			size_t live = heap.live_bytes;
+			heap.peak_bytes = live;
+			heap.num_allocs = 0;
+			double start = now();
+			sc_mountinfo *info = sc_parse_mountinfo(scratch_path);
+			double elapsed = now() - start;
+			if (info == NULL || info->num_entries != (size_t)n) {
+				fprintf(stderr, "cannot parse table of %d "
+					"entries\n", n);
+				exit(1);
+			}
+			peak = heap.peak_bytes - live;
+			allocs = heap.num_allocs;
+			sc_cleanup_mountinfo(&info);
+			if (elapsed < best_parse) {
+				best_parse = elapsed;
+			}
+			start = now();
+			if (sc_query_mountinfo(scratch_path,
+					       SC_MOUNTINFO_OPTIONAL_FIELDS,
+					       match_last, stop_query,
+					       last_dir) < 0) {
+				fprintf(stderr, "cannot query table of %d "
+					"entries\n", n);
+				exit(1);
+			}
+			elapsed = now() - start;
+			if (elapsed < best_query) {
+				best_query = elapsed;
+			}
+		}
+
+		generate_table(&t, n, true);
+		write_scratch_file(t.buf, t.len);
+		for (int r = 0; r < reps; r++) {
+			double start = now();
+			sc_mountinfo *info = sc_parse_mountinfo(scratch_path);
+			double elapsed = now() - start;
+			if (info != NULL) {
+				fprintf(stderr, "malformed table of %d entries "
+					"was accepted\n", n);
+				exit(1);
+			}
+			if (elapsed < best_reject) {
+				best_reject = elapsed;
+			}
+		}
+		printf("%8d %12.3f %12.3f %12.3f %12zu %14.3f\n", n,
+		       best_parse * 1e3, best_reject * 1e3, best_query * 1e3,
+		       peak / 1024, (double)allocs / n);
+	}
+	free(t.buf);
+}
+
+static uint32_t xorshift(uint32_t *state)
+{
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+/**
+ * Feed mutations of a small synthetic table to the fuzz target.
+ *
+ * Mutations favor the bytes that are significant to the parser so that
+ * broken escape sequences, missing separators and truncated lines are
+ * covered.
+ **/
+static void fuzz_regression(int iterations)
+{
+	static const char interesting[] = " \\-\n:0123457";
+	text seed = { 0 };
+	generate_table(&seed, 120, false);
+	char *buf = malloc(seed.len + 64);
+	if (buf == NULL) {
+		abort();
+	}
+	uint32_t state = 2463534242u;
+	for (int i = 0; i < iterations; i++) {
+		size_t len = seed.len;
+		memcpy(buf, seed.buf, len);
+		int num_mutations = 1 + xorshift(&state) % 8;
+		for (int m = 0; m < num_mutations; m++) {
+			size_t pos = xorshift(&state) % len;
+			switch (xorshift(&state) % 4) {
+			case 0:
+				buf[pos] = interesting[xorshift(&state) %
+						       (sizeof interesting - 1)];
+				break;
+			case 1:
+				buf[pos] = xorshift(&state);
+				break;
+			case 2:
+				len = pos + 1;
+				break;
+			case 3:
+				if (len < seed.len + 64) {
+					memmove(buf + pos + 1, buf + pos,
+						len - pos);
+					buf[pos] = '\\';
+					len++;
+				}
+				break;
+			}
+		}
+		LLVMFuzzerTestOneInput((const uint8_t *)buf, len);
+	}
+	free(buf);
+	free(seed.buf);
+	printf("fuzz regression: %d mutated tables\n", iterations);
+}
+
+static int replay(const char *fname)
+{
+	FILE *f = fopen(fname, "r");
+	if (f == NULL) {
+		fprintf(stderr, "cannot open %s: %s\n", fname, strerror(errno));
+		return 1;
+	}
+	text t = { 0 };
+	do {
+		if (t.len == t.cap) {
+			t.cap = t.cap ? t.cap * 2 : 4096;
+			t.buf = realloc(t.buf, t.cap);
+			if (t.buf == NULL) {
+				abort();
+			}
+		}
+		t.len += fread(t.buf + t.len, 1, t.cap - t.len, f);
+	} while (!feof(f) && !ferror(f));
+	bool failed = ferror(f);
+	fclose(f);
+	if (failed) {
+		fprintf(stderr, "cannot read %s\n", fname);
+		free(t.buf);
+		return 1;
+	}
+	LLVMFuzzerTestOneInput((const uint8_t *)t.buf, t.len);
+	free(t.buf);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc == 2 && strcmp(argv[1], "--fuzz-regression") == 0) {
+		fuzz_regression(5000);
+		return 0;
+	}
+	if (argc > 1) {
+		int res = 0;
+		for (int i = 1; i < argc; i++) {
+			res |= replay(argv[i]);
+		}
+		return res;
+	}
+	benchmark();
+	fuzz_regression(5000);
+	return 0;
+}
+
+#endif				// MOUNTINFO_FUZZER
@@ -20,6 +20,8 @@
 #include "mount-support-nvidia.h"
 #include "mount-support-nvidia.c"
 
+#include "../libsnap-confine-private/test-utils.h"
+
 #include <glib.h>
 #include <glib/gstdio.h>
 
@@ -92,10 +94,42 @@ static void test_is_subdir(void)
 	g_assert_false(is_subdir("/", ""));
 }
 
+static void test_is_mount_profile_empty(void)
+{
+	const char *d = g_dir_make_tmp(NULL, NULL);
+	g_assert_nonnull(d);
+	g_test_queue_destroy((GDestroyNotify) rm_rf_tmp, (gpointer) d);
+	char *profile = g_build_filename(d, "snap.foo.fstab", NULL);
+	g_test_queue_free(profile);
+
+	// A missing profile is empty.
+	g_assert_true(sc_is_mount_profile_empty(profile));
+
+	// So is a profile with only comments and blank lines.
+	g_assert_true(g_file_set_contents(profile, "", -1, NULL));
+	g_assert_true(sc_is_mount_profile_empty(profile));
+	g_assert_true(g_file_set_contents
+		      (profile, "# comment\n\n   \n", -1, NULL));
+	g_assert_true(sc_is_mount_profile_empty(profile));
+
+	// Any entry makes it non-empty.
+	g_assert_true(g_file_set_contents
+		      (profile,
+		       "# content\n"
+		       "/snap/foo/1/src /snap/bar/2/dst none bind,ro 0 0\n",
+		       -1, NULL));
+	g_assert_false(sc_is_mount_profile_empty(profile));
+
+	// Profiles that cannot be read are not considered empty.
+	g_assert_false(sc_is_mount_profile_empty(d));
+}
+
 static void __attribute__((constructor)) init(void)
 {
 	g_test_add_func("/mount/get_nextpath/typical",
 			test_get_nextpath__typical);
 	g_test_add_func("/mount/get_nextpath/weird", test_get_nextpath__weird);
 	g_test_add_func("/mount/is_subdir", test_is_subdir);
+	g_test_add_func("/mount/is_mount_profile_empty",
+			test_is_mount_profile_empty);
 }
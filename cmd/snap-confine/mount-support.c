@@ -309,7 +309,8 @@ static void sc_do_mounts(const char *scratch_dir, const struct sc_mount *mounts)
  * tmpfs), so that snap-update-ns will know about it and won't try to unmount
  * it.
  */
-static void sc_initialize_ns_fstab(const char *snap_instance_name)
+static void sc_initialize_ns_fstab(const char *snap_instance_name,
+				   bool normal_mode)
 {
 	FILE *stream SC_CLEANUP(sc_cleanup_file) = NULL;
 	char info_path[PATH_MAX] = { 0 };
@@ -331,15 +332,47 @@ static void sc_initialize_ns_fstab(const char *snap_instance_name)
 	}
 	// We need to store an entry for the root directory, so that snap-update-ns
 	// will know that it's a tmpfs created by us. It's not going to remount it,
-	// so there's no need to be precise with the mount flags.
-	fprintf(stream, "tmpfs / tmpfs x-snapd.origin=rootfs 0 0\n");
+	// so there's no need to be precise with the mount flags. In legacy mode
+	// there is no such tmpfs and the profile is simply empty.
+	if (normal_mode) {
+		fprintf(stream, "tmpfs / tmpfs x-snapd.origin=rootfs 0 0\n");
+	}
 	if (ferror(stream) != 0) {
 		die("I/O error when writing to %s", info_path);
 	}
 	if (fflush(stream) == EOF) {
 		die("cannot flush %s", info_path);
 	}
-	debug("saved rootfs fstab entry to %s", info_path);
+	debug("saved initial fstab to %s", info_path);
+}
+
+/**
+ * Check if the desired mount profile of a snap has no entries.
+ *
+ * A missing profile is treated as empty, just like snap-update-ns does. Any
+ * other error is reported as a non-empty profile so that the caller falls
+ * back to snap-update-ns, which knows how to report it properly.
+ **/
+static bool sc_is_mount_profile_empty(const char *profile_path)
+{
+	FILE *f SC_CLEANUP(sc_cleanup_endmntent) = NULL;
+	f = setmntent(profile_path, "re");
+	if (f == NULL) {
+		if (errno == ENOENT) {
+			return true;
+		}
+		debug("cannot open mount profile %s", profile_path);
+		return false;
+	}
+	// Blank lines and comments are skipped by getmntent.
+	if (getmntent(f) != NULL) {
+		return false;
+	}
+	if (ferror(f) != 0) {
+		debug("cannot read mount profile %s", profile_path);
+		return false;
+	}
+	return true;
 }
 
 /**
@@ -539,7 +572,7 @@ static void sc_bootstrap_mount_namespace(const struct sc_mount_config *config)
 	// guarantees that this directory will not be replicated anywhere.
 	sc_do_mount("none", scratch_dir, NULL, MS_UNBINDABLE, NULL);
 	if (config->normal_mode) {
-		sc_initialize_ns_fstab(config->snap_instance);
+		sc_initialize_ns_fstab(config->snap_instance, true);
 		// Create a tmpfs on scratch_dir; we'll them mount all the root
 		// directories of the base snap onto it.
 		sc_do_mount("none", scratch_dir, "tmpfs", 0, "uid=0,gid=0");
@@ -1031,6 +1064,23 @@ void sc_populate_mount_ns(struct sc_apparmor *apparmor, int snap_update_ns_fd,
 	// TODO: fold this into bootstrap
 	setup_private_pts();
 
+	// Most snaps do not use content sharing nor layouts and their desired
+	// mount profile is empty. Applying it would be a no-op, apart from saving
+	// the current profile, so do that here and spare the cost of starting
+	// snap-update-ns.
+	char profile_path[PATH_MAX] = { 0 };
+	sc_must_snprintf(profile_path, sizeof profile_path,
+			 "/var/lib/snapd/mount/snap.%s.fstab",
+			 inv->snap_instance);
+	if (sc_is_mount_profile_empty(profile_path)) {
+		debug("mount profile %s is empty, not calling snap-update-ns",
+		      profile_path);
+		if (!inv->is_normal_mode) {
+			// In normal mode the profile was saved while bootstrapping.
+			sc_initialize_ns_fstab(inv->snap_instance, false);
+		}
+		return;
+	}
 	// setup the security backend bind mounts
 	sc_call_snap_update_ns(snap_update_ns_fd, inv->snap_instance, apparmor);
 }
@@ -1040,21 +1090,17 @@ static bool is_mounted_with_shared_option(const char *dir)
 
 static bool is_mounted_with_shared_option(const char *dir)
 {
-	sc_mountinfo *sm SC_CLEANUP(sc_cleanup_mountinfo) = NULL;
-	sm = sc_parse_mountinfo(NULL);
+	// Each call takes a fresh snapshot, which invalidates the previous one;
+	// nothing from it is kept beyond the loop.
+	sc_mountinfo *sm = sc_mountinfo_snapshot();
 	if (sm == NULL) {
 		die("cannot parse /proc/self/mountinfo");
 	}
-	sc_mountinfo_entry *entry = sc_first_mountinfo_entry(sm);
-	while (entry != NULL) {
-		const char *mount_dir = entry->mount_dir;
-		if (sc_streq(mount_dir, dir)) {
-			const char *optional_fields = entry->optional_fields;
-			if (strstr(optional_fields, "shared:") != NULL) {
-				return true;
-			}
+	for (sc_mountinfo_entry * entry = sc_first_mountinfo_entry_at(sm, dir);
+	     entry != NULL; entry = sc_next_mountinfo_entry_at(entry)) {
+		if (strstr(entry->optional_fields, "shared:") != NULL) {
+			return true;
 		}
-		entry = sc_next_mountinfo_entry(entry);
 	}
 	return false;
 }
@@ -146,9 +146,249 @@ static void test_nsfs_fs_id(void)
 	g_assert_cmpint(buf.f_type, ==, NSFS_MAGIC);
 }
 
+static void test_sc_hash_file(void)
+{
+	const char *d = g_dir_make_tmp(NULL, NULL);
+	g_assert_nonnull(d);
+	g_test_queue_destroy((GDestroyNotify) rm_rf_tmp, (gpointer) d);
+	char *path = g_build_filename(d, "file", NULL);
+	g_test_queue_free(path);
+
+	uint64_t hash = 0;
+	g_assert_false(sc_hash_file(path, &hash));
+
+	// Known FNV-1a 64-bit hashes.
+	g_assert_true(g_file_set_contents(path, "", -1, NULL));
+	g_assert_true(sc_hash_file(path, &hash));
+	g_assert_cmpuint(hash, ==, 0xcbf29ce484222325ULL);
+	g_assert_true(g_file_set_contents(path, "a", -1, NULL));
+	g_assert_true(sc_hash_file(path, &hash));
+	g_assert_cmpuint(hash, ==, 0xaf63dc4c8601ec8cULL);
+}
+
+static void test_sc_hash_mounts_under(void)
+{
+	const char *d = g_dir_make_tmp(NULL, NULL);
+	g_assert_nonnull(d);
+	g_test_queue_destroy((GDestroyNotify) rm_rf_tmp, (gpointer) d);
+	char *path = g_build_filename(d, "mountinfo", NULL);
+	g_test_queue_free(path);
+	const char *dirs[] = { "/snap/foo_bar", "/var/snap/foo_bar", NULL };
+
+	// Nothing is mounted there.
+	g_assert_true(g_file_set_contents(path,
+					  "20 1 8:1 / / rw - ext4 /dev/sda1 rw\n",
+					  -1, NULL));
+	uint64_t none = sc_hash_mounts_under(path, dirs);
+	g_assert_cmpuint(none, ==, 0xcbf29ce484222325ULL);
+
+	// Mounts elsewhere, even with a common prefix, are not relevant.
+	g_assert_true(g_file_set_contents(path,
+					  "20 1 8:1 / / rw - ext4 /dev/sda1 rw\n"
+					  "21 20 7:1 / /snap/foo_barx/1 ro - squashfs /dev/loop1 ro\n"
+					  "22 20 7:2 / /snap/foo/1 ro - squashfs /dev/loop2 ro\n",
+					  -1, NULL));
+	g_assert_cmpuint(sc_hash_mounts_under(path, dirs), ==, none);
+
+	// Mounting a revision changes the hash.
+	g_assert_true(g_file_set_contents(path,
+					  "20 1 8:1 / / rw - ext4 /dev/sda1 rw\n"
+					  "23 20 7:3 / /snap/foo_bar/1 ro - squashfs /dev/loop3 ro\n",
+					  -1, NULL));
+	uint64_t one = sc_hash_mounts_under(path, dirs);
+	g_assert_cmpuint(one, !=, none);
+
+	// So does mounting it again.
+	g_assert_true(g_file_set_contents(path,
+					  "20 1 8:1 / / rw - ext4 /dev/sda1 rw\n"
+					  "24 20 7:3 / /snap/foo_bar/1 ro - squashfs /dev/loop3 ro\n",
+					  -1, NULL));
+	g_assert_cmpuint(sc_hash_mounts_under(path, dirs), !=, one);
+
+	// Mounts at the directory itself are relevant too.
+	g_assert_true(g_file_set_contents(path,
+					  "20 1 8:1 / / rw - ext4 /dev/sda1 rw\n"
+					  "25 20 8:1 /data /var/snap/foo_bar rw - ext4 /dev/sda1 rw\n",
+					  -1, NULL));
+	g_assert_cmpuint(sc_hash_mounts_under(path, dirs), !=, none);
+}
+
+static void test_sc_per_user_ns_info(void)
+{
+	if (geteuid() != 0) {
+		// The info file is chowned to root.
+		g_test_skip("this test needs to run as root");
+		return;
+	}
+	const char *ns_dir = sc_test_use_fake_ns_dir();
+	struct sc_mount_ns *group = sc_test_open_mount_ns("foo");
+	char *profile = g_build_filename(ns_dir, "user-fstab", NULL);
+	g_test_queue_free(profile);
+	g_assert_cmpint(setenv("XDG_RUNTIME_DIR", "/run/user/1000", 1), ==, 0);
+	g_test_queue_destroy((GDestroyNotify) my_unsetenv, "XDG_RUNTIME_DIR");
+	g_assert_cmpint(setenv("SNAP_REAL_HOME", "/home/user", 1), ==, 0);
+	g_test_queue_destroy((GDestroyNotify) my_unsetenv, "SNAP_REAL_HOME");
+
+	// Without the user mount profile the hash is not known.
+	group->per_user_info = sc_describe_per_user_ns_inputs(profile, false);
+	g_assert_true(g_str_has_prefix(group->per_user_info,
+				       "user-fstab-hash=none\n"
+				       "parent-mount-ns="));
+	g_assert_true(g_str_has_suffix(group->per_user_info,
+				       "\nxdg-runtime-dir-hash=582803ab30ff569d\n"
+				       "snap-real-home-hash=8f4b200009ba673d\n"));
+
+	// Nothing was stored yet.
+	g_assert_false(sc_is_ns_info_current
+		       (group, "info", group->per_user_info));
+
+	// What was stored is current.
+	char info_fname[PATH_MAX] = { 0 };
+	sc_must_snprintf(info_fname, sizeof info_fname, "snap.foo.%d.info",
+			 (int)getuid());
+	sc_store_per_user_ns_info(group);
+	g_assert_true(sc_is_ns_info_current
+		      (group, info_fname, group->per_user_info));
+
+	// Changes to the profile or to the environment make it stale.
+	g_assert_true(g_file_set_contents(profile, "", -1, NULL));
+	free(group->per_user_info);
+	group->per_user_info = sc_describe_per_user_ns_inputs(profile, false);
+	g_assert_false(sc_is_ns_info_current
+		       (group, info_fname, group->per_user_info));
+	sc_store_per_user_ns_info(group);
+	g_assert_true(sc_is_ns_info_current
+		      (group, info_fname, group->per_user_info));
+
+	g_assert_cmpint(setenv("XDG_RUNTIME_DIR", "/run/user/1001", 1), ==, 0);
+	free(group->per_user_info);
+	group->per_user_info = sc_describe_per_user_ns_inputs(profile, false);
+	g_assert_false(sc_is_ns_info_current
+		       (group, info_fname, group->per_user_info));
+
+	// The environment is hashed so that any value can be described.
+	char *long_value = g_strnfill(PATH_MAX * 4, 'x');
+	g_test_queue_free(long_value);
+	g_assert_cmpint(setenv("SNAP_REAL_HOME", long_value, 1), ==, 0);
+	free(group->per_user_info);
+	group->per_user_info = sc_describe_per_user_ns_inputs(profile, false);
+	g_assert_null(strstr(group->per_user_info, long_value));
+
+	// A profile that cannot be read cannot be described.
+	char *unreadable = g_build_filename(ns_dir, "user-fstab-dir", NULL);
+	g_test_queue_free(unreadable);
+	g_assert_cmpint(mkdir(unreadable, 0755), ==, 0);
+	char *description = sc_describe_per_user_ns_inputs(unreadable, false);
+	g_assert_null(description);
+
+		// So does trailing content.
+	sc_store_per_user_ns_info(group);
+	char *path = g_build_filename(ns_dir, info_fname, NULL);
+	g_test_queue_free(path);
+	char *content = g_strconcat(group->per_user_info, "x", NULL);
+	g_test_queue_free(content);
+	g_assert_true(g_file_set_contents(path, content, -1, NULL));
+	g_assert_false(sc_is_ns_info_current
+		       (group, info_fname, group->per_user_info));
+}
+
+static void test_sc_shared_per_user_ns_info(void)
+{
+	if (geteuid() != 0) {
+		// The info file is chowned to root.
+		g_test_skip("this test needs to run as root");
+		return;
+	}
+	const char *ns_dir = sc_test_use_fake_ns_dir();
+	struct sc_mount_ns *group = sc_test_open_mount_ns("foo");
+	char *profile = g_build_filename(ns_dir, "user-fstab", NULL);
+	g_test_queue_free(profile);
+	g_assert_true(g_file_set_contents(profile, "", -1, NULL));
+	g_assert_cmpint(setenv("XDG_RUNTIME_DIR", "/run/user/1000", 1), ==, 0);
+	g_test_queue_destroy((GDestroyNotify) my_unsetenv, "XDG_RUNTIME_DIR");
+
+	// The environment is not a part of the description.
+	group->per_user_info = sc_describe_per_user_ns_inputs(profile, true);
+	group->per_user_shared = true;
+	g_assert_true(g_str_has_prefix(group->per_user_info,
+				       "user-fstab-hash=cbf29ce484222325\n"
+				       "parent-mount-ns="));
+	g_assert_null(strstr(group->per_user_info, "xdg-runtime-dir-hash="));
+
+	// The description is stored under a name that does not depend on the
+	// user and replaces the one stored for the calling user alone.
+	char *per_uid_path = g_strdup_printf("%s/snap.foo.%d.info", ns_dir,
+					     (int)getuid());
+	g_test_queue_free(per_uid_path);
+	g_assert_true(g_file_set_contents(per_uid_path, "", -1, NULL));
+	sc_store_per_user_ns_info(group);
+	g_assert_false(g_file_test(per_uid_path, G_FILE_TEST_EXISTS));
+	g_assert_true(sc_is_ns_info_current
+		      (group, "snap.foo.shared.info", group->per_user_info));
+
+	g_assert_cmpint(setenv("XDG_RUNTIME_DIR", "/run/user/1001", 1), ==, 0);
+	free(group->per_user_info);
+	group->per_user_info = sc_describe_per_user_ns_inputs(profile, true);
+	g_assert_true(sc_is_ns_info_current
+		      (group, "snap.foo.shared.info", group->per_user_info));
+}
+
+static void test_sc_is_user_mount_profile_user_independent(void)
+{
+	const char *d = g_dir_make_tmp(NULL, NULL);
+	g_assert_nonnull(d);
+	g_test_queue_destroy((GDestroyNotify) rm_rf_tmp, (gpointer) d);
+	char *profile = g_build_filename(d, "user-fstab", NULL);
+	g_test_queue_free(profile);
+	g_assert_cmpint(setenv("SNAP_REAL_HOME", "/home/user", 1), ==, 0);
+	g_test_queue_destroy((GDestroyNotify) my_unsetenv, "SNAP_REAL_HOME");
+
+	// Missing and empty profiles do not depend on the user.
+	g_assert_true(sc_is_user_mount_profile_user_independent(profile));
+	g_assert_true(g_file_set_contents(profile, "", -1, NULL));
+	g_assert_true(sc_is_user_mount_profile_user_independent(profile));
+
+	// Profiles that cannot be read are assumed to depend on the user.
+	char *unreadable = g_build_filename(d, "user-fstab-dir", NULL);
+	g_test_queue_free(unreadable);
+	g_assert_cmpint(mkdir(unreadable, 0755), ==, 0);
+	g_assert_false(sc_is_user_mount_profile_user_independent(unreadable));
+
+	// Neither do profiles with fixed paths.
+	g_assert_true(g_file_set_contents(profile,
+					  "/usr/share/fonts /usr/share/fonts none bind,ro 0 0\n",
+					  -1, NULL));
+	g_assert_true(sc_is_user_mount_profile_user_independent(profile));
+
+	// Variables are expanded for the calling user.
+	g_assert_true(g_file_set_contents(profile,
+					  "$XDG_RUNTIME_DIR/doc/by-app/snap.foo $XDG_RUNTIME_DIR/doc none bind,rw,x-snapd.ignore-missing 0 0\n",
+					  -1, NULL));
+	g_assert_false(sc_is_user_mount_profile_user_independent(profile));
+
+	// Directories are created with the identity of the calling user.
+	g_assert_true(g_file_set_contents(profile,
+					  "none /var/foo none x-snapd.kind=ensure-dir,x-snapd.must-exist-dir=/var 0 0\n",
+					  -1, NULL));
+	g_assert_false(sc_is_user_mount_profile_user_independent(profile));
+
+	// The home directory of the calling user is treated specially.
+	g_assert_true(g_file_set_contents(profile,
+					  "/usr/share/fonts /home/user/fonts none bind,ro 0 0\n",
+					  -1, NULL));
+	g_assert_false(sc_is_user_mount_profile_user_independent(profile));
+}
+
 static void __attribute__((constructor)) init(void)
 {
 	g_test_add_func("/ns/sc_alloc_mount_ns", test_sc_alloc_mount_ns);
 	g_test_add_func("/ns/sc_open_mount_ns", test_sc_open_mount_ns);
 	g_test_add_func("/ns/nsfs_fs_id", test_nsfs_fs_id);
+	g_test_add_func("/ns/sc_hash_file", test_sc_hash_file);
+	g_test_add_func("/ns/sc_hash_mounts_under", test_sc_hash_mounts_under);
+	g_test_add_func("/ns/sc_per_user_ns_info", test_sc_per_user_ns_info);
+	g_test_add_func("/ns/sc_shared_per_user_ns_info",
+			test_sc_shared_per_user_ns_info);
+	g_test_add_func("/ns/sc_is_user_mount_profile_user_independent",
+			test_sc_is_user_mount_profile_user_independent);
 }
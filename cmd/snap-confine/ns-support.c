@@ -23,7 +23,9 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <linux/magic.h>
+#include <mntent.h>
 #include <sched.h>
 #include <signal.h>
 #include <string.h>
@@ -69,6 +71,8 @@ enum {
 	HELPER_CMD_EXIT,
 	HELPER_CMD_CAPTURE_MOUNT_NS,
 	HELPER_CMD_CAPTURE_PER_USER_MOUNT_NS,
+	HELPER_CMD_CAPTURE_SHARED_PER_USER_MOUNT_NS,
+	HELPER_CMD_CAPTURE_CLASSIC_MOUNT_NS,
 };
 
 void sc_reassociate_with_pid1_mount_ns(void)
@@ -133,27 +137,24 @@ void sc_initialize_mount_ns(unsigned int experimental_features)
 	(void)sc_set_effective_identity(old);
 
 	/* Read and analyze the mount table. We need to see whether /run/snapd/ns
-	 * is a mount point with private event propagation. */
-	sc_mountinfo *info SC_CLEANUP(sc_cleanup_mountinfo) = NULL;
-	info = sc_parse_mountinfo(NULL);
+	 * is a mount point with private event propagation. The snapshot, and the
+	 * entry found in it, are only valid until the next call to
+	 * sc_mountinfo_snapshot(), so the entry is not used past this block. */
+	sc_mountinfo *info = sc_mountinfo_snapshot();
 	if (info == NULL) {
 		die("cannot parse /proc/self/mountinfo");
 	}
 
 	bool is_mnt = false;
 	bool is_private = false;
-	for (sc_mountinfo_entry * entry = sc_first_mountinfo_entry(info);
-	     entry != NULL; entry = sc_next_mountinfo_entry(entry)) {
-		/* Find /run/snapd/ns */
-		if (!sc_streq(entry->mount_dir, sc_ns_dir)) {
-			continue;
-		}
+	sc_mountinfo_entry *entry =
+	    sc_first_mountinfo_entry_at(info, sc_ns_dir);
+	if (entry != NULL) {
 		is_mnt = true;
 		if (strstr(entry->optional_fields, "shared:") == NULL) {
 			/* Mount event propagation is not set to shared, good. */
 			is_private = true;
 		}
-		break;
 	}
 
 	if (!is_mnt) {
@@ -192,6 +193,16 @@ struct sc_mount_ns {
 	// Identifier of the child process that is used during the one-time (per
 	// group) initialization and capture process.
 	pid_t child;
+	// Description of the inputs of the per-user mount namespace of the
+	// calling user, computed when trying to join it and stored next to it
+	// once it is captured.
+	char *per_user_info;
+	// Whether the per-user mount namespace does not depend on the calling
+	// user and is shared by all users.
+	bool per_user_shared;
+	// Description of the inputs of the mount namespace of a parallel
+	// instance of a classic snap, computed and stored like per_user_info.
+	char *classic_info;
 };
 
 static struct sc_mount_ns *sc_alloc_mount_ns(void)
@@ -234,6 +245,8 @@ void sc_close_mount_ns(struct sc_mount_ns *group)
 	sc_cleanup_close(&group->pipe_helper[0]);
 	sc_cleanup_close(&group->pipe_helper[1]);
 	free(group->name);
+	free(group->per_user_info);
+	free(group->classic_info);
 	free(group);
 }
 
@@ -248,24 +261,23 @@ static dev_t find_base_snap_device(const char *base_snap_name,
 	sc_must_snprintf(base_squashfs_path, sizeof base_squashfs_path,
 			 "%s/%s/%s", sc_snap_mount_dir(NULL), base_snap_name,
 			 base_snap_rev);
-	sc_mountinfo *mi SC_CLEANUP(sc_cleanup_mountinfo) = NULL;
-	mi = sc_parse_mountinfo(NULL);
+	// The snapshot is only valid until the next call to
+	// sc_mountinfo_snapshot(); only the device number is kept from it.
+	sc_mountinfo *mi = sc_mountinfo_snapshot();
 	if (mi == NULL) {
 		die("cannot parse mountinfo of the current process");
 	}
 	bool found = false;
 	for (sc_mountinfo_entry * mie =
-	     sc_first_mountinfo_entry(mi); mie != NULL;
-	     mie = sc_next_mountinfo_entry(mie)) {
-		if (sc_streq(mie->mount_dir, base_squashfs_path)) {
-			base_snap_dev = makedev(mie->dev_major, mie->dev_minor);
-			debug("block device of snap %s, revision %s is %d:%d",
-			      base_snap_name, base_snap_rev, mie->dev_major,
-			      mie->dev_minor);
-			// Don't break when found, we are interested in the last
-			// entry as this is the "effective" one.
-			found = true;
-		}
+	     sc_first_mountinfo_entry_at(mi, base_squashfs_path); mie != NULL;
+	     mie = sc_next_mountinfo_entry_at(mie)) {
+		base_snap_dev = makedev(mie->dev_major, mie->dev_minor);
+		debug("block device of snap %s, revision %s is %d:%d",
+		      base_snap_name, base_snap_rev, mie->dev_major,
+		      mie->dev_minor);
+		// Don't break when found, we are interested in the last
+		// entry as this is the "effective" one.
+		found = true;
 	}
 	if (!found) {
 		die("cannot find mount entry for snap %s revision %s",
@@ -313,45 +325,22 @@ static bool base_snap_device_changed(sc_mountinfo *mi, dev_t base_snap_dev)
 static bool homedirs_are_mounted(sc_mountinfo *mi, char **homedirs,
 				 int num_homedirs)
 {
-	if (num_homedirs == 0) {
-		return true;
-	}
-
-	/* We know that the number of homedirs is not going to be huge, so let's
-	 * just allocare this vector on the stack */
-	bool homedir_seen[num_homedirs];
 	for (int i = 0; i < num_homedirs; i++) {
-		homedir_seen[i] = false;
-	}
-
-	sc_mountinfo_entry *mie;
-	for (mie = sc_first_mountinfo_entry(mi); mie != NULL;
-	     mie = sc_next_mountinfo_entry(mie)) {
-		for (int i = 0; i < num_homedirs; i++) {
-			if (sc_streq(mie->mount_dir, homedirs[i])) {
-				homedir_seen[i] = true;
-			}
-		}
-	}
-
-	bool all_seen = true;
-	for (int i = 0; i < num_homedirs; i++) {
-		if (!homedir_seen[i]) {
+		if (sc_find_mountinfo_entry(mi, homedirs[i]) == NULL) {
 			debug("Homedir %s missing from namespace", homedirs[i]);
-			all_seen = false;
-			break;
+			return false;
 		}
 	}
-	return all_seen;
+	return true;
 }
 
 // Inspect the namespace and check if we should discard it.
 static bool should_discard_current_ns(const struct sc_invocation *inv,
 				      dev_t base_snap_dev)
 {
-	sc_mountinfo *mi SC_CLEANUP(sc_cleanup_mountinfo) = NULL;
-
-	mi = sc_parse_mountinfo(NULL);
+	// The snapshot stays valid while the helpers below inspect it, as none
+	// of them takes another one.
+	sc_mountinfo *mi = sc_mountinfo_snapshot();
 	if (mi == NULL) {
 		die("cannot parse mountinfo of the current process");
 	}
@@ -422,9 +411,12 @@ static bool is_base_transition(const sc_invocation *inv)
 	}
 
 	char *base_snap_name SC_CLEANUP(sc_cleanup_string) = NULL;
+	sc_infofile_key keys[] = {
+		{.key = "base-snap-name",.value = &base_snap_name},
+	};
 	sc_error *err = NULL;
-	if (sc_infofile_get_key
-	    (stream, "base-snap-name", &base_snap_name, &err) < 0) {
+	if (sc_infofile_get_keys(stream, keys, sizeof keys / sizeof *keys, 0,
+				 &err) < 0) {
 		sc_die_on_error(err);
 	}
 
@@ -592,7 +584,9 @@ static void helper_fork(struct sc_mount_ns *group,
 static void helper_main(struct sc_mount_ns *group, struct sc_apparmor *apparmor,
 			pid_t parent);
 static void helper_capture_ns(struct sc_mount_ns *group, pid_t parent);
-static void helper_capture_per_user_ns(struct sc_mount_ns *group, pid_t parent);
+static void helper_capture_per_user_ns(struct sc_mount_ns *group, pid_t parent,
+				       bool shared);
+static void helper_capture_classic_ns(struct sc_mount_ns *group, pid_t parent);
 
 int sc_join_preserved_ns(struct sc_mount_ns *group, struct sc_apparmor
 			 *apparmor, const sc_invocation *inv,
@@ -651,13 +645,307 @@ int sc_join_preserved_ns(struct sc_mount_ns *group, struct sc_apparmor
 	return ESRCH;
 }
 
+#define SC_FNV1A_OFFSET_BASIS 0xcbf29ce484222325ULL
+
+/**
+ * Mix a buffer into a 64-bit FNV-1a hash.
+ **/
+static uint64_t sc_fnv1a_update(uint64_t hash, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/**
+ * Compute the 64-bit FNV-1a hash of the contents of a file.
+ *
+ * The return value is false if the file does not exist or cannot be read, in
+ * which case errno is set accordingly.
+ **/
+static bool sc_hash_file(const char *path, uint64_t *hash_out)
+{
+	int fd SC_CLEANUP(sc_cleanup_close) = -1;
+	fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+	if (fd < 0) {
+		return false;
+	}
+	uint64_t hash = SC_FNV1A_OFFSET_BASIS;
+	unsigned char buf[4096];
+	for (;;) {
+		ssize_t n = read(fd, buf, sizeof buf);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			return false;
+		}
+		if (n == 0) {
+			break;
+		}
+		hash = sc_fnv1a_update(hash, buf, (size_t)n);
+	}
+	*hash_out = hash;
+	return true;
+}
+
+/**
+ * Check if applying a user mount profile gives the same result for all users.
+ *
+ * That is not the case when the profile refers to variables, such as $HOME or
+ * $XDG_RUNTIME_DIR, that snap-update-ns expands for the calling user, when
+ * it asks for directories that are created with the identity of the calling
+ * user or when it touches the home directory of the calling user, which is
+ * exempt from trespassing restrictions. A missing profile is not applied at
+ * all and therefore also gives the same result for all users. A profile that
+ * cannot be read is conservatively treated as user-dependent.
+ **/
+static bool sc_is_user_mount_profile_user_independent(const char *profile_path)
+{
+	FILE *f SC_CLEANUP(sc_cleanup_endmntent) = NULL;
+	f = setmntent(profile_path, "re");
+	if (f == NULL) {
+		if (errno == ENOENT) {
+			return true;
+		}
+		debug("cannot open %s", profile_path);
+		return false;
+	}
+	const char *home = getenv("SNAP_REAL_HOME");
+	struct mntent *m;
+	while ((m = getmntent(f)) != NULL) {
+		if (strchr(m->mnt_fsname, '$') != NULL
+		    || strchr(m->mnt_dir, '$') != NULL
+		    || strchr(m->mnt_opts, '$') != NULL) {
+			return false;
+		}
+		if (strstr(m->mnt_opts, "x-snapd.kind=ensure-dir") != NULL) {
+			return false;
+		}
+		if (home != NULL && home[0] != '\0'
+		    && (sc_startswith(m->mnt_fsname, home)
+			|| sc_startswith(m->mnt_dir, home))) {
+			return false;
+		}
+	}
+	if (ferror(f) != 0) {
+		debug("cannot read %s", profile_path);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Format the name of a file describing the per-user mount namespace.
+ *
+ * The namespace of the calling user is named after the user identifier
+ * unless it is shared by all users.
+ **/
+static void sc_format_per_user_ns_fname(char *buf, size_t buf_size,
+					const char *prefix,
+					const char *snap_name, bool shared,
+					const char *suffix)
+{
+	if (shared) {
+		sc_must_snprintf(buf, buf_size, "%s%s.shared.%s", prefix,
+				 snap_name, suffix);
+	} else {
+		sc_must_snprintf(buf, buf_size, "%s%s.%d.%s", prefix,
+				 snap_name, (int)getuid(), suffix);
+	}
+}
+
+/**
+ * Describe the inputs that a per-user mount namespace is constructed from.
+ *
+ * The per-user mount namespace is derived from the per-snap mount namespace,
+ * which must be the current mount namespace, by applying the user mount
+ * profile, which is expanded by snap-update-ns using the XDG_RUNTIME_DIR and
+ * SNAP_REAL_HOME environment variables. The environment is not relevant for
+ * shared namespaces. The variables are under the control of the calling user
+ * and are recorded as hashes so that the description has a bounded size.
+ * The returned description uses the key=value format of info files and must
+ * be freed by the caller. NULL is returned if the user mount profile exists
+ * but cannot be read, as the namespace cannot be described then.
+ **/
+static char *sc_describe_per_user_ns_inputs(const char *profile_path,
+					    bool shared)
+{
+	char profile_hash[32] = "none";
+	uint64_t hash;
+	if (sc_hash_file(profile_path, &hash)) {
+		sc_must_snprintf(profile_hash, sizeof profile_hash,
+				 "%016" PRIx64, hash);
+	} else if (errno != ENOENT) {
+		debug("cannot hash %s", profile_path);
+		return NULL;
+	}
+	struct stat ns_stat_buf;
+	if (stat("/proc/self/ns/mnt", &ns_stat_buf) < 0) {
+		die("cannot inspect current mount namespace");
+	}
+	char info[256] = { 0 };
+	if (shared) {
+		sc_must_snprintf(info, sizeof info,
+				 "user-fstab-hash=%s\n"
+				 "parent-mount-ns=%ju:%ju\n", profile_hash,
+				 (uintmax_t) ns_stat_buf.st_dev,
+				 (uintmax_t) ns_stat_buf.st_ino);
+		return sc_strdup(info);
+	}
+	const char *xdg_runtime_dir = getenv("XDG_RUNTIME_DIR");
+	const char *snap_real_home = getenv("SNAP_REAL_HOME");
+	if (xdg_runtime_dir == NULL) {
+		xdg_runtime_dir = "";
+	}
+	if (snap_real_home == NULL) {
+		snap_real_home = "";
+	}
+	sc_must_snprintf(info, sizeof info,
+			 "user-fstab-hash=%s\n"
+			 "parent-mount-ns=%ju:%ju\n"
+			 "xdg-runtime-dir-hash=%016" PRIx64 "\n"
+			 "snap-real-home-hash=%016" PRIx64 "\n", profile_hash,
+			 (uintmax_t) ns_stat_buf.st_dev,
+			 (uintmax_t) ns_stat_buf.st_ino,
+			 sc_fnv1a_update(SC_FNV1A_OFFSET_BASIS, xdg_runtime_dir,
+					 strlen(xdg_runtime_dir)),
+			 sc_fnv1a_update(SC_FNV1A_OFFSET_BASIS, snap_real_home,
+					 strlen(snap_real_home)));
+	return sc_strdup(info);
+}
+
+/**
+ * Check if the stored description of a preserved mount namespace is current.
+ *
+ * The description is stored in the file info_fname, relative to the
+ * namespace directory. A missing or unreadable file is never current.
+ **/
+static bool sc_is_ns_info_current(struct sc_mount_ns *group,
+				  const char *info_fname, const char *info)
+{
+	int fd SC_CLEANUP(sc_cleanup_close) = -1;
+	fd = openat(group->dir_fd, info_fname,
+		    O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+	if (fd < 0) {
+		debug("cannot open %s", info_fname);
+		return false;
+	}
+	size_t expected_len = strlen(info);
+	char *buf SC_CLEANUP(sc_cleanup_string) = NULL;
+	// Read one byte more than expected to detect trailing content.
+	buf = calloc(expected_len + 1, 1);
+	if (buf == NULL) {
+		die("cannot allocate memory for mount namespace info");
+	}
+	size_t len = 0;
+	while (len < expected_len + 1) {
+		ssize_t n = read(fd, buf + len, expected_len + 1 - len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			debug("cannot read %s", info_fname);
+			return false;
+		}
+		if (n == 0) {
+			break;
+		}
+		len += n;
+	}
+	return len == expected_len
+	    && memcmp(buf, info, expected_len) == 0;
+}
+
+/**
+ * Store the description of a preserved mount namespace.
+ **/
+static void sc_write_ns_info(struct sc_mount_ns *group, const char *info_fname,
+			     const char *info)
+{
+	FILE *stream SC_CLEANUP(sc_cleanup_file) = NULL;
+	int fd = -1;
+	fd = openat(group->dir_fd, info_fname,
+		    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW, 0644);
+	if (fd < 0) {
+		die("cannot open %s", info_fname);
+	}
+	if (fchown(fd, 0, 0) < 0) {
+		die("cannot chown %s to root:root", info_fname);
+	}
+	// The stream now owns the file descriptor.
+	stream = fdopen(fd, "w");
+	if (stream == NULL) {
+		die("cannot get stream from file descriptor");
+	}
+	fputs(info, stream);
+	if (ferror(stream) != 0) {
+		die("I/O error when writing to %s", info_fname);
+	}
+	if (fflush(stream) == EOF) {
+		die("cannot flush %s", info_fname);
+	}
+	debug("saved mount namespace meta-data to %s", info_fname);
+}
+
+/**
+ * Store the description of the per-user mount namespace of the calling user.
+ *
+ * When the namespace is shared, the description of the namespace that was
+ * constructed for the calling user alone is stale and is removed.
+ **/
+static void sc_store_per_user_ns_info(struct sc_mount_ns *group)
+{
+	if (group->per_user_info == NULL) {
+		die("precondition failed: per-user mount namespace info is unknown");
+	}
+	char info_fname[PATH_MAX] = { 0 };
+	sc_format_per_user_ns_fname(info_fname, sizeof info_fname, "snap.",
+				    group->name, group->per_user_shared,
+				    "info");
+	sc_write_ns_info(group, info_fname, group->per_user_info);
+	if (group->per_user_shared) {
+		sc_format_per_user_ns_fname(info_fname, sizeof info_fname,
+					    "snap.", group->name, false,
+					    "info");
+		if (unlinkat(group->dir_fd, info_fname, 0) < 0
+		    && errno != ENOENT) {
+			die("cannot remove %s", info_fname);
+		}
+	}
+}
+
 int sc_join_preserved_per_user_ns(struct sc_mount_ns *group,
 				  const char *snap_name)
 {
-	uid_t uid = getuid();
+	char profile_path[PATH_MAX] = { 0 };
+	sc_must_snprintf(profile_path, sizeof profile_path,
+			 "/var/lib/snapd/mount/snap.%s.user-fstab", snap_name);
+	// When the profile gives the same result for all users there is no need
+	// for each of them to have a separate namespace.
+	bool shared = sc_is_user_mount_profile_user_independent(profile_path);
 	char mnt_fname[PATH_MAX] = { 0 };
-	sc_must_snprintf(mnt_fname, sizeof mnt_fname, "%s.%d.mnt", group->name,
-			 (int)uid);
+	sc_format_per_user_ns_fname(mnt_fname, sizeof mnt_fname, "",
+				    group->name, shared, "mnt");
+	char info_fname[PATH_MAX] = { 0 };
+	sc_format_per_user_ns_fname(info_fname, sizeof info_fname, "snap.",
+				    group->name, shared, "info");
+
+	// Describe the namespace we would construct now, while we are still in
+	// the per-snap mount namespace. The description is stored if a new
+	// namespace is constructed and captured.
+	free(group->per_user_info);
+	group->per_user_info =
+	    sc_describe_per_user_ns_inputs(profile_path, shared);
+	group->per_user_shared = shared;
+	if (group->per_user_info == NULL) {
+		debug("per-user mount namespace %s cannot be preserved",
+		      mnt_fname);
+		return ESRCH;
+	}
 
 	int mnt_fd SC_CLEANUP(sc_cleanup_close) = -1;
 	mnt_fd = openat(group->dir_fd, mnt_fname,
@@ -682,6 +970,16 @@ int sc_join_preserved_per_user_ns(struct sc_mount_ns *group,
 #endif
 	if (ns_statfs_buf.f_type == NSFS_MAGIC
 	    || ns_statfs_buf.f_type == PROC_SUPER_MAGIC) {
+		// The namespace is stale if the user mount profile, the per-snap
+		// mount namespace or the environment used to expand the profile
+		// have changed since it was constructed. A new one is constructed
+		// and captured in its place.
+		if (!sc_is_ns_info_current
+		    (group, info_fname, group->per_user_info)) {
+			debug("preserved per-user mount namespace %s is stale",
+			      mnt_fname);
+			return ESRCH;
+		}
 		if (setns(mnt_fd, CLONE_NEWNS) < 0) {
 			die("cannot join preserved per-user mount namespace %s",
 			    group->name);
@@ -692,6 +990,167 @@ int sc_join_preserved_per_user_ns(struct sc_mount_ns *group,
 	return ESRCH;
 }
 
+struct sc_mount_hash_query {
+	const char *const *dirs;
+	uint64_t hash;
+};
+
+static bool sc_is_mount_under_dirs(const char *mount_dir, void *data)
+{
+	const struct sc_mount_hash_query *query = data;
+	for (const char *const *dir = query->dirs; *dir != NULL; dir++) {
+		size_t len = strlen(*dir);
+		if (strncmp(mount_dir, *dir, len) == 0
+		    && (mount_dir[len] == '\0' || mount_dir[len] == '/')) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool sc_hash_mount_entry(const sc_mountinfo_entry * entry, void *data)
+{
+	struct sc_mount_hash_query *query = data;
+	uint64_t hash = query->hash;
+	hash = sc_fnv1a_update(hash, &entry->mount_id, sizeof entry->mount_id);
+	hash = sc_fnv1a_update(hash, &entry->parent_id,
+			       sizeof entry->parent_id);
+	hash = sc_fnv1a_update(hash, &entry->dev_major,
+			       sizeof entry->dev_major);
+	hash = sc_fnv1a_update(hash, &entry->dev_minor,
+			       sizeof entry->dev_minor);
+	hash = sc_fnv1a_update(hash, entry->root, strlen(entry->root) + 1);
+	hash = sc_fnv1a_update(hash, entry->mount_dir,
+			       strlen(entry->mount_dir) + 1);
+	query->hash = hash;
+	return true;
+}
+
+/**
+ * Compute the 64-bit FNV-1a hash of the mounts at or below some directories.
+ *
+ * The hash covers the identity, the device, the root and the mount point of
+ * each such mount in the mount table read from fname, where NULL stands for
+ * /proc/self/mountinfo. It changes whenever something is mounted or
+ * unmounted there. The list of directories is terminated with NULL.
+ **/
+static uint64_t sc_hash_mounts_under(const char *fname,
+				     const char *const *dirs)
+{
+	struct sc_mount_hash_query query = {
+		.dirs = dirs,
+		.hash = SC_FNV1A_OFFSET_BASIS,
+	};
+	if (sc_query_mountinfo(fname, SC_MOUNTINFO_ROOT,
+			       sc_is_mount_under_dirs, sc_hash_mount_entry,
+			       &query) < 0) {
+		die("cannot query mount table");
+	}
+	return query.hash;
+}
+
+/**
+ * Describe the inputs that the mount namespace of a parallel instance of a
+ * classic snap is constructed from.
+ *
+ * The namespace is derived from the initial mount namespace, which must be
+ * the current mount namespace, by bind mounting the snap and data directories
+ * of the instance over those of the snap. Those directories are re-created
+ * when the instance is removed and installed again, and the snap revisions
+ * are mounted in them and unmounted on refresh and removal, which is tracked
+ * through a hash of the host mounts there. The returned description must be
+ * freed by the caller.
+ **/
+static char *sc_describe_classic_ns_inputs(const sc_invocation *inv)
+{
+	struct stat ns_stat_buf;
+	if (stat("/proc/self/ns/mnt", &ns_stat_buf) < 0) {
+		die("cannot inspect current mount namespace");
+	}
+	char snap_dir[PATH_MAX] = { 0 };
+	sc_must_snprintf(snap_dir, sizeof snap_dir, "%s/%s",
+			 sc_snap_mount_dir(NULL), inv->snap_instance);
+	struct stat snap_dir_stat_buf;
+	if (stat(snap_dir, &snap_dir_stat_buf) < 0) {
+		die("cannot inspect %s", snap_dir);
+	}
+	char data_dir[PATH_MAX] = { 0 };
+	sc_must_snprintf(data_dir, sizeof data_dir, "/var/snap/%s",
+			 inv->snap_instance);
+	struct stat data_dir_stat_buf;
+	if (stat(data_dir, &data_dir_stat_buf) < 0) {
+		die("cannot inspect %s", data_dir);
+	}
+	char snap_name_dir[PATH_MAX] = { 0 };
+	sc_must_snprintf(snap_name_dir, sizeof snap_name_dir, "%s/%s",
+			 sc_snap_mount_dir(NULL), inv->snap_name);
+	char snap_name_data_dir[PATH_MAX] = { 0 };
+	sc_must_snprintf(snap_name_data_dir, sizeof snap_name_data_dir,
+			 "/var/snap/%s", inv->snap_name);
+	const char *mount_dirs[] = {
+		snap_dir, data_dir, snap_name_dir, snap_name_data_dir, NULL
+	};
+	uint64_t mounts_hash = sc_hash_mounts_under(NULL, mount_dirs);
+	char info[PATH_MAX] = { 0 };
+	sc_must_snprintf(info, sizeof info,
+			 "base-snap-name=%s\n"
+			 "parent-mount-ns=%ju:%ju\n"
+			 "snap-mount-dir=%ju:%ju\n"
+			 "snap-data-dir=%ju:%ju\n"
+			 "host-mounts-hash=%016" PRIx64 "\n",
+			 inv->orig_base_snap_name,
+			 (uintmax_t) ns_stat_buf.st_dev,
+			 (uintmax_t) ns_stat_buf.st_ino,
+			 (uintmax_t) snap_dir_stat_buf.st_dev,
+			 (uintmax_t) snap_dir_stat_buf.st_ino,
+			 (uintmax_t) data_dir_stat_buf.st_dev,
+			 (uintmax_t) data_dir_stat_buf.st_ino, mounts_hash);
+	return sc_strdup(info);
+}
+
+int sc_join_preserved_classic_ns(struct sc_mount_ns *group,
+				 const sc_invocation *inv)
+{
+	char mnt_fname[PATH_MAX] = { 0 };
+	sc_must_snprintf(mnt_fname, sizeof mnt_fname, "%s.classic.mnt",
+			 group->name);
+	char info_fname[PATH_MAX] = { 0 };
+	sc_must_snprintf(info_fname, sizeof info_fname, "snap.%s.classic.info",
+			 group->name);
+
+	// Describe the namespace we would construct now, while we are still in
+	// the initial mount namespace.
+	free(group->classic_info);
+	group->classic_info = sc_describe_classic_ns_inputs(inv);
+
+	int mnt_fd SC_CLEANUP(sc_cleanup_close) = -1;
+	mnt_fd = openat(group->dir_fd, mnt_fname,
+			O_RDONLY | O_CLOEXEC | O_NOFOLLOW, 0600);
+	if (mnt_fd < 0 && errno == ENOENT) {
+		return ESRCH;
+	}
+	if (mnt_fd < 0) {
+		die("cannot open preserved mount namespace %s", mnt_fname);
+	}
+	struct statfs ns_statfs_buf;
+	if (fstatfs(mnt_fd, &ns_statfs_buf) < 0) {
+		die("cannot inspect filesystem of preserved mount namespace file");
+	}
+	if (ns_statfs_buf.f_type != NSFS_MAGIC
+	    && ns_statfs_buf.f_type != PROC_SUPER_MAGIC) {
+		return ESRCH;
+	}
+	if (!sc_is_ns_info_current(group, info_fname, group->classic_info)) {
+		debug("preserved mount namespace %s is stale", mnt_fname);
+		return ESRCH;
+	}
+	if (setns(mnt_fd, CLONE_NEWNS) < 0) {
+		die("cannot join preserved mount namespace %s", mnt_fname);
+	}
+	debug("joined preserved mount namespace %s", mnt_fname);
+	return 0;
+}
+
 static void setup_signals_for_helper(void)
 {
 	/* Ignore the SIGPIPE signal so that we get EPIPE on the read / write
@@ -824,7 +1283,13 @@ static void helper_main(struct sc_mount_ns *group, struct sc_apparmor *apparmor,
 			helper_capture_ns(group, parent);
 			break;
 		case HELPER_CMD_CAPTURE_PER_USER_MOUNT_NS:
-			helper_capture_per_user_ns(group, parent);
+			helper_capture_per_user_ns(group, parent, false);
+			break;
+		case HELPER_CMD_CAPTURE_SHARED_PER_USER_MOUNT_NS:
+			helper_capture_per_user_ns(group, parent, true);
+			break;
+		case HELPER_CMD_CAPTURE_CLASSIC_MOUNT_NS:
+			helper_capture_classic_ns(group, parent);
 			break;
 		}
 		if (write(group->pipe_helper[1], &command, sizeof command) < 0) {
@@ -859,15 +1324,39 @@ static void helper_capture_ns(struct sc_mount_ns *group, pid_t parent)
 	      (int)parent, dst);
 }
 
-static void helper_capture_per_user_ns(struct sc_mount_ns *group, pid_t parent)
+static void helper_capture_per_user_ns(struct sc_mount_ns *group, pid_t parent,
+				       bool shared)
 {
 	char src[PATH_MAX] = { 0 };
 	char dst[PATH_MAX] = { 0 };
-	uid_t uid = getuid();
 
-	debug("capturing per-snap, per-user mount namespace");
+	debug("capturing per-snap, per-user mount namespace%s",
+	      shared ? " shared by all users" : "");
 	sc_must_snprintf(src, sizeof src, "/proc/%d/ns/mnt", (int)parent);
-	sc_must_snprintf(dst, sizeof dst, "%s.%d.mnt", group->name, (int)uid);
+	sc_format_per_user_ns_fname(dst, sizeof dst, "", group->name, shared,
+				    "mnt");
+
+	/* Detach a stale namespace that may still be preserved there. */
+	if (umount2(dst, MNT_DETACH | UMOUNT_NOFOLLOW) < 0 && errno != EINVAL
+	    && errno != ENOENT) {
+		die("cannot unmount stale per-user mount namespace %s", dst);
+	}
+
+	/* The namespace constructed for the calling user alone is stale once
+	 * the namespace is shared by all users. */
+	if (shared) {
+		char stale[PATH_MAX] = { 0 };
+		sc_format_per_user_ns_fname(stale, sizeof stale, "",
+					    group->name, false, "mnt");
+		if (umount2(stale, MNT_DETACH | UMOUNT_NOFOLLOW) < 0
+		    && errno != EINVAL && errno != ENOENT) {
+			die("cannot unmount stale per-user mount namespace %s",
+			    stale);
+		}
+		if (unlink(stale) < 0 && errno != ENOENT) {
+			die("cannot remove %s", stale);
+		}
+	}
 
 	/* Ensure the bind mount destination exists. */
 	int fd = open(dst, O_CREAT | O_CLOEXEC | O_NOFOLLOW | O_RDONLY, 0600);
@@ -883,6 +1372,36 @@ static void helper_capture_per_user_ns(struct sc_mount_ns *group, pid_t parent)
 	      (int)parent, dst);
 }
 
+static void helper_capture_classic_ns(struct sc_mount_ns *group, pid_t parent)
+{
+	char src[PATH_MAX] = { 0 };
+	char dst[PATH_MAX] = { 0 };
+
+	debug("capturing mount namespace of classic snap instance");
+	sc_must_snprintf(src, sizeof src, "/proc/%d/ns/mnt", (int)parent);
+	sc_must_snprintf(dst, sizeof dst, "%s.classic.mnt", group->name);
+
+	/* Detach a stale namespace that may still be preserved there. */
+	if (umount2(dst, MNT_DETACH | UMOUNT_NOFOLLOW) < 0 && errno != EINVAL
+	    && errno != ENOENT) {
+		die("cannot unmount stale mount namespace %s", dst);
+	}
+
+	/* Ensure the bind mount destination exists. */
+	int fd = open(dst, O_CREAT | O_CLOEXEC | O_NOFOLLOW | O_RDONLY, 0600);
+	if (fd < 0) {
+		die("cannot create file %s", dst);
+	}
+	close(fd);
+
+	if (mount(src, dst, NULL, MS_BIND, NULL) < 0) {
+		die("cannot preserve mount namespace of process %d as %s",
+		    (int)parent, dst);
+	}
+	debug("mount namespace of process %d preserved as %s",
+	      (int)parent, dst);
+}
+
 static void sc_message_capture_helper(struct sc_mount_ns *group, int command_id)
 {
 	int ack;
@@ -941,7 +1460,26 @@ void sc_preserve_populated_mount_ns(struct sc_mount_ns *group)
 
 void sc_preserve_populated_per_user_mount_ns(struct sc_mount_ns *group)
 {
-	sc_message_capture_helper(group, HELPER_CMD_CAPTURE_PER_USER_MOUNT_NS);
+	if (group->per_user_info == NULL) {
+		debug("NOT preserving per-user mount namespace");
+		return;
+	}
+	sc_message_capture_helper(group, group->per_user_shared ?
+				  HELPER_CMD_CAPTURE_SHARED_PER_USER_MOUNT_NS :
+				  HELPER_CMD_CAPTURE_PER_USER_MOUNT_NS);
+	sc_store_per_user_ns_info(group);
+}
+
+void sc_preserve_populated_classic_mount_ns(struct sc_mount_ns *group)
+{
+	if (group->classic_info == NULL) {
+		die("precondition failed: mount namespace info is unknown");
+	}
+	sc_message_capture_helper(group, HELPER_CMD_CAPTURE_CLASSIC_MOUNT_NS);
+	char info_fname[PATH_MAX] = { 0 };
+	sc_must_snprintf(info_fname, sizeof info_fname, "snap.%s.classic.info",
+			 group->name);
+	sc_write_ns_info(group, info_fname, group->classic_info);
 }
 
 void sc_wait_for_helper(struct sc_mount_ns *group)
@@ -103,12 +103,42 @@ int sc_join_preserved_ns(struct sc_mount_ns *group, struct sc_apparmor
  * Technically the function opens /run/snapd/ns/snap.$SNAP_NAME.$UID.mnt and
  * tries to use setns() with the obtained file descriptor.
  *
- * The return is ESRCH if a preserved per-user mount namespace does not exist
- * and cannot be joined or zero otherwise.
+ * The preserved namespace is only joined if it was constructed from the same
+ * inputs as the namespace that would be constructed now, as recorded in
+ * /run/snapd/ns/snap.$SNAP_NAME.$UID.info. The inputs are the user mount
+ * profile, the per-snap mount namespace, which must be the current mount
+ * namespace, and the XDG_RUNTIME_DIR and SNAP_REAL_HOME environment variables.
+ *
+ * When applying the user mount profile gives the same result for all users,
+ * a single namespace, /run/snapd/ns/$SNAP_NAME.shared.mnt, is shared by all
+ * of them and the environment is not one of its inputs.
+ *
+ * The return is ESRCH if a preserved per-user mount namespace does not exist,
+ * is stale or cannot be joined or zero otherwise.
 **/
 int sc_join_preserved_per_user_ns(struct sc_mount_ns *group,
 				  const char *snap_name);
 
+/**
+ * Join a preserved mount namespace of a parallel instance of a classic snap.
+ *
+ * Technically the function opens
+ * /run/snapd/ns/$SNAP_INSTANCE_NAME.classic.mnt and tries to use setns()
+ * with the obtained file descriptor. It must be called from the initial mount
+ * namespace.
+ *
+ * The preserved namespace is only joined if it was constructed from the same
+ * inputs as the namespace that would be constructed now, as recorded in
+ * /run/snapd/ns/snap.$SNAP_INSTANCE_NAME.classic.info. The inputs are the
+ * base snap, the initial mount namespace and the snap and data directories of
+ * the instance.
+ *
+ * The return is ESRCH if a preserved mount namespace does not exist, is stale
+ * or cannot be joined or zero otherwise.
+ **/
+int sc_join_preserved_classic_ns(struct sc_mount_ns *group,
+				 const sc_invocation * inv);
+
 /**
  * Fork off a helper process for mount namespace capture.
  *
@@ -136,8 +166,27 @@ void sc_fork_helper(struct sc_mount_ns *group, struct sc_apparmor *apparmor);
  **/
 void sc_preserve_populated_mount_ns(struct sc_mount_ns *group);
 
+/**
+ * Preserve prepared per-user namespace group.
+ *
+ * This function works like sc_preserve_populated_mount_ns() but captures the
+ * per-user mount namespace, replacing a stale one if necessary, and records
+ * the inputs it was constructed from. It must be preceded by a call to
+ * sc_join_preserved_per_user_ns(). A namespace whose inputs cannot be
+ * described, because the user mount profile cannot be read, is not preserved.
+ **/
 void sc_preserve_populated_per_user_mount_ns(struct sc_mount_ns *group);
 
+/**
+ * Preserve prepared mount namespace of a parallel instance of a classic snap.
+ *
+ * This function works like sc_preserve_populated_mount_ns() but captures the
+ * namespace as /run/snapd/ns/$SNAP_INSTANCE_NAME.classic.mnt, replacing a
+ * stale one if necessary, and records the inputs it was constructed from. It
+ * must be preceded by a call to sc_join_preserved_classic_ns().
+ **/
+void sc_preserve_populated_classic_mount_ns(struct sc_mount_ns *group);
+
 /**
  * Ask the helper process to terminate and wait for it to finish.
  *
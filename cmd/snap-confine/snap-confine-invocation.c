@@ -21,6 +21,7 @@
 #include <unistd.h>
 
 #include "../libsnap-confine-private/cleanup-funcs.h"
+#include "../libsnap-confine-private/infofile.h"
 #include "../libsnap-confine-private/snap-dir.h"
 #include "../libsnap-confine-private/snap.h"
 #include "../libsnap-confine-private/string-utils.h"
@@ -168,14 +169,15 @@ static char *read_homedirs_from_system_params(void) {
         return NULL;
     }
 
-    char *line SC_CLEANUP(sc_cleanup_string) = NULL;
-    size_t line_size = 0;
-    while (getline(&line, &line_size, f) != -1) {
-        if (sc_startswith(line, "homedirs=")) {
-            return sc_strdup(line + (sizeof("homedirs=") - 1));
-        }
+    /* Lines other than key=value pairs are not an error, as snapd may add
+     * other settings to the file in the future. */
+    char *homedirs = NULL;
+    sc_infofile_key keys[] = {{.key = "homedirs", .value = &homedirs}};
+    sc_error *err = NULL;
+    if (sc_infofile_get_keys(f, keys, 1, SC_INFOFILE_LENIENT, &err) < 0) {
+        sc_die_on_error(err);
     }
-    return NULL;
+    return homedirs;
 }
 
 void sc_invocation_init_homedirs(sc_invocation *inv) {
@@ -311,6 +311,7 @@ static void sc_cleanup_preserved_process_state(sc_preserved_process_state
 }
 
 static void enter_classic_execution_environment(const sc_invocation * inv,
+						struct sc_apparmor *aa,
 						gid_t real_gid,
 						gid_t saved_gid);
 static void enter_non_classic_execution_environment(sc_invocation * inv,
@@ -452,8 +453,8 @@ int main(int argc, char **argv)
 	}
 
 	if (invocation.classic_confinement) {
-		enter_classic_execution_environment(&invocation, real_gid,
-						    saved_gid);
+		enter_classic_execution_environment(&invocation, &apparmor,
+						    real_gid, saved_gid);
 	} else {
 		enter_non_classic_execution_environment(&invocation,
 							&apparmor,
@@ -578,6 +579,7 @@ int main(int argc, char **argv)
 }
 
 static void enter_classic_execution_environment(const sc_invocation *inv,
+						struct sc_apparmor *aa,
 						gid_t real_gid, gid_t saved_gid)
 {
 	/* with parallel-instances enabled, main() reassociated with the mount ns of
@@ -612,26 +614,39 @@ static void enter_classic_execution_environment(const sc_invocation *inv,
 	 *   - set slave propagation recursively on SNAP_MOUNT_DIR and /var/snap
 	 *   - recursively bind mount SNAP_MOUNT_DIR/<snap>_<key> on top of SNAP_MOUNT_DIR/<snap>
 	 *   - recursively bind mount /var/snap/<snap>_<key> on top of /var/snap/<snap>
+	 *   - preserve the mount namespace and reuse it while it is not stale
 	 *
 	 * The destination directories /var/snap/<snap> and SNAP_MOUNT_DIR/<snap>
 	 * are guaranteed to exist and were created during installation of a given
 	 * instance.
 	 */
 
-	if (unshare(CLONE_NEWNS) < 0) {
-		die("cannot unshare the mount namespace for parallel installed classic snap");
+	if (sc_streq(inv->snap_instance, inv->snap_name)) {
+		if (unshare(CLONE_NEWNS) < 0) {
+			die("cannot unshare the mount namespace for parallel installed classic snap");
+		}
+		return;
 	}
 
 	/* Parallel installed classic snap get special handling */
-	if (!sc_streq(inv->snap_instance, inv->snap_name)) {
+	int snap_lock_fd = sc_lock_snap(inv->snap_instance);
+	struct sc_mount_ns *group = sc_open_mount_ns(inv->snap_instance);
+	sc_fork_helper(group, aa);
+	if (sc_join_preserved_classic_ns(group, inv) == ESRCH) {
 		debug
 		    ("(experimental) setting up environment for classic snap instance %s",
 		     inv->snap_instance);
+		if (unshare(CLONE_NEWNS) < 0) {
+			die("cannot unshare the mount namespace for parallel installed classic snap");
+		}
 
 		/* set up mappings for snap and data directories */
 		sc_setup_parallel_instance_classic_mounts(inv->snap_name,
 							  inv->snap_instance);
+		sc_preserve_populated_classic_mount_ns(group);
 	}
+	sc_unlock(snap_lock_fd);
+	sc_close_mount_ns(group);
 }
 
 /* max wait time for /var/lib/snapd/cgroup/<snap>.devices to appear */
@@ -670,15 +685,13 @@ static void sc_get_device_cgroup_setup(const sc_invocation *inv, struct sc_devic
 
 	sc_error *err SC_CLEANUP(sc_cleanup_error) = NULL;
 	char *self_managed_value SC_CLEANUP(sc_cleanup_string) = NULL;
-	if (sc_infofile_get_key
-	    (stream, "self-managed", &self_managed_value, &err) < 0) {
-		sc_die_on_error(err);
-	}
-	rewind(stream);
-
 	char *non_strict_value SC_CLEANUP(sc_cleanup_string) = NULL;
-	if (sc_infofile_get_key(stream, "non-strict", &non_strict_value, &err) <
-	    0) {
+	sc_infofile_key keys[] = {
+		{.key = "self-managed",.value = &self_managed_value},
+		{.key = "non-strict",.value = &non_strict_value},
+	};
+	if (sc_infofile_get_keys
+	    (stream, keys, sizeof keys / sizeof *keys, 0, &err) < 0) {
 		sc_die_on_error(err);
 	}
 
@@ -17,6 +17,7 @@
 #include "config.h"
 
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
@@ -26,7 +27,9 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <limits.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <dlfcn.h>
 
 #include <libudev.h>
@@ -192,7 +195,7 @@ static void sc_udev_allow_assigned_device(sc_device_cgroup *cgroup,
 	}
 }
 
-static void sc_udev_setup_acls_common(sc_device_cgroup *cgroup)
+static void sc_udev_allow_base(sc_device_cgroup *cgroup)
 {
 
 	/* Allow access to various devices. */
@@ -203,6 +206,40 @@ static void sc_udev_setup_acls_common(sc_device_cgroup *cgroup)
 	sc_udev_allow_dev_net_tun(cgroup);
 }
 
+/**
+ * Compute a stamp of the state of the devices allowed for all snaps.
+ *
+ * The devices which are not static are all found in /dev or /dev/net, whose
+ * modification time changes whenever a device node is created or removed
+ * there. The stamp is a hash of both.
+ **/
+static uint64_t sc_udev_base_stamp(void)
+{
+	static const char *dirs[] = { "/dev", "/dev/net" };
+	/* FNV-1a */
+	uint64_t stamp = 14695981039346656037ULL;
+	for (size_t i = 0; i < sizeof dirs / sizeof *dirs; i++) {
+		struct stat sbuf;
+		uint64_t data[3] = { 0 };
+		if (stat(dirs[i], &sbuf) == 0) {
+			data[0] = sbuf.st_ino;
+			data[1] = sbuf.st_mtim.tv_sec;
+			data[2] = sbuf.st_mtim.tv_nsec;
+		}
+		const unsigned char *p = (const unsigned char *)data;
+		for (size_t j = 0; j < sizeof data; j++) {
+			stamp = (stamp ^ p[j]) * 1099511628211ULL;
+		}
+	}
+	return stamp;
+}
+
+static void sc_udev_setup_acls_common(sc_device_cgroup *cgroup)
+{
+	sc_device_cgroup_allow_base(cgroup, sc_udev_base_stamp(),
+				    sc_udev_allow_base);
+}
+
 static char *sc_security_to_udev_tag(const char *security_tag)
 {
 	char *udev_tag = sc_strdup(security_tag);
@@ -264,28 +301,152 @@ static void setup_current_tags_support(void)
 	/* coverity[leaked_storage] */
 }
 
-void sc_setup_device_cgroup(const char *security_tag,
-			    sc_device_cgroup_mode mode)
+/**
+ * Prepare the device cgroup wrapper, on first use.
+ *
+ * The cgroup is only set up once there are devices assigned to the snap,
+ * unless it is required.
+ **/
+static sc_device_cgroup *sc_udev_device_cgroup(sc_device_cgroup **cgroup,
+					       const char *security_tag)
 {
-	debug("setting up device cgroup, mode \"%s\"",
-	      mode == SC_DEVICE_CGROUP_MODE_REQUIRED ? "required" : "optional");
+	if (*cgroup == NULL) {
+		*cgroup = sc_device_cgroup_new(security_tag, 0);
+		/* Setup the device group access control list */
+		sc_udev_setup_acls_common(*cgroup);
+	}
+	return *cgroup;
+}
 
-	setup_current_tags_support();
-	if (__sc_udev_device_has_current_tag == NULL) {
-		debug("no current tags support present");
+/**
+ * Check whether the tag of a device is current, as recorded in the udev
+ * database entry of the device.
+ *
+ * Since systemd v247 tags are sticky and remain assigned to a device until it
+ * is removed, while the tags assigned by the rules in effect when the device
+ * was last processed are listed as current ones, in "Q:" lines.
+ **/
+static bool sc_udev_db_has_current_tag(const char *device_id,
+				       const char *udev_tag)
+{
+	char data_path[PATH_MAX] = { 0 };
+	sc_must_snprintf(data_path, sizeof data_path, "/run/udev/data/%s",
+			 device_id);
+	FILE *data SC_CLEANUP(sc_cleanup_file) = fopen(data_path, "re");
+	if (data == NULL) {
+		/* the device went away in the meantime */
+		debug("cannot open %s", data_path);
+		return false;
 	}
+	char *line SC_CLEANUP(sc_cleanup_string) = NULL;
+	size_t line_size = 0;
+	ssize_t len;
+	size_t tag_len = strlen(udev_tag);
+	while ((len = getline(&line, &line_size, data)) != -1) {
+		if (line[len - 1] == '\n') {
+			line[--len] = '\0';
+		}
+		if ((size_t)len == tag_len + 2 && sc_startswith(line, "Q:")
+		    && sc_streq(line + 2, udev_tag)) {
+			return true;
+		}
+	}
+	if (ferror(data)) {
+		die("cannot read %s", data_path);
+	}
+	return false;
+}
 
-	/* Derive the udev tag from the snap security tag.
-	 *
-	 * Because udev does not allow for dots in tag names, those are replaced by
-	 * underscores in snapd. We just match that behavior. */
-	char *udev_tag SC_CLEANUP(sc_cleanup_string) = NULL;
-	udev_tag = sc_security_to_udev_tag(security_tag);
+/**
+ * Allow access to assigned devices, as found in the udev database.
+ *
+ * udev indexes the devices assigned to each tag in /run/udev/tags/$TAG, with
+ * an entry per device named after the device ID, which is c or b followed by
+ * the major and minor numbers for devices with a device node. Reading it
+ * directly avoids enumerating the devices through libudev, which allocates
+ * and populates a device object from sysfs for each of them.
+ *
+ * Returns the number of devices tagged, or -1 if the database is not there.
+ **/
+static int sc_udev_db_allow_assigned_devices(sc_device_cgroup **cgroup,
+					     const char *security_tag,
+					     const char *udev_tag)
+{
+	char tag_path[PATH_MAX] = { 0 };
+	sc_must_snprintf(tag_path, sizeof tag_path, "/run/udev/tags/%s",
+			 udev_tag);
+	DIR *tag_dir SC_CLEANUP(sc_cleanup_closedir) = opendir(tag_path);
+	if (tag_dir == NULL) {
+		if (errno != ENOENT) {
+			die("cannot open %s", tag_path);
+		}
+		if (access("/run/udev/tags", F_OK) < 0) {
+			debug("udev database not found");
+			return -1;
+		}
+		/* no device was ever assigned the tag */
+		return 0;
+	}
+
+	int tagged = 0;
+	while (true) {
+		errno = 0;
+		struct dirent *dent = readdir(tag_dir);
+		if (dent == NULL) {
+			if (errno != 0) {
+				die("cannot read directory %s", tag_path);
+			}
+			break;
+		}
+		if (dent->d_name[0] == '.') {
+			continue;
+		}
+		tagged++;
+
+		/* Like in sc_udev_enumerate_assigned_devices, only devices with
+		 * a matching current tag set up the cgroup, whether they have a
+		 * device node or not. */
+		if (__sc_udev_device_has_current_tag != NULL) {
+			if (!sc_udev_db_has_current_tag(dent->d_name, udev_tag)) {
+				debug("device %s has no matching current tag",
+				      dent->d_name);
+				continue;
+			}
+			debug("device %s has matching current tag",
+			      dent->d_name);
+		}
+		sc_device_cgroup *device_cgroup =
+		    sc_udev_device_cgroup(cgroup, security_tag);
+
+		char type = 0;
+		unsigned int major = 0, minor = 0;
+		int end = 0;
+		if (sscanf(dent->d_name, "%c%u:%u%n", &type, &major, &minor,
+			   &end) != 3 || dent->d_name[end] != '\0'
+		    || (type != 'c' && type != 'b')) {
+			/* network interfaces and devices without a device
+			 * node, such as USB interfaces */
+			debug("device %s has no device node", dent->d_name);
+			continue;
+		}
+		sc_device_cgroup_allow(device_cgroup,
+				       type == 'c' ? S_IFCHR : S_IFBLK, major,
+				       minor);
+	}
+	return tagged;
+}
 
+/**
+ * Allow access to assigned devices, as enumerated by udev.
+ *
+ * Returns the number of devices tagged.
+ **/
+static int sc_udev_enumerate_assigned_devices(sc_device_cgroup **cgroup,
+					      const char *security_tag,
+					      const char *udev_tag)
+{
 	/* Use udev APIs to talk to udev-the-daemon to determine the list of
-	 * "devices" with that tag assigned. The list may be empty, in which case
-	 * there's no udev tagging in effect and we must refrain from constructing
-	 * the cgroup as it would interfere with the execution of a program. */
+	 * "devices" with that tag assigned. */
 	struct udev SC_CLEANUP(sc_cleanup_udev) * udev = NULL;
 	udev = udev_new();
 	if (udev == NULL) {
@@ -303,40 +464,14 @@ void sc_setup_device_cgroup(const char *security_tag,
 	if (udev_enumerate_scan_devices(devices) < 0) {
 		die("cannot enumerate udev devices");
 	}
+
+	int tagged = 0;
 	/* NOTE: udev_list_entry is bound to life-cycle of the used udev_enumerate */
 	struct udev_list_entry *assigned;
 	assigned = udev_enumerate_get_list_entry(devices);
-	if (assigned == NULL) {
-		if (mode == SC_DEVICE_CGROUP_MODE_OPTIONAL) {
-			/* NOTE: Nothing is assigned, don't create or use the device cgroup. */
-			debug
-			    ("no devices tagged with %s, skipping device cgroup setup",
-			     udev_tag);
-			return;
-		} else {
-			/* the device cgroup was requested to be set up despite of no
-			 * devices being assigned to this snap */
-			debug
-			    ("no devices tagged with %s, but device cgroup is required, proceeding with setup",
-			     udev_tag);
-		}
-	}
-
-	/* cgroup wrapper is lazily initialized when devices are actually
-	 * assigned */
-	sc_device_cgroup *cgroup SC_CLEANUP(sc_device_cgroup_cleanup) = NULL;
-
-	if (mode == SC_DEVICE_CGROUP_MODE_REQUIRED) {
-		/* Normally the cgroup setup is done lazily, but since device cgroup is
-		 * required, prepare for mediation of device access regardless of
-		 * devices being properly tagged. */
-		cgroup = sc_device_cgroup_new(security_tag, 0);
-		/* Setup the device group access control list */
-		sc_udev_setup_acls_common(cgroup);
-	}
-
 	for (struct udev_list_entry * entry = assigned; entry != NULL;
 	     entry = udev_list_entry_get_next(entry)) {
+		tagged++;
 		const char *path = udev_list_entry_get_name(entry);
 		if (path == NULL) {
 			die("udev_list_entry_get_name failed");
@@ -370,17 +505,69 @@ void sc_setup_device_cgroup(const char *security_tag,
 			debug("device %s has matching current tag", path);
 		}
 
-		if (cgroup == NULL) {
-			/* Lazy initialization of cgroup wrapper only when we are sure that
-			 * there are devices assigned to this snap */
-			cgroup = sc_device_cgroup_new(security_tag, 0);
-			/* Setup the device group access control list */
-			sc_udev_setup_acls_common(cgroup);
-		}
-
-		sc_udev_allow_assigned_device(cgroup, device);
+		sc_udev_allow_assigned_device(sc_udev_device_cgroup
+					      (cgroup, security_tag), device);
 		udev_device_unref(device);
 	}
+	return tagged;
+}
+
+void sc_setup_device_cgroup(const char *security_tag,
+			    sc_device_cgroup_mode mode)
+{
+	debug("setting up device cgroup, mode \"%s\"",
+	      mode == SC_DEVICE_CGROUP_MODE_REQUIRED ? "required" : "optional");
+
+	setup_current_tags_support();
+	if (__sc_udev_device_has_current_tag == NULL) {
+		debug("no current tags support present");
+	}
+
+	/* Derive the udev tag from the snap security tag.
+	 *
+	 * Because udev does not allow for dots in tag names, those are replaced by
+	 * underscores in snapd. We just match that behavior. */
+	char *udev_tag SC_CLEANUP(sc_cleanup_string) = NULL;
+	udev_tag = sc_security_to_udev_tag(security_tag);
+
+	/* cgroup wrapper is lazily initialized when devices are actually
+	 * assigned */
+	sc_device_cgroup *cgroup SC_CLEANUP(sc_device_cgroup_cleanup) = NULL;
+
+	if (mode == SC_DEVICE_CGROUP_MODE_REQUIRED) {
+		/* Normally the cgroup setup is done lazily, but since device cgroup is
+		 * required, prepare for mediation of device access regardless of
+		 * devices being properly tagged. */
+		sc_udev_device_cgroup(&cgroup, security_tag);
+	}
+
+	/* Determine the list of "devices" with the tag assigned. The list may be
+	 * empty, in which case there's no udev tagging in effect and we must
+	 * refrain from constructing the cgroup as it would interfere with the
+	 * execution of a program. */
+	int tagged =
+	    sc_udev_db_allow_assigned_devices(&cgroup, security_tag, udev_tag);
+	if (tagged < 0) {
+		tagged =
+		    sc_udev_enumerate_assigned_devices(&cgroup, security_tag,
+						       udev_tag);
+	}
+	if (tagged == 0) {
+		if (mode == SC_DEVICE_CGROUP_MODE_OPTIONAL) {
+			/* NOTE: Nothing is assigned, don't create or use the device cgroup. */
+			debug
+			    ("no devices tagged with %s, skipping device cgroup setup",
+			     udev_tag);
+			return;
+		} else {
+			/* the device cgroup was requested to be set up despite of no
+			 * devices being assigned to this snap */
+			debug
+			    ("no devices tagged with %s, but device cgroup is required, proceeding with setup",
+			     udev_tag);
+		}
+	}
+
 	if (cgroup != NULL) {
 		/* Move ourselves to the device cgroup */
 		sc_device_cgroup_attach_pid(cgroup, getpid());
@@ -15,11 +15,19 @@
  *
  */
 
+#include <unistd.h>
+
+#include "../libsnap-confine-private/string-utils.h"
 #include "../libsnap-confine-private/utils.h"
 
 #include "snap-device-helper.h"
 
 int main(int argc, char *argv[]) {
+    /* not used by the udev rules yet, see snap_device_helper_run_batch() */
+    if ((argc == 2) && sc_streq(argv[1], "--batch")) {
+        return snap_device_helper_run_batch(STDIN_FILENO);
+    }
+
     int old_invocation_detected = (argc >= 5);
 
     if ((argc != 2) && !old_invocation_detected) {
@@ -42,6 +42,7 @@ static void sdh_test_tear_down(sdh_test_fixture *fixture, gconstpointer user_dat
 static struct mocks {
     size_t cgroup_new_calls;
     void *new_ret;
+    int new_errno;
     char *new_tag;
     int new_flags;
 
@@ -52,6 +53,7 @@ static struct mocks {
     int device_minor;
     int device_ret;
 
+    size_t cgroup_cleanup_calls;
 } mocks;
 
 static void mocks_reset(void) {
@@ -65,8 +67,12 @@ static void mocks_reset(void) {
 sc_device_cgroup *sc_device_cgroup_new(const char *security_tag, int flags) {
     g_debug("cgroup new called");
     mocks.cgroup_new_calls++;
+    g_free(mocks.new_tag);
     mocks.new_tag = g_strdup(security_tag);
     mocks.new_flags = flags;
+    if (mocks.new_errno != 0) {
+        errno = mocks.new_errno;
+    }
     return (sc_device_cgroup *)mocks.new_ret;
 }
 
@@ -86,6 +92,13 @@ int sc_device_cgroup_deny(sc_device_cgroup *self, int kind, int major, int minor
     return 0;
 }
 
+void sc_device_cgroup_cleanup(sc_device_cgroup **self) {
+    if (*self != NULL) {
+        mocks.cgroup_cleanup_calls++;
+    }
+    *self = NULL;
+}
+
 struct sdh_test_data {
     char *action;
     // snap.foo.bar
@@ -116,10 +129,13 @@ static void test_sdh_action(sdh_test_fixture *fixture, gconstpointer test_data)
         g_assert_cmpint(mocks.cgroup_new_calls, ==, 1);
         g_assert_cmpint(mocks.cgroup_allow_calls, ==, 1);
         g_assert_cmpint(mocks.cgroup_deny_calls, ==, 0);
+        /* the wrapper is disposed of so that the allowed device is written */
+        g_assert_cmpint(mocks.cgroup_cleanup_calls, ==, 1);
     } else if (g_strcmp0(td->action, "remove") == 0) {
         g_assert_cmpint(mocks.cgroup_new_calls, ==, 1);
         g_assert_cmpint(mocks.cgroup_allow_calls, ==, 0);
         g_assert_cmpint(mocks.cgroup_deny_calls, ==, 1);
+        g_assert_cmpint(mocks.cgroup_cleanup_calls, ==, 1);
     } else if (g_strcmp0(td->action, "unbind") == 0) {
         g_assert_cmpint(mocks.cgroup_new_calls, ==, 0);
         g_assert_cmpint(mocks.cgroup_allow_calls, ==, 0);
@@ -373,12 +389,12 @@ static void test_sdh_err_wrongdevmajorminor2(sdh_test_fixture *fixture, gconstpo
 
 static void test_sdh_err_badaction(sdh_test_fixture *fixture, gconstpointer test_data) {
     // bogus action
-    run_sdh_die("badaction", "snap_foo_bar", "8", "4", "block", "ERROR: unknown action \"badaction\"\n");
+    run_sdh_die("badaction", "snap_foo_bar", "8", "4", "block", "unknown action \"badaction\"\n");
 }
 
 static void test_sdh_err_noaction(sdh_test_fixture *fixture, gconstpointer test_data) {
     // bogus action
-    run_sdh_die(NULL, "snap_foo_bar", "8", "4", "block", "ERROR: no action given\n");
+    run_sdh_die(NULL, "snap_foo_bar", "8", "4", "block", "no action given\n");
 }
 
 static void test_sdh_err_funtag1(sdh_test_fixture *fixture, gconstpointer test_data) {
@@ -442,6 +458,159 @@ static void test_sdh_err_funtag13(sdh_test_fixture *fixture, gconstpointer test_
                 "malformed tag \"snap_foo__comp_hook__install\"\n");
 }
 
+/* run_sdh_batch_status runs the helper in batch mode on the given input and
+ * returns its status */
+static int run_sdh_batch_status(const char *input) {
+    int fds[2];
+    g_assert_cmpint(pipe(fds), ==, 0);
+    /* the input fits in the pipe buffer */
+    g_assert_cmpint(write(fds[1], input, strlen(input)), ==, strlen(input));
+    close(fds[1]);
+    int ret = snap_device_helper_run_batch(fds[0]);
+    close(fds[0]);
+    return ret;
+}
+
+/* run_sdh_batch runs the helper in batch mode on the given input */
+static void run_sdh_batch(const char *input) { g_assert_cmpint(run_sdh_batch_status(input), ==, 0); }
+
+static void test_sdh_batch(sdh_test_fixture *fixture, gconstpointer test_data) {
+    int bogus = 0;
+    mocks.new_ret = &bogus;
+
+    run_sdh_batch(
+        "add snap_foo_bar 8 4 block\n"
+        "\n"
+        "unbind snap_foo_bar 6 64\n"
+        "add snap_foo_baz 6 64 other\n"
+        "remove snap_foo_bar 8 4 block\n"
+        "add snap_foo_bar 6 64\n"
+        "add snap_foo_baz 4 1 module\n"
+        "change snap_foo_bar 6 65\n");
+    /* the device cgroup of each application is opened once */
+    g_assert_cmpint(mocks.cgroup_new_calls, ==, 2);
+    g_assert_cmpint(mocks.cgroup_cleanup_calls, ==, 2);
+    g_assert_cmpint(mocks.new_flags, ==, SC_DEVICE_CGROUP_FROM_EXISTING);
+    /* block device 8:4 was added and removed for snap.foo.bar */
+    g_assert_cmpint(mocks.cgroup_deny_calls, ==, 1);
+    g_assert_cmpint(mocks.cgroup_allow_calls, ==, 3);
+}
+
+static void test_sdh_batch_no_newline(sdh_test_fixture *fixture, gconstpointer test_data) {
+    int bogus = 0;
+    mocks.new_ret = &bogus;
+
+    run_sdh_batch("add snap_foo_bar 8 4 block\nadd snap_foo_bar 8 5 block");
+    g_assert_cmpint(mocks.cgroup_allow_calls, ==, 2);
+    g_assert_cmpint(mocks.device_minor, ==, 5);
+}
+
+static void test_sdh_batch_full(sdh_test_fixture *fixture, gconstpointer test_data) {
+    int bogus = 0;
+    mocks.new_ret = &bogus;
+
+    GString *input = g_string_new(NULL);
+    for (int i = 0; i < SDH_BATCH_MAX_EVENTS + 1; i++) {
+        g_string_append_printf(input, "add snap_foo_bar 6 %d\n", i);
+    }
+    run_sdh_batch(input->str);
+    g_string_free(input, TRUE);
+
+    /* a full batch is applied before reading further */
+    g_assert_cmpint(mocks.cgroup_new_calls, ==, 2);
+    g_assert_cmpint(mocks.cgroup_cleanup_calls, ==, 2);
+    g_assert_cmpint(mocks.cgroup_allow_calls, ==, SDH_BATCH_MAX_EVENTS + 1);
+    g_assert_cmpint(mocks.device_minor, ==, SDH_BATCH_MAX_EVENTS);
+}
+
+static void test_sdh_batch_no_cgroup(sdh_test_fixture *fixture, gconstpointer test_data) {
+    mocks.new_ret = NULL;
+    mocks.new_errno = ENOENT;
+
+    run_sdh_batch("add snap_foo_bar 8 4 block\nadd snap_foo_bar 8 5 block\n");
+    g_assert_cmpint(mocks.cgroup_new_calls, ==, 1);
+    g_assert_cmpint(mocks.cgroup_cleanup_calls, ==, 0);
+    g_assert_cmpint(mocks.cgroup_allow_calls, ==, 0);
+}
+
+/* run_sdh_batch_skip runs the helper in batch mode on input with an invalid
+ * event, which must be reported with msg and skipped, while the valid events
+ * are still applied */
+static void run_sdh_batch_skip(const char *input, int allow_calls, const char *msg) {
+    if (g_test_subprocess()) {
+        int bogus = 0;
+        mocks.new_ret = &bogus;
+        g_assert_cmpint(run_sdh_batch_status(input), ==, 1);
+        g_assert_cmpint(mocks.cgroup_allow_calls, ==, allow_calls);
+        return;
+    }
+    g_test_trap_subprocess(NULL, 0, 0);
+    g_test_trap_assert_passed();
+    g_test_trap_assert_stderr(msg);
+}
+
+static void test_sdh_batch_err_few_fields(sdh_test_fixture *fixture, gconstpointer test_data) {
+    run_sdh_batch_skip("add snap_foo_bar 8 4\nadd snap_foo_bar 8\nadd snap_foo_bar 8 5\n", 2,
+                       "skipping invalid event on line 2: too few fields\n");
+}
+
+static void test_sdh_batch_err_many_fields(sdh_test_fixture *fixture, gconstpointer test_data) {
+    run_sdh_batch_skip("add snap_foo_bar 8 4 block extra\nadd snap_foo_bar 8 5 block\n", 1,
+                       "skipping invalid event on line 1: too many fields\n");
+}
+
+static void test_sdh_batch_err_badtag(sdh_test_fixture *fixture, gconstpointer test_data) {
+    run_sdh_batch_skip("add snap_foo_bar 8 4 block\nadd foo_bar 8 4 block\n", 1,
+                       "skipping invalid event on line 2: malformed tag \"foo_bar\"\n");
+}
+
+static void test_sdh_batch_err_badaction(sdh_test_fixture *fixture, gconstpointer test_data) {
+    run_sdh_batch_skip("badaction snap_foo_bar 8 4 block\nadd snap_foo_bar 8 5 block\n", 1,
+                       "skipping invalid event on line 1: unknown action \"badaction\"\n");
+}
+
+static void test_sdh_batch_err_badnumber(sdh_test_fixture *fixture, gconstpointer test_data) {
+    /* the invalid event is the last one, without a newline */
+    run_sdh_batch_skip("add snap_foo_bar 8 4 block\nadd snap_foo_bar 8 4x block", 1,
+                       "skipping invalid event on line 2: malformed number \"4x\"\n");
+}
+
+static void test_sdh_batch_err_too_long(sdh_test_fixture *fixture, gconstpointer test_data) {
+    if (g_test_subprocess()) {
+        int bogus = 0;
+        mocks.new_ret = &bogus;
+
+        /* the line is longer than the read buffer, it is written from
+         * another process as it does not fit in the pipe buffer */
+        GString *input = g_string_new("add snap_foo_bar 8 4 block\nadd snap_foo_bar 8 5 block");
+        for (int i = 0; i < 64 * 1024; i++) {
+            g_string_append_c(input, ' ');
+        }
+        g_string_append(input, "\nadd snap_foo_bar 8 6 block\n");
+        int fds[2];
+        g_assert_cmpint(pipe(fds), ==, 0);
+        pid_t pid = fork();
+        g_assert_cmpint(pid, >=, 0);
+        if (pid == 0) {
+            close(fds[0]);
+            g_assert_cmpint(write(fds[1], input->str, input->len), ==, input->len);
+            _exit(0);
+        }
+        close(fds[1]);
+        g_assert_cmpint(snap_device_helper_run_batch(fds[0]), ==, 1);
+        close(fds[0]);
+        g_assert_cmpint(waitpid(pid, NULL, 0), ==, pid);
+        g_string_free(input, TRUE);
+
+        g_assert_cmpint(mocks.cgroup_allow_calls, ==, 2);
+        g_assert_cmpint(mocks.device_minor, ==, 6);
+        return;
+    }
+    g_test_trap_subprocess(NULL, 0, 0);
+    g_test_trap_assert_passed();
+    g_test_trap_assert_stderr("skipping invalid event on line 2: too long\n");
+}
+
 static struct sdh_test_data add_data = {"add", "snap.foo.bar", "snap_foo_bar"};
 static struct sdh_test_data change_data = {"change", "snap.foo.bar", "snap_foo_bar"};
 
@@ -519,4 +688,15 @@ static void __attribute__((constructor)) init(void) {
     _test_add("/snap-device-helper/component/parallel/add", &component_instance_add_hook_data, test_sdh_action);
 
     _test_add("/snap-device-helper/nvme", NULL, test_sdh_action_nvme);
+
+    _test_add("/snap-device-helper/batch", NULL, test_sdh_batch);
+    _test_add("/snap-device-helper/batch/no-newline", NULL, test_sdh_batch_no_newline);
+    _test_add("/snap-device-helper/batch/full", NULL, test_sdh_batch_full);
+    _test_add("/snap-device-helper/batch/no-cgroup", NULL, test_sdh_batch_no_cgroup);
+    _test_add("/snap-device-helper/batch/err/few-fields", NULL, test_sdh_batch_err_few_fields);
+    _test_add("/snap-device-helper/batch/err/many-fields", NULL, test_sdh_batch_err_many_fields);
+    _test_add("/snap-device-helper/batch/err/bad-tag", NULL, test_sdh_batch_err_badtag);
+    _test_add("/snap-device-helper/batch/err/bad-action", NULL, test_sdh_batch_err_badaction);
+    _test_add("/snap-device-helper/batch/err/bad-number", NULL, test_sdh_batch_err_badnumber);
+    _test_add("/snap-device-helper/batch/err/too-long", NULL, test_sdh_batch_err_too_long);
 }
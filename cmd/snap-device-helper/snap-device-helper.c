@@ -18,6 +18,7 @@
 #include <fnmatch.h>
 #include <libgen.h>
 #include <limits.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -28,43 +29,53 @@
 
 #include "../libsnap-confine-private/cleanup-funcs.h"
 #include "../libsnap-confine-private/device-cgroup-support.h"
+#include "../libsnap-confine-private/error.h"
 #include "../libsnap-confine-private/snap.h"
 #include "../libsnap-confine-private/string-utils.h"
 #include "../libsnap-confine-private/utils.h"
 
 #include "snap-device-helper.h"
 
-static unsigned long must_strtoul(const char *str) {
+static unsigned long parse_number(const char *str, sc_error **errorp) {
+    sc_error *err = NULL;
     char *end = NULL;
     unsigned long val = strtoul(str, &end, 10);
     if (*end != '\0') {
-        die("malformed number \"%s\"", str);
+        err = sc_error_init_simple("malformed number \"%s\"", str);
     }
+    sc_error_forward(errorp, err);
     return val;
 }
 
-static void reverse_component_separator_encoding(char *tag, const char *original) {
+static void reverse_component_separator_encoding(char *tag, const char *original, sc_error **errorp) {
+    sc_error *err = NULL;
     char *separator = strstr(tag, "__");
     if (separator == NULL) {
-        return;
+        goto out;
     }
 
     // if there is another double underscore anywhere in the string, something is wrong
     if (strstr(separator + 2, "__") != NULL) {
-        die("malformed tag \"%s\"", original);
+        err = sc_error_init_simple("malformed tag \"%s\"", original);
+        goto out;
     }
 
     *separator = '+';
     memmove(separator + 1, separator + 2, strlen(separator + 2) + 1);
+out:
+    sc_error_forward(errorp, err);
 }
 
 /* udev_to_security_tag converts a udev tag (snap_foo_bar) to security tag
- * (snap.foo.bar) */
-static char *udev_to_security_tag(const char *udev_tag) {
+ * (snap.foo.bar), returns NULL if the udev tag is malformed */
+static char *udev_to_security_tag(const char *udev_tag, sc_error **errorp) {
+    sc_error *err = NULL;
+    char *tag = NULL;
     if (!sc_startswith(udev_tag, "snap_")) {
-        die("malformed tag \"%s\"", udev_tag);
+        err = sc_error_init_simple("malformed tag \"%s\"", udev_tag);
+        goto out;
     }
-    char *tag = sc_strdup(udev_tag);
+    tag = sc_strdup(udev_tag);
     /* possible udev tags are:
      * snap_foo_bar
      * snap_foo_instance_bar
@@ -82,7 +93,8 @@ static char *udev_to_security_tag(const char *udev_tag) {
      */
     size_t tag_len = strlen(tag);
     if (tag_len < strlen("snap_a_b") || tag_len > SNAP_SECURITY_TAG_MAX_LEN) {
-        die("tag \"%s\" length %zu is incorrect", udev_tag, tag_len);
+        err = sc_error_init_simple("tag \"%s\" length %zu is incorrect", udev_tag, tag_len);
+        goto out;
     }
 
     const size_t snap_prefix_len = strlen("snap_");
@@ -95,12 +107,16 @@ static char *udev_to_security_tag(const char *udev_tag) {
     // plus signs, used to denote snap component names, are encoded in the udev
     // tag as double underscores, so we swap out the double underscores for plus
     // signs. if there is more than one occurrence of a double underscore, we fail
-    reverse_component_separator_encoding(tag, udev_tag);
+    reverse_component_separator_encoding(tag, udev_tag, &err);
+    if (err != NULL) {
+        goto out;
+    }
 
     /* find the last separator */
     char *last_sep = strrchr(tag, '_');
     if (last_sep == NULL) {
-        die("missing app name in tag \"%s\"", udev_tag);
+        err = sc_error_init_simple("missing app name in tag \"%s\"", udev_tag);
+        goto out;
     }
     *last_sep = '.';
     /* we are left with the following possibilities:
@@ -157,7 +173,8 @@ static char *udev_to_security_tag(const char *udev_tag) {
         }
     }
     if (snap_name_end <= snap_name_start) {
-        die("missing snap name in tag \"%s\"", udev_tag);
+        err = sc_error_init_simple("missing snap name in tag \"%s\"", udev_tag);
+        goto out;
     }
 
     char *component_name = NULL;
@@ -170,7 +187,8 @@ static char *udev_to_security_tag(const char *udev_tag) {
     char *comp_sep = strchr(snap_name_start, '+');
     if (comp_sep != NULL) {
         if (comp_sep >= snap_name_end) {
-            die("component separator in tag \"%s\" is misplaced", udev_tag);
+            err = sc_error_init_simple("component separator in tag \"%s\" is misplaced", udev_tag);
+            goto out;
         }
 
         char *comp_name_start = comp_sep + 1;
@@ -183,17 +201,20 @@ static char *udev_to_security_tag(const char *udev_tag) {
         // check this again, since snap_name_end was updated. this would catch the case:
         // snap.+comp.hook.hookname
         if (snap_name_end <= snap_name_start) {
-            die("missing snap name in tag \"%s\"", udev_tag);
+            err = sc_error_init_simple("missing snap name in tag \"%s\"", udev_tag);
+            goto out;
         }
 
         // this catches the case: snap.foo_instance+.hook.hookname
         if (comp_name_end <= comp_name_start) {
-            die("missing component name in tag \"%s\"", udev_tag);
+            err = sc_error_init_simple("missing component name in tag \"%s\"", udev_tag);
+            goto out;
         }
 
         size_t comp_name_len = (size_t)(comp_name_end - comp_name_start);
         if (comp_name_len >= sizeof(component_name_buffer)) {
-            die("component name of tag \"%s\" is too long", udev_tag);
+            err = sc_error_init_simple("component name of tag \"%s\" is too long", udev_tag);
+            goto out;
         }
         memcpy(component_name_buffer, comp_name_start, comp_name_len);
         component_name = component_name_buffer;
@@ -203,7 +224,8 @@ static char *udev_to_security_tag(const char *udev_tag) {
     char snap_instance[SNAP_INSTANCE_LEN + 1] = {0};
     size_t snap_instance_len = (size_t)(snap_name_end - snap_name_start);
     if (snap_instance_len >= sizeof(snap_instance)) {
-        die("snap instance of tag \"%s\" is too long", udev_tag);
+        err = sc_error_init_simple("snap instance of tag \"%s\" is too long", udev_tag);
+        goto out;
     }
     memcpy(snap_instance, snap_name_start, snap_instance_len);
 
@@ -213,13 +235,33 @@ static char *udev_to_security_tag(const char *udev_tag) {
     }
 
     if (!sc_security_tag_validate(tag, snap_instance, component_name)) {
-        die("security tag \"%s\" for snap \"%s\" is not valid", tag, snap_instance);
+        err = sc_error_init_simple("security tag \"%s\" for snap \"%s\" is not valid", tag, snap_instance);
+        goto out;
     }
 
+out:
+    if (err != NULL) {
+        sc_cleanup_string(&tag);
+    }
+    sc_error_forward(errorp, err);
     return tag;
 }
 
-int snap_device_helper_run(const struct sdh_invocation *inv) {
+/* sdh_event is a device event which was validated and needs to be applied to
+ * the device cgroup of a snap application */
+struct sdh_event {
+    char *security_tag;
+    int devtype;
+    int major;
+    int minor;
+    bool allow;
+};
+
+/* sdh_event_parse validates the invocation and fills the event, returns false
+ * when there is nothing to do for the invocation or when it is invalid, in
+ * which case the error is forwarded */
+static bool sdh_event_parse(const struct sdh_invocation *inv, struct sdh_event *event, sc_error **errorp) {
+    sc_error *err = NULL;
     const char *action = inv->action;
     const char *udev_tagname = inv->tagname;
     const char *major = inv->major;
@@ -230,26 +272,28 @@ int snap_device_helper_run(const struct sdh_invocation *inv) {
 
     if ((major == NULL) && (minor == NULL)) {
         /* no device node */
-        return 0;
+        return false;
     }
     if ((major == NULL) || (minor == NULL)) {
-        die("incomplete major/minor");
+        err = sc_error_init_simple("incomplete major/minor");
+        goto out;
     }
     if (subsystem != NULL) {
         /* ignore kobjects that are not devices */
         if (strcmp(subsystem, "subsystem") == 0) {
-            return 0;
+            return false;
         }
         if (strcmp(subsystem, "module") == 0) {
-            return 0;
+            return false;
         }
         if (strcmp(subsystem, "drivers") == 0) {
-            return 0;
+            return false;
         }
     }
 
     if (action == NULL) {
-        die("ERROR: no action given");
+        err = sc_error_init_simple("no action given");
+        goto out;
     }
     if (sc_streq(action, "bind") || sc_streq(action, "add") || sc_streq(action, "change")) {
         allow = true;
@@ -261,32 +305,265 @@ int snap_device_helper_run(const struct sdh_invocation *inv) {
          * We will disable access to the device once we get "remove". For "unbind", we
          * simply ignore it.
          */
-        return 0;
+        return false;
     } else {
-        die("ERROR: unknown action \"%s\"", action);
+        err = sc_error_init_simple("unknown action \"%s\"", action);
+        goto out;
     }
 
-    char *security_tag SC_CLEANUP(sc_cleanup_string) = udev_to_security_tag(udev_tagname);
+    int devmajor = parse_number(major, &err);
+    if (err != NULL) {
+        goto out;
+    }
+    int devminor = parse_number(minor, &err);
+    if (err != NULL) {
+        goto out;
+    }
+    char *security_tag = udev_to_security_tag(udev_tagname, &err);
+    if (err != NULL) {
+        goto out;
+    }
 
     int devtype = ((subsystem != NULL) && (strcmp(subsystem, "block") == 0)) ? S_IFBLK : S_IFCHR;
+    debug("%s device type is %s, %d:%d", action, (devtype == S_IFCHR) ? "char" : "block", devmajor, devminor);
 
+    *event = (struct sdh_event){
+        .security_tag = security_tag,
+        .devtype = devtype,
+        .major = devmajor,
+        .minor = devminor,
+        .allow = allow,
+    };
+out:
+    return sc_error_forward(errorp, err) == 0;
+}
+
+static void sdh_event_apply(sc_device_cgroup *cgroup, const struct sdh_event *event) {
+    if (event->allow) {
+        sc_device_cgroup_allow(cgroup, event->devtype, event->major, event->minor);
+    } else {
+        sc_device_cgroup_deny(cgroup, event->devtype, event->major, event->minor);
+    }
+}
+
+/* sdh_device_cgroup_new returns the device cgroup wrapper of a snap
+ * application, or NULL if the application is not running */
+static sc_device_cgroup *sdh_device_cgroup_new(const char *security_tag) {
     sc_device_cgroup *cgroup = sc_device_cgroup_new(security_tag, SC_DEVICE_CGROUP_FROM_EXISTING);
     if (!cgroup) {
         if (errno == ENOENT) {
             debug("device cgroup does not exist");
-            return 0;
+            return NULL;
         }
         die("cannot create device cgroup wrapper");
     }
+    return cgroup;
+}
 
-    int devmajor = must_strtoul(major);
-    int devminor = must_strtoul(minor);
-    debug("%s device type is %s, %d:%d", inv->action, (devtype == S_IFCHR) ? "char" : "block", devmajor, devminor);
-    if (allow) {
-        sc_device_cgroup_allow(cgroup, devtype, devmajor, devminor);
-    } else {
-        sc_device_cgroup_deny(cgroup, devtype, devmajor, devminor);
+int snap_device_helper_run(const struct sdh_invocation *inv) {
+    struct sdh_event event;
+    /* errors are fatal for a single invocation */
+    if (!sdh_event_parse(inv, &event, NULL)) {
+        return 0;
+    }
+    char *security_tag SC_CLEANUP(sc_cleanup_string) = event.security_tag;
+
+    /* the allowed devices are buffered and written when the wrapper is disposed of */
+    sc_device_cgroup *cgroup SC_CLEANUP(sc_device_cgroup_cleanup) = sdh_device_cgroup_new(security_tag);
+    if (cgroup != NULL) {
+        sdh_event_apply(cgroup, &event);
     }
 
     return 0;
 }
+
+/* events are coalesced into batches of at most this many distinct devices */
+#define SDH_BATCH_MAX_EVENTS 1024
+
+struct sdh_batch {
+    struct sdh_event events[SDH_BATCH_MAX_EVENTS];
+    size_t len;
+};
+
+/* sdh_batch_add adds the event to the batch, taking ownership of the security
+ * tag. An event for a device which is already in the batch replaces the
+ * earlier one, as only the last action on a device matters. */
+static void sdh_batch_add(struct sdh_batch *batch, struct sdh_event *event) {
+    for (size_t i = 0; i < batch->len; i++) {
+        struct sdh_event *queued = &batch->events[i];
+        if (queued->devtype == event->devtype && queued->major == event->major && queued->minor == event->minor &&
+            sc_streq(queued->security_tag, event->security_tag)) {
+            debug("coalescing events of device %d:%d for %s", event->major, event->minor, event->security_tag);
+            queued->allow = event->allow;
+            sc_cleanup_string(&event->security_tag);
+            return;
+        }
+    }
+    if (batch->len == SDH_BATCH_MAX_EVENTS) {
+        die("internal error: too many events in a batch");
+    }
+    batch->events[batch->len++] = *event;
+    event->security_tag = NULL;
+}
+
+/* sdh_batch_apply applies all the events in the batch, opening the device
+ * cgroup of each snap application once, and empties the batch. The wrappers
+ * are not kept past the batch as the map of an application is replaced when
+ * the application is started again with a different device policy. */
+static void sdh_batch_apply(struct sdh_batch *batch) {
+    for (size_t i = 0; i < batch->len; i++) {
+        if (batch->events[i].security_tag == NULL) {
+            /* already applied along with an earlier event of the same tag */
+            continue;
+        }
+        char *security_tag SC_CLEANUP(sc_cleanup_string) = batch->events[i].security_tag;
+        sc_device_cgroup *cgroup SC_CLEANUP(sc_device_cgroup_cleanup) = sdh_device_cgroup_new(security_tag);
+        for (size_t j = i; j < batch->len; j++) {
+            struct sdh_event *event = &batch->events[j];
+            if (j != i && (event->security_tag == NULL || !sc_streq(event->security_tag, security_tag))) {
+                continue;
+            }
+            if (cgroup != NULL) {
+                sdh_event_apply(cgroup, event);
+            }
+            if (j != i) {
+                sc_cleanup_string(&event->security_tag);
+            }
+        }
+        batch->events[i].security_tag = NULL;
+    }
+    batch->len = 0;
+}
+
+/* sdh_batch_add_line parses a line of the form:
+ * ACTION TAG MAJOR MINOR [SUBSYSTEM]
+ * and adds the event it describes to the batch, empty lines are ignored. An
+ * invalid event is not added and the error is forwarded. */
+static void sdh_batch_add_line(struct sdh_batch *batch, char *line, sc_error **errorp) {
+    sc_error *err = NULL;
+    char *fields[5] = {NULL};
+    size_t num_fields = 0;
+    char *saveptr = NULL;
+    for (char *field = strtok_r(line, " \t", &saveptr); field != NULL; field = strtok_r(NULL, " \t", &saveptr)) {
+        if (num_fields == sizeof fields / sizeof *fields) {
+            err = sc_error_init_simple("too many fields");
+            goto out;
+        }
+        fields[num_fields++] = field;
+    }
+    if (num_fields == 0) {
+        goto out;
+    }
+    if (num_fields < 4) {
+        err = sc_error_init_simple("too few fields");
+        goto out;
+    }
+    struct sdh_invocation inv = {
+        .action = fields[0],
+        .tagname = fields[1],
+        .major = fields[2],
+        .minor = fields[3],
+        .subsystem = fields[4],
+    };
+    struct sdh_event event;
+    if (sdh_event_parse(&inv, &event, &err)) {
+        sdh_batch_add(batch, &event);
+    }
+out:
+    sc_error_forward(errorp, err);
+}
+
+/* sdh_batch_add_line_or_skip adds the event on the line to the batch, an
+ * invalid event is reported and skipped so that the events around it are still
+ * applied. Returns false if the event was skipped. */
+static bool sdh_batch_add_line_or_skip(struct sdh_batch *batch, char *line, size_t lineno) {
+    sc_error *err SC_CLEANUP(sc_cleanup_error) = NULL;
+    sdh_batch_add_line(batch, line, &err);
+    if (err != NULL) {
+        fprintf(stderr, "skipping invalid event on line %zu: %s\n", lineno, sc_error_msg(err));
+        return false;
+    }
+    return true;
+}
+
+static bool sdh_input_pending(int fd) {
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    int ret;
+    do {
+        ret = poll(&pfd, 1, 0);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0) {
+        die("cannot poll for events");
+    }
+    return ret > 0 && (pfd.revents & POLLIN) != 0;
+}
+
+int snap_device_helper_run_batch(int fd) {
+    struct sdh_batch *batch = calloc(1, sizeof *batch);
+    if (batch == NULL) {
+        die("cannot allocate memory for a batch of events");
+    }
+    /* one byte is kept for terminating the last line if it has no newline */
+    char buf[64 * 1024];
+    size_t buf_len = 0;
+    size_t lineno = 0;
+    /* set while the rest of a line which was too long is being dropped */
+    bool skipping_line = false;
+    bool skipped = false;
+
+    for (;;) {
+        if (buf_len == sizeof buf - 1) {
+            if (!skipping_line) {
+                fprintf(stderr, "skipping invalid event on line %zu: too long\n", lineno + 1);
+                skipping_line = true;
+                skipped = true;
+            }
+            buf_len = 0;
+        }
+        ssize_t n = read(fd, buf + buf_len, sizeof buf - 1 - buf_len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            die("cannot read events");
+        }
+        if (n == 0) {
+            break;
+        }
+        buf_len += (size_t)n;
+
+        char *line = buf;
+        char *newline = NULL;
+        while ((newline = memchr(line, '\n', buf_len - (size_t)(line - buf))) != NULL) {
+            *newline = '\0';
+            ++lineno;
+            if (skipping_line) {
+                skipping_line = false;
+            } else if (!sdh_batch_add_line_or_skip(batch, line, lineno)) {
+                skipped = true;
+            }
+            if (batch->len == SDH_BATCH_MAX_EVENTS) {
+                sdh_batch_apply(batch);
+            }
+            line = newline + 1;
+        }
+        buf_len -= (size_t)(line - buf);
+        memmove(buf, line, buf_len);
+
+        /* events which arrive in a burst are queued up in the meantime, apply
+         * the batch once everything that was queued has been read */
+        if (!sdh_input_pending(fd)) {
+            sdh_batch_apply(batch);
+        }
+    }
+    if (buf_len > 0 && !skipping_line) {
+        buf[buf_len] = '\0';
+        if (!sdh_batch_add_line_or_skip(batch, buf, ++lineno)) {
+            skipped = true;
+        }
+    }
+    sdh_batch_apply(batch);
+    free(batch);
+
+    return skipped ? 1 : 0;
+}
@@ -28,4 +28,21 @@ struct sdh_invocation {
 
 int snap_device_helper_run(const struct sdh_invocation *inv);
 
+/**
+ * snap_device_helper_run_batch applies a stream of device events read from the
+ * given descriptor, which may be a pipe or a connected socket.
+ *
+ * Each line describes one event as "ACTION TAG MAJOR MINOR [SUBSYSTEM]", with
+ * the same meaning as in a single invocation. Events which are queued up are
+ * read together, events for the same device are coalesced and the device
+ * cgroup of each application is opened once per batch. An invalid event is
+ * reported and skipped, without affecting the other events. Returns when the
+ * end of the stream is reached, with a non-zero value if any event was
+ * skipped. *
+ * Nothing invokes snap-device-helper --batch yet, the udev rules generated by
+ * snapd still run one helper per event. Feeding events to the batch mode, from
+ * a udev rule or a socket unit, is left to a follow-up change.
+ */
+int snap_device_helper_run_batch(int fd);
+
 #endif /* SNAP_DEVICE_HELPER_H */
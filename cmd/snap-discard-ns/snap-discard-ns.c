@@ -24,12 +24,16 @@
 #include <limits.h>
 #include <linux/magic.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/mount.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/vfs.h>
 #include <unistd.h>
 
+#include "../libsnap-confine-private/device-cgroup-support.h"
 #include "../libsnap-confine-private/error.h"
 #include "../libsnap-confine-private/locking.h"
 #include "../libsnap-confine-private/snap.h"
@@ -40,85 +44,234 @@
 #define NSFS_MAGIC 0x6e736673
 #endif
 
-int main(int argc, char** argv) {
-    if (argc != 2 && argc != 3) {
-        printf("Usage: snap-discard-ns [--from-snap-confine] <SNAP-INSTANCE-NAME>\n");
-        return 0;
+/* The directory where preserved mount namespaces and the associated mount
+ * profiles and information files are kept. */
+static const char* ns_dir_path = "/run/snapd/ns";
+
+/**
+ * sc_discard_action describes what should happen to an entry of the namespace
+ * directory.
+ **/
+typedef enum sc_discard_action {
+    SC_DISCARD_NONE = 0,
+    SC_DISCARD_UNLINK = 1 << 0,
+    SC_DISCARD_UNMOUNT = 1 << 1,
+} sc_discard_action;
+
+/**
+ * sc_discard_target is a snap instance whose namespace is being discarded.
+ *
+ * Some targets are only locked, see sc_device_tag_instance_names.
+ **/
+typedef struct sc_discard_target {
+    char instance_name[SNAP_INSTANCE_LEN + 1];
+    int lock_fd;
+    bool discard;
+} sc_discard_target;
+
+/**
+ * sc_discard_targets is a sorted and de-duplicated set of discard targets.
+ **/
+typedef struct sc_discard_targets {
+    sc_discard_target* items;
+    size_t len;
+    size_t cap;
+} sc_discard_targets;
+
+static void sc_discard_targets_add_lock_only(sc_discard_targets* targets, const char* instance_name) {
+    if (targets->len == targets->cap) {
+        size_t new_cap = targets->cap == 0 ? 16 : targets->cap * 2;
+        sc_discard_target* items = reallocarray(targets->items, new_cap, sizeof *items);
+        if (items == NULL) {
+            die("cannot allocate memory for discard targets");
+        }
+        targets->items = items;
+        targets->cap = new_cap;
     }
-    const char* snap_instance_name;
-    bool from_snap_confine;
+    sc_discard_target* target = &targets->items[targets->len++];
+    sc_must_snprintf(target->instance_name, sizeof target->instance_name, "%s", instance_name);
+    target->lock_fd = -1;
+    target->discard = false;
+}
 
-    if (argc == 3) {
-        if (!sc_streq(argv[1], "--from-snap-confine")) {
-            die("unexpected argument %s", argv[1]);
+static void sc_discard_targets_add(sc_discard_targets* targets, const char* instance_name) {
+    sc_discard_targets_add_lock_only(targets, instance_name);
+    targets->items[targets->len - 1].discard = true;
+}
+
+static int sc_discard_target_cmp(const void* a, const void* b) {
+    return strcmp(((const sc_discard_target*)a)->instance_name, ((const sc_discard_target*)b)->instance_name);
+}
+
+/* Sort the targets and remove duplicates. The sort order doubles as the
+ * locking order, see sc_discard_targets_lock. */
+static void sc_discard_targets_sort_unique(sc_discard_targets* targets) {
+    if (targets->len == 0) {
+        return;
+    }
+    qsort(targets->items, targets->len, sizeof *targets->items, sc_discard_target_cmp);
+    size_t n = 1;
+    for (size_t i = 1; i < targets->len; ++i) {
+        if (!sc_streq(targets->items[i].instance_name, targets->items[n - 1].instance_name)) {
+            targets->items[n++] = targets->items[i];
+        } else if (targets->items[i].discard) {
+            targets->items[n - 1].discard = true;
         }
-        from_snap_confine = true;
-        snap_instance_name = argv[2];
-    } else {
-        from_snap_confine = false;
-        snap_instance_name = argv[1];
     }
+    targets->len = n;
+}
 
-    sc_error* err = NULL;
-    sc_instance_name_validate(snap_instance_name, &err);
-    sc_die_on_error(err);
+static sc_discard_target* sc_discard_targets_find(sc_discard_targets* targets, const char* instance_name) {
+    sc_discard_target key;
+    if (strlen(instance_name) >= sizeof key.instance_name) {
+        return NULL;
+    }
+    strcpy(key.instance_name, instance_name);
+    return bsearch(&key, targets->items, targets->len, sizeof *targets->items, sc_discard_target_cmp);
+}
 
-    int snap_lock_fd = -1;
-    if (from_snap_confine) {
-        sc_verify_snap_lock(snap_instance_name);
-    } else {
-        /* Grab the lock holding the snap instance. This prevents races from
-         * concurrently executing snap-confine. The lock is explicitly released
-         * during normal operation but it is not preserved across the life-cycle of
-         * the process anyway so no attempt is made to unlock it ahead of any call
-         * to die() */
-        snap_lock_fd = sc_lock_snap(snap_instance_name);
-    }
-    debug("discarding mount namespaces of snap %s", snap_instance_name);
-
-    const char* ns_dir_path = "/run/snapd/ns";
-    int ns_dir_fd = open(ns_dir_path, O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
-    if (ns_dir_fd < 0) {
-        /* The directory may legitimately not exist if no snap has started to
-         * prepare it. This is not an error condition. */
-        if (errno == ENOENT) {
-            return 0;
+/**
+ * Lock all the targets.
+ *
+ * Locks are always taken in the sorted order of instance names. Any two
+ * processes discarding overlapping sets of snaps acquire the shared locks in
+ * the same order and cannot deadlock. snap-confine only ever holds a single
+ * snap lock at a time.
+ **/
+static void sc_discard_targets_lock(sc_discard_targets* targets) {
+    /* Each lock is held open until we are done. Make sure that a large set of
+     * snaps does not exhaust the soft limit of open file descriptors. */
+    struct rlimit nofile;
+    if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur != RLIM_INFINITY &&
+        nofile.rlim_cur < targets->len + 64) {
+        nofile.rlim_cur = nofile.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &nofile) < 0) {
+            debug("cannot raise limit of open file descriptors");
+        }
+    }
+    for (size_t i = 0; i < targets->len; ++i) {
+        targets->items[i].lock_fd = sc_lock_snap(targets->items[i].instance_name);
+    }
+}
+
+static void sc_discard_targets_unlock(sc_discard_targets* targets) {
+    /* Release locks in the reverse order of acquisition. */
+    for (size_t i = targets->len; i > 0; --i) {
+        sc_discard_target* target = &targets->items[i - 1];
+        if (target->lock_fd != -1) {
+            sc_unlock(target->lock_fd);
+            target->lock_fd = -1;
+        }
+    }
+}
+
+/**
+ * Classify an entry of the namespace directory.
+ *
+ * The snap instance name the entry belongs to is stored in instance_name and
+ * the action to perform is returned. The following names are recognized:
+ *
+ * Preserved mount namespaces to unmount and unlink:
+ * - "$SNAP_INSTANCE_NAME.mnt"
+ * - "$SNAP_INSTANCE_NAME.*.mnt"
+ *
+ * Applied mount profiles to unlink:
+ * - "snap.$SNAP_INSTANCE_NAME.fstab"
+ * - "snap.$SNAP_INSTANCE_NAME.*.user-fstab"
+ *
+ * Mount namespace information files:
+ * - "snap.$SNAP_INSTANCE_NAME.info"
+ *
+ * Snap instance names never contain a dot so the name always extends to the
+ * first dot following the optional "snap." prefix.
+ **/
+static sc_discard_action sc_classify_ns_dir_entry(const char* dname, char* instance_name, size_t instance_name_size) {
+    const char* name = NULL;
+    const char* dot = NULL;
+    sc_discard_action action = SC_DISCARD_NONE;
+
+    if (sc_startswith(dname, "snap.")) {
+        name = dname + strlen("snap.");
+        dot = strchr(name, '.');
+        if (dot != NULL && (sc_streq(dot + 1, "fstab") || sc_streq(dot + 1, "info") ||
+                            sc_endswith(dot + 1, ".user-fstab") || sc_endswith(dot + 1, ".info"))) {
+            action = SC_DISCARD_UNLINK;
+        }
+    }
+    /* Anything else may still be a preserved mount namespace, including one
+     * of a snap called "snap". */
+    if (action == SC_DISCARD_NONE) {
+        name = dname;
+        dot = strchr(name, '.');
+        if (dot != NULL && (sc_streq(dot + 1, "mnt") || sc_endswith(dot + 1, ".mnt"))) {
+            action = SC_DISCARD_UNMOUNT | SC_DISCARD_UNLINK;
         }
+    }
+    if (action == SC_DISCARD_NONE) {
+        return SC_DISCARD_NONE;
+    }
+
+    size_t name_len = dot - name;
+    if (name_len == 0 || name_len >= instance_name_size) {
+        return SC_DISCARD_NONE;
+    }
+    memcpy(instance_name, name, name_len);
+    instance_name[name_len] = '\0';
+    return action;
+}
+
+/**
+ * Collect the names of all snap instances with files in the namespace
+ * directory.
+ **/
+static void sc_discard_targets_add_all(sc_discard_targets* targets, int ns_dir_fd) {
+    /* Use a separate open file description so that the directory offset of
+     * ns_dir_fd is not affected. */
+    int dir_fd = openat(ns_dir_fd, ".", O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+    if (dir_fd < 0) {
         die("cannot open path %s", ns_dir_path);
     }
+    DIR* dir = fdopendir(dir_fd);
+    if (dir == NULL) {
+        die("cannot fdopendir");
+    }
+    while (true) {
+        errno = 0;
+        struct dirent* dent = readdir(dir);
+        if (dent == NULL) {
+            if (errno != 0) {
+                die("cannot read next directory entry");
+            }
+            break;
+        }
+        char instance_name[SNAP_INSTANCE_LEN + 1];
+        if (sc_classify_ns_dir_entry(dent->d_name, instance_name, sizeof instance_name) == SC_DISCARD_NONE) {
+            continue;
+        }
+        sc_error* err = NULL;
+        sc_instance_name_validate(instance_name, &err);
+        if (err != NULL) {
+            debug("ignoring %s: %s", dent->d_name, sc_error_msg(err));
+            sc_error_free(err);
+            continue;
+        }
+        sc_discard_targets_add(targets, instance_name);
+    }
+    if (closedir(dir) < 0) {
+        die("cannot close directory");
+    }
+}
 
+/**
+ * Discard namespace files of all the targets in a single directory pass.
+ **/
+static void sc_discard_ns_dir_entries(int ns_dir_fd, sc_discard_targets* targets) {
     /* Move to the namespace directory. This is used so that we don't need to
      * traverse the path over and over in our upcoming umount2(2) calls. */
     if (fchdir(ns_dir_fd) < 0) {
         die("cannot move to directory %s", ns_dir_path);
     }
 
-    /* Create shell patterns that describe the things we are interested in:
-     *
-     * Preserved mount namespaces to unmount and unlink:
-     * - "$SNAP_INSTANCE_NAME.mnt"
-     * - "$SNAP_INSTANCE_NAME.[0-9]+.mnt"
-     *
-     * Applied mount profiles to unlink:
-     * - "snap.$SNAP_INSTANCE_NAME.fstab"
-     * - "snap.$SNAP_INSTANCE_NAME.[0-9]+.user-fstab"
-     *
-     * Mount namespace information files:
-     * - "snap.$SNAP_INSTANCE_NAME.info"
-     *
-     * Use PATH_MAX as the size of each buffer since those can store any file
-     * name. */
-    char sys_fstab_pattern[PATH_MAX];
-    char usr_fstab_pattern[PATH_MAX];
-    char sys_mnt_pattern[PATH_MAX];
-    char usr_mnt_pattern[PATH_MAX];
-    char sys_info_pattern[PATH_MAX];
-    sc_must_snprintf(sys_fstab_pattern, sizeof sys_fstab_pattern, "snap\\.%s\\.fstab", snap_instance_name);
-    sc_must_snprintf(usr_fstab_pattern, sizeof usr_fstab_pattern, "snap\\.%s\\.*\\.user-fstab", snap_instance_name);
-    sc_must_snprintf(sys_mnt_pattern, sizeof sys_mnt_pattern, "%s\\.mnt", snap_instance_name);
-    sc_must_snprintf(usr_mnt_pattern, sizeof usr_mnt_pattern, "%s\\.*\\.mnt", snap_instance_name);
-    sc_must_snprintf(sys_info_pattern, sizeof sys_info_pattern, "snap\\.%s\\.info", snap_instance_name);
-
     DIR* ns_dir = fdopendir(ns_dir_fd);
     if (ns_dir == NULL) {
         die("cannot fdopendir");
@@ -141,38 +294,18 @@ int main(int argc, char** argv) {
         /* We use dnet->d_name a lot so let's shorten it. */
         const char* dname = dent->d_name;
 
-        /* Check the four patterns that we have against the name and set the
-         * two should flags to decide further actions. Note that we always
-         * unlink matching files so that is not reflected in the structure. */
-        bool should_unmount = false;
-        bool should_unlink = false;
-        struct variant {
-            const char* pattern;
-            bool unmount;
-        };
-        struct variant variants[] = {
-            {.pattern = sys_mnt_pattern, .unmount = true},
-            {.pattern = usr_mnt_pattern, .unmount = true},
-            {.pattern = sys_fstab_pattern},
-            {.pattern = usr_fstab_pattern},
-            {.pattern = sys_info_pattern},
-        };
-        for (size_t i = 0; i < sizeof variants / sizeof *variants; ++i) {
-            struct variant* v = &variants[i];
-            debug("checking if %s matches %s", dname, v->pattern);
-            int match_result = fnmatch(v->pattern, dname, 0);
-            if (match_result == FNM_NOMATCH) {
-                continue;
-            } else if (match_result == 0) {
-                should_unmount |= v->unmount;
-                should_unlink = true;
-                debug("file %s matches pattern %s", dname, v->pattern);
-                /* One match is enough. */
-                break;
-            } else if (match_result < 0) {
-                die("cannot execute match against pattern %s", v->pattern);
-            }
+        /* Find out which snap the entry belongs to and what to do with it.
+         * Note that we always unlink matching files. */
+        char instance_name[SNAP_INSTANCE_LEN + 1];
+        sc_discard_action action = sc_classify_ns_dir_entry(dname, instance_name, sizeof instance_name);
+        if (action == SC_DISCARD_NONE) {
+            continue;
+        }
+        sc_discard_target* target = sc_discard_targets_find(targets, instance_name);
+        if (target == NULL || !target->discard) {
+            continue;
         }
+        debug("file %s belongs to snap %s", dname, instance_name);
 
         /* Stat the candidate directory entry to know what we are dealing with.
          */
@@ -188,7 +321,7 @@ int main(int argc, char** argv) {
             continue;
         }
 
-        if (should_unmount) {
+        if (action & SC_DISCARD_UNMOUNT) {
             /* If we are asked to unmount the file double check that it is
              * really a preserved mount namespace since the error code from
              * umount2(2) is inconclusive. */
@@ -209,7 +342,7 @@ int main(int argc, char** argv) {
             }
         }
 
-        if (should_unlink) {
+        if (action & SC_DISCARD_UNLINK) {
             debug("unlinking %s", dname);
             if (unlinkat(ns_dir_fd, dname, 0) < 0) {
                 die("cannot unlink %s", dname);
@@ -217,12 +350,264 @@ int main(int argc, char** argv) {
         }
     }
 
-    /* Close the directory and release the lock, we're done. */
+    /* Close the directory, we're done. */
     if (closedir(ns_dir) < 0) {
         die("cannot close directory");
     }
-    if (snap_lock_fd != -1) {
-        sc_unlock(snap_lock_fd);
+}
+
+/**
+ * Find the snap instances a security tag of a device cgroup may belong to.
+ *
+ * The pinned device maps and programs are named after the security tag with
+ * dots replaced by underscores, which also separate the snap name from the
+ * instance key. The forms are:
+ * - "snap_$SNAP_NAME_$APP"
+ * - "snap_$SNAP_NAME_hook_$HOOK"
+ * - "snap_$SNAP_NAME_$INSTANCE_KEY_$APP"
+ * - "snap_$SNAP_NAME_$INSTANCE_KEY_hook_$HOOK"
+ *
+ * The second and third forms are ambiguous when the instance key is "hook", in
+ * which case both instance names are returned. Components of a snap are named
+ * after the snap with a "+$COMPONENT" suffix, which is dropped. The objects
+ * shared by the applications and hooks of a snap instance with the same device
+ * policy are named "snap_$INSTANCE_NAME_@$POLICY", which takes the first or
+ * the third form. The return value is the number of instance names stored.
+ **/
+static size_t sc_device_tag_instance_names(const char* tag, char names[2][SNAP_INSTANCE_LEN + 1]) {
+    if (!sc_startswith(tag, "snap_")) {
+        return 0;
+    }
+    /* split the rest of the tag into at most four parts */
+    char parts[4][SNAP_INSTANCE_LEN + 1] = {{0}};
+    size_t num_parts = 0;
+    for (const char* p = tag + strlen("snap_"); *p != '\0';) {
+        size_t len = strcspn(p, "_");
+        if (num_parts == 4 || len == 0 || len >= sizeof parts[0]) {
+            return 0;
+        }
+        memcpy(parts[num_parts], p, len);
+        /* drop the component name */
+        parts[num_parts][strcspn(parts[num_parts], "+")] = '\0';
+        num_parts++;
+        p += len;
+        if (*p == '_') {
+            p++;
+        }
+    }
+
+    size_t num_names = 0;
+    if (num_parts == 2 || (num_parts == 3 && sc_streq(parts[1], "hook"))) {
+        sc_must_snprintf(names[num_names++], sizeof names[0], "%s", parts[0]);
+    }
+    if (num_parts == 3 || (num_parts == 4 && sc_streq(parts[2], "hook"))) {
+        int n = snprintf(names[num_names], sizeof names[0], "%s_%s", parts[0], parts[1]);
+        if (n > 0 && (size_t)n < sizeof names[0]) {
+            num_names++;
+        }
+    }
+
+    size_t num_valid = 0;
+    for (size_t i = 0; i < num_names; ++i) {
+        sc_error* err = NULL;
+        sc_instance_name_validate(names[i], &err);
+        if (err != NULL) {
+            sc_error_free(err);
+            continue;
+        }
+        if (num_valid != i) {
+            strcpy(names[num_valid], names[i]);
+        }
+        num_valid++;
+    }
+    return num_valid;
+}
+
+/**
+ * State of the collection of pinned device maps and programs.
+ **/
+typedef struct sc_device_gc {
+    sc_discard_targets* targets;
+    /* the number of sorted targets, more are added as tags are found */
+    size_t num_sorted;
+    /* all the pinned objects are considered, rather than just those of the
+     * discarded snap instances */
+    bool all;
+} sc_device_gc;
+
+/**
+ * Add the snap instances a security tag may belong to as targets to lock, if
+ * the tag is to be collected.
+ **/
+static void sc_device_gc_add_tag(const char* tag, void* data) {
+    sc_device_gc* gc = data;
+    char names[2][SNAP_INSTANCE_LEN + 1];
+    size_t num_names = sc_device_tag_instance_names(tag, names);
+
+    sc_discard_targets sorted = {.items = gc->targets->items, .len = gc->num_sorted};
+    bool wanted = gc->all;
+    for (size_t i = 0; i < num_names && !wanted; ++i) {
+        sc_discard_target* target = sc_discard_targets_find(&sorted, names[i]);
+        wanted = target != NULL && target->discard;
+    }
+    if (!wanted) {
+        return;
+    }
+    for (size_t i = 0; i < num_names; ++i) {
+        sc_discard_targets_add_lock_only(gc->targets, names[i]);
+    }
+}
+
+/**
+ * Select a security tag for collection if all the snap instances it may
+ * belong to are locked.
+ **/
+static bool sc_device_gc_select_tag(const char* tag, void* data) {
+    sc_device_gc* gc = data;
+    char names[2][SNAP_INSTANCE_LEN + 1];
+    size_t num_names = sc_device_tag_instance_names(tag, names);
+    if (num_names == 0) {
+        debug("ignoring device cgroup objects of %s", tag);
+        return false;
+    }
+
+    bool wanted = gc->all;
+    for (size_t i = 0; i < num_names; ++i) {
+        sc_discard_target* target = sc_discard_targets_find(gc->targets, names[i]);
+        if (target == NULL || target->lock_fd == -1) {
+            return false;
+        }
+        wanted = wanted || target->discard;
+    }
+    return wanted;
+}
+
+/**
+ * sc_device_gc_check_error handles a failure to collect device cgroup objects.
+ * It is fatal with --device-maps, which does nothing else. Otherwise the
+ * mount namespaces are discarded all the same, the objects are left for a
+ * later collection. Returns true if there was no error.
+ */
+static bool sc_device_gc_check_error(sc_error* err, bool device_maps) {
+    if (err == NULL) {
+        return true;
+    }
+    if (device_maps) {
+        sc_die_on_error(err);
     }
+    fprintf(stderr, "WARNING: cannot discard unused device cgroup objects: %s\n", sc_error_msg(err));
+    sc_error_free(err);
+    return false;
+}
+
+static void show_usage(void) {
+    printf("Usage: snap-discard-ns [--from-snap-confine] <SNAP-INSTANCE-NAME>\n");
+    printf("       snap-discard-ns <SNAP-INSTANCE-NAME>...\n");
+    printf("       snap-discard-ns --all\n");
+    printf("       snap-discard-ns --device-maps\n");
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        show_usage();
+        return 0;
+    }
+    bool from_snap_confine = false;
+    bool all = false;
+    bool device_maps = false;
+    int first_name = 1;
+
+    if (sc_streq(argv[1], "--from-snap-confine")) {
+        if (argc != 3) {
+            die("--from-snap-confine requires exactly one snap instance name");
+        }
+        from_snap_confine = true;
+        first_name = 2;
+    } else if (sc_streq(argv[1], "--all")) {
+        if (argc != 2) {
+            die("--all cannot be combined with snap instance names");
+        }
+        all = true;
+        first_name = 2;
+    } else if (sc_streq(argv[1], "--device-maps")) {
+        if (argc != 2) {
+            die("--device-maps cannot be combined with snap instance names");
+        }
+        device_maps = true;
+        first_name = 2;
+    }
+
+    sc_discard_targets targets = {0};
+    for (int i = first_name; i < argc; ++i) {
+        if (sc_startswith(argv[i], "-")) {
+            die("unexpected argument %s", argv[i]);
+        }
+        sc_error* err = NULL;
+        sc_instance_name_validate(argv[i], &err);
+        sc_die_on_error(err);
+        sc_discard_targets_add(&targets, argv[i]);
+    }
+
+    int ns_dir_fd = -1;
+    if (!device_maps) {
+        ns_dir_fd = open(ns_dir_path, O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+        if (ns_dir_fd < 0) {
+            /* The directory may legitimately not exist if no snap has started
+             * to prepare it. This is not an error condition. */
+            if (errno != ENOENT) {
+                die("cannot open path %s", ns_dir_path);
+            }
+            if (from_snap_confine) {
+                return 0;
+            }
+        }
+    }
+
+    if (all && ns_dir_fd != -1) {
+        sc_discard_targets_add_all(&targets, ns_dir_fd);
+    }
+    sc_discard_targets_sort_unique(&targets);
+
+    /* Unless invoked by snap-confine, also collect the device maps and
+     * programs pinned for the discarded snap instances, or for all snap
+     * instances, which are no longer used by any cgroup. The snap instances
+     * the pinned objects may belong to are locked along with the targets. */
+    sc_device_gc gc = {.targets = &targets, .num_sorted = targets.len, .all = device_maps};
+    bool collect_devices = !from_snap_confine;
+    if (collect_devices) {
+        sc_error* err = NULL;
+        sc_device_cgroup_for_each_pinned_tag(sc_device_gc_add_tag, &gc, &err);
+        collect_devices = sc_device_gc_check_error(err, device_maps);
+        sc_discard_targets_sort_unique(&targets);
+    }
+
+    if (from_snap_confine) {
+        sc_verify_snap_lock(targets.items[0].instance_name);
+    } else {
+        /* Grab the locks holding the snap instances. This prevents races from
+         * concurrently executing snap-confine. The locks are explicitly released
+         * during normal operation but they are not preserved across the
+         * life-cycle of the process anyway so no attempt is made to unlock them
+         * ahead of any call to die() */
+        sc_discard_targets_lock(&targets);
+    }
+    for (size_t i = 0; i < targets.len; ++i) {
+        if (targets.items[i].discard) {
+            debug("discarding mount namespaces of snap %s", targets.items[i].instance_name);
+        }
+    }
+
+    if (ns_dir_fd != -1) {
+        sc_discard_ns_dir_entries(ns_dir_fd, &targets);
+    }
+    if (collect_devices) {
+        sc_error* err = NULL;
+        sc_device_cgroup_discard_unused(sc_device_gc_select_tag, &gc, &err);
+        sc_device_gc_check_error(err, device_maps);
+    }
+
+    /* Release the locks, we're done. */
+    sc_discard_targets_unlock(&targets);
+    free(targets.items);
     return 0;
 }
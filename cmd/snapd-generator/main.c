@@ -15,6 +15,7 @@
  *
  */
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -31,19 +32,71 @@
 #include "../libsnap-confine-private/mountinfo.h"
 #include "../libsnap-confine-private/string-utils.h"
 
-static sc_mountinfo_entry *find_dir_mountinfo(sc_mountinfo *mounts,
-					      const char *mnt_dir)
+// Mount points looked up with a single pass over /proc/1/mountinfo, which is
+// shared by all the checks below.
+enum {
+	QUERY_ROOT_DIR,
+	QUERY_FIRMWARE_DIR,
+	QUERY_MODULES_DIR,
+	QUERY_KERNEL_DIR,
+	MAX_QUERY_DIRS,
+};
+
+typedef struct dir_mountinfo_query {
+	size_t num_dirs;
+	const char *dirs[MAX_QUERY_DIRS];
+	// The last entry of each mount point, which would be the last mount on
+	// top of it, or NULL if there is none.
+	sc_mountinfo_entry *found[MAX_QUERY_DIRS];
+	bool failed;
+} dir_mountinfo_query;
+
+static void cleanup_dir_mountinfo_query(dir_mountinfo_query *query)
 {
-	sc_mountinfo_entry *cur, *root = NULL;
-	for (cur = sc_first_mountinfo_entry(mounts); cur != NULL;
-	     cur = sc_next_mountinfo_entry(cur)) {
-		// Look for the mount info entry. We take the last one, which
-		// would be the last mount on top of mnt_dir.
-		if (sc_streq(mnt_dir, cur->mount_dir)) {
-			root = cur;
+	for (size_t i = 0; i < query->num_dirs; ++i) {
+		sc_cleanup_mountinfo_entry(&query->found[i]);
+	}
+}
+
+static bool match_query_dir(const char *mount_dir, void *data)
+{
+	dir_mountinfo_query *query = data;
+	for (size_t i = 0; i < query->num_dirs; ++i) {
+		if (sc_streq(query->dirs[i], mount_dir)) {
+			return true;
 		}
 	}
-	return root;
+	return false;
+}
+
+static bool keep_query_entry(const sc_mountinfo_entry *entry, void *data)
+{
+	dir_mountinfo_query *query = data;
+	for (size_t i = 0; i < query->num_dirs; ++i) {
+		if (!sc_streq(query->dirs[i], entry->mount_dir)) {
+			continue;
+		}
+		// We take the last one, so replace any earlier entry.
+		sc_cleanup_mountinfo_entry(&query->found[i]);
+		query->found[i] = sc_dup_mountinfo_entry(entry);
+		if (query->found[i] == NULL) {
+			query->failed = true;
+			return false;
+		}
+	}
+	return true;
+}
+
+static int find_dirs_mountinfo(const char *fname, unsigned fields,
+			       dir_mountinfo_query *query)
+{
+	if (sc_query_mountinfo(fname, fields, match_query_dir,
+			       keep_query_entry, query) < 0
+	    || query->failed) {
+		fprintf(stderr, "cannot open or parse %s\n", fname);
+		return -1;
+	}
+	return 0;
 }
 
 // Create a mount unit in normal_dir that is performed at early stages for
@@ -117,26 +170,18 @@ static int create_early_mount(const char *normal_dir,
 #define MODULES_DIR "modules"
 #define FIRMWARE_MNTPOINT "/usr/lib/" FIRMWARE_DIR
 #define MODULES_MNTPOINT "/usr/lib/" MODULES_DIR
+#define KERNEL_MNTPOINT "/run/mnt/kernel"
 
-static int ensure_kernel_drivers_mounts(const char *normal_dir)
+static int ensure_kernel_drivers_mounts(const char *normal_dir,
+					const dir_mountinfo_query *query)
 {
-	const char *const kern_mnt_dir = "/run/mnt/kernel";
-	// Find mount information
-	sc_mountinfo *mounts SC_CLEANUP(sc_cleanup_mountinfo) = NULL;
-	mounts = sc_parse_mountinfo("/proc/1/mountinfo");
-	if (!mounts) {
-		fprintf(stderr, "cannot open or parse /proc/1/mountinfo\n");
-		return 1;
-	}
+	const char *const kern_mnt_dir = KERNEL_MNTPOINT;
 	// Create mount units only if not already present (which would be the
 	// case for an old initramfs) - otherwise systemd-fstab-generator
 	// complains, and older initramfs won't come in a kernel snap with
 	// support for components anyway.
-	const char *const kern_mntpts[] =
-	    { FIRMWARE_MNTPOINT, MODULES_MNTPOINT };
-	for (size_t i = 0; i < sizeof kern_mntpts / sizeof(char *); ++i) {
-		sc_mountinfo_entry *minfo =
-		    find_dir_mountinfo(mounts, kern_mntpts[i]);
+	for (size_t i = QUERY_FIRMWARE_DIR; i <= QUERY_MODULES_DIR; ++i) {
+		const sc_mountinfo_entry *minfo = query->found[i];
 		// If the mounts already exist (old initramfs), do not create them -
 		// note that we additionally check for SNAPD_DRIVERS_TREE_DIR in the
 		// mount source to make sure the units created here are still
@@ -150,8 +195,7 @@ static int ensure_kernel_drivers_mounts(const char *normal_dir)
 	// Find active kernel name and revision by looking at what was
 	// mounted in /run/mnt/kernel by snap-bootstrap.
 
-	sc_mountinfo_entry *kern_minfo =
-	    find_dir_mountinfo(mounts, kern_mnt_dir);
+	const sc_mountinfo_entry *kern_minfo = query->found[QUERY_KERNEL_DIR];
 	if (!kern_minfo) {
 		// This is not Ubuntu Core / hybrid, do nothing and do not fail
 		return 0;
@@ -219,16 +263,11 @@ static int ensure_kernel_drivers_mounts(const char *normal_dir)
 	return create_early_mount(normal_dir, what, FIRMWARE_MNTPOINT);
 }
 
-static int ensure_root_fs_shared(const char *normal_dir)
+static int ensure_root_fs_shared(const char *normal_dir,
+				 const dir_mountinfo_query *query)
 {
-	// Load /proc/1/mountinfo so that we can inspect the root filesystem.
-	sc_mountinfo *mounts SC_CLEANUP(sc_cleanup_mountinfo) = NULL;
-	mounts = sc_parse_mountinfo("/proc/1/mountinfo");
-	if (!mounts) {
-		fprintf(stderr, "cannot open or parse /proc/1/mountinfo\n");
-		return 1;
-	}
-	sc_mountinfo_entry *root = find_dir_mountinfo(mounts, "/");
+	// Inspect the root filesystem as seen in /proc/1/mountinfo.
+	const sc_mountinfo_entry *root = query->found[QUERY_ROOT_DIR];
 	if (!root) {
 		fprintf(stderr,
 			"cannot find mountinfo entry of the root filesystem\n");
@@ -425,10 +464,27 @@ int main(int argc, char **argv)
 	// const char *early_dir = argv[2];
 	// const char *late_dir = argv[3];
 
+	dir_mountinfo_query query SC_CLEANUP(cleanup_dir_mountinfo_query) = {
+		.num_dirs = MAX_QUERY_DIRS,
+		.dirs = {
+			[QUERY_ROOT_DIR] = "/",
+			[QUERY_FIRMWARE_DIR] = FIRMWARE_MNTPOINT,
+			[QUERY_MODULES_DIR] = MODULES_MNTPOINT,
+			[QUERY_KERNEL_DIR] = KERNEL_MNTPOINT,
+		},
+	};
+	bool have_mountinfo = find_dirs_mountinfo("/proc/1/mountinfo",
+						  SC_MOUNTINFO_ROOT |
+						  SC_MOUNTINFO_OPTIONAL_FIELDS |
+						  SC_MOUNTINFO_FS_TYPE |
+						  SC_MOUNTINFO_MOUNT_SOURCE,
+						  &query) == 0;
+
 	int status = 0;
-	status = ensure_root_fs_shared(normal_dir);
+	status = have_mountinfo ? ensure_root_fs_shared(normal_dir, &query) : 1;
 	status |= ensure_fusesquashfs_inside_container(normal_dir);
-	status |= ensure_kernel_drivers_mounts(normal_dir);
+	status |= have_mountinfo ?
+	    ensure_kernel_drivers_mounts(normal_dir, &query) : 1;
 
 	return status;
 }
@@ -18,4 +18,322 @@
 #include "system-shutdown-utils.h"
 #include "system-shutdown-utils.c"
 
+#include <string.h>
+
 #include <glib.h>
+
+static void reset_report(void)
+{
+	report_len = 0;
+	report[0] = '\0';
+	report_truncated = false;
+}
+
+static void test_shutdown_report_add(void)
+{
+	reset_report();
+	g_assert_cmpstr(report, ==, "");
+
+	shutdown_report_add("start_ms=%.1f", 0.25);
+	g_assert_cmpstr(report, ==, "start_ms=0.2");
+	shutdown_report_add("name=%s", "foo");
+	shutdown_report_add("count=%u", 3U);
+	g_assert_cmpstr(report, ==, "start_ms=0.2 name=foo count=3");
+	g_assert_cmpuint(report_len, ==, strlen(report));
+	g_assert_false(report_truncated);
+}
+
+static void test_shutdown_report_add_umount(void)
+{
+	struct umount_stats stats = {
+		.umounted = 12,
+		.failed = 1,
+		.loops_detached = 2,
+		.retries = 3,
+		.sync_ms = 1.5,
+		.umount_ms = 20.25,
+	};
+
+	reset_report();
+	shutdown_report_add_umount("umount1", &stats);
+	g_assert_cmpstr(report, ==,
+			"umount1_ms=20.2 umount1_sync_ms=1.5 umount1_umounted=12 "
+			"umount1_failed=1 umount1_loops=2 umount1_retries=3");
+
+	// The slowest and busy mount points are only reported when known.
+	strcpy(stats.slowest_dir, "/writable");
+	stats.slowest_ms = 10.0;
+	strcpy(stats.busy_dir, "/run/mnt/data");
+	reset_report();
+	shutdown_report_add_umount("umount2", &stats);
+	g_assert_cmpstr(report, ==,
+			"umount2_ms=20.2 umount2_sync_ms=1.5 umount2_umounted=12 "
+			"umount2_failed=1 umount2_loops=2 umount2_retries=3 "
+			"umount2_slowest=/writable:10.0 "
+			"umount2_busy=/run/mnt/data");
+
+	// Mount points are escaped so that they cannot be mistaken for the
+	// separators of the report.
+	strcpy(stats.slowest_dir, "/media/a b:c");
+	strcpy(stats.busy_dir, "/run/x=y\\z");
+	reset_report();
+	shutdown_report_add_umount("umount3", &stats);
+	g_assert_cmpstr(report, ==,
+			"umount3_ms=20.2 umount3_sync_ms=1.5 umount3_umounted=12 "
+			"umount3_failed=1 umount3_loops=2 umount3_retries=3 "
+			"umount3_slowest=/media/a\\040b\\072c:10.0 "
+			"umount3_busy=/run/x\\075y\\134z");
+}
+
+static void test_report_escape(void)
+{
+	char buf[8];
+
+	report_escape(buf, sizeof buf, "/a b");
+	g_assert_cmpstr(buf, ==, "/a\\040b");
+
+	// Escape sequences are not split when truncating.
+	report_escape(buf, sizeof buf, "/abc d");
+	g_assert_cmpstr(buf, ==, "/abc");
+	report_escape(buf, sizeof buf, "/abcdefgh");
+	g_assert_cmpstr(buf, ==, "/abcdef");
+}
+
+static void test_shutdown_report_overflow(void)
+{
+	char value[100];
+	memset(value, 'x', sizeof value - 1);
+	value[sizeof value - 1] = '\0';
+
+	reset_report();
+	// Each field takes 102 bytes, including the separator.
+	size_t fields = 0;
+	while (!report_truncated) {
+		shutdown_report_add("f=%s", value);
+		fields++;
+	}
+	// Eight fields fit in the 900 byte report, the ninth one does not.
+	g_assert_cmpuint(fields, ==, 9);
+	// The field which did not fit is left out whole.
+	g_assert_cmpuint(report_len, ==, (fields - 1) * 102 - 1);
+	g_assert_cmpuint(report_len, ==, strlen(report));
+	g_assert_true(report[report_len - 1] == 'x');
+
+	// Nothing is added after the report was truncated, not even a field
+	// which would still fit.
+	shutdown_report_add("short=%d", 1);
+	g_assert_cmpuint(report_len, ==, (fields - 1) * 102 - 1);
+	g_assert_null(strstr(report, "short"));
+}
+
+static void test_shutdown_report_exact_fit(void)
+{
+	char value[sizeof report];
+
+	reset_report();
+	// A field ending right before the last byte still fits.
+	memset(value, 'x', sizeof report - 3);
+	value[sizeof report - 3] = '\0';
+	shutdown_report_add("a=%s", value);
+	g_assert_cmpuint(report_len, ==, sizeof report - 1);
+	g_assert_false(report_truncated);
+
+	// Even the separator of the next field does not fit anymore.
+	shutdown_report_add("b");
+	g_assert_true(report_truncated);
+	g_assert_cmpuint(report_len, ==, sizeof report - 1);
+	g_assert_cmpuint(strlen(report), ==, sizeof report - 1);
+	g_assert_null(strchr(report, ' '));
+}
+
+static sc_mountinfo *parse_mountinfo_text(const char *text)
+{
+	GError *err = NULL;
+	char *path = NULL;
+	int fd = g_file_open_tmp(NULL, &path, &err);
+	g_assert_no_error(err);
+	close(fd);
+	g_assert_true(g_file_set_contents(path, text, -1, NULL));
+	sc_mountinfo *info = sc_parse_mountinfo(path);
+	unlink(path);
+	g_free(path);
+	g_assert_nonnull(info);
+	return info;
+}
+
+static const char *plan_mountinfo =
+    "1 0 8:1 / / rw - ext4 /dev/sda1 rw\n"
+    "2 1 0:2 / /dev rw - devtmpfs udev rw\n"
+    "3 1 0:3 / /proc rw - proc proc rw\n"
+    "4 1 0:4 / /run rw - tmpfs tmpfs rw\n"
+    "5 4 0:5 / /run/a rw - tmpfs tmpfs rw\n"
+    "6 5 0:6 / /run/a rw - tmpfs tmpfs rw\n"
+    "7 6 0:7 / /run/a/b rw - tmpfs tmpfs rw\n"
+    "8 1 7:1 / /snap/core/1 ro - squashfs /dev/loop1 ro\n";
+
+static void test_umount_plan(void)
+{
+	sc_mountinfo *mounts SC_CLEANUP(sc_cleanup_mountinfo) = NULL;
+	mounts = parse_mountinfo_text(plan_mountinfo);
+	sc_mountinfo_entry *e = mounts->entries;
+	struct umount_plan plan;
+	umount_plan_init(&plan, mounts);
+
+	// Everything but /, /dev and /proc is unmounted, in post-order.
+	g_assert_cmpuint(plan.num_order, ==, 5);
+	g_assert_true(plan.order[0] == &e[6]);
+	g_assert_true(plan.order[1] == &e[5]);
+	g_assert_true(plan.order[2] == &e[4]);
+	g_assert_true(plan.order[3] == &e[3]);
+	g_assert_true(plan.order[4] == &e[7]);
+
+	// Leaves have no height, the root is the highest.
+	g_assert_cmpuint(plan.heights[6], ==, 0);
+	g_assert_cmpuint(plan.heights[5], ==, 1);
+	g_assert_cmpuint(plan.heights[4], ==, 2);
+	g_assert_cmpuint(plan.heights[3], ==, 3);
+	g_assert_cmpuint(plan.heights[7], ==, 0);
+	g_assert_cmpuint(plan.max_height, ==, 4);
+
+	// Each step unmounts one height. The mounts stacked at /run/a share
+	// their mount point and are unmounted serially.
+	sc_mountinfo_entry *batch[8];
+	g_assert_cmpuint(umount_plan_step(&plan, mounts, 0, true, batch), ==,
+			 2);
+	g_assert_true(batch[0] == &e[6]);
+	g_assert_true(batch[1] == &e[7]);
+	g_assert_cmpuint(umount_plan_step(&plan, mounts, 0, false, batch), ==,
+			 0);
+	g_assert_cmpuint(umount_plan_step(&plan, mounts, 1, true, batch), ==,
+			 0);
+	g_assert_cmpuint(umount_plan_step(&plan, mounts, 1, false, batch), ==,
+			 1);
+	g_assert_true(batch[0] == &e[5]);
+	g_assert_cmpuint(umount_plan_step(&plan, mounts, 2, false, batch), ==,
+			 1);
+	g_assert_true(batch[0] == &e[4]);
+	g_assert_cmpuint(umount_plan_step(&plan, mounts, 3, true, batch), ==,
+			 1);
+	g_assert_true(batch[0] == &e[3]);
+	g_assert_cmpuint(umount_plan_step(&plan, mounts, 4, true, batch), ==,
+			 0);
+
+	umount_plan_free(&plan);
+	g_assert_null(plan.order);
+}
+
+// fake_umount fails with EBUSY for mounts that are busy or that have
+// something still mounted on them, as tracked in the mounted array indexed as
+// the mount table.
+struct fake_mounts {
+	sc_mountinfo *mounts;
+	bool mounted[8];
+	bool busy[8];
+};
+
+static int fake_umount(sc_mountinfo_entry * entry, void *data)
+{
+	struct fake_mounts *fake = data;
+	size_t idx = entry - fake->mounts->entries;
+	if (fake->busy[idx]) {
+		return EBUSY;
+	}
+	for (sc_mountinfo_entry * child = entry->first_child; child != NULL;
+	     child = child->next_sibling) {
+		if (fake->mounted[child - fake->mounts->entries]) {
+			return EBUSY;
+		}
+	}
+	fake->mounted[idx] = false;
+	return 0;
+}
+
+static void test_retry_umounts(void)
+{
+	sc_mountinfo *mounts SC_CLEANUP(sc_cleanup_mountinfo) = NULL;
+	mounts = parse_mountinfo_text(plan_mountinfo);
+	sc_mountinfo_entry *e = mounts->entries;
+	struct fake_mounts fake = {.mounts = mounts };
+	int errors[8] = { 0 };
+	unsigned passes = 0;
+
+	// Mounts are retried as long as others get unmounted.
+	memset(fake.mounted, true, sizeof fake.mounted);
+	sc_mountinfo_entry *failed[] = { &e[4], &e[5], &e[6] };
+	g_assert_cmpuint(retry_umounts
+			 (mounts, failed, 3, errors, 10, fake_umount, &fake,
+			  &passes), ==, 0);
+	g_assert_cmpuint(passes, ==, 3);
+
+	// The number of passes is bounded. What is still failing is kept in
+	// order, with its error.
+	memset(fake.mounted, true, sizeof fake.mounted);
+	sc_mountinfo_entry *failed2[] = { &e[4], &e[5], &e[6] };
+	passes = 0;
+	g_assert_cmpuint(retry_umounts
+			 (mounts, failed2, 3, errors, 2, fake_umount, &fake,
+			  &passes), ==, 1);
+	g_assert_cmpuint(passes, ==, 2);
+	g_assert_true(failed2[0] == &e[4]);
+	g_assert_cmpint(errors[4], ==, EBUSY);
+
+	// Passes stop once one does not unmount anything.
+	memset(fake.mounted, true, sizeof fake.mounted);
+	fake.busy[6] = true;
+	sc_mountinfo_entry *failed3[] = { &e[4], &e[5], &e[6], &e[7] };
+	passes = 0;
+	g_assert_cmpuint(retry_umounts
+			 (mounts, failed3, 4, errors, 10, fake_umount, &fake,
+			  &passes), ==, 3);
+	g_assert_cmpuint(passes, ==, 2);
+	g_assert_true(failed3[0] == &e[4]);
+	g_assert_true(failed3[1] == &e[5]);
+	g_assert_true(failed3[2] == &e[6]);
+	g_assert_cmpint(errors[6], ==, EBUSY);
+}
+
+static void test_keep_mounted(void)
+{
+	sc_mountinfo *mounts SC_CLEANUP(sc_cleanup_mountinfo) = NULL;
+	mounts = parse_mountinfo_text(plan_mountinfo);
+	sc_mountinfo_entry *e = mounts->entries;
+
+	// Mount 6 went away and the identifier of mount 7 was reused for
+	// another mount point, only mount 5 is still mounted.
+	GError *err = NULL;
+	char *path = NULL;
+	int fd = g_file_open_tmp(NULL, &path, &err);
+	g_assert_no_error(err);
+	close(fd);
+	g_assert_true(g_file_set_contents(path,
+					  "1 0 8:1 / / rw - ext4 /dev/sda1 rw\n"
+					  "4 1 0:4 / /run rw - tmpfs tmpfs rw\n"
+					  "5 4 0:5 / /run/a rw - tmpfs tmpfs rw\n"
+					  "7 1 0:7 / /mnt rw - tmpfs tmpfs rw\n",
+					  -1, NULL));
+	sc_mountinfo_entry *failed[] = { &e[4], &e[5], &e[6] };
+	g_assert_cmpuint(keep_mounted(path, failed, 3), ==, 1);
+	g_assert_true(failed[0] == &e[4]);
+
+	// All the entries are kept when the mount table cannot be read.
+	sc_mountinfo_entry *failed2[] = { &e[5], &e[6] };
+	unlink(path);
+	g_assert_cmpuint(keep_mounted(path, failed2, 2), ==, 2);
+	g_free(path);
+}
+
+static void __attribute__((constructor)) init(void)
+{
+	g_test_add_func("/system-shutdown/report/add",
+			test_shutdown_report_add);
+	g_test_add_func("/system-shutdown/report/add_umount",
+			test_shutdown_report_add_umount);
+	g_test_add_func("/system-shutdown/report/overflow",
+			test_shutdown_report_overflow);
+	g_test_add_func("/system-shutdown/report/exact_fit",
+			test_shutdown_report_exact_fit);
+	g_test_add_func("/system-shutdown/report/escape", test_report_escape);
+	g_test_add_func("/system-shutdown/umount_plan", test_umount_plan);
+	g_test_add_func("/system-shutdown/retry_umounts", test_retry_umounts);
+	g_test_add_func("/system-shutdown/keep_mounted", test_keep_mounted);
+}
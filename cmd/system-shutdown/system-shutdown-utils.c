@@ -15,12 +15,15 @@
  *
  */
 
+#define _GNU_SOURCE		// syncfs
+
 #include "system-shutdown-utils.h"
 
 #include <errno.h>		// errno, sys_errlist
 #include <fcntl.h>		// open
 #include <linux/loop.h>		// LOOP_CLR_FD
 #include <linux/major.h>
+#include <pthread.h>		// pthread_*
 #include <stdarg.h>		// va_*
 #include <stdio.h>		// fprintf, stderr
 #include <stdlib.h>		// exit
@@ -29,8 +32,10 @@
 #include <sys/mount.h>		// umount
 #include <sys/reboot.h>		// reboot, RB_*
 #include <sys/stat.h>		// mkdir
+#include <time.h>		// clock_gettime
 #include <unistd.h>		// getpid, close
 
+#include "../libsnap-confine-private/cleanup-funcs.h"
 #include "../libsnap-confine-private/mountinfo.h"
 #include "../libsnap-confine-private/string-utils.h"
 #include "../libsnap-confine-private/utils.h"
@@ -48,9 +53,11 @@ void kmsg(const char *fmt, ...)
 
 	va_list va;
 	va_start(va, fmt);
+	flockfile(kmsg);
 	fputs(head, kmsg);
 	vfprintf(kmsg, fmt, va);
 	fprintf(kmsg, "\n");
+	funlockfile(kmsg);
 	va_end(va);
 }
 
@@ -76,8 +83,108 @@ int sc_read_reboot_arg(char *arg, size_t max_size)
 	return 0;
 }
 
-static void detach_loop(const char *src)
+double shutdown_clock_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static char report[900];
+static size_t report_len;
+static bool report_truncated;
+
+void shutdown_report_add(const char *fmt, ...)
+{
+	if (report_truncated) {
+		return;
+	}
+	size_t len = report_len;
+	if (len > 0) {
+		report[len++] = ' ';
+	}
+	va_list va;
+	va_start(va, fmt);
+	int n = vsnprintf(report + len, sizeof report - len, fmt, va);
+	va_end(va);
+	if (n < 0) {
+		report[report_len] = '\0';
+		return;
+	}
+	// A field which does not fit is left out whole, along with all the
+	// fields after it, so that the report never ends with a cut value.
+	if (len + (size_t)n >= sizeof report) {
+		report[report_len] = '\0';
+		report_truncated = true;
+		return;
+	}
+	report_len = len + (size_t)n;
+}
+
+// report_escape copies a mount point into buf, escaping the bytes that would
+// make the report ambiguous as octal sequences, as in mountinfo. The copy is
+// truncated, at an escape sequence boundary, to fit.
+static void report_escape(char *buf, size_t size, const char *dir)
+{
+	size_t len = 0;
+	for (const char *p = dir; *p != '\0'; p++) {
+		unsigned char c = *p;
+		bool escape = c <= ' ' || c >= 0x7f || c == '\\' || c == ':'
+		    || c == '=';
+		size_t n = escape ? 4 : 1;
+		if (len + n >= size) {
+			break;
+		}
+		if (escape) {
+			snprintf(buf + len, size - len, "\\%03o", c);
+		} else {
+			buf[len] = c;
+		}
+		len += n;
+	}
+	buf[len] = '\0';
+}
+
+void shutdown_report_add_umount(const char *name,
+				const struct umount_stats *stats)
+{
+	char dir[sizeof stats->slowest_dir * 4];
+	shutdown_report_add("%s_ms=%.1f", name, stats->umount_ms);
+	shutdown_report_add("%s_sync_ms=%.1f", name, stats->sync_ms);
+	shutdown_report_add("%s_umounted=%u", name, stats->umounted);
+	shutdown_report_add("%s_failed=%u", name, stats->failed);
+	shutdown_report_add("%s_loops=%u", name, stats->loops_detached);
+	shutdown_report_add("%s_retries=%u", name, stats->retries);
+	if (stats->slowest_dir[0] != '\0') {
+		report_escape(dir, sizeof dir, stats->slowest_dir);
+		shutdown_report_add("%s_slowest=%s:%.1f", name, dir,
+				    stats->slowest_ms);
+	}
+	if (stats->busy_dir[0] != '\0') {
+		report_escape(dir, sizeof dir, stats->busy_dir);
+		shutdown_report_add("%s_busy=%s", name, dir);
+	}
+}
+
+void shutdown_report_emit(void)
 {
+	char line[sizeof report + 64];
+	int n = snprintf(line, sizeof line,
+			 "<5>snapd system-shutdown helper: report %s%s\n",
+			 report, report_truncated ? " truncated=1" : "");
+	int fd = open("/dev/kmsg", O_WRONLY | O_CLOEXEC);
+	if (fd < 0 || n < 0 || write(fd, line, (size_t)n) != n) {
+		kmsg("report %s%s", report,
+		     report_truncated ? " truncated=1" : "");
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+}
+
+static bool detach_loop(const char *src)
+{
+	bool ok = false;
 	int fd = open(src, O_RDONLY);
 	if (fd < 0) {
 		kmsg("* unable to open loop device %s: %s", src,
@@ -86,62 +193,448 @@ static void detach_loop(const char *src)
 		if (ioctl(fd, LOOP_CLR_FD) < 0) {
 			kmsg("* unable to disassociate loop device %s: %s",
 			     src, strerror(errno));
+		} else {
+			ok = true;
 		}
 		close(fd);
 	}
+	return ok;
 }
 
-// tries to umount all (well, most) things. Returns whether in the last pass it
-// no longer found writable.
-bool umount_all(void)
+// Protects umount_stats updated by concurrent workers.
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// umount_entry unmounts a single mount and detaches the loop device backing
+// it, if any. Returns zero on success and -1, with errno set, on failure.
+static int umount_entry(const sc_mountinfo_entry * entry,
+			struct umount_stats *stats)
 {
-	bool did_umount = true;
-	bool had_writable = false;
+	double start = shutdown_clock_ms();
+	if (umount(entry->mount_dir) < 0) {
+		return -1;
+	}
+	double took = shutdown_clock_ms() - start;
+	bool detached = false;
+	if (entry->dev_major == LOOP_MAJOR) {
+		detached = detach_loop(entry->mount_source);
+	}
 
-	for (int i = 0; i < 10 && did_umount; i++) {
-		sc_mountinfo *mounts = sc_parse_mountinfo(NULL);
-		if (!mounts) {
-			// oh dear
-			die("unable to get mount info; giving up");
+	pthread_mutex_lock(&stats_lock);
+	stats->umounted++;
+	if (detached) {
+		stats->loops_detached++;
+	}
+	if (stats->slowest_ms < took || stats->slowest_dir[0] == '\0') {
+		stats->slowest_ms = took;
+		sc_must_snprintf(stats->slowest_dir,
+				 sizeof stats->slowest_dir, "%.*s",
+				 (int)sizeof stats->slowest_dir - 1,
+				 entry->mount_dir);
+	}
+	pthread_mutex_unlock(&stats_lock);
+	return 0;
+}
+
+static bool is_writable(const sc_mountinfo_entry * entry)
+{
+	return entry->dev_major != 0 && entry->dev_major != LOOP_MAJOR
+	    && sc_endswith(entry->mount_dir, "/writable");
+}
+
+static bool match_writable_dir(const char *mount_dir, void *data)
+{
+	return sc_endswith(mount_dir, "/writable");
+}
+
+static bool find_writable(const sc_mountinfo_entry * entry, void *data)
+{
+	bool *found = data;
+	*found = is_writable(entry);
+	// Stop at the first match.
+	return !*found;
+}
+
+// has_writable returns whether writable is still mounted. Only the mount
+// points of the other mounts are looked at.
+static bool has_writable(void)
+{
+	bool found = false;
+	if (sc_query_mountinfo(NULL, 0, match_writable_dir, find_writable,
+			       &found) < 0) {
+		die("unable to get mount info; giving up");
+	}
+	return found;
+}
+
+// Number of threads, including the calling one, used to sync file systems,
+// unmount them and detach the loop devices backing them.
+#define SHUTDOWN_WORKERS 8
+
+typedef void (*work_fn)(size_t i, void *data);
+
+struct work_queue {
+	work_fn fn;
+	void *data;
+	size_t num_items;
+	size_t next_item;
+};
+
+static void *work_queue_worker(void *arg)
+{
+	struct work_queue *queue = arg;
+	for (;;) {
+		size_t i =
+		    __atomic_fetch_add(&queue->next_item, 1, __ATOMIC_RELAXED);
+		if (i >= queue->num_items) {
+			break;
 		}
-		sc_mountinfo_entry *cur = sc_first_mountinfo_entry(mounts);
+		queue->fn(i, queue->data);
+	}
+	return NULL;
+}
 
-		had_writable = false;
-		did_umount = false;
-		while (cur) {
-			const char *dir = cur->mount_dir;
-			const char *src = cur->mount_source;
-			unsigned major = cur->dev_major;
+// run_parallel calls fn for each of the items, concurrently. The calling
+// thread takes part in the work so, should no thread be started, all the
+// items are processed serially, in order.
+static void run_parallel(size_t num_items, work_fn fn, void *data)
+{
+	struct work_queue queue = {
+		.fn = fn,
+		.data = data,
+		.num_items = num_items,
+	};
+	pthread_t threads[SHUTDOWN_WORKERS - 1];
+	size_t num_threads = 0;
 
-			cur = sc_next_mountinfo_entry(cur);
+	while (num_threads < SHUTDOWN_WORKERS - 1
+	       && num_threads + 1 < num_items) {
+		if (pthread_create(&threads[num_threads], NULL,
+				   work_queue_worker, &queue) != 0) {
+			break;
+		}
+		num_threads++;
+	}
+	work_queue_worker(&queue);
+	for (size_t i = 0; i < num_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+}
 
-			if (sc_streq("/", dir)) {
-				continue;
-			}
+static void syncfs_worker(size_t i, void *data)
+{
+	sc_mountinfo_entry **entries = data;
+	int fd = open(entries[i]->mount_dir,
+		      O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+	if (fd < 0) {
+		// Unmounting syncs the file system anyway.
+		return;
+	}
+	syncfs(fd);
+	close(fd);
+}
 
-			if (sc_streq("/dev", dir)) {
-				continue;
-			}
+struct umount_batch {
+	sc_mountinfo_entry **entries;
+	// The outcome of unmounting, indexed as the whole mount table.
+	sc_mountinfo *mounts;
+	int *errors;
+	struct umount_stats *stats;
+};
 
-			if (sc_streq("/proc", dir)) {
-				continue;
-			}
+static void umount_worker(size_t i, void *data)
+{
+	struct umount_batch *batch = data;
+	sc_mountinfo_entry *entry = batch->entries[i];
+	size_t idx = entry - batch->mounts->entries;
+
+	batch->errors[idx] = umount_entry(entry, batch->stats) == 0 ? 0 : errno;
+}
+
+// umount_plan is the order in which the mounts of a mount table are
+// unmounted.
+struct umount_plan {
+	// The mounts to unmount, in post-order, so that everything mounted on
+	// a given mount, including mounts stacked on top of it, comes before
+	// the mount itself.
+	sc_mountinfo_entry **order;
+	size_t num_order;
+	// The height of each mount in the mount tree, indexed as the mount
+	// table. Mounts of the same height are never mounted on one another and
+	// can be unmounted concurrently.
+	size_t *heights;
+	size_t max_height;
+};
+
+static void umount_plan_init(struct umount_plan *plan, sc_mountinfo * mounts)
+{
+	size_t num_entries = mounts->num_entries;
+	memset(plan, 0, sizeof *plan);
+	plan->order = calloc(num_entries + 1, sizeof *plan->order);
+	plan->heights = calloc(num_entries + 1, sizeof *plan->heights);
+	if (plan->order == NULL || plan->heights == NULL) {
+		die("cannot allocate memory for unmounting");
+	}
 
-			if (major != 0 && major != LOOP_MAJOR
-			    && sc_endswith(dir, "/writable")) {
-				had_writable = true;
+	for (sc_mountinfo_entry * cur =
+	     sc_first_postorder_mountinfo_entry(mounts, NULL); cur != NULL;
+	     cur = sc_next_postorder_mountinfo_entry(NULL, cur)) {
+		size_t height = plan->heights[cur - mounts->entries];
+		if (cur->parent != NULL) {
+			size_t *parent_height =
+			    &plan->heights[cur->parent - mounts->entries];
+			if (*parent_height < height + 1) {
+				*parent_height = height + 1;
 			}
+		}
+		if (plan->max_height < height) {
+			plan->max_height = height;
+		}
+
+		const char *dir = cur->mount_dir;
+
+		if (sc_streq("/", dir)) {
+			continue;
+		}
+
+		if (sc_streq("/dev", dir)) {
+			continue;
+		}
+
+		if (sc_streq("/proc", dir)) {
+			continue;
+		}
+
+		plan->order[plan->num_order++] = cur;
+	}
+}
 
-			if (umount(dir) == 0) {
-				if (major == LOOP_MAJOR) {
-					detach_loop(src);
-				}
+static void umount_plan_free(struct umount_plan *plan)
+{
+	free(plan->order);
+	free(plan->heights);
+	memset(plan, 0, sizeof *plan);
+}
+
+// umount_plan_step collects the mounts of the given height into batch, in
+// post-order, and returns their number. Stacked mounts at one mount point are
+// reached through the same path, so mounts sharing their mount point with
+// others are collected separately, when parallel is false, to be unmounted
+// serially and in order. The others can be unmounted concurrently.
+static size_t umount_plan_step(const struct umount_plan *plan,
+			       sc_mountinfo * mounts, size_t height,
+			       bool parallel, sc_mountinfo_entry ** batch)
+{
+	size_t num_batch = 0;
+	for (size_t i = 0; i < plan->num_order; i++) {
+		sc_mountinfo_entry *cur = plan->order[i];
+		if (plan->heights[cur - mounts->entries] != height) {
+			continue;
+		}
+		bool alone =
+		    sc_first_mountinfo_entry_at(mounts, cur->mount_dir) == cur
+		    && sc_next_mountinfo_entry_at(cur) == NULL;
+		if (alone == parallel) {
+			batch[num_batch++] = cur;
+		}
+	}
+	return num_batch;
+}
 
+// umount_fn unmounts a single mount, returning zero on success or an errno
+// value on failure.
+typedef int (*umount_fn)(sc_mountinfo_entry * entry, void *data);
+
+// retry_umounts retries unmounting the failed mounts serially, in order. Passes
+// are made as long as one unmounts something, at most max_passes of them,
+// and counted in passes. The mounts that are still failing are moved to the
+// front of failed, their errors are recorded in errors, indexed as the mount
+// table, and their number is returned.
+//
+// Something may still be using the failed mounts, or something mounted on
+// them was busy itself, or they were hidden by a mount that is now gone.
+static size_t retry_umounts(sc_mountinfo * mounts, sc_mountinfo_entry ** failed,
+			    size_t num_failed, int *errors, int max_passes,
+			    umount_fn fn, void *data, unsigned *passes)
+{
+	bool did_umount = true;
+	for (int i = 0; i < max_passes && did_umount && num_failed > 0; i++) {
+		size_t num_still_failed = 0;
+
+		did_umount = false;
+		(*passes)++;
+		for (size_t j = 0; j < num_failed; j++) {
+			sc_mountinfo_entry *cur = failed[j];
+			int err = fn(cur, data);
+			if (err == 0) {
 				did_umount = true;
+			} else {
+				errors[cur - mounts->entries] = err;
+				failed[num_still_failed++] = cur;
 			}
 		}
-		sc_cleanup_mountinfo(&mounts);
+		num_failed = num_still_failed;
+	}
+	return num_failed;
+}
+
+struct mounted_query {
+	sc_mountinfo_entry **entries;
+	size_t num_entries;
+	bool *mounted;
+};
+
+static bool find_mounted(const sc_mountinfo_entry * entry, void *data)
+{
+	struct mounted_query *query = data;
+	for (size_t i = 0; i < query->num_entries; i++) {
+		if (query->entries[i]->mount_id == entry->mount_id
+		    && sc_streq(query->entries[i]->mount_dir,
+				entry->mount_dir)) {
+			query->mounted[i] = true;
+		}
 	}
+	return true;
+}
+
+// keep_mounted moves the entries that are still in the mount table read from
+// fname, NULL standing for the one of the current process, to the front and
+// returns their number. Mounts that failed to unmount may be gone anyway, for
+// instance when they were unmounted through propagation. Should the mount
+// table be unreadable, all the entries are kept.
+static size_t keep_mounted(const char *fname, sc_mountinfo_entry ** entries,
+			   size_t num_entries)
+{
+	if (num_entries == 0) {
+		return 0;
+	}
+	bool *mounted = calloc(num_entries, sizeof *mounted);
+	if (mounted == NULL) {
+		return num_entries;
+	}
+	struct mounted_query query = {
+		.entries = entries,
+		.num_entries = num_entries,
+		.mounted = mounted,
+	};
+	if (sc_query_mountinfo(fname, 0, NULL, find_mounted, &query) < 0) {
+		free(mounted);
+		return num_entries;
+	}
+	size_t num_mounted = 0;
+	for (size_t i = 0; i < num_entries; i++) {
+		if (mounted[i]) {
+			entries[num_mounted++] = entries[i];
+		}
+	}
+	free(mounted);
+	return num_mounted;
+}
+
+static int umount_entry_err(sc_mountinfo_entry * entry, void *data)
+{
+	return umount_entry(entry, data) == 0 ? 0 : errno;
+}
+
+// tries to umount all (well, most) things. Returns whether in the end it
+// no longer found writable.
+bool umount_all(struct umount_stats *stats)
+{
+	struct umount_stats local_stats;
+	if (stats == NULL) {
+		stats = &local_stats;
+	}
+	memset(stats, 0, sizeof *stats);
+	double start = shutdown_clock_ms();
+
+	// The whole mount tree is needed to order the unmounts, so the table is
+	// parsed in full rather than queried.
+	sc_mountinfo *mounts SC_CLEANUP(sc_cleanup_mountinfo) = NULL;
+	mounts = sc_parse_mountinfo(NULL);
+	if (!mounts) {
+		// oh dear
+		die("unable to get mount info; giving up");
+	}
+
+	struct umount_plan plan;
+	umount_plan_init(&plan, mounts);
+	size_t num_entries = mounts->num_entries;
+	int *errors = calloc(num_entries + 1, sizeof *errors);
+	sc_mountinfo_entry **batch = calloc(num_entries + 1, sizeof *batch);
+	if (errors == NULL || batch == NULL) {
+		die("cannot allocate memory for unmounting");
+	}
+
+	// Write back each writable block device once, all of them at the same
+	// time, rather than one by one as they get unmounted.
+	size_t num_batch = 0;
+	for (size_t i = 0; i < plan.num_order; i++) {
+		sc_mountinfo_entry *cur = plan.order[i];
+		if (cur->dev_major == 0 || !sc_startswith(cur->mount_opts, "rw")) {
+			continue;
+		}
+		bool seen = false;
+		for (size_t j = 0; j < num_batch && !seen; j++) {
+			seen = batch[j]->dev_major == cur->dev_major
+			    && batch[j]->dev_minor == cur->dev_minor;
+		}
+		if (!seen) {
+			batch[num_batch++] = cur;
+		}
+	}
+	run_parallel(num_batch, syncfs_worker, batch);
+	stats->sync_ms = shutdown_clock_ms() - start;
+
+	// Unmount the mounts one height at a time, starting with the leaves.
+	struct umount_batch umount_batch = {
+		.entries = batch,
+		.mounts = mounts,
+		.errors = errors,
+		.stats = stats,
+	};
+	for (size_t height = 0; height <= plan.max_height; height++) {
+		num_batch =
+		    umount_plan_step(&plan, mounts, height, true, batch);
+		run_parallel(num_batch, umount_worker, &umount_batch);
+
+		num_batch =
+		    umount_plan_step(&plan, mounts, height, false, batch);
+		for (size_t i = 0; i < num_batch; i++) {
+			errors[batch[i] - mounts->entries] =
+			    umount_entry_err(batch[i], stats);
+		}
+	}
+
+	// Mounts that failed to unmount, in post-order.
+	size_t num_failed = 0;
+	for (size_t i = 0; i < plan.num_order; i++) {
+		if (errors[plan.order[i] - mounts->entries] != 0) {
+			batch[num_failed++] = plan.order[i];
+		}
+	}
+	num_failed = retry_umounts(mounts, batch, num_failed, errors, 10,
+				   umount_entry_err, stats, &stats->retries);
+	num_failed = keep_mounted(NULL, batch, num_failed);
+
+	for (size_t j = 0; j < num_failed; j++) {
+		int err = errors[batch[j] - mounts->entries];
+		if (err == EBUSY) {
+			kmsg("* unable to unmount %s: %s", batch[j]->mount_dir,
+			     strerror(err));
+			if (stats->busy_dir[0] == '\0') {
+				sc_must_snprintf(stats->busy_dir,
+						 sizeof stats->busy_dir, "%.*s",
+						 (int)sizeof stats->busy_dir -
+						 1, batch[j]->mount_dir);
+			}
+		}
+	}
+	stats->failed = num_failed;
+
+	free(batch);
+	free(errors);
+	umount_plan_free(&plan);
 
-	return !had_writable;
+	bool ok = num_failed == 0 || !has_writable();
+	stats->umount_ms = shutdown_clock_ms() - start;
+	return ok;
 }
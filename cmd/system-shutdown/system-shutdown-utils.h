@@ -21,9 +21,40 @@
 #include <stdbool.h>
 #include <stddef.h>		// size_t
 
-// tries to umount all (well, most) things. Returns whether in the last pass it
-// no longer found writable.
-bool umount_all(void);
+// Counters and timing of a single umount_all() call.
+struct umount_stats {
+	unsigned umounted;	// mounts that were unmounted
+	unsigned failed;	// mounts that were left mounted
+	unsigned loops_detached;
+	unsigned retries;	// serial passes over the failed mounts
+	double sync_ms;
+	double umount_ms;
+	double slowest_ms;	// the slowest successful umount
+	char slowest_dir[128];
+	char busy_dir[128];	// the first mount that stayed busy, if any
+};
+
+// tries to umount all (well, most) things. Returns whether in the end it
+// no longer found writable. The stats are filled in if not NULL.
+bool umount_all(struct umount_stats *stats);
+
+// Returns the time, in milliseconds, of a monotonic clock.
+double shutdown_clock_ms(void);
+
+// Adds a key=value field to the shutdown report. Once a field does not fit,
+// it and all the following fields are left out and the report is marked as
+// truncated.
+__attribute__((format(printf, 1, 2)))
+void shutdown_report_add(const char *fmt, ...);
+
+// Adds the fields describing a umount_all() call to the shutdown report. The
+// keys are prefixed with the given name.
+void shutdown_report_add_umount(const char *name,
+				const struct umount_stats *stats);
+
+// Writes the shutdown report as a single line to /dev/kmsg, so that it can be
+// found in the kernel log, falling back to kmsg().
+void shutdown_report_emit(void);
 
 __attribute__((format(printf, 1, 2)))
 void kmsg(const char *fmt, ...);
@@ -68,6 +68,7 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
+	double start = shutdown_clock_ms();
 	kmsg("started.");
 
 	/*
@@ -101,15 +102,24 @@ int main(int argc, char *argv[])
 		kmsg("no reboot parameter");
 	}
 
-	if (umount_all()) {
+	struct umount_stats stats;
+	if (umount_all(&stats)) {
+		shutdown_report_add_umount("umount1", &stats);
 		kmsg("- found no hard-to-unmount writable partition.");
 	} else {
+		shutdown_report_add_umount("umount1", &stats);
+
+		double move_start = shutdown_clock_ms();
 		if (mount("/oldroot/writable", "/writable", NULL, MS_MOVE, NULL)
 		    < 0) {
 			die("cannot move writable out of the way");
 		}
+		shutdown_report_add("move_ms=%.1f",
+				    shutdown_clock_ms() - move_start);
 
-		if (umount_all()) {
+		bool umounted = umount_all(&stats);
+		shutdown_report_add_umount("umount2", &stats);
+		if (umounted) {
 			kmsg("- was able to unmount writable cleanly");
 		} else {
 			kmsg("* was *NOT* able to unmount writable cleanly");
@@ -139,6 +149,11 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	// The report is written before the reboot syscall, which does not
+	// return on success.
+	shutdown_report_add("reboot_at_ms=%.1f", shutdown_clock_ms() - start);
+	shutdown_report_emit();
+
 	// glibc reboot wrapper does not expose the optional reboot syscall
 	// parameter
 